@@ -0,0 +1,376 @@
+//! Host benchmarks of Translation Table operations: `cargo bench` (add `--features granule_16k`
+//! or `--features granule_64k` for the other granules).
+//!
+//! Mapped memory is never accessed, so it's not allocated: only the descriptor tables are.
+
+#![feature(allocator_api)]
+
+use std::{
+    alloc::{AllocError, Allocator, Global, Layout},
+    ops::Range,
+    ptr::NonNull,
+    time::{Duration, Instant},
+};
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use rayon::prelude::*;
+
+use libmei::{
+    address::{PhysicalAddress, VirtualAddress},
+    mmu::{TableUsage, TranslationTable, GRANULE_SIZE},
+    vm::{AccessPermissions, MapDesc, MemoryMap, PhysicalPageAllocator},
+};
+
+const PAGE_SIZE: usize = GRANULE_SIZE;
+const ENTRIES_PER_TABLE: usize = GRANULE_SIZE / core::mem::size_of::<u64>();
+const L2_BLOCK_SIZE: usize = PAGE_SIZE * ENTRIES_PER_TABLE;
+const L1_BLOCK_SIZE: usize = L2_BLOCK_SIZE * ENTRIES_PER_TABLE;
+const GIB: usize = 1 << 30;
+
+/// VA the spans are mapped at: aligned to an L1 block, so that all kinds of spans fit.
+const VADDR: usize = L1_BLOCK_SIZE;
+/// No. of pages (or blocks) mapped by a single `map`.
+const NUM_SPANS: usize = 512;
+/// No. of level 3 tables the lookups are spread over. Larger than the Walk Cache, so that
+/// lookups cycling through them always miss it.
+const NUM_LOOKUP_TABLES: usize = 64;
+/// No. of blocks split by the removal benchmark.
+const NUM_SPLIT_BLOCKS: usize = 64;
+/// No. of subtrees (see `TranslationTable::into_subtrees`) updated in parallel by the subtree
+/// benchmarks, and the no. of threads they are spread over.
+const NUM_SUBTREES: usize = 16;
+const NUM_THREADS: [usize; 4] = [1, 2, 4, 8];
+/// Mapped by the subtree benchmarks, at the start of each subtree.
+const SUBTREE_MAPPED_SIZE: usize = 8 * L2_BLOCK_SIZE;
+
+/// Allocator of the descriptor tables.
+#[derive(Default)]
+struct TableAllocator;
+
+unsafe impl Allocator for TableAllocator {
+    fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        Global.allocate(layout)
+    }
+
+    unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        Global.deallocate(ptr, layout)
+    }
+}
+
+impl PhysicalPageAllocator for TableAllocator {}
+
+/// Kind of mappings a span is made of.
+#[derive(Clone, Copy)]
+struct Span {
+    name: &'static str,
+    size: usize,
+    /// Misaligned to the contiguous run (and the next level block) size, so that the span
+    /// is mapped using plain pages (or blocks) of `size`.
+    phy_addr: PhysicalAddress,
+}
+
+fn spans() -> Vec<Span> {
+    let mut spans = vec![
+        Span {
+            name: "pages",
+            size: PAGE_SIZE,
+            phy_addr: PhysicalAddress::new(PAGE_SIZE),
+        },
+        Span {
+            name: "l2_blocks",
+            size: L2_BLOCK_SIZE,
+            phy_addr: PhysicalAddress::new(L2_BLOCK_SIZE),
+        },
+    ];
+
+    // Only the 4KiB granule has level 1 blocks.
+    if GRANULE_SIZE == 4 * 1024 {
+        spans.push(Span {
+            name: "l1_blocks",
+            size: L1_BLOCK_SIZE,
+            phy_addr: PhysicalAddress::new(L1_BLOCK_SIZE),
+        });
+    }
+
+    spans
+}
+
+fn base_vaddr() -> VirtualAddress {
+    VirtualAddress::new(VADDR).unwrap()
+}
+
+/// Mapping of `len` bytes of `span`, at `VADDR`.
+fn memory_map(span: &Span, len: usize) -> MemoryMap {
+    MemoryMap::Normal(MapDesc::new(
+        span.phy_addr,
+        base_vaddr(),
+        len / PAGE_SIZE,
+        AccessPermissions::normal_memory_default(),
+    ))
+}
+
+fn map_bench(c: &mut Criterion) {
+    let mut group = c.benchmark_group("map");
+
+    for span in spans() {
+        let map = memory_map(&span, NUM_SPANS * span.size);
+
+        group.throughput(Throughput::Elements(NUM_SPANS as u64));
+        group.bench_function(span.name, |b| {
+            b.iter_custom(|iters| {
+                let desc_alloc = TableAllocator::default();
+                let mut elapsed = Duration::ZERO;
+
+                for _ in 0..iters {
+                    let tt = TranslationTable::default();
+                    let start = Instant::now();
+
+                    tt.map(&map, &desc_alloc).unwrap();
+                    elapsed += start.elapsed();
+                    tt.destroy(&desc_alloc);
+                }
+
+                elapsed
+            })
+        });
+    }
+
+    group.finish();
+}
+
+fn virt2phy_bench(c: &mut Criterion) {
+    let span = &spans()[0];
+    let desc_alloc = TableAllocator::default();
+    let tt = TranslationTable::default();
+    let map = memory_map(span, NUM_LOOKUP_TABLES * L2_BLOCK_SIZE);
+    let vaddr = base_vaddr();
+    tt.map(&map, &desc_alloc).unwrap();
+
+    // Consecutive pages of a table: all but the first lookup hit the Walk Cache.
+    let hot: Vec<VirtualAddress> = (0..NUM_LOOKUP_TABLES)
+        .map(|i| vaddr + i * PAGE_SIZE)
+        .collect();
+    // A page from each table in turn: every lookup walks the last level afresh.
+    let cold: Vec<VirtualAddress> = (0..NUM_LOOKUP_TABLES)
+        .map(|i| vaddr + (i * L2_BLOCK_SIZE + i * PAGE_SIZE))
+        .collect();
+
+    let mut group = c.benchmark_group("virt2phy");
+    group.throughput(Throughput::Elements(NUM_LOOKUP_TABLES as u64));
+
+    for (name, vaddrs) in [("hot", &hot), ("cold", &cold)] {
+        group.bench_function(name, |b| {
+            b.iter(|| {
+                for vaddr in vaddrs {
+                    black_box(tt.virt2phy(*vaddr).unwrap());
+                }
+            })
+        });
+    }
+
+    group.finish();
+    tt.destroy(&desc_alloc);
+}
+
+fn traverse_bench(c: &mut Criterion) {
+    let mut group = c.benchmark_group("traverse");
+    group.throughput(Throughput::Bytes(GIB as u64));
+
+    for span in spans().iter().filter(|span| span.size < GIB) {
+        let desc_alloc = TableAllocator::default();
+        let tt = TranslationTable::default();
+        let map = memory_map(span, GIB);
+        let vaddr = base_vaddr();
+        tt.map(&map, &desc_alloc).unwrap();
+
+        group.bench_function(span.name, |b| {
+            b.iter(|| black_box(tt.traverse(vaddr..vaddr + GIB, false).count()))
+        });
+
+        tt.destroy(&desc_alloc);
+    }
+
+    group.finish();
+}
+
+fn unmap_bench(c: &mut Criterion) {
+    let span = &spans()[1];
+    let map = memory_map(span, NUM_SPLIT_BLOCKS * span.size);
+    let vaddr = base_vaddr();
+    let blocks: Vec<VirtualAddress> = (0..NUM_SPLIT_BLOCKS)
+        .map(|i| vaddr + i * span.size)
+        .collect();
+
+    let mut group = c.benchmark_group("unmap");
+    group.throughput(Throughput::Elements(NUM_SPLIT_BLOCKS as u64));
+
+    // Removing whole blocks only clears their descriptors, while removing a page from the
+    // middle of each splits it into a level 3 table first.
+    for (name, hole) in [
+        ("whole_blocks", 0..span.size),
+        ("split_blocks", span.size / 2..span.size / 2 + PAGE_SIZE),
+    ] {
+        group.bench_function(name, |b| {
+            b.iter_custom(|iters| {
+                let desc_alloc = TableAllocator::default();
+                let mut elapsed = Duration::ZERO;
+
+                for _ in 0..iters {
+                    let tt = TranslationTable::default();
+                    tt.map(&map, &desc_alloc).unwrap();
+                    let start = Instant::now();
+
+                    for block in &blocks {
+                        tt.unmap(*block + hole.start..*block + hole.end, &desc_alloc)
+                            .unwrap();
+                    }
+                    elapsed += start.elapsed();
+                    tt.destroy(&desc_alloc);
+                }
+
+                elapsed
+            })
+        });
+    }
+
+    group.finish();
+}
+
+/// VA ranges of the first `NUM_SUBTREES` subtrees from `VADDR`, and the mappings of pages
+/// filling a few level 3 tables in each. Memory isn't contiguous in PA with the block
+/// boundaries, so that the pages aren't promoted.
+fn subtree_maps() -> (Vec<Range<VirtualAddress>>, Vec<MemoryMap>) {
+    let va_end = VirtualAddress::new(1 << 47).unwrap();
+    let subtrees: Vec<Range<VirtualAddress>> =
+        TranslationTable::split_at_subtrees(base_vaddr()..va_end)
+            .take(NUM_SUBTREES)
+            .collect();
+    let maps = subtrees
+        .iter()
+        .map(|subtree| {
+            let mapped_size = SUBTREE_MAPPED_SIZE.min((subtree.end - subtree.start) as usize);
+
+            MemoryMap::Normal(MapDesc::new(
+                PhysicalAddress::new(PAGE_SIZE),
+                subtree.start,
+                mapped_size / PAGE_SIZE,
+                AccessPermissions::normal_memory_default(),
+            ))
+        })
+        .collect();
+
+    (subtrees, maps)
+}
+
+/// Time `update` of a fresh table mapping `maps`, `iters` times. The table `update` leaves
+/// (if any) is torn down untimed.
+fn time_updates<F>(iters: u64, maps: &[MemoryMap], update: F) -> Duration
+where
+    F: Fn(TranslationTable, &TableAllocator) -> Option<TranslationTable>,
+{
+    let desc_alloc = TableAllocator::default();
+    let mut elapsed = Duration::ZERO;
+
+    for _ in 0..iters {
+        let tt = TranslationTable::new(maps, &desc_alloc).unwrap();
+        let start = Instant::now();
+
+        let tt = update(tt, &desc_alloc);
+        elapsed += start.elapsed();
+        if let Some(tt) = tt {
+            tt.destroy(&desc_alloc);
+        }
+    }
+
+    elapsed
+}
+
+/// Tearing down (`into_subtrees`), unmapping (`unmap_subtree`) and protecting the subtrees
+/// of a table in parallel, to show how it scales with the no. of threads.
+fn subtrees_bench(c: &mut Criterion) {
+    let (subtrees, maps) = subtree_maps();
+    let ro_perms = AccessPermissions::EL1_READ;
+    let mut group = c.benchmark_group("subtrees");
+    group.throughput(Throughput::Elements(NUM_SUBTREES as u64));
+    group.sample_size(10);
+
+    for num_threads in NUM_THREADS {
+        let pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(num_threads)
+            .build()
+            .unwrap();
+
+        group.bench_function(BenchmarkId::new("destroy", num_threads), |b| {
+            b.iter_custom(|iters| {
+                time_updates(iters, &maps, |tt, desc_alloc| {
+                    let subtrees: Vec<_> = tt.into_subtrees(desc_alloc, false).collect();
+                    pool.install(|| {
+                        subtrees
+                            .into_par_iter()
+                            .for_each(|subtree| subtree.destroy(desc_alloc))
+                    });
+                    None
+                })
+            })
+        });
+        group.bench_function(BenchmarkId::new("unmap", num_threads), |b| {
+            b.iter_custom(|iters| {
+                time_updates(iters, &maps, |tt, desc_alloc| {
+                    pool.install(|| {
+                        (&subtrees).into_par_iter().for_each(|subtree| {
+                            tt.unmap_subtree(subtree.clone(), desc_alloc, false)
+                                .unwrap()
+                        })
+                    });
+                    Some(tt)
+                })
+            })
+        });
+        group.bench_function(BenchmarkId::new("protect", num_threads), |b| {
+            b.iter_custom(|iters| {
+                time_updates(iters, &maps, |tt, desc_alloc| {
+                    pool.install(|| {
+                        (&subtrees).into_par_iter().for_each(|subtree| {
+                            tt.protect(subtree.clone(), &ro_perms, desc_alloc).unwrap()
+                        })
+                    });
+                    Some(tt)
+                })
+            })
+        });
+    }
+
+    group.finish();
+}
+
+/// Not timed: reports memory taken by the descriptor tables (including the root table, which
+/// is part of `TranslationTable`), per byte mapped with each span.
+fn table_overhead_report(_c: &mut Criterion) {
+    for span in spans() {
+        let desc_alloc = TableAllocator::default();
+        let tt = TranslationTable::default();
+        let len = NUM_SPANS * span.size;
+        tt.map(&memory_map(&span, len), &desc_alloc).unwrap();
+        // Root table isn't counted in the usage.
+        let table_bytes = TableUsage::BYTES_PER_TABLE + tt.table_usage().bytes;
+
+        println!(
+            "table_overhead/{}: {table_bytes} table bytes for {len} mapped bytes ({:.3e} per mapped byte)",
+            span.name,
+            table_bytes as f64 / len as f64
+        );
+
+        tt.destroy(&desc_alloc);
+    }
+}
+
+criterion_group!(
+    benches,
+    map_bench,
+    virt2phy_bench,
+    traverse_bench,
+    unmap_bench,
+    subtrees_bench,
+    table_overhead_report
+);
+criterion_main!(benches);
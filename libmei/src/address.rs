@@ -1,17 +1,16 @@
 use macros::AddressOps;
-use tock_registers::{
-    interfaces::{ReadWriteable, Readable},
-    register_bitfields,
-    registers::InMemoryRegister,
-};
+use tock_registers::{interfaces::Readable, register_bitfields, registers::InMemoryRegister};
 
 use crate::{
     bug,
     error::{Error, Result},
+    mmu::{GRANULE_SIZE, GRANULE_SIZE_BITS},
 };
 
 pub const VIRTUAL_ADDRESS_IGNORE_MSB: u32 = 16;
-pub const VIRTUAL_ADDRESS_LEVEL_IDX_BITS: u32 = 9;
+pub const VIRTUAL_ADDRESS_NBITS: u32 = usize::BITS - VIRTUAL_ADDRESS_IGNORE_MSB;
+/// A translation table is a granule worth of 8 byte descriptors.
+pub const VIRTUAL_ADDRESS_LEVEL_IDX_BITS: u32 = GRANULE_SIZE_BITS - 3;
 
 /// Base trait common to both Physical and Virtual Addresses
 #[const_trait]
@@ -82,6 +81,27 @@ pub enum AddressTranslationLevel {
 }
 
 impl AddressTranslationLevel {
+    /// Lowest bit of the VA bits indexing the table at this level.
+    pub const fn va_shift(&self) -> u32 {
+        GRANULE_SIZE_BITS
+            + (AddressTranslationLevel::Three as u32 - *self as u32)
+                * VIRTUAL_ADDRESS_LEVEL_IDX_BITS
+    }
+
+    /// No. of VA bits indexing the table at this level.
+    /// Table at the root level could be indexed by fewer bits than the rest.
+    pub const fn idx_bits(&self) -> u32 {
+        let shift = self.va_shift();
+
+        if shift >= VIRTUAL_ADDRESS_NBITS {
+            0
+        } else if VIRTUAL_ADDRESS_NBITS - shift < VIRTUAL_ADDRESS_LEVEL_IDX_BITS {
+            VIRTUAL_ADDRESS_NBITS - shift
+        } else {
+            VIRTUAL_ADDRESS_LEVEL_IDX_BITS
+        }
+    }
+
     pub(crate) fn next(&self) -> AddressTranslationLevel {
         match self {
             AddressTranslationLevel::Zero => AddressTranslationLevel::One,
@@ -101,6 +121,14 @@ impl AddressTranslationLevel {
     }
 }
 
+/// Level of the tables pointed by TTBR0/1.
+/// 48 bit VA space needs 4 levels with 4KiB and 16KiB granule, but only 3 with 64KiB granule.
+pub const ROOT_TRANSLATION_LEVEL: AddressTranslationLevel =
+    match AddressTranslationLevel::Zero.idx_bits() {
+        0 => AddressTranslationLevel::One,
+        _ => AddressTranslationLevel::Zero,
+    };
+
 impl From<usize> for AddressTranslationLevel {
     fn from(level: usize) -> Self {
         match level {
@@ -127,95 +155,29 @@ impl VirtualAddress {
         self.identify_ttbr_select().unwrap()
     }
 
+    // Position of the level index bits depends on the granule, so they are not described as
+    // fields of the `VA` register.
     pub fn get_idx_for_level(&self, level: &AddressTranslationLevel) -> usize {
-        let reg = InMemoryRegister::<usize, VA::Register>::new(self.0);
-
-        match level {
-            AddressTranslationLevel::Zero => reg.read(VA::Level_0),
-            AddressTranslationLevel::One => reg.read(VA::Level_1),
-            AddressTranslationLevel::Two => reg.read(VA::Level_2),
-            AddressTranslationLevel::Three => reg.read(VA::Level_3),
-        }
+        (self.0 >> level.va_shift()) & Self::level_idx_mask(level)
     }
 
     pub fn set_idx_for_level(&mut self, level: &AddressTranslationLevel, idx: usize) {
-        assert!(idx < (1 << VIRTUAL_ADDRESS_LEVEL_IDX_BITS));
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        match level {
-            AddressTranslationLevel::Zero => bits.modify(VA::Level_0.val(idx as usize)),
-            AddressTranslationLevel::One => bits.modify(VA::Level_1.val(idx as usize)),
-            AddressTranslationLevel::Two => bits.modify(VA::Level_2.val(idx as usize)),
-            AddressTranslationLevel::Three => bits.modify(VA::Level_3.val(idx as usize)),
-        };
-        self.0 = bits.get();
+        assert!(idx <= Self::level_idx_mask(level));
+        self.clear_idx_for_level(level);
+        self.0 |= idx << level.va_shift();
     }
 
     pub fn clear_idx_for_level(&mut self, level: &AddressTranslationLevel) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        match level {
-            AddressTranslationLevel::Zero => bits.modify(VA::Level_0.val(0)),
-            AddressTranslationLevel::One => bits.modify(VA::Level_1.val(0)),
-            AddressTranslationLevel::Two => bits.modify(VA::Level_2.val(0)),
-            AddressTranslationLevel::Three => bits.modify(VA::Level_3.val(0)),
-        };
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn get_page_offset_4KiB(&self) -> usize {
-        InMemoryRegister::<usize, VA::Register>::new(self.0).read(VA::PageOffset_4KiB)
-    }
-
-    #[allow(non_snake_case)]
-    pub fn get_page_offset_2MiB(&self) -> usize {
-        InMemoryRegister::<usize, VA::Register>::new(self.0).read(VA::PageOffset_2MiB)
+        self.0 &= !(Self::level_idx_mask(level) << level.va_shift());
     }
 
-    #[allow(non_snake_case)]
-    pub fn get_page_offset_1GiB(&self) -> usize {
-        InMemoryRegister::<usize, VA::Register>::new(self.0).read(VA::PageOffset_1GiB)
+    /// Offset within the page (of `GRANULE_SIZE`).
+    pub fn get_page_offset(&self) -> usize {
+        self.align_offset(GRANULE_SIZE)
     }
 
-    #[allow(non_snake_case)]
-    pub fn set_page_offset_4KiB(&mut self, pgoff: usize) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_4KiB.val(pgoff));
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn clear_page_offset_4KiB(&mut self) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_4KiB.val(0));
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn set_page_offset_2MiB(&mut self, pgoff: usize) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_2MiB.val(pgoff));
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn clear_page_offset_2MiB(&mut self) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_2MiB.val(0));
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn set_page_offset_1GiB(&mut self, pgoff: usize) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_1GiB.val(pgoff));
-        self.0 = bits.get();
-    }
-
-    #[allow(non_snake_case)]
-    pub fn clear_page_offset_1GiB(&mut self) {
-        let bits = InMemoryRegister::<usize, VA::Register>::new(self.0);
-        bits.modify(VA::PageOffset_1GiB.val(0));
-        self.0 = bits.get();
+    fn level_idx_mask(level: &AddressTranslationLevel) -> usize {
+        (1 << level.idx_bits()) - 1
     }
 
     fn identify_ttbr_select(&self) -> Option<TTBR> {
@@ -233,29 +195,9 @@ impl core::fmt::Display for VirtualAddress {
     }
 }
 
-// Virtual Address with 4KB granule and 4 level translation
+// Virtual Address with 48 bit VA space
 register_bitfields![usize,
     VA [
-        /// Offset within page
-        // For 4 KiB Page
-        PageOffset_4KiB OFFSET(0) NUMBITS(12) [],
-        // For 2 MiB Page
-        PageOffset_2MiB OFFSET(0) NUMBITS(21) [],
-        // For 1 GiB Page
-        PageOffset_1GiB OFFSET(0) NUMBITS(30) [],
-
-        /// Level 3 Index
-        Level_3 OFFSET(12) NUMBITS(9) [],
-
-        /// Level 2 Index
-        Level_2 OFFSET(21) NUMBITS(9) [],
-
-        /// Level 1 Index
-        Level_1 OFFSET(30) NUMBITS(9) [],
-
-        /// Level 0 Index
-        Level_0 OFFSET(39) NUMBITS(9) [],
-
         /// TTBR select
         TTBR_Select OFFSET(48) NUMBITS(16) [],
     ]
@@ -5,13 +5,14 @@ use core::{
     fmt,
 };
 use macros::exception_handler;
+use spin::Mutex;
 use tock_registers::{
     interfaces::{Readable, Writeable},
     registers::InMemoryRegister,
 };
 
 use super::gic::dispatch_peripheral_irq;
-use crate::println;
+use crate::{mmu::PageFault, println};
 
 global_asm!(include_str!("asm/rpi3/exception.s"));
 
@@ -20,6 +21,16 @@ mod daifbits {
     pub const IRQ_DISABLE: u8 = 0b0000;
 }
 
+/// Called on page faults taken from EL0, with the address space of the faulting process
+/// expected to be looked up by the handler (ex: `AddressSpace::handle_fault`).
+/// Returns true, if the fault is resolved and the faulting instruction can be retried.
+static USER_PAGE_FAULT_HANDLER: Mutex<Option<fn(&PageFault) -> bool>> = Mutex::new(None);
+
+/// Install `handler` for page faults from EL0.
+pub fn set_user_page_fault_handler(handler: fn(&PageFault) -> bool) {
+    *USER_PAGE_FAULT_HANDLER.lock() = Some(handler);
+}
+
 /// .
 ///
 /// # Safety
@@ -136,9 +147,24 @@ fn current_el_spn_serror(ec: &mut ExceptionContext) {
 
 #[exception_handler]
 fn lower_el_aarch64_sync(ec: &mut ExceptionContext) {
+    // Returning from here restores the context and `eret`s to the faulting instruction.
+    if let Some(fault) = ec.page_fault() {
+        if handle_user_page_fault(&fault) {
+            return;
+        }
+    }
     default_handler("lower_el_aarch64_sync", ec);
 }
 
+fn handle_user_page_fault(fault: &PageFault) -> bool {
+    let handler = *USER_PAGE_FAULT_HANDLER.lock();
+
+    match handler {
+        Some(handler) => handler(fault),
+        None => false,
+    }
+}
+
 #[exception_handler]
 fn lower_el_aarch64_irq(ec: &mut ExceptionContext) {
     if !dispatch_peripheral_irq(ec) {
@@ -248,6 +274,21 @@ impl ExceptionContext {
         self.esr_el1.exception_class()
     }
 
+    /// Page fault described by an Instruction/Data Abort from EL0.
+    fn page_fault(&self) -> Option<PageFault> {
+        let is_instr_abort = match self.exception_class()? {
+            ESR_EL1::EC::Value::InstrAbortLowerEL => true,
+            ESR_EL1::EC::Value::DataAbortLowerEL => false,
+            _ => return None,
+        };
+
+        PageFault::decode(
+            self.esr_el1.0.read(ESR_EL1::ISS),
+            FAR_EL1.get() as usize,
+            is_instr_abort,
+        )
+    }
+
     #[inline(always)]
     fn fault_address_valid(&self) -> bool {
         use ESR_EL1::EC::Value::*;
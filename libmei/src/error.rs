@@ -8,6 +8,8 @@ pub enum Error {
     CorruptedTranslationTable(u64),
     VMMapExists(MemoryMap),
     VMMapNotExists(MemoryMap),
+    VMRegionExists(usize),
+    VMRegionsExhausted,
 
     PhysicalOOM,
     ContigiousPhysicalRangeUnavailable(u64),
@@ -29,6 +31,10 @@ impl core::fmt::Display for Error {
             }
             Error::VMMapExists(map) => write!(f, "Provided Map already Exists: {map}"),
             Error::VMMapNotExists(map) => write!(f, "Requested Map doesn't Exist: {map}"),
+            Error::VMRegionExists(addr) => {
+                write!(f, "Region overlapping `{addr:#x}` is already reserved")
+            }
+            Error::VMRegionsExhausted => write!(f, "No more regions can be reserved"),
 
             Error::PhysicalOOM => write!(f, "Out of Physical Memory"),
             Error::ContigiousPhysicalRangeUnavailable(num_pages) => {
@@ -0,0 +1,1694 @@
+//! User Address Spaces.
+//!
+//! An address space is a translation table along with the regions of VA reserved in it.
+//! Memory backing a region is allocated on demand: a page gets mapped only when it's first
+//! accessed, from the page fault handler. So, reserving large sparse regions is cheap.
+//!
+//! Sequential access of a region would then take a fault per page. So, a fault can also map
+//! the unmapped neighbours of the page within an aligned window (fault-around), trading some
+//! memory for fewer exception round trips. Neighbours may never be touched, so allocating them
+//! is opt-in (see `AddressSpace::set_fault_around_pages`). Zero page takes no memory, so it's
+//! always mapped around.
+//!
+//! Parts of a region spanning an entire level 2 block are backed by a huge page (block)
+//! instead, when a block of memory is available. Parts populated page by page are collapsed
+//! into huge pages later, by `collapse_huge_pages`. Both cut down the faults and TLB misses.
+//!
+//! Reads of memory never written before are backed by the shared zero page (or zero huge
+//! page) of `ZeroPages`, mapped copy-on-write. Memory gets allocated only on the first write.
+//!
+//! The working set is estimated by aging the mapped pages (see `AddressSpace::age_pages`):
+//! each scan clears the access flag of every page, and a page's age is the no. of scans it
+//! went without being accessed. Reclaim and huge page decisions can prefer the idle ones.
+//!
+//! Writes are tracked by write protecting clean pages (see `AddressSpace::collect_dirty`), so
+//! that writeback, snapshots and migration need to touch only the pages which changed.
+//!
+//! Threads of a process fault on several cores at once, so `AddressSpace::handle_fault`
+//! can be called concurrently (see `TranslationTable`'s `Concurrency`). Scans rewriting the
+//! whole table (`age_pages`, `collect_dirty`) and `fork` cannot, so they hold off the faults
+//! until they're done.
+
+use core::{
+    alloc::Layout,
+    cmp::{max, min},
+    ops::Range,
+    ptr::NonNull,
+    sync::atomic::{AtomicUsize, Ordering},
+};
+
+use heapless::Vec;
+use spin::RwLock;
+
+use crate::{
+    address::{Address, AddressTranslationLevel, PhysicalAddress, VirtualAddress},
+    error::{Error, Result},
+    vm::{AccessPermissions, MapDesc, MemoryMap, PhysicalPageAllocator},
+};
+
+use super::{
+    fault::{AccessKind, FaultKind, PageFault},
+    translation_table::{IntoSubtrees, TranslationTable},
+    utils::get_vaddr_spacing_per_entry,
+    GRANULE_SIZE,
+};
+
+/// Max. no of regions reserved in an address space.
+pub const MAX_REGIONS: usize = 64;
+/// Max. no. of pages mapped around a demand fault (including the faulting page). The zero page
+/// is always mapped around a read fault this much, as it takes no memory.
+pub const FAULT_AROUND_PAGES: usize = 16;
+/// Size of a huge page: a level 2 block (2MiB with 4KiB granule).
+pub const HUGE_PAGE_SIZE: usize = get_vaddr_spacing_per_entry(&AddressTranslationLevel::Two);
+/// Age at which pages stop aging. They have been idle long enough to be reclaimed.
+pub const MAX_PAGE_AGE: u8 = 7;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum RegionKind {
+    /// Zero filled memory, private to the address space.
+    Anonymous,
+}
+
+/// Range of VA reserved in an address space.
+#[derive(Debug, Clone)]
+pub struct Region {
+    /// Page Aligned
+    vaddr_rng: Range<VirtualAddress>,
+    access_perms: AccessPermissions,
+    kind: RegionKind,
+}
+
+impl Region {
+    pub fn new(
+        vaddr_rng: Range<VirtualAddress>,
+        access_perms: AccessPermissions,
+        kind: RegionKind,
+    ) -> Self {
+        Self {
+            vaddr_rng,
+            access_perms,
+            kind,
+        }
+    }
+
+    pub fn vaddr_range(&self) -> &Range<VirtualAddress> {
+        &self.vaddr_rng
+    }
+
+    pub fn access_permissions(&self) -> AccessPermissions {
+        self.access_perms
+    }
+
+    pub fn kind(&self) -> RegionKind {
+        self.kind
+    }
+
+    fn contains(&self, vaddr: VirtualAddress) -> bool {
+        self.vaddr_rng.contains(&vaddr)
+    }
+
+    fn overlaps(&self, vaddr_rng: &Range<VirtualAddress>) -> bool {
+        self.vaddr_rng.start < vaddr_rng.end && vaddr_rng.start < self.vaddr_rng.end
+    }
+
+    /// Whether EL0 is allowed to `access` the region.
+    fn permits(&self, access: AccessKind) -> bool {
+        self.access_perms.contains(match access {
+            AccessKind::Read => AccessPermissions::EL0_READ,
+            AccessKind::Write => AccessPermissions::EL0_WRITE,
+            AccessKind::Execute => AccessPermissions::EL0_EXECUTE,
+        })
+    }
+}
+
+/// Counters of demand faults handled by an address space.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct FaultStats {
+    /// Translation faults resolved by mapping a page.
+    pub demand_faults: usize,
+    /// Pages mapped by fault-around, other than the faulting ones. Each of them would have
+    /// cost a fault of its own, when first accessed.
+    pub faults_avoided: usize,
+    /// Translation faults resolved by mapping a huge page.
+    pub huge_page_faults: usize,
+    /// Faults which could've been resolved by mapping a huge page, but no block of memory
+    /// was available.
+    pub huge_page_fallbacks: usize,
+    /// Read faults resolved by mapping the zero page (or the zero huge page).
+    pub zero_page_faults: usize,
+    /// Access Flag faults taken on pages aged by `AddressSpace::age_pages`.
+    pub access_flag_faults: usize,
+    /// Write faults taken on clean pages (see `AddressSpace::collect_dirty`).
+    pub dirty_faults: usize,
+}
+
+/// Counters of `FaultStats`, updated by faults on several cores at once.
+#[derive(Default)]
+struct AtomicFaultStats {
+    demand_faults: AtomicUsize,
+    faults_avoided: AtomicUsize,
+    huge_page_faults: AtomicUsize,
+    huge_page_fallbacks: AtomicUsize,
+    zero_page_faults: AtomicUsize,
+    access_flag_faults: AtomicUsize,
+    dirty_faults: AtomicUsize,
+}
+
+impl AtomicFaultStats {
+    fn add(counter: &AtomicUsize, val: usize) {
+        counter.fetch_add(val, Ordering::Relaxed);
+    }
+
+    /// Counters may be updated while they're read, so they needn't add up exactly.
+    fn snapshot(&self) -> FaultStats {
+        FaultStats {
+            demand_faults: self.demand_faults.load(Ordering::Relaxed),
+            faults_avoided: self.faults_avoided.load(Ordering::Relaxed),
+            huge_page_faults: self.huge_page_faults.load(Ordering::Relaxed),
+            huge_page_fallbacks: self.huge_page_fallbacks.load(Ordering::Relaxed),
+            zero_page_faults: self.zero_page_faults.load(Ordering::Relaxed),
+            access_flag_faults: self.access_flag_faults.load(Ordering::Relaxed),
+            dirty_faults: self.dirty_faults.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Estimate of the memory used by an address space, as of the last aging scan.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct WorkingSet {
+    /// Bytes of private memory mapped.
+    pub resident: usize,
+    /// Bytes of private memory mapped, by the age of the page (or huge page) backing it.
+    pub by_age: [usize; MAX_PAGE_AGE as usize + 1],
+}
+
+impl WorkingSet {
+    /// Bytes of memory accessed within the last `max_age + 1` scans.
+    pub fn active(&self, max_age: u8) -> usize {
+        self.by_age[..=min(max_age, MAX_PAGE_AGE) as usize]
+            .iter()
+            .sum()
+    }
+}
+
+/// Zero filled page and huge page, shared read-only by the address spaces using them (see
+/// `AddressSpace::set_zero_pages`).
+#[derive(Debug, Clone, Copy)]
+pub struct ZeroPages {
+    page: PhysicalAddress,
+    /// None, if no block of memory was available.
+    huge_page: Option<PhysicalAddress>,
+}
+
+impl ZeroPages {
+    pub fn new<PageAlloc: PhysicalPageAllocator>(page_alloc: &PageAlloc) -> Result<Self> {
+        Ok(Self {
+            page: allocate_zeroed(page_alloc, GRANULE_SIZE)?,
+            huge_page: allocate_zeroed(page_alloc, HUGE_PAGE_SIZE).ok(),
+        })
+    }
+
+    /// Return the pages to `page_alloc`.
+    ///
+    /// # Safety
+    ///
+    /// No address space must be mapping the pages anymore.
+    pub unsafe fn release<PageAlloc: PhysicalPageAllocator>(self, page_alloc: &PageAlloc) {
+        deallocate(page_alloc, self.page, GRANULE_SIZE);
+        if let Some(huge_page) = self.huge_page {
+            deallocate(page_alloc, huge_page, HUGE_PAGE_SIZE);
+        }
+    }
+}
+
+pub struct AddressSpace {
+    tt: TranslationTable,
+    regions: Vec<Region, MAX_REGIONS>,
+    /// Size of the fault-around window for newly allocated pages, in pages. Power of 2, no more
+    /// than FAULT_AROUND_PAGES.
+    fault_around_pages: usize,
+    /// Whether to back regions with huge pages.
+    huge_pages: bool,
+    /// Used for backing reads of memory not written yet. Disabled, if None.
+    zero_pages: Option<ZeroPages>,
+    stats: AtomicFaultStats,
+    /// Held shared by faults and exclusively by the scans which cannot run concurrently with
+    /// them (see `age_pages`). Guards the working set estimate of the last aging scan.
+    scan_lock: RwLock<WorkingSet>,
+}
+
+impl Default for AddressSpace {
+    fn default() -> Self {
+        Self {
+            tt: TranslationTable::default(),
+            regions: Vec::new(),
+            // Neighbours may never be touched, so they aren't allocated unless asked for.
+            fault_around_pages: 1,
+            huge_pages: true,
+            zero_pages: None,
+            stats: AtomicFaultStats::default(),
+            scan_lock: RwLock::default(),
+        }
+    }
+}
+
+impl AddressSpace {
+    pub fn translation_table(&self) -> &TranslationTable {
+        &self.tt
+    }
+
+    pub fn regions(&self) -> &[Region] {
+        &self.regions
+    }
+
+    pub fn fault_stats(&self) -> FaultStats {
+        self.stats.snapshot()
+    }
+
+    /// Working set as of the last `age_pages`.
+    pub fn working_set(&self) -> WorkingSet {
+        *self.scan_lock.read()
+    }
+
+    /// Set the no. of pages allocated and mapped around a demand fault. 1 (the default) disables
+    /// fault-around. Rounded up to a power of 2 and capped at FAULT_AROUND_PAGES.
+    pub fn set_fault_around_pages(&mut self, num_pages: usize) {
+        self.fault_around_pages = num_pages.clamp(1, FAULT_AROUND_PAGES).next_power_of_two();
+    }
+
+    /// Enable (or disable) backing regions with huge pages.
+    pub fn set_huge_pages(&mut self, enable: bool) {
+        self.huge_pages = enable;
+    }
+
+    /// Back reads of memory not written yet with `zero_pages`, instead of allocating memory.
+    /// `zero_pages` must have been created with the allocator used for handling faults.
+    pub fn set_zero_pages(&mut self, zero_pages: Option<ZeroPages>) {
+        self.zero_pages = zero_pages;
+    }
+
+    /// Reserve `region` in this address space. No memory is allocated, until it's accessed.
+    pub fn reserve(&mut self, region: Region) -> Result<()> {
+        let vaddr_rng = region.vaddr_range();
+
+        if !vaddr_rng.start.is_aligned(GRANULE_SIZE)
+            || !vaddr_rng.end.is_aligned(GRANULE_SIZE)
+            || vaddr_rng.start >= vaddr_rng.end
+        {
+            return Err(Error::InvalidVirtualAddress(vaddr_rng.start.as_raw_ptr()));
+        }
+        if self.regions.iter().any(|r| r.overlaps(vaddr_rng)) {
+            return Err(Error::VMRegionExists(vaddr_rng.start.as_raw_ptr()));
+        }
+
+        self.regions
+            .push(region)
+            .map_err(|_| Error::VMRegionsExhausted)
+    }
+
+    /// Release the regions within `vaddr_rng`, along with the memory backing them.
+    /// Regions partially overlapping `vaddr_rng` are left as is.
+    pub fn release<PageAlloc: PhysicalPageAllocator>(
+        &mut self,
+        vaddr_rng: Range<VirtualAddress>,
+        page_alloc: &PageAlloc,
+    ) -> Result<()> {
+        let mut idx = 0;
+
+        while idx < self.regions.len() {
+            let region = &self.regions[idx];
+
+            if vaddr_rng.start <= region.vaddr_rng.start && region.vaddr_rng.end <= vaddr_rng.end {
+                self.tt
+                    .unmap_and_free(region.vaddr_rng.clone(), page_alloc)?;
+                self.regions.swap_remove(idx);
+            } else {
+                idx += 1;
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Destroy this address space (ex: on process exit), along with the memory backing its
+    /// regions (see `TranslationTable::destroy_and_free`).
+    /// The address space must not be active on any core.
+    pub fn destroy<PageAlloc: PhysicalPageAllocator>(self, page_alloc: &PageAlloc) {
+        self.tt.destroy_and_free(page_alloc);
+    }
+
+    /// Same as `destroy`, but leaves the subtrees of the translation table to the caller, so
+    /// that a very large address space can be torn down on several cores (see
+    /// `TranslationTable::into_subtrees`).
+    pub fn into_subtrees<PageAlloc: PhysicalPageAllocator>(
+        self,
+        page_alloc: &PageAlloc,
+    ) -> IntoSubtrees<'_, PageAlloc> {
+        self.tt.into_subtrees(page_alloc, true)
+    }
+
+    /// Clone this address space. Memory is shared copy-on-write (see `TranslationTable::fork`).
+    /// Faults are held off meanwhile.
+    pub fn fork<PageAlloc: PhysicalPageAllocator>(&self, page_alloc: &PageAlloc) -> Result<Self> {
+        let _scan = self.scan_lock.write();
+
+        Ok(Self {
+            tt: self.tt.fork(page_alloc)?,
+            regions: self.regions.clone(),
+            fault_around_pages: self.fault_around_pages,
+            huge_pages: self.huge_pages,
+            zero_pages: self.zero_pages,
+            ..Default::default()
+        })
+    }
+
+    /// Resolve a page fault taken by EL0 while running in this address space.
+    /// Returns false, if the access is not allowed (i.e) it's a genuine fault.
+    /// Can be called concurrently by the threads running in this address space.
+    pub fn handle_fault<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        fault: &PageFault,
+        page_alloc: &PageAlloc,
+    ) -> Result<bool> {
+        let _scan = self.scan_lock.read();
+        let region = match self.regions.iter().find(|r| r.contains(fault.vaddr())) {
+            Some(region) if region.permits(fault.access()) => region,
+            _ => return Ok(false),
+        };
+
+        match fault.kind() {
+            FaultKind::Translation => {
+                self.populate(region, fault.vaddr(), fault.access(), page_alloc)
+            }
+            FaultKind::Permission if fault.access() == AccessKind::Write => {
+                match self.resolve_zero_fault(fault.vaddr(), page_alloc)? {
+                    true => Ok(true),
+                    false if self.tt.resolve_cow_fault(fault.vaddr(), page_alloc)? => Ok(true),
+                    false => {
+                        let resolved = self.tt.mark_dirty(fault.vaddr());
+                        if resolved {
+                            AtomicFaultStats::add(&self.stats.dirty_faults, 1);
+                        }
+                        Ok(resolved)
+                    }
+                }
+            }
+            FaultKind::AccessFlag => {
+                let resolved = self.tt.mark_accessed(fault.vaddr());
+                if resolved {
+                    AtomicFaultStats::add(&self.stats.access_flag_faults, 1);
+                }
+                Ok(resolved)
+            }
+            _ => Ok(false),
+        }
+    }
+
+    /// Collect and clear the dirty set of the regions within `vaddr_rng`: `visit` is called
+    /// with the VA, PA and size of each page (or huge page) written since the last call (see
+    /// `TranslationTable::clear_dirty`). Pages never collected before are reported as dirty.
+    /// Faults are held off meanwhile.
+    pub fn collect_dirty<F: FnMut(VirtualAddress, PhysicalAddress, usize)>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        mut visit: F,
+    ) -> Result<()> {
+        let _scan = self.scan_lock.write();
+
+        for region in self.regions.iter().filter(|r| r.overlaps(&vaddr_rng)) {
+            let start = max(region.vaddr_rng.start, vaddr_rng.start);
+            let end = min(region.vaddr_rng.end, vaddr_rng.end);
+
+            self.tt.clear_dirty(start..end, &mut visit)?;
+        }
+
+        Ok(())
+    }
+
+    /// Age the private pages (and huge pages) mapped in the regions: the ones accessed since
+    /// the last scan become 0 years old, the rest get a year older (upto MAX_PAGE_AGE). Ages
+    /// are kept by `page_alloc`, along with the rest of the page's metadata.
+    /// Meant to be called periodically from a background scanner. Returns the working set
+    /// estimate, which is also kept until the next scan (see `working_set`). Faults are held
+    /// off meanwhile.
+    pub fn age_pages<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        page_alloc: &PageAlloc,
+    ) -> Result<WorkingSet> {
+        let mut last_working_set = self.scan_lock.write();
+        let mut working_set = WorkingSet::default();
+
+        for region in &self.regions {
+            self.tt
+                .clear_accessed(region.vaddr_rng.clone(), |paddr, size, accessed| {
+                    let age = if accessed {
+                        0
+                    } else {
+                        min(page_alloc.page_age(paddr) + 1, MAX_PAGE_AGE)
+                    };
+                    page_alloc.set_page_age(paddr, age);
+                    working_set.resident += size;
+                    working_set.by_age[age as usize] += size;
+                })?;
+        }
+
+        *last_working_set = working_set;
+        Ok(working_set)
+    }
+
+    /// Collapse the parts of the regions, which are fully populated with pages, into huge
+    /// pages (see `TranslationTable::collapse_pages`). Meant to be called periodically from
+    /// a background scanner. Returns the no. of huge pages installed.
+    /// Can run along with faults, but not with the other scans.
+    pub fn collapse_huge_pages<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        page_alloc: &PageAlloc,
+    ) -> usize {
+        if !self.huge_pages {
+            return 0;
+        }
+
+        let _scan = self.scan_lock.read();
+        self.regions
+            .iter()
+            .map(|region| self.tt.collapse_pages(region.vaddr_rng.clone(), page_alloc))
+            .sum()
+    }
+
+    /// Resolve a write fault at `vaddr` on the zero page (or the zero huge page), by mapping
+    /// fresh memory in its place instead of copying it (see
+    /// `TranslationTable::resolve_zero_fault`). Returns false, if it's not mapped at `vaddr`.
+    fn resolve_zero_fault<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr: VirtualAddress,
+        page_alloc: &PageAlloc,
+    ) -> Result<bool> {
+        let zero_pages = match self.zero_pages {
+            Some(zero_pages) => zero_pages,
+            None => return Ok(false),
+        };
+
+        match self.tt.resolve_zero_fault(
+            vaddr,
+            zero_pages.page,
+            zero_pages.huge_page,
+            page_alloc,
+        )? {
+            Some(HUGE_PAGE_SIZE) => AtomicFaultStats::add(&self.stats.huge_page_faults, 1),
+            Some(_) => AtomicFaultStats::add(&self.stats.demand_faults, 1),
+            None => return Ok(false),
+        }
+
+        Ok(true)
+    }
+
+    /// Aligned fault-around window of `num_pages` around `vaddr`, clipped to `region`.
+    fn fault_around_window(
+        region: &Region,
+        vaddr: VirtualAddress,
+        num_pages: usize,
+    ) -> Result<Range<VirtualAddress>> {
+        let window_size = num_pages * GRANULE_SIZE;
+        let window_start = VirtualAddress::new(vaddr.align_down(window_size))?;
+
+        Ok(max(window_start, region.vaddr_rng.start)
+            ..min(window_start + window_size, region.vaddr_rng.end))
+    }
+
+    /// VA range of the huge page around `vaddr`, if it lies entirely within `region` and none
+    /// of it is mapped yet.
+    fn huge_page_range(
+        &self,
+        region: &Region,
+        vaddr: VirtualAddress,
+    ) -> Result<Option<Range<VirtualAddress>>> {
+        let block_vaddr = VirtualAddress::new(vaddr.align_down(HUGE_PAGE_SIZE))?;
+        let block_rng = block_vaddr..block_vaddr + HUGE_PAGE_SIZE;
+
+        match block_rng.start < region.vaddr_rng.start
+            || block_rng.end > region.vaddr_rng.end
+            || self.tt.traverse(block_rng.clone(), false).next().is_some()
+        {
+            true => Ok(None),
+            false => Ok(Some(block_rng)),
+        }
+    }
+
+    /// Map memory of `region` at `vaddr` for an `access`. Reads are backed by the zero pages,
+    /// if available. Otherwise, newly allocated memory is mapped: a huge page if possible, or
+    /// a page along with the unmapped pages around it within the fault-around window.
+    fn populate<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        region: &Region,
+        vaddr: VirtualAddress,
+        access: AccessKind,
+        page_alloc: &PageAlloc,
+    ) -> Result<bool> {
+        if let (AccessKind::Read, Some(zero_pages)) = (access, self.zero_pages) {
+            return self.populate_zero_pages(region, vaddr, &zero_pages, page_alloc);
+        }
+        if self.huge_pages && self.populate_huge_page(region, vaddr, page_alloc)? {
+            return Ok(true);
+        }
+
+        let layout =
+            Layout::from_size_align(GRANULE_SIZE, GRANULE_SIZE).map_err(|_| Error::AllocError)?;
+        let window = Self::fault_around_window(region, vaddr, self.fault_around_pages)?;
+
+        // Pages are allocated one at a time, as they are freed one at a time on release.
+        let alloc_page = |_| match region.kind {
+            RegionKind::Anonymous => page_alloc
+                .allocate_zeroed(layout)
+                .map(|page| PhysicalAddress::new(page.as_non_null_ptr().addr().get()))
+                .map_err(|_| Error::PhysicalOOM),
+        };
+
+        match self
+            .tt
+            .map_pages(window, &region.access_permissions(), page_alloc, alloc_page)
+        {
+            Ok(num_mapped) => {
+                AtomicFaultStats::add(&self.stats.demand_faults, 1);
+                // Nothing gets mapped, if raced with another fault on the same page.
+                AtomicFaultStats::add(&self.stats.faults_avoided, num_mapped.saturating_sub(1));
+                Ok(true)
+            }
+            // Running out of memory for the neighbours is fine.
+            Err(e) => match self.tt.virt2phy(vaddr) {
+                Some(_) => Ok(true),
+                None => Err(e),
+            },
+        }
+    }
+
+    /// Map a newly allocated huge page of `region` around `vaddr`, if the huge page lies
+    /// entirely within the region and none of it is mapped yet.
+    /// Returns false, if pages must be mapped instead.
+    fn populate_huge_page<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        region: &Region,
+        vaddr: VirtualAddress,
+        page_alloc: &PageAlloc,
+    ) -> Result<bool> {
+        let block_vaddr = match self.huge_page_range(region, vaddr)? {
+            Some(block_rng) => block_rng.start,
+            None => return Ok(false),
+        };
+
+        let layout = Layout::from_size_align(HUGE_PAGE_SIZE, HUGE_PAGE_SIZE)
+            .map_err(|_| Error::AllocError)?;
+        let block = match region.kind {
+            RegionKind::Anonymous => page_alloc.allocate_zeroed(layout),
+        };
+        let block = match block {
+            Ok(block) => block.as_non_null_ptr(),
+            Err(_) => {
+                AtomicFaultStats::add(&self.stats.huge_page_fallbacks, 1);
+                return Ok(false);
+            }
+        };
+        let map = MemoryMap::Normal(MapDesc::new(
+            PhysicalAddress::new(block.addr().get()),
+            block_vaddr,
+            HUGE_PAGE_SIZE / GRANULE_SIZE,
+            region.access_permissions(),
+        ));
+
+        match self.tt.map_block(&map, page_alloc) {
+            Ok(()) => {
+                AtomicFaultStats::add(&self.stats.huge_page_faults, 1);
+                Ok(true)
+            }
+            // Level 3 table left behind by an earlier fault is in the way.
+            Err(_) => {
+                unsafe { page_alloc.deallocate(block, layout) };
+                Ok(false)
+            }
+        }
+    }
+
+    /// Map the zero huge page around `vaddr`, if possible (see `populate_huge_page`).
+    /// Otherwise, map the zero page at the unmapped pages within the largest fault-around
+    /// window.
+    fn populate_zero_pages<PageAlloc: PhysicalPageAllocator>(
+        &self,
+        region: &Region,
+        vaddr: VirtualAddress,
+        zero_pages: &ZeroPages,
+        page_alloc: &PageAlloc,
+    ) -> Result<bool> {
+        if let (true, Some(huge_page)) = (self.huge_pages, zero_pages.huge_page) {
+            if let Some(block_rng) = self.huge_page_range(region, vaddr)? {
+                let map = MemoryMap::Normal(MapDesc::new(
+                    huge_page,
+                    block_rng.start,
+                    HUGE_PAGE_SIZE / GRANULE_SIZE,
+                    region.access_permissions(),
+                ));
+
+                if self.tt.map_shared_block(&map, page_alloc).is_ok() {
+                    AtomicFaultStats::add(&self.stats.zero_page_faults, 1);
+                    return Ok(true);
+                }
+            }
+        }
+
+        let num_mapped = self.tt.map_shared_pages(
+            Self::fault_around_window(region, vaddr, FAULT_AROUND_PAGES)?,
+            zero_pages.page,
+            &region.access_permissions(),
+            page_alloc,
+        )?;
+        AtomicFaultStats::add(&self.stats.zero_page_faults, 1);
+        AtomicFaultStats::add(&self.stats.faults_avoided, num_mapped.saturating_sub(1));
+
+        Ok(true)
+    }
+}
+
+fn allocate_zeroed<PageAlloc: PhysicalPageAllocator>(
+    page_alloc: &PageAlloc,
+    size: usize,
+) -> Result<PhysicalAddress> {
+    let layout = Layout::from_size_align(size, size).map_err(|_| Error::AllocError)?;
+    let ptr = page_alloc
+        .allocate_zeroed(layout)
+        .map_err(|_| Error::PhysicalOOM)?
+        .as_non_null_ptr();
+
+    Ok(PhysicalAddress::new(ptr.addr().get()))
+}
+
+unsafe fn deallocate<PageAlloc: PhysicalPageAllocator>(
+    page_alloc: &PageAlloc,
+    paddr: PhysicalAddress,
+    size: usize,
+) {
+    let layout = Layout::from_size_align_unchecked(size, size);
+    if let Some(ptr) = NonNull::new(paddr.as_raw_ptr() as *mut u8) {
+        page_alloc.deallocate(ptr, layout);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use core::{
+        alloc::{AllocError, Allocator, Layout},
+        cmp::min,
+        ops::Range,
+        ptr::NonNull,
+        sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+    };
+    use std::sync::Mutex;
+
+    use rand::{thread_rng, Rng};
+
+    use crate::{
+        address::{Address, AddressTranslationLevel, PhysicalAddress, VirtualAddress},
+        mmu::{
+            fault::{AccessKind, FaultKind, PageFault},
+            translation_table::tests::TestAllocator,
+            utils::consts::MAX_TRANSLATION_LEVELS,
+            GRANULE_SIZE,
+        },
+        vm::{AccessPermissions, PhysicalPageAllocator},
+    };
+
+    use super::{
+        AddressSpace, FaultStats, Region, RegionKind, ZeroPages, FAULT_AROUND_PAGES,
+        HUGE_PAGE_SIZE, MAX_PAGE_AGE,
+    };
+
+    const REGION_PAGES: usize = 1024;
+    /// Huge pages are too large to be tested with 64KiB granule.
+    const TEST_HUGE_PAGES: bool = HUGE_PAGE_SIZE <= 32 * 1024 * 1024;
+
+    /// Allocator which has run out of huge pages.
+    #[derive(Default)]
+    struct NoHugePageAllocator(TestAllocator);
+
+    unsafe impl Allocator for NoHugePageAllocator {
+        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+            match layout.size() < HUGE_PAGE_SIZE {
+                true => self.0.allocate(layout),
+                false => Err(AllocError),
+            }
+        }
+
+        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+            self.0.deallocate(ptr, layout)
+        }
+    }
+
+    impl PhysicalPageAllocator for NoHugePageAllocator {
+        fn share(&self, paddr: PhysicalAddress) {
+            self.0.share(paddr)
+        }
+
+        fn unshare(&self, paddr: PhysicalAddress) {
+            self.0.unshare(paddr)
+        }
+
+        fn is_shared(&self, paddr: PhysicalAddress) -> bool {
+            self.0.is_shared(paddr)
+        }
+    }
+
+    /// `TestAllocator` shareable across threads.
+    #[derive(Default)]
+    struct SyncTestAllocator(Mutex<TestAllocator>);
+
+    unsafe impl Sync for SyncTestAllocator {}
+
+    unsafe impl Allocator for SyncTestAllocator {
+        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+            self.0.lock().unwrap().allocate(layout)
+        }
+
+        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+            self.0.lock().unwrap().deallocate(ptr, layout)
+        }
+    }
+
+    impl PhysicalPageAllocator for SyncTestAllocator {
+        fn share(&self, paddr: PhysicalAddress) {
+            self.0.lock().unwrap().share(paddr)
+        }
+
+        fn unshare(&self, paddr: PhysicalAddress) {
+            self.0.lock().unwrap().unshare(paddr)
+        }
+
+        fn is_shared(&self, paddr: PhysicalAddress) -> bool {
+            self.0.lock().unwrap().is_shared(paddr)
+        }
+
+        fn page_age(&self, paddr: PhysicalAddress) -> u8 {
+            self.0.lock().unwrap().page_age(paddr)
+        }
+
+        fn set_page_age(&self, paddr: PhysicalAddress, age: u8) {
+            self.0.lock().unwrap().set_page_age(paddr, age)
+        }
+    }
+
+    fn get_random_virt_addr() -> VirtualAddress {
+        VirtualAddress::new(thread_rng().gen_range(1..1024usize) * 1024 * 1024 * 1024).unwrap()
+    }
+
+    fn fault(vaddr: VirtualAddress, kind: FaultKind, access: AccessKind) -> PageFault {
+        PageFault::new(vaddr, kind, access, AddressTranslationLevel::Three)
+    }
+
+    fn read_word(aspace: &AddressSpace, vaddr: VirtualAddress) -> usize {
+        let paddr = aspace
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        unsafe { *(paddr.as_raw_ptr() as *const usize) }
+    }
+
+    fn write_word(aspace: &AddressSpace, vaddr: VirtualAddress, val: usize) {
+        let paddr = aspace
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        unsafe { *(paddr.as_raw_ptr() as *mut usize) = val }
+    }
+
+    fn reserve_anonymous(aspace: &mut AddressSpace, vaddr_rng: Range<VirtualAddress>) {
+        assert!(aspace
+            .reserve(Region::new(
+                vaddr_rng,
+                AccessPermissions::user_memory_default(),
+                RegionKind::Anonymous,
+            ))
+            .is_ok());
+    }
+
+    #[test]
+    fn demand_paging_sanity_test() {
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let ro_vaddr = vaddr + REGION_PAGES * GRANULE_SIZE;
+        let region_rng = vaddr..ro_vaddr;
+        let ro_perms = AccessPermissions::EL1_READ | AccessPermissions::EL0_READ;
+
+        aspace.set_fault_around_pages(1);
+        aspace.set_huge_pages(false);
+        assert!(aspace
+            .reserve(Region::new(
+                region_rng.clone(),
+                AccessPermissions::user_memory_default(),
+                RegionKind::Anonymous,
+            ))
+            .is_ok());
+        assert!(aspace
+            .reserve(Region::new(
+                ro_vaddr..ro_vaddr + GRANULE_SIZE,
+                ro_perms,
+                RegionKind::Anonymous,
+            ))
+            .is_ok());
+        assert!(aspace
+            .reserve(Region::new(
+                vaddr + GRANULE_SIZE..vaddr + 2 * GRANULE_SIZE,
+                ro_perms,
+                RegionKind::Anonymous,
+            ))
+            .is_err());
+
+        // Reserving doesn't allocate anything.
+        assert!(page_alloc.mem.borrow().is_empty());
+        assert!(aspace.translation_table().virt2phy(vaddr).is_none());
+
+        // Only the pages touched get mapped, zero filled.
+        let pages = [0, 7, REGION_PAGES - 1];
+        for page in pages {
+            let vaddr = vaddr + page * GRANULE_SIZE + 16usize;
+            let access = match page % 2 {
+                0 => AccessKind::Read,
+                _ => AccessKind::Write,
+            };
+
+            assert!(aspace
+                .handle_fault(&fault(vaddr, FaultKind::Translation, access), &page_alloc)
+                .unwrap());
+            assert_eq!(read_word(&aspace, vaddr), 0);
+            assert_eq!(
+                aspace
+                    .translation_table()
+                    .virt2phy(vaddr)
+                    .unwrap()
+                    .access_permissions(),
+                AccessPermissions::user_memory_default()
+            );
+        }
+        assert!(aspace
+            .translation_table()
+            .virt2phy(vaddr + GRANULE_SIZE)
+            .is_none());
+
+        // Accesses denied by the region and accesses outside of any region are genuine faults.
+        let write = fault(ro_vaddr, FaultKind::Translation, AccessKind::Write);
+        assert!(!aspace.handle_fault(&write, &page_alloc).unwrap());
+        let exec = fault(vaddr, FaultKind::Translation, AccessKind::Execute);
+        assert!(!aspace.handle_fault(&exec, &page_alloc).unwrap());
+        let outside = fault(
+            ro_vaddr + GRANULE_SIZE,
+            FaultKind::Translation,
+            AccessKind::Read,
+        );
+        assert!(!aspace.handle_fault(&outside, &page_alloc).unwrap());
+
+        // Releasing the regions frees both the pages and the tables (once the recycled ones
+        // are trimmed).
+        assert!(aspace
+            .release(vaddr..ro_vaddr + GRANULE_SIZE, &page_alloc)
+            .is_ok());
+        assert!(aspace.regions().is_empty());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn fault_around_test() {
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        aspace.set_huge_pages(false);
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        let vaddr = get_random_virt_addr();
+        // Region ends in the middle of a fault-around window.
+        let region_rng = vaddr..vaddr + (REGION_PAGES + FAULT_AROUND_PAGES / 2) * GRANULE_SIZE;
+        let is_mapped = |aspace: &AddressSpace, page: usize| {
+            aspace
+                .translation_table()
+                .virt2phy(vaddr + page * GRANULE_SIZE)
+                .is_some()
+        };
+        let read = |page: usize| {
+            fault(
+                vaddr + page * GRANULE_SIZE,
+                FaultKind::Translation,
+                AccessKind::Read,
+            )
+        };
+
+        assert!(aspace
+            .reserve(Region::new(
+                region_rng.clone(),
+                AccessPermissions::user_memory_default(),
+                RegionKind::Anonymous,
+            ))
+            .is_ok());
+
+        // Fault in the middle of a window maps the whole window.
+        assert!(aspace.handle_fault(&read(3), &page_alloc).unwrap());
+        for page in 0..=FAULT_AROUND_PAGES {
+            assert_eq!(is_mapped(&aspace, page), page < FAULT_AROUND_PAGES);
+        }
+        assert_eq!(
+            aspace.fault_stats(),
+            FaultStats {
+                demand_faults: 1,
+                faults_avoided: FAULT_AROUND_PAGES - 1,
+                ..Default::default()
+            }
+        );
+
+        // Pages already mapped within the window are left as is.
+        let paddr = aspace
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        assert!(aspace
+            .translation_table()
+            .unmap_and_free(vaddr + GRANULE_SIZE..vaddr + 2 * GRANULE_SIZE, &page_alloc)
+            .is_ok());
+        assert!(aspace.handle_fault(&read(1), &page_alloc).unwrap());
+        assert_eq!(
+            aspace
+                .translation_table()
+                .virt2phy(vaddr)
+                .unwrap()
+                .physical_address(),
+            paddr
+        );
+        assert_eq!(aspace.fault_stats().faults_avoided, FAULT_AROUND_PAGES - 1);
+
+        // Window is clipped to the region.
+        assert!(aspace
+            .handle_fault(&read(REGION_PAGES + 1), &page_alloc)
+            .unwrap());
+        for page in REGION_PAGES - 1..REGION_PAGES + FAULT_AROUND_PAGES {
+            assert_eq!(
+                is_mapped(&aspace, page),
+                page >= REGION_PAGES && page < REGION_PAGES + FAULT_AROUND_PAGES / 2
+            );
+        }
+        assert_eq!(
+            aspace.fault_stats(),
+            FaultStats {
+                demand_faults: 3,
+                faults_avoided: FAULT_AROUND_PAGES - 1 + FAULT_AROUND_PAGES / 2 - 1,
+                ..Default::default()
+            }
+        );
+
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn fault_around_default_test() {
+        let page_alloc = TestAllocator::default();
+        let zero_pages = ZeroPages::new(&page_alloc).unwrap();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + 2 * FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let zero_vaddr = vaddr + FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let num_mapped = |aspace: &AddressSpace, vaddr: VirtualAddress| {
+            aspace
+                .translation_table()
+                .traverse(vaddr..vaddr + FAULT_AROUND_PAGES * GRANULE_SIZE, false)
+                .count()
+        };
+
+        aspace.set_huge_pages(false);
+        reserve_anonymous(&mut aspace, region_rng.clone());
+
+        // Only the faulting page is allocated, unless fault-around is asked for.
+        let write = fault(vaddr, FaultKind::Translation, AccessKind::Write);
+        assert!(aspace.handle_fault(&write, &page_alloc).unwrap());
+        assert_eq!(num_mapped(&aspace, vaddr), 1);
+
+        // Zero page is mapped around anyway.
+        aspace.set_zero_pages(Some(zero_pages));
+        let read = fault(zero_vaddr, FaultKind::Translation, AccessKind::Read);
+        assert!(aspace.handle_fault(&read, &page_alloc).unwrap());
+        assert_eq!(num_mapped(&aspace, zero_vaddr), FAULT_AROUND_PAGES);
+
+        aspace.destroy(&page_alloc);
+        unsafe { zero_pages.release(&page_alloc) };
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn huge_page_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        let vaddr = get_random_virt_addr();
+        // Region ends with a partial huge page.
+        let region_rng = vaddr..vaddr + HUGE_PAGE_SIZE + FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let read = |vaddr: VirtualAddress| fault(vaddr, FaultKind::Translation, AccessKind::Read);
+
+        reserve_anonymous(&mut aspace, region_rng.clone());
+
+        // Whole huge page is mapped on the first fault, zero filled.
+        let fault_vaddr = vaddr + HUGE_PAGE_SIZE / 2;
+        assert!(aspace
+            .handle_fault(&read(fault_vaddr), &page_alloc)
+            .unwrap());
+        let paddr = aspace
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        assert!(paddr.is_aligned(HUGE_PAGE_SIZE));
+        assert_eq!(
+            aspace
+                .translation_table()
+                .virt2phy(vaddr + (HUGE_PAGE_SIZE - GRANULE_SIZE))
+                .unwrap()
+                .physical_address(),
+            paddr + (HUGE_PAGE_SIZE - GRANULE_SIZE)
+        );
+        assert_eq!(read_word(&aspace, fault_vaddr), 0);
+
+        // Partial huge page at the end is mapped with pages.
+        assert!(aspace
+            .handle_fault(&read(vaddr + HUGE_PAGE_SIZE), &page_alloc)
+            .unwrap());
+        assert_eq!(
+            aspace.fault_stats(),
+            FaultStats {
+                demand_faults: 1,
+                faults_avoided: FAULT_AROUND_PAGES - 1,
+                huge_page_faults: 1,
+                huge_page_fallbacks: 0,
+                zero_page_faults: 0,
+                access_flag_faults: 0,
+                dirty_faults: 0,
+            }
+        );
+
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn huge_page_fallback_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        let page_alloc = NoHugePageAllocator::default();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + HUGE_PAGE_SIZE;
+        let next_window = vaddr + FAULT_AROUND_PAGES * GRANULE_SIZE;
+
+        reserve_anonymous(&mut aspace, region_rng.clone());
+
+        // Falls back to pages, when no huge page is available.
+        let read = fault(vaddr, FaultKind::Translation, AccessKind::Read);
+        assert!(aspace.handle_fault(&read, &page_alloc).unwrap());
+        assert!(aspace.translation_table().virt2phy(next_window).is_none());
+        assert_eq!(aspace.fault_stats().huge_page_fallbacks, 1);
+
+        // Once pages are mapped, the huge page isn't attempted anymore.
+        let read = fault(next_window, FaultKind::Translation, AccessKind::Read);
+        assert!(aspace.handle_fault(&read, &page_alloc).unwrap());
+        assert_eq!(aspace.fault_stats().huge_page_fallbacks, 1);
+
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.0.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn huge_page_collapse_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        const NUM_PAGES: usize = HUGE_PAGE_SIZE / GRANULE_SIZE;
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + 2 * HUGE_PAGE_SIZE;
+        // Populates the first huge page entirely and the second partially.
+        let pages = (0..=NUM_PAGES).step_by(FAULT_AROUND_PAGES);
+
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        aspace.set_huge_pages(false);
+
+        for page in pages.clone() {
+            let vaddr = vaddr + page * GRANULE_SIZE;
+            let write = fault(vaddr, FaultKind::Translation, AccessKind::Write);
+
+            assert!(aspace.handle_fault(&write, &page_alloc).unwrap());
+            write_word(&aspace, vaddr, page + 1);
+        }
+
+        // Nothing is collapsed, unless huge pages are enabled.
+        assert_eq!(aspace.collapse_huge_pages(&page_alloc), 0);
+        aspace.set_huge_pages(true);
+        assert_eq!(aspace.collapse_huge_pages(&page_alloc), 1);
+        assert_eq!(aspace.collapse_huge_pages(&page_alloc), 0);
+
+        // Contents are preserved.
+        let paddr = aspace
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        for page in pages {
+            let vaddr = vaddr + page * GRANULE_SIZE;
+
+            assert_eq!(read_word(&aspace, vaddr), page + 1);
+            if page < NUM_PAGES {
+                assert_eq!(
+                    aspace
+                        .translation_table()
+                        .virt2phy(vaddr)
+                        .unwrap()
+                        .physical_address(),
+                    paddr + page * GRANULE_SIZE
+                );
+            }
+        }
+
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn huge_page_partial_release_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        let page_alloc = TestAllocator::default();
+        let mut parent = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + HUGE_PAGE_SIZE;
+        let last_page = region_rng.end - GRANULE_SIZE;
+        let huge_page_layout = Layout::from_size_align(HUGE_PAGE_SIZE, HUGE_PAGE_SIZE).unwrap();
+
+        reserve_anonymous(&mut parent, region_rng.clone());
+        let write = fault(vaddr, FaultKind::Translation, AccessKind::Write);
+        assert!(parent.handle_fault(&write, &page_alloc).unwrap());
+        write_word(&parent, last_page, 1);
+        let paddr = parent
+            .translation_table()
+            .virt2phy(vaddr)
+            .unwrap()
+            .physical_address();
+        let is_allocated = || {
+            page_alloc
+                .mem
+                .borrow()
+                .get(&(paddr.as_raw_ptr() as *mut u8))
+                .is_some_and(|layout| *layout == huge_page_layout)
+        };
+
+        // Protecting (or releasing) part of the huge page splits it into pages. Released pages
+        // are freed only along with the rest of the huge page.
+        let tt = parent.translation_table();
+        assert!(tt
+            .protect(
+                vaddr + GRANULE_SIZE..vaddr + 2 * GRANULE_SIZE,
+                &(AccessPermissions::EL1_READ | AccessPermissions::EL0_READ),
+                &page_alloc,
+            )
+            .is_ok());
+        assert!(tt
+            .unmap_and_free(vaddr..vaddr + GRANULE_SIZE, &page_alloc)
+            .is_ok());
+        assert!(tt.virt2phy(vaddr).is_none());
+        assert!(is_allocated());
+        assert_eq!(read_word(&parent, last_page), 1);
+
+        // Huge page is freed as a whole, once the last of its pages is in any address space.
+        let child = parent.fork(&page_alloc).unwrap();
+        assert!(parent.release(region_rng, &page_alloc).is_ok());
+        assert!(is_allocated());
+        assert_eq!(read_word(&child, last_page), 1);
+
+        child.destroy(&page_alloc);
+        parent.destroy(&page_alloc);
+        assert!(!is_allocated());
+        assert!(page_alloc.mem.borrow().is_empty());
+        assert!(page_alloc.refs.borrow().is_empty());
+    }
+
+    #[test]
+    fn zero_page_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        let page_alloc = TestAllocator::default();
+        let zero_pages = ZeroPages::new(&page_alloc).unwrap();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let pages_vaddr = vaddr + HUGE_PAGE_SIZE;
+        let region_rng = vaddr..pages_vaddr + FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let paddr = |aspace: &AddressSpace, vaddr: VirtualAddress| {
+            aspace
+                .translation_table()
+                .virt2phy(vaddr)
+                .unwrap()
+                .physical_address()
+        };
+        let read = |vaddr| fault(vaddr, FaultKind::Translation, AccessKind::Read);
+        let write = |vaddr| fault(vaddr, FaultKind::Permission, AccessKind::Write);
+
+        aspace.set_zero_pages(Some(zero_pages));
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        let num_allocated = page_alloc.mem.borrow().len();
+
+        // Reads are backed by the zero huge page and the zero page, allocating just the tables.
+        assert!(aspace.handle_fault(&read(vaddr), &page_alloc).unwrap());
+        assert_eq!(paddr(&aspace, vaddr), zero_pages.huge_page.unwrap());
+        assert!(aspace
+            .handle_fault(&read(pages_vaddr), &page_alloc)
+            .unwrap());
+        for page in 0..FAULT_AROUND_PAGES {
+            let vaddr = pages_vaddr + page * GRANULE_SIZE;
+
+            assert_eq!(paddr(&aspace, vaddr), zero_pages.page);
+            assert_eq!(read_word(&aspace, vaddr), 0);
+        }
+        assert!(page_alloc.mem.borrow().len() - num_allocated < MAX_TRANSLATION_LEVELS);
+        assert_eq!(aspace.fault_stats().zero_page_faults, 2);
+        assert_eq!(aspace.fault_stats().demand_faults, 0);
+
+        // First write maps fresh memory, in place of the zero page.
+        let write_vaddr = pages_vaddr + GRANULE_SIZE;
+        assert!(aspace
+            .handle_fault(&write(write_vaddr), &page_alloc)
+            .unwrap());
+        assert_ne!(paddr(&aspace, write_vaddr), zero_pages.page);
+        assert_eq!(paddr(&aspace, pages_vaddr), zero_pages.page);
+        assert_eq!(read_word(&aspace, write_vaddr), 0);
+        assert_eq!(
+            aspace
+                .translation_table()
+                .virt2phy(write_vaddr)
+                .unwrap()
+                .access_permissions(),
+            AccessPermissions::user_memory_default()
+        );
+
+        // ... and a fresh huge page, in place of the zero huge page.
+        let write_vaddr = vaddr + HUGE_PAGE_SIZE / 2;
+        assert!(aspace
+            .handle_fault(&write(write_vaddr), &page_alloc)
+            .unwrap());
+        assert_ne!(paddr(&aspace, vaddr), zero_pages.huge_page.unwrap());
+        assert!(paddr(&aspace, vaddr).is_aligned(HUGE_PAGE_SIZE));
+        assert_eq!(aspace.fault_stats().huge_page_faults, 1);
+
+        // Releasing the region leaves only the zero pages behind.
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert_eq!(page_alloc.mem.borrow().len(), 2);
+        assert!(page_alloc.refs.borrow().is_empty());
+        unsafe { zero_pages.release(&page_alloc) };
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn zero_page_fallback_test() {
+        if !TEST_HUGE_PAGES {
+            return;
+        }
+
+        let page_alloc = NoHugePageAllocator::default();
+        let zero_pages = ZeroPages::new(&page_alloc.0).unwrap();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + HUGE_PAGE_SIZE;
+        let write_vaddr = vaddr + GRANULE_SIZE;
+
+        aspace.set_zero_pages(Some(zero_pages));
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        let paddr = |vaddr: VirtualAddress| {
+            aspace
+                .translation_table()
+                .virt2phy(vaddr)
+                .unwrap()
+                .physical_address()
+        };
+        assert!(aspace
+            .handle_fault(
+                &fault(vaddr, FaultKind::Translation, AccessKind::Read),
+                &page_alloc
+            )
+            .unwrap());
+        assert_eq!(paddr(vaddr), zero_pages.huge_page.unwrap());
+
+        // With no block of memory available, only the page written is allocated. The rest of
+        // the zero huge page is mapped by the zero page.
+        assert!(aspace
+            .handle_fault(
+                &fault(write_vaddr, FaultKind::Permission, AccessKind::Write),
+                &page_alloc
+            )
+            .unwrap());
+        assert_ne!(paddr(write_vaddr), zero_pages.page);
+        assert_eq!(read_word(&aspace, write_vaddr), 0);
+        for vaddr in [vaddr, region_rng.end - GRANULE_SIZE] {
+            assert_eq!(paddr(vaddr), zero_pages.page);
+        }
+        assert_eq!(aspace.fault_stats().demand_faults, 1);
+        assert_eq!(aspace.fault_stats().huge_page_faults, 0);
+
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert_eq!(page_alloc.0.mem.borrow().len(), 2);
+        assert!(page_alloc.0.refs.borrow().is_empty());
+        unsafe { zero_pages.release(&page_alloc) };
+        assert!(page_alloc.0.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn demand_paging_fork_test() {
+        let page_alloc = TestAllocator::default();
+        let mut parent = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + REGION_PAGES * GRANULE_SIZE;
+        let read = fault(vaddr, FaultKind::Translation, AccessKind::Read);
+        let write = fault(vaddr, FaultKind::Permission, AccessKind::Write);
+
+        assert!(parent
+            .reserve(Region::new(
+                region_rng.clone(),
+                AccessPermissions::user_memory_default(),
+                RegionKind::Anonymous,
+            ))
+            .is_ok());
+        assert!(parent.handle_fault(&read, &page_alloc).unwrap());
+
+        let mut child = parent.fork(&page_alloc).unwrap();
+
+        // Write faults on the shared page are resolved with a private copy.
+        assert!(child.handle_fault(&write, &page_alloc).unwrap());
+        assert_ne!(
+            child
+                .translation_table()
+                .virt2phy(vaddr)
+                .unwrap()
+                .physical_address(),
+            parent
+                .translation_table()
+                .virt2phy(vaddr)
+                .unwrap()
+                .physical_address()
+        );
+        assert!(parent.handle_fault(&write, &page_alloc).unwrap());
+
+        assert!(child.release(region_rng.clone(), &page_alloc).is_ok());
+        assert!(parent.release(region_rng, &page_alloc).is_ok());
+        child.translation_table().trim_tables(&page_alloc);
+        parent.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn destroy_test() {
+        let page_alloc = TestAllocator::default();
+        let zero_pages = ZeroPages::new(&page_alloc).unwrap();
+        let mut parent = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + REGION_PAGES * GRANULE_SIZE;
+        let write_vaddr = region_rng.end - GRANULE_SIZE;
+
+        parent.set_huge_pages(TEST_HUGE_PAGES);
+        parent.set_zero_pages(Some(zero_pages));
+        reserve_anonymous(&mut parent, region_rng.clone());
+        let num_allocated = page_alloc.mem.borrow().len();
+
+        // Private, zero and shared (copy-on-write) pages.
+        for (vaddr, kind, access) in [
+            (vaddr, FaultKind::Translation, AccessKind::Read),
+            (write_vaddr, FaultKind::Translation, AccessKind::Write),
+        ] {
+            assert!(parent
+                .handle_fault(&fault(vaddr, kind, access), &page_alloc)
+                .unwrap());
+        }
+        let refs = page_alloc.refs.borrow().clone();
+        let child = parent.fork(&page_alloc).unwrap();
+        assert!(child
+            .handle_fault(
+                &fault(write_vaddr, FaultKind::Permission, AccessKind::Write),
+                &page_alloc
+            )
+            .unwrap());
+
+        // Tearing down either one leaves the memory shared with the other in place.
+        child.destroy(&page_alloc);
+        assert_eq!(*page_alloc.refs.borrow(), refs);
+        let paddr = parent
+            .translation_table()
+            .virt2phy(write_vaddr)
+            .unwrap()
+            .physical_address();
+        assert!(page_alloc.mem.borrow().iter().any(|(ptr, layout)| {
+            (*ptr as usize..*ptr as usize + layout.size()).contains(&paddr.as_raw_ptr())
+        }));
+
+        parent.destroy(&page_alloc);
+        assert_eq!(page_alloc.mem.borrow().len(), num_allocated);
+        assert!(page_alloc.refs.borrow().is_empty());
+        unsafe { zero_pages.release(&page_alloc) };
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn page_aging_test() {
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        let vaddr = get_random_virt_addr();
+        let mapped_size = FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let region_rng = vaddr..vaddr + 2 * mapped_size;
+        let accessed_vaddr = vaddr + GRANULE_SIZE;
+        let accessed = fault(accessed_vaddr, FaultKind::AccessFlag, AccessKind::Read);
+        let age = |aspace: &AddressSpace, vaddr: VirtualAddress| {
+            let paddr = aspace.translation_table().virt2phy(vaddr).unwrap();
+            page_alloc.page_age(paddr.physical_address())
+        };
+
+        aspace.set_huge_pages(false);
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        assert!(aspace
+            .handle_fault(
+                &fault(vaddr, FaultKind::Translation, AccessKind::Read),
+                &page_alloc
+            )
+            .unwrap());
+
+        // Pages start out accessed.
+        let working_set = aspace.age_pages(&page_alloc).unwrap();
+        assert_eq!(working_set.resident, mapped_size);
+        assert_eq!(working_set.active(0), mapped_size);
+        assert_eq!(aspace.working_set(), working_set);
+
+        // Pages age, until they are accessed again.
+        for scan in 1..=MAX_PAGE_AGE as usize + 1 {
+            if scan == 2 {
+                assert!(aspace.handle_fault(&accessed, &page_alloc).unwrap());
+            }
+
+            let working_set = aspace.age_pages(&page_alloc).unwrap();
+            let age_of_idle = min(scan, MAX_PAGE_AGE as usize);
+            assert_eq!(working_set.resident, mapped_size);
+            assert_eq!(age(&aspace, vaddr) as usize, age_of_idle);
+            assert_eq!(
+                working_set.by_age[age_of_idle],
+                mapped_size - min(scan - 1, 1) * GRANULE_SIZE
+            );
+        }
+        assert_eq!(age(&aspace, accessed_vaddr), MAX_PAGE_AGE - 1);
+        assert_eq!(aspace.fault_stats().access_flag_faults, 1);
+
+        // Access Flag faults on unmapped memory are genuine.
+        let unmapped = fault(vaddr + mapped_size, FaultKind::AccessFlag, AccessKind::Read);
+        assert!(!aspace.handle_fault(&unmapped, &page_alloc).unwrap());
+
+        // Ages of the freed pages are forgotten.
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        assert!(page_alloc.ages.borrow().is_empty());
+    }
+
+    #[test]
+    fn dirty_tracking_test() {
+        let page_alloc = TestAllocator::default();
+        let mut aspace = AddressSpace::default();
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + FAULT_AROUND_PAGES * GRANULE_SIZE;
+        let written_vaddr = vaddr + 3 * GRANULE_SIZE;
+        let write = fault(written_vaddr, FaultKind::Permission, AccessKind::Write);
+        let collect_dirty = |aspace: &AddressSpace| {
+            let mut dirty = std::vec::Vec::new();
+            assert!(aspace
+                .collect_dirty(region_rng.clone(), |vaddr, _, size| dirty
+                    .push((vaddr, size)))
+                .is_ok());
+            dirty
+        };
+
+        aspace.set_huge_pages(false);
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        assert!(aspace
+            .handle_fault(
+                &fault(vaddr, FaultKind::Translation, AccessKind::Write),
+                &page_alloc
+            )
+            .unwrap());
+
+        // Pages not tracked yet may have been written.
+        assert_eq!(collect_dirty(&aspace).len(), FAULT_AROUND_PAGES);
+        assert!(collect_dirty(&aspace).is_empty());
+
+        // Clean pages are still writable, but the first write faults.
+        assert_eq!(
+            aspace
+                .translation_table()
+                .virt2phy(written_vaddr)
+                .unwrap()
+                .access_permissions(),
+            AccessPermissions::user_memory_default()
+        );
+        assert!(aspace.handle_fault(&write, &page_alloc).unwrap());
+        write_word(&aspace, written_vaddr, 1);
+        assert_eq!(aspace.fault_stats().dirty_faults, 1);
+        assert_eq!(collect_dirty(&aspace), [(written_vaddr, GRANULE_SIZE)]);
+
+        // Clean pages are shared copy-on-write by a fork. Only the copies are dirty.
+        let mut child = aspace.fork(&page_alloc).unwrap();
+        assert!(child.handle_fault(&write, &page_alloc).unwrap());
+        assert_eq!(child.fault_stats().dirty_faults, 0);
+        assert_eq!(collect_dirty(&child), [(written_vaddr, GRANULE_SIZE)]);
+        assert!(collect_dirty(&aspace).is_empty());
+        assert_eq!(read_word(&child, written_vaddr), 1);
+
+        assert!(child.release(region_rng.clone(), &page_alloc).is_ok());
+        assert!(aspace.release(region_rng, &page_alloc).is_ok());
+        child.translation_table().trim_tables(&page_alloc);
+        aspace.translation_table().trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+
+    #[test]
+    fn concurrent_faults_test() {
+        const NUM_THREADS: usize = 4;
+
+        let page_alloc = SyncTestAllocator::default();
+        let zero_pages = ZeroPages::new(&page_alloc).unwrap();
+        let mut aspace = AddressSpace::default();
+        let vaddr = get_random_virt_addr();
+        let region_rng = vaddr..vaddr + REGION_PAGES * GRANULE_SIZE;
+        let done = AtomicBool::new(false);
+        let num_collapsed = AtomicUsize::new(0);
+        // First huge page is populated with pages beforehand, for the scanners to collapse.
+        let collapsible_pages =
+            match TEST_HUGE_PAGES && HUGE_PAGE_SIZE <= REGION_PAGES * GRANULE_SIZE {
+                true => HUGE_PAGE_SIZE / GRANULE_SIZE,
+                false => 0,
+            };
+
+        aspace.set_huge_pages(false);
+        aspace.set_fault_around_pages(FAULT_AROUND_PAGES);
+        aspace.set_zero_pages(Some(zero_pages));
+        reserve_anonymous(&mut aspace, region_rng.clone());
+        let num_allocated = page_alloc.0.lock().unwrap().mem.borrow().len();
+        for page in (0..collapsible_pages).step_by(FAULT_AROUND_PAGES) {
+            let write = fault(
+                vaddr + page * GRANULE_SIZE,
+                FaultKind::Translation,
+                AccessKind::Write,
+            );
+            assert!(aspace.handle_fault(&write, &page_alloc).unwrap());
+        }
+        aspace.set_huge_pages(TEST_HUGE_PAGES);
+
+        // Each thread faults its share of the pages in for reading and then for writing,
+        // interleaved with the others', while the scanners age them, collect the dirty ones,
+        // collapse them into huge pages and fork the address space.
+        std::thread::scope(|scope| {
+            scope.spawn(|| {
+                while !done.load(Ordering::Relaxed) {
+                    assert!(aspace.age_pages(&page_alloc).is_ok());
+                    assert!(aspace
+                        .collect_dirty(region_rng.clone(), |_, _, _| {})
+                        .is_ok());
+                    std::thread::yield_now();
+                }
+            });
+            scope.spawn(|| {
+                while !done.load(Ordering::Relaxed) {
+                    num_collapsed
+                        .fetch_add(aspace.collapse_huge_pages(&page_alloc), Ordering::Relaxed);
+                    aspace.fork(&page_alloc).unwrap().destroy(&page_alloc);
+                    std::thread::yield_now();
+                }
+            });
+
+            let writers: std::vec::Vec<_> = (0..NUM_THREADS)
+                .map(|thread| {
+                    let aspace = &aspace;
+                    let page_alloc = &page_alloc;
+
+                    scope.spawn(move || {
+                        for page in (thread..REGION_PAGES).step_by(NUM_THREADS) {
+                            let vaddr = vaddr + page * GRANULE_SIZE;
+
+                            for (kind, access) in [
+                                (FaultKind::Translation, AccessKind::Read),
+                                (FaultKind::Permission, AccessKind::Write),
+                            ] {
+                                // Faults on pages mapped (or made writable) by the others
+                                // are spurious.
+                                assert!(aspace
+                                    .handle_fault(&fault(vaddr, kind, access), page_alloc)
+                                    .is_ok());
+                            }
+                        }
+                    })
+                })
+                .collect();
+
+            for writer in writers {
+                writer.join().unwrap();
+            }
+            done.store(true, Ordering::Relaxed);
+        });
+
+        // Writes bypass the MMU here, so they couldn't be retried if a collapse unmapped the
+        // page meanwhile. Each page must be private by now.
+        for page in 0..REGION_PAGES {
+            write_word(&aspace, vaddr + page * GRANULE_SIZE, page + 1);
+        }
+        for page in 0..REGION_PAGES {
+            assert_eq!(read_word(&aspace, vaddr + page * GRANULE_SIZE), page + 1);
+        }
+        assert!(aspace.fault_stats().zero_page_faults > 0);
+        assert_eq!(num_collapsed.into_inner() > 0, collapsible_pages > 0);
+
+        aspace.destroy(&page_alloc);
+        let page_alloc = page_alloc.0.into_inner().unwrap();
+        assert_eq!(page_alloc.mem.borrow().len(), num_allocated);
+        assert!(page_alloc.refs.borrow().is_empty());
+        unsafe { zero_pages.release(&page_alloc) };
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
+}
@@ -0,0 +1,332 @@
+//! Address Space IDentifiers.
+//!
+//! TLB entries of non-global (user) mappings are tagged with the ASID held in TTBR0_EL1.
+//! So, switching between user address spaces doesn't need a TLB flush, as long as each of
+//! them has a distinct ASID.
+//!
+//! There are only 256 (8 bit) ASIDs, so they are handed out in generations. Once the current
+//! generation runs out of ASIDs, a new generation begins with the entire TLB flushed. Address
+//! spaces holding an ASID of an older generation get a new one, when they are switched to next.
+//!
+//! Other cores may still be running with an older generation ASID when a generation ends
+//! (the flush doesn't change their TTBR0). So, the ASID active on each core is reserved in
+//! the new generation: it's never handed out to another address space, and the address space
+//! holding it keeps it.
+
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use spin::Mutex;
+
+#[cfg(feature = "no_std")]
+use aarch64_cpu::{
+    asm::barrier::{isb, SY},
+    registers::{MPIDR_EL1, TTBR0_EL1},
+};
+#[cfg(feature = "no_std")]
+use tock_registers::interfaces::{Readable, Writeable};
+
+pub const ASID_BITS: u32 = 8;
+const NUM_ASIDS: usize = 1 << ASID_BITS;
+const ASID_MASK: u64 = NUM_ASIDS as u64 - 1;
+
+/// ASID reserved for the kernel. It's never handed out to an address space.
+const RESERVED_ASID: usize = 0;
+
+/// First generation handed out by the allocator. Generation 0 marks an unallocated `Asid`.
+const FIRST_GENERATION: u64 = 1;
+
+/// Max. no. of cores, as identified by the last 2 bits of MPIDR_EL1 (see `boot.rs`).
+pub const MAX_CPUS: usize = 4;
+
+/// ASID along with the generation it was allocated in.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Asid(u64);
+
+impl Asid {
+    /// ASID to be written into TTBR0_EL1.
+    pub fn get(&self) -> u16 {
+        (self.0 & ASID_MASK) as u16
+    }
+
+    fn generation(&self) -> u64 {
+        self.0 >> ASID_BITS
+    }
+
+    fn new(generation: u64, asid: usize) -> Self {
+        Self(generation << ASID_BITS | asid as u64)
+    }
+}
+
+/// `Asid` of an address space, which can be read without `ASID_ALLOCATOR` locked (for TLB
+/// maintenance). It's changed only with `ASID_ALLOCATOR` locked.
+#[derive(Debug, Default)]
+pub struct AtomicAsid(AtomicU64);
+
+impl AtomicAsid {
+    pub fn load(&self) -> Asid {
+        Asid(self.0.load(Ordering::Relaxed))
+    }
+
+    pub fn store(&self, asid: Asid) {
+        self.0.store(asid.0, Ordering::Relaxed);
+    }
+}
+
+pub struct AsidAllocator {
+    generation: u64,
+    /// ASIDs handed out in the current generation.
+    used: [u64; NUM_ASIDS / u64::BITS as usize],
+    /// Where to look for the next free ASID.
+    next: usize,
+    /// ASID each core last switched to.
+    active: [Asid; MAX_CPUS],
+    /// ASIDs active when the current generation began. They are still tagging TLB entries
+    /// (of the address spaces holding them), so are kept used in this generation.
+    reserved: [Asid; MAX_CPUS],
+}
+
+impl AsidAllocator {
+    pub const fn new() -> Self {
+        let mut used = [0; NUM_ASIDS / u64::BITS as usize];
+        used[RESERVED_ASID / u64::BITS as usize] |= 1 << (RESERVED_ASID % u64::BITS as usize);
+
+        Self {
+            generation: FIRST_GENERATION,
+            used,
+            next: RESERVED_ASID + 1,
+            active: [Asid(0); MAX_CPUS],
+            reserved: [Asid(0); MAX_CPUS],
+        }
+    }
+
+    /// Returns the ASID to be used for an address space currently holding `asid`, which is
+    /// being switched to on core `cpu`.
+    /// `asid` is returned as is, if it belongs to the current generation.
+    /// Also returns true, if a new generation began and the entire TLB must be flushed
+    /// before the returned ASID is used.
+    pub fn get_or_allocate(&mut self, asid: Asid, cpu: usize) -> (Asid, bool) {
+        let (asid, flush_tlb) = self.allocate(asid);
+        self.active[cpu] = asid;
+        (asid, flush_tlb)
+    }
+
+    fn allocate(&mut self, asid: Asid) -> (Asid, bool) {
+        if asid.generation() == self.generation {
+            return (asid, false);
+        }
+
+        if let Some(asid) = self.update_reserved(asid) {
+            return (asid, false);
+        }
+
+        if let Some(asid) = self.find_free_asid() {
+            return (self.mark_used(asid), false);
+        }
+
+        self.rollover();
+        if let Some(asid) = self.update_reserved(asid) {
+            return (asid, true);
+        }
+        let asid = self
+            .find_free_asid()
+            .unwrap_or_else(|| crate::bug!("no free ASID in a new generation"));
+
+        (self.mark_used(asid), true)
+    }
+
+    /// Hand `asid` back for reuse, once the address space holding it is destroyed (and isn't
+    /// active on any core).
+    /// Returns true, if the TLB may still hold entries tagged with it, which must be
+    /// invalidated before it's handed out again. Entries of an older generation were flushed,
+    /// when the generation ended, unless it was reserved.
+    pub fn free(&mut self, asid: Asid) -> bool {
+        if asid.generation() == 0 {
+            return false;
+        }
+        for active in self.active.iter_mut().filter(|active| **active == asid) {
+            *active = Asid(0);
+        }
+        if asid.generation() != self.generation {
+            let mut reserved = false;
+            for slot in self.reserved.iter_mut().filter(|slot| **slot == asid) {
+                *slot = Asid(0);
+                reserved = true;
+            }
+            if !reserved {
+                return false;
+            }
+        }
+
+        let asid = asid.get() as usize;
+        self.used[asid / u64::BITS as usize] &= !(1 << (asid % u64::BITS as usize));
+        true
+    }
+
+    /// If `asid` (of an older generation) was reserved, returns it updated to the current
+    /// generation. It's already marked used.
+    fn update_reserved(&mut self, asid: Asid) -> Option<Asid> {
+        if asid.generation() == 0 {
+            return None;
+        }
+
+        let new_asid = Asid::new(self.generation, asid.get() as usize);
+        let mut found = false;
+        for slot in self.reserved.iter_mut().filter(|slot| **slot == asid) {
+            *slot = new_asid;
+            found = true;
+        }
+        found.then_some(new_asid)
+    }
+
+    fn find_free_asid(&self) -> Option<usize> {
+        (self.next..NUM_ASIDS)
+            .chain(RESERVED_ASID + 1..self.next)
+            .find(|&asid| !self.is_used(asid))
+    }
+
+    fn is_used(&self, asid: usize) -> bool {
+        self.used[asid / u64::BITS as usize] & (1 << (asid % u64::BITS as usize)) != 0
+    }
+
+    fn mark_used(&mut self, asid: usize) -> Asid {
+        self.used[asid / u64::BITS as usize] |= 1 << (asid % u64::BITS as usize);
+        self.next = (asid + 1) % NUM_ASIDS;
+        Asid::new(self.generation, asid)
+    }
+
+    fn rollover(&mut self) {
+        let generation = self.generation + 1;
+        let active = self.active;
+        *self = Self::new();
+        self.generation = generation;
+
+        for (cpu, asid) in active.into_iter().enumerate() {
+            if asid.generation() != 0 {
+                self.mark_used(asid.get() as usize);
+            }
+            self.active[cpu] = asid;
+            self.reserved[cpu] = asid;
+        }
+        self.next = RESERVED_ASID + 1;
+    }
+}
+
+pub static ASID_ALLOCATOR: Mutex<AsidAllocator> = Mutex::new(AsidAllocator::new());
+
+/// Install the translation table at `base_address` in TTBR0_EL1, tagged with `asid`.
+#[cfg(feature = "no_std")]
+pub(super) fn set_ttbr0(base_address: u64, asid: Asid) {
+    TTBR0_EL1
+        .write(TTBR0_EL1::ASID.val(asid.get() as u64) + TTBR0_EL1::BADDR.val(base_address >> 1));
+    isb(SY);
+}
+
+/// There are no TTBRs on the host.
+#[cfg(not(feature = "no_std"))]
+pub(super) fn set_ttbr0(_base_address: u64, _asid: Asid) {}
+
+/// Core this is running on.
+#[cfg(feature = "no_std")]
+pub(super) fn current_cpu() -> usize {
+    MPIDR_EL1.get() as usize & (MAX_CPUS - 1)
+}
+
+/// Host threads are all treated as a single core.
+#[cfg(not(feature = "no_std"))]
+pub(super) fn current_cpu() -> usize {
+    0
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Asid, AsidAllocator, MAX_CPUS, NUM_ASIDS, RESERVED_ASID};
+
+    #[test]
+    fn asid_sanity_test() {
+        let mut allocator = AsidAllocator::new();
+        let mut asids = [Asid::default(); NUM_ASIDS - 1];
+
+        for asid in asids.iter_mut() {
+            let (new_asid, flush_tlb) = allocator.get_or_allocate(*asid, 0);
+
+            assert!(!flush_tlb);
+            assert_ne!(new_asid.get() as usize, RESERVED_ASID);
+            *asid = new_asid;
+        }
+
+        // All ASIDs are distinct and are retained by their address spaces.
+        for (i, asid) in asids.iter().enumerate() {
+            assert!(asids[..i].iter().all(|other| other.get() != asid.get()));
+            assert_eq!(allocator.get_or_allocate(*asid, 0), (*asid, false));
+        }
+
+        // A freed ASID is handed out again, without starting a new generation.
+        assert!(!allocator.free(Asid::default()));
+        assert!(allocator.free(asids[3]));
+        assert_eq!(
+            allocator.get_or_allocate(Asid::default(), 0),
+            (asids[3], false)
+        );
+    }
+
+    #[test]
+    fn asid_rollover_test() {
+        let mut allocator = AsidAllocator::new();
+        let mut asids = [Asid::default(); NUM_ASIDS + 1];
+        let mut num_flushes = 0;
+
+        // Round robin among more address spaces than there are ASIDs.
+        for _ in 0..4 {
+            for asid in asids.iter_mut() {
+                let (new_asid, flush_tlb) = allocator.get_or_allocate(*asid, 0);
+
+                if flush_tlb {
+                    num_flushes += 1;
+                    assert_ne!(new_asid.generation(), asid.generation());
+                }
+                assert_ne!(new_asid.get() as usize, RESERVED_ASID);
+                *asid = new_asid;
+            }
+        }
+
+        // TLB is flushed only once per generation (of 255 ASIDs) and not on every switch.
+        assert_eq!(num_flushes as u64, allocator.generation - 1);
+        assert!(num_flushes * (NUM_ASIDS - 1) <= 4 * asids.len());
+    }
+
+    #[test]
+    fn asid_reserved_test() {
+        let mut allocator = AsidAllocator::new();
+
+        // Address spaces left running on the other cores.
+        let mut running = [Asid::default(); MAX_CPUS];
+        for (cpu, asid) in running.iter_mut().enumerate().skip(1) {
+            *asid = allocator.get_or_allocate(*asid, cpu).0;
+        }
+
+        // Core 0 switches between enough address spaces to end the generation.
+        let mut num_flushes = 0;
+        for _ in 0..NUM_ASIDS {
+            let (new_asid, flush_tlb) = allocator.get_or_allocate(Asid::default(), 0);
+
+            num_flushes += flush_tlb as usize;
+            if num_flushes > 0 {
+                // ASIDs still in use on other cores aren't handed out again.
+                assert!(running[1..].iter().all(|asid| asid.get() != new_asid.get()));
+            }
+        }
+        assert_eq!(num_flushes, 1);
+
+        // Reserved ASID of a destroyed address space may still be tagging TLB entries.
+        assert!(allocator.free(running[MAX_CPUS - 1]));
+
+        // Address spaces running across the rollover keep their ASIDs, without a flush.
+        for (cpu, asid) in running.iter().enumerate().take(MAX_CPUS - 1).skip(1) {
+            let (new_asid, flush_tlb) = allocator.get_or_allocate(*asid, cpu);
+
+            assert!(!flush_tlb);
+            assert_ne!(new_asid, *asid);
+            assert_eq!(new_asid.get(), asid.get());
+        }
+    }
+}
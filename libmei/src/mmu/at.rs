@@ -0,0 +1,109 @@
+//! Hardware assisted Address Translation.
+//!
+//! The `AT` instructions make the MMU walk the currently installed translation tables
+//! (consulting the TLBs first) and report the outcome in PAR_EL1. This is much cheaper than
+//! a software walk, but only works for the tables loaded in TTBR0/TTBR1 of the current core.
+//!
+//! Addresses in the TTBR0 (user) half are translated with `AT S1E0R`, so a translation
+//! succeeds only if EL0 is allowed to read the address. TTBR1 (kernel) addresses are
+//! translated with `AT S1E1R`.
+
+#[cfg(feature = "no_std")]
+use core::arch::asm;
+
+#[cfg(feature = "no_std")]
+use aarch64_cpu::registers::{TTBR0_EL1, TTBR1_EL1};
+use tock_registers::register_bitfields;
+#[cfg(feature = "no_std")]
+use tock_registers::{interfaces::Readable, registers::InMemoryRegister};
+
+use crate::address::{PhysicalAddress, VirtualAddress};
+
+#[cfg(feature = "no_std")]
+use crate::address::{Address, TTBR};
+#[cfg(not(feature = "no_std"))]
+use crate::bug;
+
+/// Returns true, if the translation table with root at `base_address` is installed in the
+/// TTBR used for translating `vaddr`.
+#[cfg(feature = "no_std")]
+pub(super) fn is_installed(base_address: u64, vaddr: VirtualAddress) -> bool {
+    match vaddr.get_ttbr_select() {
+        TTBR::Zero => TTBR0_EL1.get_baddr() == base_address,
+        TTBR::One => TTBR1_EL1.get_baddr() == base_address,
+    }
+}
+
+/// There is no MMU to ask on the host.
+#[cfg(not(feature = "no_std"))]
+pub(super) fn is_installed(_base_address: u64, _vaddr: VirtualAddress) -> bool {
+    false
+}
+
+/// Translate `vaddr` using the MMU.
+/// Must be called only if `is_installed` is true for the translation table being queried.
+#[cfg(feature = "no_std")]
+pub(super) fn translate(vaddr: VirtualAddress) -> Option<PhysicalAddress> {
+    let va = vaddr.as_raw_ptr();
+    let par: u64;
+
+    // IRQ and FIQ are masked, so that an interrupt handler cannot clobber PAR_EL1
+    // between the `AT` and the read of the result.
+    unsafe {
+        match vaddr.get_ttbr_select() {
+            TTBR::Zero => asm!(
+                "mrs {daif}, DAIF",
+                "msr DAIFSet, #0b0011",
+                "at s1e0r, {va}",
+                "isb",
+                "mrs {par}, PAR_EL1",
+                "msr DAIF, {daif}",
+                va = in(reg) va,
+                par = out(reg) par,
+                daif = out(reg) _,
+                options(nostack, preserves_flags)
+            ),
+            TTBR::One => asm!(
+                "mrs {daif}, DAIF",
+                "msr DAIFSet, #0b0011",
+                "at s1e1r, {va}",
+                "isb",
+                "mrs {par}, PAR_EL1",
+                "msr DAIF, {daif}",
+                va = in(reg) va,
+                par = out(reg) par,
+                daif = out(reg) _,
+                options(nostack, preserves_flags)
+            ),
+        }
+    }
+
+    let par = InMemoryRegister::<u64, PAR_EL1::Register>::new(par);
+    if par.matches_all(PAR_EL1::F::Fault) {
+        return None;
+    }
+
+    Some(PhysicalAddress::new(
+        (par.read(PAR_EL1::PA) << PAR_EL1::PA.shift) as usize
+            + vaddr.align_offset(1 << PAR_EL1::PA.shift),
+    ))
+}
+
+#[cfg(not(feature = "no_std"))]
+pub(super) fn translate(_vaddr: VirtualAddress) -> Option<PhysicalAddress> {
+    bug!("AT instructions are unavailable on host")
+}
+
+register_bitfields! {u64,
+    // Physical Address Register, as per ARMv8-A Architecture Reference Manual D13.2.102.
+    PAR_EL1 [
+        /// Output address [47:12] of a successful translation.
+        PA OFFSET(12) NUMBITS(36) [], // [47:12]
+
+        /// Whether the translation aborted.
+        F OFFSET(0) NUMBITS(1) [
+            Success = 0,
+            Fault = 1
+        ]
+    ]
+}
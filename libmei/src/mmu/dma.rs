@@ -0,0 +1,165 @@
+//! Scatter-Gather lists for DMA.
+//!
+//! DMA engines access memory by physical (bus) address, while a buffer contiguous in VA is
+//! usually backed by scattered pages. Such a buffer is handed to the engine as a list of
+//! physically contiguous segments (ex: a chain of BCM2837 DMA control blocks, one per segment).
+//!
+//! Memory the engine cannot reach is bounced: the segment is backed by a buffer allocated
+//! from the reachable memory, which is synced with the original memory around the transfer.
+//! Cache maintenance for the transfer is left to the driver.
+
+use core::{
+    alloc::{Allocator, Layout},
+    ptr::NonNull,
+};
+
+use crate::{
+    address::{Address, PhysicalAddress, VirtualAddress},
+    address_map::DRAM_END,
+    bug,
+    vm::phy2virt,
+};
+
+use super::GRANULE_SIZE;
+
+/// Limits of a DMA engine, on the segments it can be handed.
+#[derive(Debug, Clone, Copy)]
+pub struct DmaConstraints {
+    /// Segments longer than this are split.
+    pub max_segment_size: usize,
+    /// Memory at or beyond this address is unreachable by the engine.
+    pub dma_limit: PhysicalAddress,
+    /// Added to a physical address, to get the address the engine uses for it.
+    pub bus_offset: usize,
+}
+
+impl DmaConstraints {
+    /// BCM2837 DMA channels: TXFR_LEN of a control block is 30 bits wide (the largest power
+    /// of 2 fitting it is used) and the engine sees SDRAM through the uncached bus alias at
+    /// 0xC000_0000, which covers all of the DRAM.
+    pub const BCM2837: Self = Self {
+        max_segment_size: 1 << 29,
+        dma_limit: DRAM_END,
+        bus_offset: 0xC000_0000,
+    };
+
+    /// BCM2837 DMA Lite channels: same as the above, but TXFR_LEN is only 16 bits wide.
+    pub const BCM2837_LITE: Self = Self {
+        max_segment_size: 1 << 15,
+        ..Self::BCM2837
+    };
+}
+
+/// Physically contiguous piece of a buffer, to be transferred by a DMA engine.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DmaSegment {
+    virt_addr: VirtualAddress,
+    phy_addr: PhysicalAddress,
+    len: usize,
+    /// Buffer standing in for `phy_addr`, when the engine cannot reach it.
+    bounce: Option<PhysicalAddress>,
+    bus_offset: usize,
+}
+
+/// Empty segment, for preparing the slots `TranslationTable::build_sg_list` fills in.
+impl Default for DmaSegment {
+    fn default() -> Self {
+        Self {
+            virt_addr: VirtualAddress::new(0).unwrap_or_else(|_| bug!("Invalid VA")),
+            phy_addr: PhysicalAddress::new(0),
+            len: 0,
+            bounce: None,
+            bus_offset: 0,
+        }
+    }
+}
+
+impl DmaSegment {
+    pub(super) fn new(
+        virt_addr: VirtualAddress,
+        phy_addr: PhysicalAddress,
+        len: usize,
+        bounce: Option<PhysicalAddress>,
+        constraints: &DmaConstraints,
+    ) -> Self {
+        Self {
+            virt_addr,
+            phy_addr,
+            len,
+            bounce,
+            bus_offset: constraints.bus_offset,
+        }
+    }
+
+    /// Address of the segment in the address space, it was built from.
+    pub fn virtual_address(&self) -> VirtualAddress {
+        self.virt_addr
+    }
+
+    /// Memory backing the segment (even if bounced).
+    pub fn physical_address(&self) -> PhysicalAddress {
+        self.phy_addr
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Address to program the DMA engine with.
+    pub fn dma_address(&self) -> usize {
+        self.bounce.unwrap_or(self.phy_addr).as_raw_ptr() + self.bus_offset
+    }
+
+    pub fn is_bounced(&self) -> bool {
+        self.bounce.is_some()
+    }
+
+    /// Copy the memory backing the segment into the bounce buffer, before a transfer from
+    /// memory (to the device).
+    ///
+    /// # Safety
+    /// Both the memory and the bounce buffer must be statically mapped (see `phy2virt`) and
+    /// no transfer using the segment must be in progress.
+    pub unsafe fn sync_for_device(&self) {
+        if let Some(bounce) = self.bounce {
+            Self::copy(self.phy_addr, bounce, self.len);
+        }
+    }
+
+    /// Copy the bounce buffer back into the memory backing the segment, after a transfer to
+    /// memory (from the device).
+    ///
+    /// # Safety
+    /// Same as `sync_for_device`.
+    pub unsafe fn sync_for_cpu(&self) {
+        if let Some(bounce) = self.bounce {
+            Self::copy(bounce, self.phy_addr, self.len);
+        }
+    }
+
+    unsafe fn copy(src: PhysicalAddress, dst: PhysicalAddress, len: usize) {
+        core::ptr::copy_nonoverlapping(
+            phy2virt(src).as_raw_ptr() as *const u8,
+            phy2virt(dst).as_raw_ptr() as *mut u8,
+            len,
+        );
+    }
+}
+
+pub(super) fn bounce_layout(len: usize) -> Layout {
+    Layout::from_size_align(len, GRANULE_SIZE).unwrap()
+}
+
+/// Free the bounce buffers of `segments`, allocated from `dma_alloc`.
+pub fn release_sg_list<DmaAlloc: Allocator>(segments: &[DmaSegment], dma_alloc: &DmaAlloc) {
+    for segment in segments {
+        if let Some(bounce) = segment.bounce {
+            unsafe {
+                dma_alloc.deallocate(
+                    NonNull::new_unchecked(bounce.as_raw_ptr() as *mut u8),
+                    bounce_layout(segment.len),
+                )
+            };
+        }
+    }
+}
@@ -0,0 +1,124 @@
+//! Epoch based reclamation of Translation Tables.
+//!
+//! Translation tables are walked without locks (ex: `TranslationTable::virt2phy`), while
+//! other cores unmap. A table unlinked by an update may still be walked by those, which
+//! loaded its descriptor before. So, unlinked tables are retired instead of being freed.
+//!
+//! Walkers pin the current epoch for the duration of a walk. The epoch advances only once
+//! no walker is pinned in the previous one, so a table retired in epoch `e` can be freed once
+//! the epoch reaches `e + 2`: every walker, which could have seen the table, is done by then.
+//! Pinned walkers are counted per epoch (modulo 3), so walks need no per-core state.
+//!
+//! Each translation table has an epoch of its own, so that walkers of one address space
+//! never hold back the reclamation in another.
+
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+/// No. of epochs, whose walkers can be pinned at a time.
+const NUM_EPOCH_COUNTERS: usize = 3;
+
+pub struct Epoch {
+    epoch: AtomicU64,
+    /// No. of walkers pinned in each epoch (modulo `NUM_EPOCH_COUNTERS`).
+    pinned: [AtomicUsize; NUM_EPOCH_COUNTERS],
+}
+
+impl Epoch {
+    pub const fn new() -> Self {
+        const UNPINNED: AtomicUsize = AtomicUsize::new(0);
+
+        Self {
+            // Epoch 0 marks a live (not retired) table.
+            epoch: AtomicU64::new(1),
+            pinned: [UNPINNED; NUM_EPOCH_COUNTERS],
+        }
+    }
+
+    /// Pin the current epoch, until the returned guard is dropped.
+    /// Retries only if the epoch advances meanwhile, so walkers never wait for each other
+    /// or for the reclaimers.
+    pub fn pin(&self) -> EpochGuard<'_> {
+        loop {
+            let epoch = self.epoch.load(Ordering::SeqCst);
+            let pinned = &self.pinned[epoch as usize % NUM_EPOCH_COUNTERS];
+
+            pinned.fetch_add(1, Ordering::SeqCst);
+            // Walker is counted in `epoch`, only if it's still current.
+            if self.epoch.load(Ordering::SeqCst) == epoch {
+                return EpochGuard { pinned };
+            }
+            pinned.fetch_sub(1, Ordering::SeqCst);
+        }
+    }
+
+    /// Epoch to retire a table in. Must be read after the table is unlinked.
+    pub fn current(&self) -> u64 {
+        self.epoch.load(Ordering::SeqCst)
+    }
+
+    /// Advance the epoch, if no walker is pinned in the previous one.
+    /// Returns the current epoch.
+    pub fn try_advance(&self) -> u64 {
+        let epoch = self.epoch.load(Ordering::SeqCst);
+        let prev = (epoch as usize + NUM_EPOCH_COUNTERS - 1) % NUM_EPOCH_COUNTERS;
+
+        if self.pinned[prev].load(Ordering::SeqCst) == 0 {
+            let _ =
+                self.epoch
+                    .compare_exchange(epoch, epoch + 1, Ordering::SeqCst, Ordering::SeqCst);
+        }
+
+        self.epoch.load(Ordering::SeqCst)
+    }
+
+    /// Whether a table retired in `retired` can be freed, as of `epoch`.
+    pub fn is_reclaimable(retired: u64, epoch: u64) -> bool {
+        epoch >= retired + 2
+    }
+}
+
+impl Default for Epoch {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+pub struct EpochGuard<'a> {
+    pinned: &'a AtomicUsize,
+}
+
+impl Drop for EpochGuard<'_> {
+    fn drop(&mut self) {
+        self.pinned.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Epoch;
+
+    #[test]
+    fn epoch_sanity_test() {
+        let epoch = Epoch::new();
+        let retired = epoch.current();
+
+        // A walker pinned in the epoch of retirement holds the epoch back.
+        let guard = epoch.pin();
+        for _ in 0..4 {
+            assert!(!Epoch::is_reclaimable(retired, epoch.try_advance()));
+        }
+        assert_eq!(epoch.current(), retired + 1);
+
+        // Walkers pinned later don't.
+        let later_guard = epoch.pin();
+        drop(guard);
+        assert_eq!(epoch.try_advance(), retired + 2);
+        assert!(Epoch::is_reclaimable(retired, epoch.current()));
+
+        let retired = epoch.current();
+        assert_eq!(epoch.try_advance(), retired);
+        drop(later_guard);
+        epoch.try_advance();
+        assert!(Epoch::is_reclaimable(retired, epoch.try_advance()));
+    }
+}
@@ -0,0 +1,149 @@
+//! Page Faults.
+//!
+//! Instruction and Data Aborts taken on a translation table walk are decoded into a
+//! `PageFault`, using the syndrome in ESR_EL1 and the faulting address in FAR_EL1.
+
+use tock_registers::{interfaces::Readable, register_bitfields, registers::InMemoryRegister};
+
+use crate::address::{AddressTranslationLevel, VirtualAddress};
+
+/// Why the translation table walk failed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FaultKind {
+    /// No valid descriptor maps the address.
+    Translation,
+    /// Access flag of the descriptor is clear.
+    AccessFlag,
+    /// Access permissions of the descriptor deny the access.
+    Permission,
+}
+
+/// Access which caused the fault.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum AccessKind {
+    Read,
+    Write,
+    Execute,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct PageFault {
+    vaddr: VirtualAddress,
+    kind: FaultKind,
+    access: AccessKind,
+    /// Level of the translation table walk, at which the fault occured.
+    level: AddressTranslationLevel,
+}
+
+impl PageFault {
+    pub fn new(
+        vaddr: VirtualAddress,
+        kind: FaultKind,
+        access: AccessKind,
+        level: AddressTranslationLevel,
+    ) -> Self {
+        Self {
+            vaddr,
+            kind,
+            access,
+            level,
+        }
+    }
+
+    /// Decode the Instruction Specific Syndrome `iss` of an Instruction Abort (if
+    /// `is_instr_abort`) or a Data Abort on the address `far`.
+    /// Returns None, if the abort isn't a fault on a translation table walk (ex: alignment
+    /// fault or external abort).
+    pub fn decode(iss: u64, far: usize, is_instr_abort: bool) -> Option<Self> {
+        let iss = InMemoryRegister::<u64, ABORT_ISS::Register>::new(iss);
+        let fsc = iss.read(ABORT_ISS::FSC);
+        let kind = match fsc & FSC_KIND_MASK {
+            FSC_TRANSLATION_FAULT => FaultKind::Translation,
+            FSC_ACCESS_FLAG_FAULT => FaultKind::AccessFlag,
+            FSC_PERMISSION_FAULT => FaultKind::Permission,
+            _ => return None,
+        };
+        let access = if is_instr_abort {
+            AccessKind::Execute
+        } else if iss.is_set(ABORT_ISS::WNR) {
+            AccessKind::Write
+        } else {
+            AccessKind::Read
+        };
+
+        Some(Self {
+            vaddr: VirtualAddress::new(far).ok()?,
+            kind,
+            access,
+            level: AddressTranslationLevel::from((fsc & FSC_LEVEL_MASK) as usize),
+        })
+    }
+
+    pub fn vaddr(&self) -> VirtualAddress {
+        self.vaddr
+    }
+
+    pub fn kind(&self) -> FaultKind {
+        self.kind
+    }
+
+    pub fn access(&self) -> AccessKind {
+        self.access
+    }
+
+    pub fn level(&self) -> AddressTranslationLevel {
+        self.level
+    }
+}
+
+/// Fault Status Codes are 0bKKKKLL, where K is the kind of fault and L is the level.
+const FSC_KIND_MASK: u64 = 0b11_1100;
+const FSC_LEVEL_MASK: u64 = 0b00_0011;
+const FSC_TRANSLATION_FAULT: u64 = 0b00_0100;
+const FSC_ACCESS_FLAG_FAULT: u64 = 0b00_1000;
+const FSC_PERMISSION_FAULT: u64 = 0b00_1100;
+
+register_bitfields! {u64,
+    // ISS of Instruction and Data Aborts, as per ARMv8-A Architecture Reference Manual D13.2.37.
+    ABORT_ISS [
+        /// Write not Read. Only valid for Data Aborts.
+        WNR OFFSET(6) NUMBITS(1) [],
+
+        /// Fault Status Code (IFSC/DFSC).
+        FSC OFFSET(0) NUMBITS(6) []
+    ]
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::address::{Address, AddressTranslationLevel};
+
+    use super::{AccessKind, FaultKind, PageFault};
+
+    #[test]
+    fn decode_sanity_test() {
+        const FAR: usize = 0x1234_5678;
+
+        // Write to a page without a valid descriptor at level 3.
+        let fault = PageFault::decode(1 << 6 | 0b00_0111, FAR, false).unwrap();
+        assert_eq!(fault.vaddr().as_raw_ptr(), FAR);
+        assert_eq!(fault.kind(), FaultKind::Translation);
+        assert_eq!(fault.access(), AccessKind::Write);
+        assert_eq!(fault.level(), AddressTranslationLevel::Three);
+
+        // Read of a level 2 block with access flag clear.
+        let fault = PageFault::decode(0b00_1010, FAR, false).unwrap();
+        assert_eq!(fault.kind(), FaultKind::AccessFlag);
+        assert_eq!(fault.access(), AccessKind::Read);
+        assert_eq!(fault.level(), AddressTranslationLevel::Two);
+
+        // Instruction fetch from an execute-never page.
+        let fault = PageFault::decode(0b00_1111, FAR, true).unwrap();
+        assert_eq!(fault.kind(), FaultKind::Permission);
+        assert_eq!(fault.access(), AccessKind::Execute);
+
+        // Alignment fault and synchronous external abort aren't page faults.
+        assert!(PageFault::decode(0b10_0001, FAR, false).is_none());
+        assert!(PageFault::decode(0b01_0000, FAR, false).is_none());
+    }
+}
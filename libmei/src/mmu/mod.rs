@@ -1,15 +1,31 @@
+#[cfg(feature = "no_std")]
+use core::arch::asm;
+
 use aarch64_cpu::{
     asm::barrier::{isb, SY},
     registers::{MAIR_EL1, SCTLR_EL1, TCR_EL1},
 };
 use tock_registers::{
+    fields::FieldValue,
     interfaces::{ReadWriteable, Writeable},
     register_bitfields,
 };
+#[cfg(feature = "no_std")]
+use tock_registers::{interfaces::Readable, registers::InMemoryRegister};
 
 use crate::address::VIRTUAL_ADDRESS_LEVEL_IDX_BITS;
 
-pub const GRANULE_SIZE: usize = 4096;
+#[cfg(all(feature = "granule_16k", feature = "granule_64k"))]
+compile_error!("features `granule_16k` and `granule_64k` are mutually exclusive");
+
+/// Translation granule (4KiB by default), selected at build time using the features
+/// `granule_16k` and `granule_64k`. Size of every page and translation table.
+#[cfg(not(any(feature = "granule_16k", feature = "granule_64k")))]
+pub const GRANULE_SIZE: usize = 4 * 1024;
+#[cfg(feature = "granule_16k")]
+pub const GRANULE_SIZE: usize = 16 * 1024;
+#[cfg(feature = "granule_64k")]
+pub const GRANULE_SIZE: usize = 64 * 1024;
 pub const GRANULE_SIZE_BITS: u32 = GRANULE_SIZE.ilog2();
 
 pub const TRANSLATION_TABLE_DESC_ALIGN: usize =
@@ -19,22 +35,35 @@ pub const TRANSLATION_TABLE_DESC_ALIGN_BITS: u32 = TRANSLATION_TABLE_DESC_ALIGN.
 pub const OUTPUT_ADDR_BITS: u32 = 48;
 pub const NEXT_LEVEL_TABLE_ADDR_BITS: u32 = 36;
 pub const NEXT_LEVEL_TABLE_ADDR_SHIFT: u32 = OUTPUT_ADDR_BITS - NEXT_LEVEL_TABLE_ADDR_BITS;
-pub const LEVEL_1_OUTPUT_ADDR_BITS: u32 = 18;
-pub const LEVEL_1_OUTPUT_ADDR_SHIFT: u32 = OUTPUT_ADDR_BITS - LEVEL_1_OUTPUT_ADDR_BITS;
-pub const LEVEL_2_OUTPUT_ADDR_BITS: u32 = 27;
-pub const LEVEL_2_OUTPUT_ADDR_SHIFT: u32 = OUTPUT_ADDR_BITS - LEVEL_2_OUTPUT_ADDR_BITS;
-pub const LEVEL_3_OUTPUT_ADDR_BITS: u32 = 36;
-pub const LEVEL_3_OUTPUT_ADDR_SHIFT: u32 = OUTPUT_ADDR_BITS - LEVEL_3_OUTPUT_ADDR_BITS;
-
+/// Output address field of block/page descriptors is laid out the same for all granules.
+/// Bits below the size of the block (or page) are RES0.
+pub const DESC_OUTPUT_ADDR_BITS: u32 = 36;
+pub const DESC_OUTPUT_ADDR_SHIFT: u32 = OUTPUT_ADDR_BITS - DESC_OUTPUT_ADDR_BITS;
+
+mod address_space;
+mod asid;
+mod at;
+mod dma;
+mod epoch;
+mod fault;
+mod tlb;
 mod translation_table;
 mod utils;
 
+pub use address_space::{
+    AddressSpace, FaultStats, Region, RegionKind, WorkingSet, ZeroPages, FAULT_AROUND_PAGES,
+    HUGE_PAGE_SIZE, MAX_PAGE_AGE,
+};
+pub use dma::{release_sg_list, DmaConstraints, DmaSegment};
+pub use fault::{AccessKind, FaultKind, PageFault};
+pub use translation_table::{IntoSubtrees, Subtree, TableUsage, TranslationTable};
+
 /// Setup all registers before enabling MMU
 /// Also return the value to be written to SCTLR_EL1 for enabling MMU.
 pub fn setup_mmu() {
     setup_ttbr1_entries();
     setup_ttbr0_entries();
-    config_4kb_48bit_virtual_address_space();
+    config_48bit_virtual_address_space();
     config_el1_memory_attributes();
     enable_mmu();
 }
@@ -49,26 +78,72 @@ fn setup_ttbr0_entries() {
     todo!()
 }
 
-/// Setup VA space for both Kernel and User space to contain 48 bits and 4KB granule
-/// This means there are 4 levels of Translation required to obtain Physical address
-/// from Virtual address
-fn config_4kb_48bit_virtual_address_space() {
+/// Setup VA space for both Kernel and User space to contain 48 bits and `GRANULE_SIZE` granule
+/// With 4KB and 16KB granule, there are 4 levels of Translation required to obtain Physical
+/// address from Virtual address. With 64KB granule, there are 3.
+fn config_48bit_virtual_address_space() {
     TCR_EL1.write(
         TCR_EL1::A1::TTBR0
+            + TCR_EL1::AS::ASID8Bits
             + TCR_EL1::IPS::Bits_48
-            + TCR_EL1::TG0::KiB_4
-            + TCR_EL1::TG1::KiB_4
+            + tcr_granule()
             + TCR_EL1::SH1::Inner
             + TCR_EL1::SH0::Inner
             + TCR_EL1::ORGN1::WriteBack_ReadAlloc_WriteAlloc_Cacheable
             + TCR_EL1::IRGN1::WriteBack_ReadAlloc_WriteAlloc_Cacheable
             + TCR_EL1::T0SZ.val(16) // 16 MSB's are ignored
-            + TCR_EL1::T1SZ.val(16), // 16 MSB's are ignored
+            + TCR_EL1::T1SZ.val(16) // 16 MSB's are ignored
+            + tcr_hw_access_flag(),
     );
 
     isb(SY);
 }
 
+/// Let the MMU set the access flag of descriptors, instead of taking an Access Flag fault,
+/// where supported.
+fn tcr_hw_access_flag() -> FieldValue<u64, TCR_EL1::Register> {
+    if supports_hw_access_flag() {
+        TCR_EL1::HA::Enable
+    } else {
+        TCR_EL1::HA::Disable
+    }
+}
+
+#[cfg(feature = "no_std")]
+fn supports_hw_access_flag() -> bool {
+    let mmfr1: u64;
+    unsafe {
+        asm!(
+            "mrs {}, ID_AA64MMFR1_EL1",
+            out(reg) mmfr1,
+            options(nomem, nostack, preserves_flags)
+        )
+    };
+
+    let mmfr1 = InMemoryRegister::<u64, ID_AA64MMFR1_EL1::Register>::new(mmfr1);
+    !mmfr1.matches_all(ID_AA64MMFR1_EL1::HAFDBS::Unsupported)
+}
+
+#[cfg(not(feature = "no_std"))]
+fn supports_hw_access_flag() -> bool {
+    false
+}
+
+#[cfg(not(any(feature = "granule_16k", feature = "granule_64k")))]
+fn tcr_granule() -> FieldValue<u64, TCR_EL1::Register> {
+    TCR_EL1::TG0::KiB_4 + TCR_EL1::TG1::KiB_4
+}
+
+#[cfg(feature = "granule_16k")]
+fn tcr_granule() -> FieldValue<u64, TCR_EL1::Register> {
+    TCR_EL1::TG0::KiB_16 + TCR_EL1::TG1::KiB_16
+}
+
+#[cfg(feature = "granule_64k")]
+fn tcr_granule() -> FieldValue<u64, TCR_EL1::Register> {
+    TCR_EL1::TG0::KiB_64 + TCR_EL1::TG1::KiB_64
+}
+
 /// Setup Memory Attribute Indirection Register to include Normal and Device Memory
 fn config_el1_memory_attributes() {
     // Define the memory types being mapped.
@@ -97,6 +172,16 @@ fn enable_mmu() {
 }
 
 register_bitfields! {u64,
+    // Memory Model Feature Register 1, as per ARMv8-A Architecture Reference Manual D13.2.65.
+    ID_AA64MMFR1_EL1 [
+        /// Hardware updates of the access flag and dirty state of descriptors.
+        HAFDBS OFFSET(0) NUMBITS(4) [
+            Unsupported = 0b0000,
+            AccessFlag = 0b0001,
+            AccessFlagAndDirtyState = 0b0010
+        ]
+    ],
+
     // A table descriptor (level 0), as per ARMv8-A Architecture Reference Manual Figure D8-12.
     STAGE1_TABLE_DESCRIPTOR [
         /// Physical address of the next descriptor.
@@ -131,10 +216,23 @@ register_bitfields! {u64,
             True = 1
         ],
 
-        /// Bits [47:30] of Output Address. Points to a 1GiB Physical Page.
-        OUTPUT_ADDR_1GiB OFFSET(30) NUMBITS(18) [], // [47:30]
-        /// Bits [47:21] of Output Address. Points to a 2MiB Physical Page.
-        OUTPUT_ADDR_2MiB OFFSET(21) NUMBITS(27) [], // [47:21]
+        /// Hint that the entry is one of a run of adjacent entries (16 with 4KiB granule), mapping
+        /// a contiguous output address range with identical attributes. Lets a single TLB entry
+        /// cache all of them.
+        Contiguous OFFSET(52) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
+
+        /// Bits [47:12] of Output Address. Points to a Physical Block, so bits below the
+        /// block size are RES0.
+        OUTPUT_ADDR OFFSET(12) NUMBITS(36) [], // [47:12]
+
+        /// Not global. Translations are tagged with the current ASID, when set.
+        NG OFFSET(11) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
 
         /// Access flag.
         AF OFFSET(10) NUMBITS(1) [
@@ -187,8 +285,23 @@ register_bitfields! {u64,
             True = 1
         ],
 
-        /// Bits [47:12] of Output Address. Points to a 4KiB Physical Page.
-        OUTPUT_ADDR_4KiB OFFSET(12) NUMBITS(36) [], // [47:12]
+        /// Hint that the entry is one of a run of adjacent entries (16 with 4KiB granule), mapping
+        /// a contiguous output address range with identical attributes. Lets a single TLB entry
+        /// cache all of them.
+        Contiguous OFFSET(52) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
+
+        /// Bits [47:12] of Output Address. Points to a Physical Page, so bits below the
+        /// granule size are RES0.
+        OUTPUT_ADDR OFFSET(12) NUMBITS(36) [], // [47:12]
+
+        /// Not global. Translations are tagged with the current ASID, when set.
+        NG OFFSET(11) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
 
         /// Access flag.
         AF OFFSET(10) NUMBITS(1) [
@@ -241,12 +354,23 @@ register_bitfields! {u64,
             True = 1
         ],
 
-        /// Bits [47:12] of Output Address. Points to a 4KiB Physical Page. (Level 3)
-        OUTPUT_ADDR_4KiB OFFSET(12) NUMBITS(36) [], // [47:12]
-        /// Bits [47:21] of Output Address. Points to a 2MiB Physical Page. (Level 2)
-        OUTPUT_ADDR_2MiB OFFSET(21) NUMBITS(27) [], // [47:21]
-        /// Bits [47:30] of Output Address. Points to a 1GiB Physical Page. (Level 1)
-        OUTPUT_ADDR_1GiB OFFSET(30) NUMBITS(18) [], // [47:30]
+        /// Hint that the entry is one of a run of adjacent entries (16 with 4KiB granule), mapping
+        /// a contiguous output address range with identical attributes. Lets a single TLB entry
+        /// cache all of them.
+        Contiguous OFFSET(52) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
+
+        /// Bits [47:12] of Output Address. Points to a Physical Page/Block, so bits below its
+        /// size are RES0.
+        OUTPUT_ADDR OFFSET(12) NUMBITS(36) [], // [47:12]
+
+        /// Not global. Translations are tagged with the current ASID, when set.
+        NG OFFSET(11) NUMBITS(1) [
+            False = 0,
+            True = 1
+        ],
 
         /// Access flag.
         AF OFFSET(10) NUMBITS(1) [
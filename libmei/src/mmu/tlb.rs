@@ -0,0 +1,122 @@
+//! TLB maintenance.
+//!
+//! Translation table updates that change (or remove) a valid descriptor must follow the
+//! break-before-make sequence: the old descriptor is invalidated, stale TLB entries are
+//! invalidated and only then the new descriptor is written.
+
+use core::ops::Range;
+
+#[cfg(feature = "no_std")]
+use core::arch::asm;
+
+#[cfg(feature = "no_std")]
+use aarch64_cpu::asm::barrier::{dsb, isb, ISH, ISHST, SY};
+
+#[cfg(feature = "no_std")]
+use crate::address::Address;
+use crate::address::VirtualAddress;
+
+#[cfg(feature = "no_std")]
+use super::GRANULE_SIZE;
+
+/// TLB entries the mappings (and walks) of a translation table may be cached in.
+#[derive(Debug, Clone, Copy)]
+pub(super) enum Scope {
+    /// Entries of all address spaces, as the table holds global mappings.
+    All,
+    /// Entries tagged with the table's ASID.
+    Asid(u16),
+}
+
+/// Upper bound on the number of TLBI by VA instructions issued for a single range.
+/// Beyond this, it's cheaper to invalidate the entire TLB.
+#[cfg(feature = "no_std")]
+const MAX_TLBI_OPS: usize = 512;
+
+#[cfg(feature = "no_std")]
+const TLBI_VA_SHIFT: usize = 12;
+/// Operand bits holding the VA. Bits above are the TTL hint (with FEAT_TTL) and the ASID, which
+/// the upper VA bits of kernel (TTBR1) addresses must not spill into.
+#[cfg(feature = "no_std")]
+const TLBI_VA_MASK: usize = (1 << 44) - 1;
+
+/// Invalidate TLB entries (in the Inner Shareable domain) caching translations or
+/// table walks for any address in `vaddr_rng`. Large ranges are invalidated as a whole
+/// `scope` instead.
+/// Must be called after the descriptors mapping `vaddr_rng` are invalidated.
+#[cfg(feature = "no_std")]
+pub(super) fn invalidate_range(vaddr_rng: Range<VirtualAddress>, scope: Scope) {
+    let num_pages = (vaddr_rng.end - vaddr_rng.start) as usize / GRANULE_SIZE;
+
+    // Make the invalidated descriptors visible to the table walkers, before TLBI.
+    dsb(ISHST);
+
+    if num_pages > MAX_TLBI_OPS {
+        match scope {
+            Scope::All => unsafe { asm!("tlbi vmalle1is", options(nostack, preserves_flags)) },
+            Scope::Asid(asid) => unsafe {
+                asm!(
+                    "tlbi aside1is, {}",
+                    in(reg) asid_operand(asid),
+                    options(nostack, preserves_flags)
+                )
+            },
+        }
+    } else {
+        let mut vaddr = vaddr_rng.start;
+        while vaddr < vaddr_rng.end {
+            // Operand holds VA[55:12], irrespective of the granule size.
+            let operand = (vaddr.as_raw_ptr() >> TLBI_VA_SHIFT) & TLBI_VA_MASK;
+            unsafe { asm!("tlbi vaae1is, {}", in(reg) operand, options(nostack, preserves_flags)) };
+            vaddr += GRANULE_SIZE;
+        }
+    }
+
+    dsb(ISH);
+    isb(SY);
+}
+
+/// Invalidate all TLB entries (in the Inner Shareable domain) for EL1&0 regime.
+#[cfg(feature = "no_std")]
+pub(super) fn invalidate_all() {
+    dsb(ISHST);
+    unsafe { asm!("tlbi vmalle1is", options(nostack, preserves_flags)) };
+    dsb(ISH);
+    isb(SY);
+}
+
+/// Invalidate all TLB entries (in the Inner Shareable domain) tagged with `asid`, including
+/// the cached walks of the user (TTBR0) translation table using it.
+#[cfg(feature = "no_std")]
+pub(super) fn invalidate_asid(asid: u16) {
+    dsb(ISHST);
+    unsafe {
+        asm!("tlbi aside1is, {}", in(reg) asid_operand(asid), options(nostack, preserves_flags))
+    };
+    dsb(ISH);
+    isb(SY);
+}
+
+/// Invalidate all TLB entries in `scope`.
+pub(super) fn invalidate(scope: Scope) {
+    match scope {
+        Scope::All => invalidate_all(),
+        Scope::Asid(asid) => invalidate_asid(asid),
+    }
+}
+
+/// Operand of TLBI by ASID, which holds the ASID in bits [63:48].
+#[cfg(feature = "no_std")]
+fn asid_operand(asid: u16) -> u64 {
+    (asid as u64) << 48
+}
+
+/// There are no TLBs to maintain on the host.
+#[cfg(not(feature = "no_std"))]
+pub(super) fn invalidate_range(_vaddr_rng: Range<VirtualAddress>, _scope: Scope) {}
+
+#[cfg(not(feature = "no_std"))]
+pub(super) fn invalidate_all() {}
+
+#[cfg(not(feature = "no_std"))]
+pub(super) fn invalidate_asid(_asid: u16) {}
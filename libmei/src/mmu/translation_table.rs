@@ -10,15 +10,16 @@
 //!     - This is loaded into TTBR0 and is used in Un-privileged (User) mode.
 
 use core::{
-    alloc::Layout,
-    cell::UnsafeCell,
+    alloc::{Allocator, Layout},
     cmp::{max, min},
     mem::size_of,
     ops::Range,
-    ptr::NonNull,
+    ptr::{addr_of_mut, NonNull},
+    sync::atomic::{fence, AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering},
 };
 
 use heapless::Vec;
+use spin::{Mutex, MutexGuard};
 
 use tock_registers::{
     interfaces::{ReadWriteable, Readable},
@@ -26,49 +27,493 @@ use tock_registers::{
 };
 
 use crate::{
-    address::{Address, AddressTranslationLevel, PhysicalAddress, VirtualAddress},
+    address::{
+        Address, AddressTranslationLevel, PhysicalAddress, VirtualAddress, ROOT_TRANSLATION_LEVEL,
+        TTBR,
+    },
     bug,
     error::{Error, Result},
     mmu::NEXT_LEVEL_TABLE_ADDR_SHIFT,
-    vm::{AccessPermissions, MapDesc, MemoryKind, MemoryMap, PhysicalPageAllocator},
+    vm::{phy2virt, AccessPermissions, MemoryKind, MemoryMap, PhysicalPageAllocator},
 };
 
 use super::{
-    utils::{consts::MAX_TRANSLATION_LEVELS, *},
-    GRANULE_SIZE, LEVEL_1_OUTPUT_ADDR_SHIFT, LEVEL_2_OUTPUT_ADDR_SHIFT, LEVEL_3_OUTPUT_ADDR_SHIFT,
-    STAGE1_BLOCK_DESCRIPTOR, STAGE1_LAST_LEVEL_DESCRIPTOR, STAGE1_PAGE_DESCRIPTOR,
-    STAGE1_TABLE_DESCRIPTOR, TRANSLATION_TABLE_DESC_ALIGN,
+    asid::{self, AtomicAsid, ASID_ALLOCATOR},
+    at,
+    dma::{self, DmaConstraints, DmaSegment},
+    epoch::Epoch,
+    tlb,
+    utils::{
+        consts::{MAX_TRANSLATION_LEVELS, VIRTUAL_ADDRESS_LEVEL_IDX_BITS, VIRTUAL_ADDRESS_NBITS},
+        *,
+    },
+    DESC_OUTPUT_ADDR_SHIFT, GRANULE_SIZE, STAGE1_BLOCK_DESCRIPTOR, STAGE1_LAST_LEVEL_DESCRIPTOR,
+    STAGE1_PAGE_DESCRIPTOR, STAGE1_TABLE_DESCRIPTOR, TRANSLATION_TABLE_DESC_ALIGN,
 };
 
-const NUM_TABLE_DESC_ENTRIES: usize = 512;
+const NUM_TABLE_DESC_ENTRIES: usize = 1 << VIRTUAL_ADDRESS_LEVEL_IDX_BITS;
 const INVALID_DESCRIPTOR: u64 = 0;
-const TRANSLATION_LEVELS: &[AddressTranslationLevel] = &[
-    AddressTranslationLevel::Zero,
-    AddressTranslationLevel::One,
-    AddressTranslationLevel::Two,
-    AddressTranslationLevel::Three,
-];
-const ONE_GIB: usize = consts::ONE_GIB;
-const TWO_MIB: usize = consts::TWO_MIB;
-const FOUR_KIB: usize = consts::FOUR_KIB;
+/// Levels walked for translating an address, starting from the root table.
+const TRANSLATION_LEVELS: &[AddressTranslationLevel] = match ROOT_TRANSLATION_LEVEL {
+    AddressTranslationLevel::Zero => &[
+        AddressTranslationLevel::Zero,
+        AddressTranslationLevel::One,
+        AddressTranslationLevel::Two,
+        AddressTranslationLevel::Three,
+    ],
+    _ => &[
+        AddressTranslationLevel::One,
+        AddressTranslationLevel::Two,
+        AddressTranslationLevel::Three,
+    ],
+};
+/// Sizes of a page, level 2 and level 1 block (level 1 block is available only with 4KiB granule).
+const PAGE_SIZE: usize = GRANULE_SIZE;
+const L2_BLOCK_SIZE: usize = get_vaddr_spacing_per_entry(&AddressTranslationLevel::Two);
+const L1_BLOCK_SIZE: usize = get_vaddr_spacing_per_entry(&AddressTranslationLevel::One);
+/// No. of pages in a run, which can be hinted as contiguous.
+const PAGE_RUN_LEN: usize = get_contiguous_run_len(&AddressTranslationLevel::Three);
+/// Number of cached table pointers per translation level (must be a power of 2).
+const WALK_CACHE_ENTRIES: usize = 8;
+/// Level of the tables heading the subtrees below the root (see
+/// `TranslationTable::into_subtrees`).
+const SUBTREE_LEVEL: AddressTranslationLevel = match ROOT_TRANSLATION_LEVEL {
+    AddressTranslationLevel::Zero => AddressTranslationLevel::Two,
+    _ => AddressTranslationLevel::Three,
+};
+/// Max. no. of free tables held by a `TablePool`. Tables freed beyond it are returned to the
+/// allocator.
+const TABLE_POOL_MAX_TABLES: usize = 16;
+/// Software use (SWUSE) bits of block/page descriptors.
+/// Output address is shared with other address spaces (see `TranslationTable::fork`).
+const SWUSE_SHARED: u64 = 0b0001;
+/// Mapping is writable, but is write protected until it's made private.
+const SWUSE_COW: u64 = 0b0010;
+/// Mapping is writable, but is write protected until it's written (see `clear_dirty`).
+const SWUSE_WRITABLE: u64 = 0b0100;
+/// Output address is a level 2 block allocated as a whole (see `map_block`), or a page of one
+/// split into pages. The pages hold a reference each to the block, so that it's freed as it
+/// was allocated, along with the last of them.
+const SWUSE_BLOCK: u64 = 0b1000;
+/// AP bit denying writes at both EL1 and EL0.
+const AP_READ_ONLY: u64 = 0b10;
 
 type Stage1LastLevelDescriptor = InMemoryRegister<u64, STAGE1_LAST_LEVEL_DESCRIPTOR::Register>;
 type Stage1PageDescriptor = InMemoryRegister<u64, STAGE1_PAGE_DESCRIPTOR::Register>;
 type Stage1TableDescriptor = InMemoryRegister<u64, STAGE1_TABLE_DESCRIPTOR::Register>;
 type Stage1BlockDescriptor = InMemoryRegister<u64, STAGE1_BLOCK_DESCRIPTOR::Register>;
 
-/// Translation Table Descriptors
-#[derive(Debug)]
+/// Translation Table Descriptors, walked by the MMU.
+/// Followed by a record of the valid ones in the companion granule, so that scans can jump
+/// over the invalid ones and an empty table is known without a scan.
+/// Descriptors must be updated only through `store_desc` (or `cas_desc`), which keeps the
+/// record in sync.
+///
+/// Descriptors are accessed atomically, so that walks can run concurrently with updates.
+/// Updates are serialized by the lock of the level 2 table on their walk (see `lock`).
 #[repr(C)]
-#[repr(align(4096))]
-struct DescriptorTable(UnsafeCell<[u64; NUM_TABLE_DESC_ENTRIES]>);
+#[cfg_attr(
+    not(any(feature = "granule_16k", feature = "granule_64k")),
+    repr(align(4096))
+)]
+#[cfg_attr(feature = "granule_16k", repr(align(16384)))]
+#[cfg_attr(feature = "granule_64k", repr(align(65536)))]
+struct DescriptorTable {
+    descs: [AtomicU64; NUM_TABLE_DESC_ENTRIES],
+    occupancy: Occupancy,
+    lock: Mutex<()>,
+    /// Epoch the table was retired in, once it's unlinked (see `TranslationTable::retire_table`).
+    retired_epoch: AtomicU64,
+    /// Next table in the list of retired tables (or of free tables in the `TablePool`).
+    next_retired: AtomicPtr<DescriptorTable>,
+}
+
+/// No. of words in the bitmap of valid descriptors of a table.
+const OCCUPANCY_WORDS: usize = NUM_TABLE_DESC_ENTRIES / u64::BITS as usize;
+
+/// Valid descriptors of a table. All zeros for an empty table.
+#[derive(Debug)]
+struct Occupancy {
+    /// Bit `i` is set, if descriptor `i` is valid.
+    bitmap: [AtomicU64; OCCUPANCY_WORDS],
+    num_valid: AtomicUsize,
+}
 
 impl Default for DescriptorTable {
     fn default() -> Self {
-        Self(UnsafeCell::new(
-            [INVALID_DESCRIPTOR; NUM_TABLE_DESC_ENTRIES],
-        ))
+        const INVALID: AtomicU64 = AtomicU64::new(INVALID_DESCRIPTOR);
+        const EMPTY: AtomicU64 = AtomicU64::new(0);
+
+        Self {
+            descs: [INVALID; NUM_TABLE_DESC_ENTRIES],
+            occupancy: Occupancy {
+                bitmap: [EMPTY; OCCUPANCY_WORDS],
+                num_valid: AtomicUsize::new(0),
+            },
+            lock: Mutex::new(()),
+            retired_epoch: AtomicU64::new(0),
+            next_retired: AtomicPtr::new(core::ptr::null_mut()),
+        }
+    }
+}
+
+impl DescriptorTable {
+    /// Reset the table at `descs` to an empty, unlocked and live one (same as `default`),
+    /// without building it on the stack first.
+    ///
+    /// # Safety
+    ///
+    /// `descs` must be valid for writes and not be walked or locked by anyone.
+    unsafe fn reset(descs: *mut DescriptorTable) {
+        const EMPTY: AtomicU64 = AtomicU64::new(0);
+        const _: () = assert!(INVALID_DESCRIPTOR == 0);
+
+        core::ptr::write_bytes(addr_of_mut!((*descs).descs), 0, 1);
+        addr_of_mut!((*descs).occupancy).write(Occupancy {
+            bitmap: [EMPTY; OCCUPANCY_WORDS],
+            num_valid: AtomicUsize::new(0),
+        });
+        addr_of_mut!((*descs).lock).write(Mutex::new(()));
+        addr_of_mut!((*descs).retired_epoch).write(AtomicU64::new(0));
+        addr_of_mut!((*descs).next_retired).write(AtomicPtr::new(core::ptr::null_mut()));
+    }
+
+    fn num_valid(&self) -> usize {
+        self.occupancy.num_valid.load(Ordering::Relaxed)
+    }
+
+    fn is_empty(&self) -> bool {
+        self.num_valid() == 0
+    }
+
+    fn is_full(&self) -> bool {
+        self.num_valid() == NUM_TABLE_DESC_ENTRIES
+    }
+
+    /// Serializes the updates of block/page descriptors of this table and, for a level 2
+    /// table, of the level 3 tables below it (including their replacement by blocks). So,
+    /// threads updating disjoint 1GiB regions (with 4KiB granule) never contend.
+    /// Tables are installed lock-free (see `install_new_tbl_desc`).
+    fn lock(&self) -> MutexGuard<'_, ()> {
+        self.lock.lock()
+    }
+
+    /// Same as `lock`, but fails if the table was retired, until the lock was taken. The
+    /// walk which led to it must then be restarted from the root.
+    fn lock_live(&self) -> Option<MutexGuard<'_, ()>> {
+        let guard = self.lock();
+        (!self.is_retired()).then_some(guard)
+    }
+
+    fn is_retired(&self) -> bool {
+        self.retired_epoch.load(Ordering::Acquire) != 0
+    }
+
+    /// Index of the first valid descriptor at or after `idx`.
+    fn next_valid_idx(&self, idx: usize) -> Option<usize> {
+        let bitmap = &self.occupancy.bitmap;
+        let load = |word: usize| Some(bitmap.get(word)?.load(Ordering::Relaxed));
+        let mut word = idx / u64::BITS as usize;
+        let mut bits = load(word)? & (!0 << (idx % u64::BITS as usize));
+
+        while bits == 0 {
+            word += 1;
+            bits = load(word)?;
+        }
+
+        Some(word * u64::BITS as usize + bits.trailing_zeros() as usize)
+    }
+
+    /// Indices of the valid descriptors.
+    fn valid_indices(&self) -> impl Iterator<Item = usize> + '_ {
+        let mut idx = 0;
+
+        core::iter::from_fn(move || {
+            let valid_idx = self.next_valid_idx(idx)?;
+            idx = valid_idx + 1;
+            Some(valid_idx)
+        })
+    }
+}
+
+/// A cached pointer to the Descriptor Table used at some level for the VA prefix `prefix`.
+///
+/// Entries are read and written concurrently, so they are guarded by a sequence count
+/// (odd while being written): a read, which saw the count change, is a miss.
+#[derive(Default)]
+struct WalkCacheEntry {
+    seq: AtomicU64,
+    prefix: AtomicUsize,
+    descs: AtomicPtr<DescriptorTable>,
+    generation: AtomicU64,
+}
+
+impl WalkCacheEntry {
+    /// Cached table, if the entry is for `prefix` of `generation`.
+    fn get(&self, prefix: usize, generation: u64) -> Option<*const DescriptorTable> {
+        let seq = self.seq.load(Ordering::Acquire);
+        let hit = self.generation.load(Ordering::Relaxed) == generation
+            && self.prefix.load(Ordering::Relaxed) == prefix;
+        let descs = self.descs.load(Ordering::Relaxed);
+
+        fence(Ordering::Acquire);
+        match seq % 2 == 0 && hit && self.seq.load(Ordering::Relaxed) == seq {
+            true => Some(descs),
+            false => None,
+        }
+    }
+
+    /// Cache `descs` for `prefix` of `generation`. Skipped, if another thread is writing
+    /// the entry.
+    fn set(&self, prefix: usize, descs: *const DescriptorTable, generation: u64) {
+        let seq = self.seq.load(Ordering::Relaxed);
+        if seq % 2 != 0
+            || self
+                .seq
+                .compare_exchange(seq, seq + 1, Ordering::Acquire, Ordering::Relaxed)
+                .is_err()
+        {
+            return;
+        }
+        // Readers seeing any of the stores below, must see the count changed.
+        fence(Ordering::Release);
+
+        self.prefix.store(prefix, Ordering::Relaxed);
+        self.descs.store(descs as *mut _, Ordering::Relaxed);
+        self.generation.store(generation, Ordering::Relaxed);
+        self.seq.store(seq + 2, Ordering::Release);
+    }
+}
+
+/// Software Page-Walk Cache.
+///
+/// Remembers the Descriptor Tables used at the levels below root for recently translated
+/// VA prefixes, so that lookups of nearby addresses can skip the upper levels of the walk.
+/// Only table pointers are cached (never leaf descriptors), so an entry stays valid until
+/// a table is free'd. Every map/unmap bumps `generation`, which invalidates all entries.
+struct WalkCache {
+    generation: AtomicU64,
+    entries: [[WalkCacheEntry; WALK_CACHE_ENTRIES]; MAX_TRANSLATION_LEVELS - 1],
+}
+
+impl Default for WalkCache {
+    fn default() -> Self {
+        Self {
+            generation: AtomicU64::new(1),
+            entries: Default::default(),
+        }
+    }
+}
+
+impl WalkCache {
+    fn invalidate(&self) {
+        self.generation.fetch_add(1, Ordering::Release);
+    }
+
+    /// Returns the deepest cached Descriptor Table for `vaddr` along with its level.
+    fn lookup(&self, vaddr: VirtualAddress) -> Option<(&DescriptorTable, AddressTranslationLevel)> {
+        self.lookup_upto(vaddr, &AddressTranslationLevel::Three)
+    }
+
+    /// Same as `lookup`, but the table is of `deepest` level or above.
+    fn lookup_upto(
+        &self,
+        vaddr: VirtualAddress,
+        deepest: &AddressTranslationLevel,
+    ) -> Option<(&DescriptorTable, AddressTranslationLevel)> {
+        let generation = self.generation();
+
+        for level in TRANSLATION_LEVELS[1..].iter().rev() {
+            if level > deepest {
+                continue;
+            }
+
+            let prefix = Self::prefix(vaddr, level);
+            if let Some(descs) = self.slot(prefix, level).get(prefix, generation) {
+                return Some((unsafe { &*descs }, *level));
+            }
+        }
+
+        None
+    }
+
+    /// Generation to insert the tables found by a walk with. Must be read before the walk,
+    /// so that tables unlinked meanwhile are never looked up.
+    fn generation(&self) -> u64 {
+        self.generation.load(Ordering::Acquire)
+    }
+
+    /// Remember `descs` as the Descriptor Table used at `level` for `vaddr`.
+    fn insert(
+        &self,
+        vaddr: VirtualAddress,
+        level: &AddressTranslationLevel,
+        descs: &DescriptorTable,
+        generation: u64,
+    ) {
+        let prefix = Self::prefix(vaddr, level);
+        self.slot(prefix, level).set(prefix, descs, generation);
+    }
+
+    fn slot(&self, prefix: usize, level: &AddressTranslationLevel) -> &WalkCacheEntry {
+        &self.entries[*level as usize - ROOT_TRANSLATION_LEVEL as usize - 1]
+            [prefix & (WALK_CACHE_ENTRIES - 1)]
+    }
+
+    /// VA bits which select the Descriptor Table used at `level`.
+    fn prefix(vaddr: VirtualAddress, level: &AddressTranslationLevel) -> usize {
+        vaddr.as_raw_ptr() >> get_vaddr_spacing_per_entry(&level.prev()).trailing_zeros()
+    }
+}
+
+/// Descriptor tables of a translation table are allocated through this pool. Tables freed
+/// by updates (ex: unmap, promotion to blocks) are recycled for the tables installed next,
+/// instead of a round trip through the allocator.
+///
+/// Before each walk installing mappings, the pool is topped up with the tables missing on the
+/// walk (see `TranslationTable::reserve_tables`). So, running out of memory fails the walk
+/// before it installs any table, instead of leaving empty tables behind. Concurrent walks
+/// share the pool though, so they could still fall back to the allocator midway.
+#[derive(Default)]
+struct TablePool {
+    /// Serializes the updates of the free list.
+    lock: Mutex<()>,
+    /// Free tables, linked through `DescriptorTable::next_retired`. Reset (but the link),
+    /// same as freshly allocated ones (see `DescriptorTable::reset`).
+    free: AtomicPtr<DescriptorTable>,
+    num_free: AtomicUsize,
+    /// Tables allocated from the allocator, which are in use, retired or free.
+    num_tables: AtomicUsize,
+}
+
+impl TablePool {
+    /// Empty table, from the pool unless it's empty.
+    fn alloc<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        desc_alloc: &DescAlloc,
+    ) -> Result<NonNull<DescriptorTable>> {
+        match self.pop() {
+            Some(descs) => Ok(descs),
+            None => self.alloc_fresh(desc_alloc),
+        }
+    }
+
+    /// Recycle `descs`, which must not be walked anymore.
+    fn free<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        desc_alloc: &DescAlloc,
+        descs: &DescriptorTable,
+    ) {
+        let descs_ptr = descs as *const DescriptorTable as *mut DescriptorTable;
+        unsafe { DescriptorTable::reset(descs_ptr) };
+
+        if !self.push(descs) {
+            self.num_tables.fetch_sub(1, Ordering::Relaxed);
+            free_desc_table(desc_alloc, descs);
+        }
+    }
+
+    /// Top up the pool to `num_tables` free tables.
+    fn reserve<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        desc_alloc: &DescAlloc,
+        num_tables: usize,
+    ) -> Result<()> {
+        while self.num_free.load(Ordering::Relaxed) < num_tables {
+            let descs = self.alloc_fresh(desc_alloc)?;
+
+            if !self.push(unsafe { descs.as_ref() }) {
+                self.num_tables.fetch_sub(1, Ordering::Relaxed);
+                free_desc_table(desc_alloc, unsafe { descs.as_ref() });
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Return the free tables to `desc_alloc`. Returns the no. of tables freed.
+    fn drain<DescAlloc: PhysicalPageAllocator>(&self, desc_alloc: &DescAlloc) -> usize {
+        let mut num_freed = 0;
+
+        while let Some(descs) = self.pop() {
+            self.num_tables.fetch_sub(1, Ordering::Relaxed);
+            free_desc_table(desc_alloc, unsafe { descs.as_ref() });
+            num_freed += 1;
+        }
+
+        num_freed
+    }
+
+    fn usage(&self) -> TableUsage {
+        let tables = self.num_tables.load(Ordering::Relaxed);
+
+        TableUsage {
+            tables,
+            pooled: self.num_free.load(Ordering::Relaxed),
+            bytes: tables * TableUsage::BYTES_PER_TABLE,
+        }
+    }
+
+    fn alloc_fresh<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        desc_alloc: &DescAlloc,
+    ) -> Result<NonNull<DescriptorTable>> {
+        let descs = desc_alloc
+            .allocate(desc_table_layout())
+            .map_err(|_| Error::PhysicalOOM)?
+            .as_non_null_ptr()
+            .cast();
+        unsafe { DescriptorTable::reset(descs.as_ptr()) };
+
+        self.num_tables.fetch_add(1, Ordering::Relaxed);
+        Ok(descs)
+    }
+
+    /// Returns false, if the pool is full.
+    fn push(&self, descs: &DescriptorTable) -> bool {
+        let _guard = self.lock.lock();
+        if self.num_free.load(Ordering::Relaxed) >= TABLE_POOL_MAX_TABLES {
+            return false;
+        }
+
+        descs
+            .next_retired
+            .store(self.free.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.free.store(
+            descs as *const DescriptorTable as *mut DescriptorTable,
+            Ordering::Relaxed,
+        );
+        self.num_free.fetch_add(1, Ordering::Relaxed);
+        true
     }
+
+    fn pop(&self) -> Option<NonNull<DescriptorTable>> {
+        let _guard = self.lock.lock();
+        let descs = NonNull::new(self.free.load(Ordering::Relaxed))?;
+        let next = unsafe { descs.as_ref() }
+            .next_retired
+            .swap(core::ptr::null_mut(), Ordering::Relaxed);
+
+        self.free.store(next, Ordering::Relaxed);
+        self.num_free.fetch_sub(1, Ordering::Relaxed);
+        Some(descs)
+    }
+}
+
+/// Memory taken by the descriptor tables of a translation table (see `TablePool`).
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct TableUsage {
+    /// Tables allocated, other than the root: in use, retired or free in the pool.
+    pub tables: usize,
+    /// Free tables held in the pool, for recycling.
+    pub pooled: usize,
+    /// Bytes taken by `tables`.
+    pub bytes: usize,
+}
+
+impl TableUsage {
+    /// Bytes taken by a table: its descriptors, along with their companion metadata.
+    pub const BYTES_PER_TABLE: usize = size_of::<DescriptorTable>();
 }
 
 /// This stores the root of Translation Table
@@ -81,6 +526,8 @@ impl Default for DescriptorTable {
 /// In level 1, with Level 1 Block descriptor, VA and PA both are aligned to 1 GiB boundary.
 /// In level 2, with Level 2 Block descriptor, VA and PA both are aligned to 2 MiB boundary.
 /// In level 3, with Page Descriptor, VA and PA both are aligned to 4 KiB boundary.
+/// (Sizes are for 4KiB granule. With 16KiB/64KiB granule, Level 2 Blocks are 32MiB/512MiB and
+/// there are no Level 1 Blocks.)
 ///
 /// This means, Huge Pages must be aligned at both Virtual and Physical address spaces.
 /// Consequently, if either of the address'es are unaligned to the required huge page boundary (1GiB/2MiB),
@@ -88,19 +535,46 @@ impl Default for DescriptorTable {
 ///
 /// Though, an 1 GiB VA mapping consisting of 512 2MiB PA pages is only needed to be aligned at 2MiB boundary.
 /// Similarly, a 2 MiB VA mapping consisting of 512 4KiB PA pages is only needed to be aligned at 4KiB boundary.
+///
+/// ### Concurrency:
+///
+/// Threads of a process can fault and map in disjoint regions in parallel: `map*`,
+/// `resolve_cow_fault`, `resolve_zero_fault`, `mark_accessed`, `mark_dirty`,
+/// `promote_mappings` and `collapse_pages` can be called concurrently. Updates of the mappings take the lock of the level 2 table
+/// holding them (see `DescriptorTable::lock`), while new tables are installed lock-free.
+///
+/// Other updates (`unmap*`, `protect`, `clear_*`, `fork`) rewrite and unlink tables without
+/// locking, so they must not run concurrently with any other update. Except for `unmap_subtree`
+/// and `protect` of ranges in different subtrees (see `split_at_subtrees`), which share no
+/// tables they could rewrite or unlink: these can run concurrently with each other, to spread
+/// bulk updates of very large ranges across cores.
+///
+/// Lookups (`virt2phy`, `translate`) take no locks and can run concurrently with any update:
+/// unlinked tables are retired and freed only once no walk could be in them (see `epoch`).
+/// So can `resolve_*_fault`, `mark_accessed` and `mark_dirty`, with unmaps of other regions.
 #[derive(Default)]
 pub struct TranslationTable {
     root: DescriptorTable,
+    walk_cache: WalkCache,
+    /// Tables unlinked, but not freed yet (see `retire_table`).
+    retired: AtomicPtr<DescriptorTable>,
+    epoch: Epoch,
+    tables: TablePool,
+    /// ASID used for tagging TLB entries, when this table is active in TTBR0.
+    asid: AtomicAsid,
+    /// Whether global mappings (see `parse_map_attrs`) were ever added. Their TLB entries
+    /// aren't tagged with `asid`, so they outlive invalidating it.
+    has_global: AtomicBool,
 }
 
+unsafe impl Sync for TranslationTable {}
+
 impl TranslationTable {
     pub fn new<DescAlloc: PhysicalPageAllocator>(
         maps: &[MemoryMap],
         desc_alloc: &DescAlloc,
     ) -> Result<Self> {
-        let tt = Self {
-            root: DescriptorTable::default(),
-        };
+        let tt = Self::default();
 
         for map in maps {
             tt.map_impl(&parse_memory_map(map), desc_alloc, map)?;
@@ -118,6 +592,207 @@ impl TranslationTable {
         self.map_impl(&parse_memory_map(map), desc_alloc, map)
     }
 
+    /// Map a page of normal memory at each unmapped slot of `vaddr_rng`, backed by the memory
+    /// `alloc_page` returns for the slot. Slots already mapped are left as is.
+    ///
+    /// `vaddr_rng` must lie within the VA range of a single level 3 table, so that all the
+    /// pages get installed with a single walk. Aligned runs of pages, which turn out to be
+    /// contiguous in PA, are hinted as contiguous.
+    /// Returns the no. of pages mapped. Pages mapped before `alloc_page` fails stay mapped.
+    pub fn map_pages<DescAlloc, AllocPage>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        access_perms: &AccessPermissions,
+        desc_alloc: &DescAlloc,
+        alloc_page: AllocPage,
+    ) -> Result<usize>
+    where
+        DescAlloc: PhysicalPageAllocator,
+        AllocPage: FnMut(VirtualAddress) -> Result<PhysicalAddress>,
+    {
+        let attributes = parse_map_attrs(access_perms, MemoryKind::Normal, vaddr_rng.start);
+        self.map_pages_impl(vaddr_rng, attributes, desc_alloc, alloc_page)
+    }
+
+    /// Same as `map_pages`, but every unmapped slot is mapped to the same page at `paddr`,
+    /// shared copy-on-write with its other mappings (see `fork`). A reference to the page is
+    /// added (see `PhysicalPageAllocator::share`) for each slot mapped.
+    /// Meant for user mappings of pages with fixed contents, like the zero page.
+    pub fn map_shared_pages<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        paddr: PhysicalAddress,
+        access_perms: &AccessPermissions,
+        desc_alloc: &DescAlloc,
+    ) -> Result<usize> {
+        let attributes = with_sharing(parse_map_attrs(
+            access_perms,
+            MemoryKind::Normal,
+            vaddr_rng.start,
+        ));
+        self.map_pages_impl(vaddr_rng, attributes, desc_alloc, |_| {
+            desc_alloc.share(paddr);
+            Ok(paddr)
+        })
+    }
+
+    fn map_pages_impl<DescAlloc, AllocPage>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        attributes: u64,
+        desc_alloc: &DescAlloc,
+        mut alloc_page: AllocPage,
+    ) -> Result<usize>
+    where
+        DescAlloc: PhysicalPageAllocator,
+        AllocPage: FnMut(VirtualAddress) -> Result<PhysicalAddress>,
+    {
+        self.note_attributes(attributes);
+        if vaddr_rng.start >= vaddr_rng.end
+            || !vaddr_rng.start.is_aligned(PAGE_SIZE)
+            || !vaddr_rng.end.is_aligned(PAGE_SIZE)
+            || vaddr_rng.start.align_down(L2_BLOCK_SIZE)
+                != (vaddr_rng.end - 1usize).align_down(L2_BLOCK_SIZE)
+        {
+            return Err(Error::InvalidVirtualAddress(vaddr_rng.start.as_raw_ptr()));
+        }
+
+        let _epoch = self.epoch.pin();
+        let levels = &TRANSLATION_LEVELS[..TRANSLATION_LEVELS.len() - 1];
+        self.reserve_tables(vaddr_rng.start, levels, desc_alloc)?;
+
+        let mut descs = &self.root;
+        let mut _guard = None;
+        for level in levels {
+            let idx = vaddr_rng.start.get_idx_for_level(level);
+            if *level == AddressTranslationLevel::Two {
+                match descs.lock_live() {
+                    Some(live) => _guard = Some(live),
+                    None => {
+                        return self.map_pages_impl(vaddr_rng, attributes, desc_alloc, alloc_page)
+                    }
+                }
+            }
+            let desc = load_desc(descs, idx);
+
+            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+                Descriptor::Table(tbl_desc) => descend_tbl_desc(tbl_desc, &mut descs),
+                // Whole of `vaddr_rng` is mapped by a block.
+                Descriptor::Block(_) | Descriptor::Page(_) => return Ok(0),
+                Descriptor::Invalid => {
+                    match self.install_tbl_desc(descs, idx, level, desc_alloc)? {
+                        Some(tbl_desc) => descend_tbl_desc(tbl_desc, &mut descs),
+                        None => return Ok(0),
+                    }
+                }
+            }
+        }
+
+        let first_idx = vaddr_rng
+            .start
+            .get_idx_for_level(&AddressTranslationLevel::Three);
+        let end_idx = first_idx + (vaddr_rng.end - vaddr_rng.start) as usize / PAGE_SIZE;
+        let mut num_mapped = 0;
+        let mut run_start = first_idx;
+
+        while run_start < end_idx {
+            let run_end = min(end_idx, run_start - run_start % PAGE_RUN_LEN + PAGE_RUN_LEN);
+            let mut pages = Vec::<(usize, PhysicalAddress), PAGE_RUN_LEN>::new();
+            let mut res = Ok(());
+
+            for idx in run_start..run_end {
+                if load_desc(descs, idx) != INVALID_DESCRIPTOR {
+                    continue;
+                }
+
+                match alloc_page(vaddr_rng.start + (idx - first_idx) * PAGE_SIZE) {
+                    Ok(paddr) => pages
+                        .push((idx, paddr))
+                        .unwrap_or_else(|_| bug!("Page run length exceeded")),
+                    Err(e) => {
+                        res = Err(e);
+                        break;
+                    }
+                }
+            }
+
+            // Descriptors are written only after the whole run is allocated, as hinting
+            // live descriptors would need a break-before-make.
+            let run_attributes = match res.is_ok() && is_contiguous_page_run(&pages) {
+                true => with_contiguous_hint(attributes),
+                false => attributes,
+            };
+            for (idx, paddr) in pages.iter() {
+                store_desc(
+                    descs,
+                    *idx,
+                    new_stage1_page_desc(paddr.as_raw_ptr() as u64, run_attributes),
+                );
+            }
+
+            num_mapped += pages.len();
+            res?;
+            run_start = run_end;
+        }
+
+        Ok(num_mapped)
+    }
+
+    /// Map a single level 2 block. Unlike `map`, the block is never merged with its
+    /// neighbours into a larger block, so that it can be freed as it was allocated (see
+    /// `unmap_and_free`). If it's split later on (ex: by a partial unmap or `protect`), it's
+    /// freed once the last of its pages is.
+    pub fn map_block<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &MemoryMap,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        self.map_block_impl(map, false, desc_alloc)
+    }
+
+    /// Same as `map_block`, but the block is shared copy-on-write with its other mappings
+    /// (see `map_shared_pages`).
+    pub fn map_shared_block<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &MemoryMap,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        self.map_block_impl(map, true, desc_alloc)
+    }
+
+    fn map_block_impl<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &MemoryMap,
+        shared: bool,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        let _epoch = self.epoch.pin();
+        let mut parsed = parse_memory_map(map);
+
+        if parsed.num_pages * GRANULE_SIZE != L2_BLOCK_SIZE
+            || !parsed.virt_addr.is_aligned(L2_BLOCK_SIZE)
+            || !parsed.phy_addr.is_aligned(L2_BLOCK_SIZE)
+        {
+            return Err(Error::InvalidVirtualAddress(parsed.virt_addr.as_raw_ptr()));
+        }
+
+        // `install_l2_block_desc` counts in blocks.
+        parsed.num_pages = 1;
+        parsed.attributes = with_block_tag(parsed.attributes);
+        if !shared {
+            return self.install_l2_block_desc(&mut parsed, desc_alloc, map);
+        }
+
+        let paddr = parsed.phy_addr;
+        parsed.attributes = with_sharing(parsed.attributes);
+        desc_alloc.share(paddr);
+        self.install_l2_block_desc(&mut parsed, desc_alloc, map)
+            .map_err(|e| {
+                desc_alloc.unshare(paddr);
+                e
+            })
+    }
+
     /// Traverse a range of Virtual Address.
     /// For each mapping within the provided range, call the Visitor.
     pub fn traverse<'tt>(
@@ -125,32 +800,73 @@ impl TranslationTable {
         vaddr_rng: Range<VirtualAddress>,
         free_empty_descs: bool,
     ) -> impl Iterator<Item = Result<TraverseYield<'tt>>> {
-        TraverseIterator::new(&self.root, vaddr_rng, free_empty_descs)
+        TraverseIterator::new(
+            &self.root,
+            &self.walk_cache,
+            vaddr_rng,
+            free_empty_descs.then(|| ROOT_TRANSLATION_LEVEL.next()),
+        )
+    }
+
+    /// Mappings within `vaddr_rng`, coalesced into extents: runs of pages and blocks that are
+    /// contiguous in both VA and PA, with identical attributes. Mappings extending beyond the
+    /// range are clipped to it.
+    /// Yields an item per extent instead of one per page, so that callers can do their work
+    /// per extent.
+    pub fn extents(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+    ) -> impl Iterator<Item = Result<Extent>> + '_ {
+        let mut blocks = self.traverse(vaddr_rng, false);
+        let mut extent: Option<Extent> = None;
+
+        core::iter::from_fn(move || loop {
+            let next = match blocks.next() {
+                Some(Ok(TraverseYield::PhysicalBlock(pbo_info))) => pbo_info.extent(),
+                Some(Ok(TraverseYield::UnusedMemory(_))) => {
+                    bug!("Tables aren't freed, when only traversing")
+                }
+                Some(Err(e)) => return Some(Err(e)),
+                None => return extent.take().map(Ok),
+            };
+
+            match extent.as_mut() {
+                Some(extent) if extent.is_followed_by(&next) => extent.len += next.len,
+                _ => {
+                    if let Some(extent) = extent.replace(next) {
+                        return Some(Ok(extent));
+                    }
+                }
+            }
+        })
     }
 
     /// Walk the translation table using the VirtualAddress `vaddr` and produce corresponding PhysicalAddress
     /// This is similar to what CPU does after a TLB Miss.
+    /// Upper levels of the walk are skipped, when the Walk Cache has the tables for `vaddr`.
     pub fn virt2phy(&self, vaddr: VirtualAddress) -> Option<TranslationDesc> {
-        let mut descs = &self.root;
-
-        for level in TRANSLATION_LEVELS.iter() {
+        let _epoch = self.epoch.pin();
+        let generation = self.walk_cache.generation();
+        let (mut descs, start_level) = self
+            .walk_cache
+            .lookup(vaddr)
+            .unwrap_or((&self.root, ROOT_TRANSLATION_LEVEL));
+
+        for level in
+            TRANSLATION_LEVELS[start_level as usize - ROOT_TRANSLATION_LEVEL as usize..].iter()
+        {
             let idx = vaddr.get_idx_for_level(level);
             let desc = load_desc(descs, idx);
 
             let to_translation_desc = |desc: u64| {
                 let ll_desc = Stage1LastLevelDescriptor::new(desc);
-                let is_cacheable =
-                    !ll_desc.matches_all(STAGE1_LAST_LEVEL_DESCRIPTOR::SH::OuterShareable);
 
                 Some(TranslationDesc {
                     virt_addr: vaddr,
-                    phy_addr: parse_output_address(&ll_desc, level),
-                    access_perms: parse_access_perms(&ll_desc),
-                    memory_kind: if is_cacheable {
-                        MemoryKind::Normal
-                    } else {
-                        MemoryKind::Device
-                    },
+                    phy_addr: parse_output_address(&ll_desc, level)
+                        + get_block_offset(vaddr, level),
+                    access_perms: parse_mapped_access_perms(desc),
+                    memory_kind: parse_memory_kind(&ll_desc),
                 })
             };
 
@@ -158,6 +874,8 @@ impl TranslationTable {
                 Descriptor::Table(tbl_desc) => {
                     assert_ne!(level, &AddressTranslationLevel::Three);
                     descend_tbl_desc(tbl_desc, &mut descs);
+                    self.walk_cache
+                        .insert(vaddr, &level.next(), descs, generation);
                 }
                 Descriptor::Block(block_desc) => return to_translation_desc(block_desc.get()),
                 Descriptor::Page(page_desc) => return to_translation_desc(page_desc.get()),
@@ -169,1409 +887,5051 @@ impl TranslationTable {
     }
 
     pub fn get_base_address(&self) -> u64 {
-        self.root.0.get() as u64
+        self.root.descs.as_ptr() as u64
     }
 
-    fn map_impl<DescAlloc: PhysicalPageAllocator>(
+    /// Clone this address space.
+    /// User mappings of normal memory are shared with the clone. Writable ones are shared
+    /// copy-on-write: they are write protected in both, until a write fault on either side
+    /// is resolved by `resolve_cow_fault`. Other mappings are copied as is.
+    ///
+    /// Only the descriptor tables are copied, so forking costs no. of tables and not the
+    /// size of memory mapped.
+    pub fn fork<DescAlloc: PhysicalPageAllocator>(&self, desc_alloc: &DescAlloc) -> Result<Self> {
+        let tt = Self::default();
+        tt.has_global
+            .store(self.has_global.load(Ordering::Relaxed), Ordering::Relaxed);
+        let res = fork_table(
+            &self.root,
+            &tt.root,
+            &ROOT_TRANSLATION_LEVEL,
+            &tt.tables,
+            desc_alloc,
+        );
+
+        // Write protection of the shared mappings must be visible, before this address space
+        // gets to run again. Mappings shared until a failure are left write protected, which
+        // is harmless: they are made writable again on the next write fault.
+        tlb::invalidate(self.tlb_scope());
+
+        match res {
+            Ok(()) => Ok(tt),
+            Err(e) => {
+                release_forked_table(&tt.root, &ROOT_TRANSLATION_LEVEL, desc_alloc);
+                tt.tables.drain(desc_alloc);
+                Err(e)
+            }
+        }
+    }
+
+    /// Resolve a write fault at `vaddr` on a copy-on-write mapping (see `fork`).
+    /// The shared page (or block) is replaced with a writable private copy. If no other
+    /// address space is sharing it anymore, it's just made writable again.
+    ///
+    /// Returns false, if `vaddr` isn't mapped copy-on-write, (i.e) it's a genuine fault.
+    pub fn resolve_cow_fault<DescAlloc: PhysicalPageAllocator>(
         &self,
-        map: &ParsedMemoryMap,
+        vaddr: VirtualAddress,
         desc_alloc: &DescAlloc,
-        mmap: &MemoryMap,
-    ) -> Result<()> {
-        let map_scheme =
-            find_best_mapping_scheme(map.virt_addr, map.phy_addr, map.num_pages * GRANULE_SIZE);
-        let mut map = ParsedMemoryMap {
-            phy_addr: map.phy_addr,
-            virt_addr: map.virt_addr,
-            attributes: map.attributes,
-            num_pages: 0,
+    ) -> Result<bool> {
+        let _epoch = self.epoch.pin();
+        let (_guard, descs, idx, level) = match self.lock_leaf_desc(vaddr) {
+            Some(leaf) => leaf,
+            None => return Ok(false),
         };
 
-        for scheme in map_scheme.spans {
-            match scheme {
-                ContiguousSpan::FourKiB(num_pages) => {
-                    map.num_pages = num_pages;
-                    while map.num_pages > 0 {
-                        self.install_page_descs(&mut map, desc_alloc, mmap)
-                            .map_err(|e| e)?;
-                    }
-                }
-                ContiguousSpan::TwoMiB(num_pages) => {
-                    map.num_pages = num_pages;
-                    while map.num_pages > 0 {
-                        self.install_l2_block_desc(&mut map, desc_alloc, mmap)
-                            .map_err(|e| e)?;
-                    }
-                }
-                ContiguousSpan::OneGiB(num_pages) => {
-                    map.num_pages = num_pages;
-                    while map.num_pages > 0 {
-                        self.install_l1_block_desc(&mut map, desc_alloc, mmap)
-                            .map_err(|e| e)?;
-                    }
-                }
-            }
+        if read_swuse(load_desc(descs, idx)) & SWUSE_COW == 0 {
+            return Ok(false);
         }
 
-        Ok(())
+        let leaf_vaddr = vaddr - get_block_offset(vaddr, &level);
+        self.make_leaf_private(descs, idx, &level, leaf_vaddr, false, desc_alloc)?;
+        Ok(true)
     }
 
-    fn install_page_descs<DescAlloc: PhysicalPageAllocator>(
+    /// Resolve a write fault at `vaddr` on a mapping of shared zero filled memory (see
+    /// `map_shared_pages`): the page at `zero_page` or the block at `zero_block`. It's replaced
+    /// in place with newly allocated zeroed memory, private to this address space. Unlike
+    /// `resolve_cow_fault`, nothing is copied. If no block of memory is available, the zero
+    /// block is replaced with a table mapping `zero_page` instead, but for the page at `vaddr`.
+    ///
+    /// Returns the size of the memory allocated, or None if `vaddr` isn't mapping either.
+    pub fn resolve_zero_fault<DescAlloc: PhysicalPageAllocator>(
         &self,
-        map: &mut ParsedMemoryMap,
+        vaddr: VirtualAddress,
+        zero_page: PhysicalAddress,
+        zero_block: Option<PhysicalAddress>,
         desc_alloc: &DescAlloc,
-        mmap: &MemoryMap,
-    ) -> Result<()> {
-        let mut descs = &self.root;
+    ) -> Result<Option<usize>> {
+        let _epoch = self.epoch.pin();
+        let (_guard, descs, idx, level) = match self.lock_leaf_desc(vaddr) {
+            Some(leaf) => leaf,
+            None => return Ok(None),
+        };
 
-        for level in TRANSLATION_LEVELS {
-            let idx = map.virt_addr.get_idx_for_level(level);
-            let desc = load_desc(descs, idx);
+        let desc = load_desc(descs, idx);
+        let paddr = parse_ref_block(desc, &level).start;
+        if read_swuse(desc) & SWUSE_SHARED == 0 || (paddr != zero_page && Some(paddr) != zero_block)
+        {
+            return Ok(None);
+        }
 
-            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
-                Descriptor::Table(tbl_desc) => {
-                    assert_ne!(level, &AddressTranslationLevel::Three);
-                    descend_tbl_desc(tbl_desc, &mut descs);
-                }
-                Descriptor::Block(_) | Descriptor::Page(_) => {
-                    return Err(Error::VMMapExists(*mmap))
-                }
+        let size = get_vaddr_spacing_per_entry(&level);
+        let leaf_vaddr = vaddr - get_block_offset(vaddr, &level);
+        match self.make_leaf_private(descs, idx, &level, leaf_vaddr, true, desc_alloc) {
+            Ok(()) => return Ok(Some(size)),
+            Err(e) if level != AddressTranslationLevel::Two => return Err(e),
+            Err(_) => {}
+        }
 
-                Descriptor::Invalid => {
-                    match level {
-                        // We need to insert only Page Descriptor.
-                        // Until we reach level 3, insert Table Descriptors.
-                        AddressTranslationLevel::Zero
-                        | AddressTranslationLevel::One
-                        | AddressTranslationLevel::Two => {
-                            let tbl_desc =
-                                install_new_tbl_desc(desc_alloc, load_desc_mut(descs, idx))?;
-                            descend_tbl_desc(tbl_desc, &mut descs);
-                        }
-                        AddressTranslationLevel::Three => {
-                            install_contigious_mappings(
-                                map,
-                                idx,
-                                descs,
-                                FOUR_KIB,
-                                &|output_address, attributes| {
-                                    new_stage1_page_desc(output_address, attributes)
-                                },
-                            );
-                            break;
-                        }
-                    }
-                }
-            }
+        let tbl_desc = new_tbl_desc(&self.tables, desc_alloc)?;
+        let page_descs = get_next_level_desc(&tbl_desc);
+        let page_desc = new_stage1_page_desc(
+            zero_page.as_raw_ptr() as u64,
+            without_block_tag(parse_attributes(desc, paddr)),
+        );
+        for page_idx in 0..NUM_TABLE_DESC_ENTRIES {
+            desc_alloc.share(zero_page);
+            store_desc(page_descs, page_idx, page_desc);
         }
 
-        Ok(())
+        // Break-before-make, as a block is replaced with a table. The table is covered by the
+        // lock held, as it's a child of the level 2 table.
+        store_desc(descs, idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(leaf_vaddr..leaf_vaddr + size, self.tlb_scope());
+        store_desc(descs, idx, tbl_desc.get());
+        self.walk_cache.invalidate();
+        desc_alloc.unshare(paddr);
+
+        let page_vaddr = VirtualAddress::new(vaddr.align_down(PAGE_SIZE))?;
+        self.make_leaf_private(
+            page_descs,
+            page_vaddr.get_idx_for_level(&AddressTranslationLevel::Three),
+            &AddressTranslationLevel::Three,
+            page_vaddr,
+            true,
+            desc_alloc,
+        )?;
+        Ok(Some(PAGE_SIZE))
     }
 
-    fn install_l2_block_desc<DescAlloc: PhysicalPageAllocator>(
+    /// Clear the access flag of the pages and blocks mapped within `vaddr_rng`, so that the
+    /// next access to each of them is noticed: either the MMU sets the flag again (with
+    /// hardware access flag management) or it takes an Access Flag fault, which is resolved
+    /// by `mark_accessed`.
+    /// `visit` is called with the PA and size of each of them and whether it was accessed
+    /// since the flag was last cleared. Shared mappings are skipped, as their accesses cannot be
+    /// attributed to this address space alone.
+    pub fn clear_accessed<F: FnMut(PhysicalAddress, usize, bool)>(
         &self,
-        map: &mut ParsedMemoryMap,
-        desc_alloc: &DescAlloc,
-        mmap: &MemoryMap,
+        vaddr_rng: Range<VirtualAddress>,
+        mut visit: F,
     ) -> Result<()> {
-        let mut descs = &self.root;
-
-        for level in TRANSLATION_LEVELS {
-            let idx = map.virt_addr.get_idx_for_level(level);
-            let desc = load_desc(descs, idx);
-
-            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
-                Descriptor::Table(tbl_desc) => {
-                    assert_ne!(level, &AddressTranslationLevel::Three);
-                    descend_tbl_desc(tbl_desc, &mut descs);
+        for res in self.traverse(vaddr_rng.clone(), false) {
+            if let TraverseYield::PhysicalBlock(pbo_info) = res? {
+                let desc = load_desc(pbo_info.descs, pbo_info.idx);
+                if read_swuse(desc) & SWUSE_SHARED != 0 {
+                    continue;
                 }
-                Descriptor::Block(_) => return Err(Error::VMMapExists(*mmap)),
-                Descriptor::Page(_) => return Err(Error::CorruptedTranslationTable(desc)),
 
-                Descriptor::Invalid => {
-                    // We need to insert only Level 2 Block Descriptor.
-                    // Until we reach level 2, insert Table Descriptors.
-                    match level {
-                        AddressTranslationLevel::Zero | AddressTranslationLevel::One => {
-                            let tbl_desc =
-                                install_new_tbl_desc(desc_alloc, load_desc_mut(descs, idx))?;
-                            descend_tbl_desc(tbl_desc, &mut descs);
-                        }
-                        AddressTranslationLevel::Two => {
-                            install_contigious_mappings(
-                                map,
-                                idx,
-                                descs,
-                                TWO_MIB,
-                                &|output_address, attributes| {
-                                    new_stage1_block_desc(
-                                        BlockDescLevel::Two,
-                                        output_address,
-                                        attributes,
-                                    )
-                                },
-                            );
-                            break;
-                        }
-                        AddressTranslationLevel::Three => {
-                            return Err(Error::CorruptedTranslationTable(desc))
-                        }
-                    }
-                }
+                let ll_desc = Stage1LastLevelDescriptor::new(desc);
+                let accessed = ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::AF);
+                ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::AF::False);
+                store_desc(pbo_info.descs, pbo_info.idx, ll_desc.get());
+
+                visit(pbo_info.phy_block, pbo_info.size(), accessed);
             }
         }
 
+        // Cached translations would let the accesses go unnoticed. Clearing the flag doesn't
+        // change the output address, so no break-before-make is needed.
+        tlb::invalidate_range(vaddr_rng, self.tlb_scope());
         Ok(())
     }
 
-    fn install_l1_block_desc<DescAlloc: PhysicalPageAllocator>(
+    /// Resolve an Access Flag fault at `vaddr`, by setting the access flag of the page (or
+    /// block) mapping it. No TLB maintenance is needed, as descriptors with the flag clear
+    /// are never cached.
+    ///
+    /// Returns false, if `vaddr` isn't mapped, (i.e) it's a genuine fault.
+    pub fn mark_accessed(&self, vaddr: VirtualAddress) -> bool {
+        let _epoch = self.epoch.pin();
+        let (_guard, descs, idx, _) = match self.lock_leaf_desc(vaddr) {
+            Some(leaf) => leaf,
+            None => return false,
+        };
+
+        let ll_desc = Stage1LastLevelDescriptor::new(load_desc(descs, idx));
+        ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::AF::True);
+        store_desc(descs, idx, ll_desc.get());
+        true
+    }
+
+    /// Collect and clear the dirty set of `vaddr_rng`: `visit` is called with the VA, PA and
+    /// size of each private user page (or block) written since the last call, which is then
+    /// write protected again. The first write to it is resolved by `mark_dirty`.
+    ///
+    /// Writable mappings not tracked yet are reported as dirty, as they may have been
+    /// written. Blocks extending beyond the range are reported (and tracked) as a whole.
+    pub fn clear_dirty<F: FnMut(VirtualAddress, PhysicalAddress, usize)>(
         &self,
-        map: &mut ParsedMemoryMap,
-        desc_alloc: &DescAlloc,
-        mmap: &MemoryMap,
+        vaddr_rng: Range<VirtualAddress>,
+        mut visit: F,
     ) -> Result<()> {
-        let mut descs = &self.root;
-
-        for level in TRANSLATION_LEVELS {
-            let idx = map.virt_addr.get_idx_for_level(level);
-            let desc = load_desc(descs, idx);
+        for res in self.traverse(vaddr_rng.clone(), false) {
+            if let TraverseYield::PhysicalBlock(pbo_info) = res? {
+                let desc = load_desc(pbo_info.descs, pbo_info.idx);
+                let ll_desc = Stage1LastLevelDescriptor::new(desc);
+                let ap = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
 
-            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
-                Descriptor::Table(tbl_desc) => {
-                    assert_ne!(level, &AddressTranslationLevel::Three);
-                    descend_tbl_desc(tbl_desc, &mut descs);
-                }
-                Descriptor::Block(_) => {
-                    if *level == AddressTranslationLevel::One {
-                        return Err(Error::VMMapExists(*mmap));
-                    } else {
-                        return Err(Error::CorruptedTranslationTable(desc));
-                    }
+                if !is_user_memory_desc(desc)
+                    || read_swuse(desc) & SWUSE_SHARED != 0
+                    || ap & AP_READ_ONLY != 0
+                {
+                    continue;
                 }
-                Descriptor::Page(_) => return Err(Error::CorruptedTranslationTable(desc)),
-                Descriptor::Invalid => {
-                    // We need to insert only Level 1 Block Descriptor.
-                    // Until we reach level 1, insert Table Descriptors.
-                    match level {
-                        AddressTranslationLevel::Zero => {
-                            let tbl_desc =
-                                install_new_tbl_desc(desc_alloc, load_desc_mut(descs, idx))?;
-                            descend_tbl_desc(tbl_desc, &mut descs);
-                        }
-                        AddressTranslationLevel::One => {
-                            install_contigious_mappings(
-                                map,
-                                idx,
-                                descs,
-                                ONE_GIB,
-                                &|output_address, attributes| {
-                                    new_stage1_block_desc(
-                                        BlockDescLevel::One,
-                                        output_address,
-                                        attributes,
-                                    )
-                                },
-                            );
-                            break;
-                        }
-                        AddressTranslationLevel::Two | AddressTranslationLevel::Three => {
-                            return Err(Error::CorruptedTranslationTable(desc))
-                        }
-                    }
+
+                // Rest of the run may not be write protected along with this one.
+                if !pbo_info.run_overlapped {
+                    break_contiguous_run(
+                        pbo_info.descs,
+                        pbo_info.idx,
+                        &pbo_info.level,
+                        pbo_info.vaddr,
+                        self.tlb_scope(),
+                    );
                 }
+
+                ll_desc.modify(
+                    STAGE1_LAST_LEVEL_DESCRIPTOR::AP.val(ap | AP_READ_ONLY)
+                        + STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE
+                            .val(read_swuse(desc) | SWUSE_WRITABLE),
+                );
+                store_desc(pbo_info.descs, pbo_info.idx, ll_desc.get());
+
+                visit(pbo_info.vaddr, pbo_info.phy_block, pbo_info.size());
             }
         }
 
+        // Write protection must be visible, before the dirty set is acted upon.
+        tlb::invalidate_range(vaddr_rng, self.tlb_scope());
         Ok(())
     }
-}
-
-pub enum TraverseYield<'tt> {
-    PhysicalBlock(PhysicalBlockOverlapInfo<'tt>),
-    UnusedMemory(NonNull<u8>),
-}
 
-/// Information about a physical block.
-pub struct PhysicalBlockOverlapInfo<'tt> {
-    /// Range of physical block, that contains the overlap.
-    phy_block: PhysicalAddress,
-    vaddr: VirtualAddress,
-    size: u32,
+    /// Resolve a write fault at `vaddr` on a mapping write protected by `clear_dirty`, by
+    /// making it writable again. The page (or block) is dirty from then on.
+    ///
+    /// Returns false, if `vaddr` isn't mapped writable, (i.e) it's a genuine fault.
+    pub fn mark_dirty(&self, vaddr: VirtualAddress) -> bool {
+        let _epoch = self.epoch.pin();
+        let (_guard, descs, idx, level) = match self.lock_leaf_desc(vaddr) {
+            Some(leaf) => leaf,
+            None => return false,
+        };
 
-    /// Offest within the above `phy_block`, which ovelaps the provided VA space.
-    overlap: Range<u32>,
-    desc_ptr: &'tt mut u64,
-}
+        let desc = load_desc(descs, idx);
+        if read_swuse(desc) & SWUSE_WRITABLE == 0 {
+            return false;
+        }
 
-impl<'tt> PhysicalBlockOverlapInfo<'tt> {
-    fn new(
-        iter: &TraverseIterator<'tt>,
-        paddr: PhysicalAddress,
-        vaddr: VirtualAddress,
-        block_size: u32,
-        desc_ptr: &'tt mut u64,
-    ) -> Self {
-        let phy_start = paddr;
-        let vaddr_start = vaddr;
-        let vaddr_end = vaddr_start + block_size as usize;
-        let va_space_overlap_start = max(vaddr_start, iter.va_rng.start);
-        let va_space_overlap_end = min(vaddr_end, iter.va_rng.end);
+        let size = get_vaddr_spacing_per_entry(&level);
+        let leaf_vaddr = vaddr - get_block_offset(vaddr, &level);
 
-        Self {
-            phy_block: phy_start,
-            vaddr: vaddr_start,
-            size: block_size as u32,
-            overlap: (va_space_overlap_start - vaddr_start) as u32
-                ..(va_space_overlap_end - vaddr_start) as u32,
-            desc_ptr,
-        }
-    }
+        // Rest of the run stays write protected.
+        break_contiguous_run(descs, idx, &level, leaf_vaddr, self.tlb_scope());
 
-    pub fn phy_block(&self) -> Range<PhysicalAddress> {
-        self.phy_block..self.phy_block + self.size as usize
+        // Relaxing permissions needs no break-before-make, but the write protected entry
+        // could still be cached.
+        store_desc(descs, idx, without_write_tracking(desc));
+        tlb::invalidate_range(leaf_vaddr..leaf_vaddr + size, self.tlb_scope());
+        true
     }
 
-    pub fn vaddr(&self) -> VirtualAddress {
-        self.vaddr
-    }
+    /// Change the access permissions of all mappings within `vaddr_rng` to `access_perms`,
+    /// rewriting the descriptors in place (ex: for mprotect, JITs and guard pages). Only the
+    /// blocks extending beyond the range are split, into tables allocated from `desc_alloc`.
+    ///
+    /// TLB maintenance is batched: the whole range is invalidated once, instead of once per
+    /// block. Unmapped parts of the range are left as is.
+    pub fn protect<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        access_perms: &AccessPermissions,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        let res = self
+            .traverse(vaddr_rng.clone(), false)
+            .try_for_each(|res| match res? {
+                TraverseYield::PhysicalBlock(pbo_info) => {
+                    pbo_info.protect_overlapping_range(self, access_perms, desc_alloc)
+                }
+                TraverseYield::UnusedMemory(_) => bug!("Tables aren't freed, when only traversing"),
+            });
 
-    pub fn size(&self) -> usize {
-        self.size as usize
+        // Mappings protected before a failure must not stay cached with the old permissions.
+        tlb::invalidate_range(vaddr_rng, self.tlb_scope());
+        res
     }
 
-    pub fn overlapping_range(&self) -> &Range<u32> {
-        &self.overlap
+    /// Remove all mappings within `vaddr_rng`. Blocks extending beyond the range are split.
+    /// Tables left empty are returned to `desc_alloc`.
+    ///
+    /// TLB maintenance is batched: the whole range is invalidated once (and only then the
+    /// tables are freed), instead of once per removed block.
+    pub fn unmap<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        self.unmap_impl(vaddr_rng, desc_alloc, false, ROOT_TRANSLATION_LEVEL.next())
     }
 
-    pub fn non_overlapping_range(&self) -> (Range<u32>, Range<u32>) {
-        (0..self.overlap.start, self.overlap.end..self.size)
+    /// Same as `unmap`, but the memory of the pages and blocks removed entirely is also
+    /// returned to `desc_alloc`, once no other address space is sharing it.
+    /// Must be used only for ranges backed by memory allocated from `desc_alloc` (with the
+    /// page/block size as alignment).
+    pub fn unmap_and_free<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        self.unmap_impl(vaddr_rng, desc_alloc, true, ROOT_TRANSLATION_LEVEL.next())
     }
 
-    pub fn remove_overlapping_range<DescAlloc: PhysicalPageAllocator>(
-        &mut self,
-        tt: &TranslationTable,
+    /// Same as `unmap` (or `unmap_and_free`, if `free_memory`), for a range within a single
+    /// subtree (see `split_at_subtrees`). Tables above the subtree are left in place even if
+    /// emptied, so that the other subtrees can be updated concurrently (see `Concurrency`).
+    /// They are freed by a later `unmap` spanning them, or along with the table.
+    pub fn unmap_subtree<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
         desc_alloc: &DescAlloc,
+        free_memory: bool,
     ) -> Result<()> {
-        let ll_desc = Stage1LastLevelDescriptor::new(*self.desc_ptr);
-
-        // Remove the existing mapping
-        *self.desc_ptr = INVALID_DESCRIPTOR;
-
-        // Physical Block:
-        // [..........MMMM...........]
-        // [A         B  C          D]
-        // first_range = [A, B)
-        // overlapping_range = [B, C)
-        // last_range = [C, D)
-        let (first_rng, last_rng) = self.non_overlapping_range();
+        let subtree_span = get_vaddr_spacing_per_entry(&SUBTREE_LEVEL.prev());
 
-        // Install the new ranges (Non-Overlapping)
-        if let Some(map) = self.create_memory_map(first_rng, &ll_desc) {
-            tt.map(&map, desc_alloc)?;
-        }
-        if let Some(map) = self.create_memory_map(last_rng, &ll_desc) {
-            tt.map(&map, desc_alloc)?;
+        if vaddr_rng.start < vaddr_rng.end
+            && vaddr_rng.start.align_down(subtree_span)
+                != (vaddr_rng.end - 1usize).align_down(subtree_span)
+        {
+            return Err(Error::InvalidVirtualAddress(vaddr_rng.end.as_raw_ptr()));
         }
 
-        Ok(())
+        self.unmap_impl(vaddr_rng, desc_alloc, free_memory, SUBTREE_LEVEL)
     }
 
-    fn create_memory_map(
-        &self,
-        rng: Range<u32>,
-        ll_desc: &Stage1LastLevelDescriptor,
-    ) -> Option<MemoryMap> {
-        let num_pages = (rng.end - rng.start) as usize / GRANULE_SIZE;
-        if num_pages == 0 {
-            return None;
-        }
+    /// Split `vaddr_rng` at the boundaries of the subtrees below the root (see
+    /// `into_subtrees`). Pieces share no tables but the ones above the subtrees, so they can be
+    /// unmapped (see `unmap_subtree`) or protected on different cores.
+    pub fn split_at_subtrees(
+        vaddr_rng: Range<VirtualAddress>,
+    ) -> impl Iterator<Item = Range<VirtualAddress>> {
+        let subtree_span = get_vaddr_spacing_per_entry(&SUBTREE_LEVEL.prev());
+        let mut start = vaddr_rng.start;
 
-        let access_perms = parse_access_perms(ll_desc);
-        let paddr = self.phy_block + rng.start as usize;
-        let vaddr = self.vaddr + rng.start as usize;
-        let is_cacheable = !ll_desc.matches_all(STAGE1_LAST_LEVEL_DESCRIPTOR::SH::OuterShareable);
-        let map = MapDesc::new(paddr, vaddr, num_pages, access_perms);
+        core::iter::from_fn(move || {
+            if start >= vaddr_rng.end {
+                return None;
+            }
 
-        Some(match is_cacheable {
-            true => MemoryMap::Normal(map),
-            false => MemoryMap::Device(map),
+            // Last subtree of the VA space ends with the range.
+            let end = match start
+                .align_down(subtree_span)
+                .checked_add(subtree_span)
+                .map(VirtualAddress::new)
+            {
+                Some(Ok(end)) if end < vaddr_rng.end => end,
+                _ => vaddr_rng.end,
+            };
+            let piece = start..end;
+            start = end;
+            Some(piece)
         })
     }
-}
 
-type Stash<'tt> = Vec<&'tt DescriptorTable, MAX_TRANSLATION_LEVELS>;
+    /// Tear down this (user) translation table, returning all of its tables to `desc_alloc`.
+    /// References to the memory shared with other address spaces are dropped.
+    ///
+    /// Unlike unmapping the whole VA space, this is a single depth first pass over the tables,
+    /// which neither splits nor rewrites any descriptor. Instead of TLB maintenance per unmapped
+    /// range, TLB entries tagged with the table's ASID are invalidated at once, and the ASID is
+    /// released for reuse. The table must not be active on any core.
+    pub fn destroy<DescAlloc: PhysicalPageAllocator>(self, desc_alloc: &DescAlloc) {
+        self.destroy_impl(desc_alloc, false)
+    }
 
-#[derive(Clone, Copy)]
-enum IterState {
-    Load,
-    Step,
-    MoveRight,
-    Halt,
-}
-
-pub struct TraverseIterator<'tt> {
-    root: &'tt DescriptorTable,
-    va_rng: Range<VirtualAddress>,
-    va_space_explored: VirtualAddress,
-
-    empty_descs: Vec<NonNull<u8>, MAX_TRANSLATION_LEVELS>,
-    stash: Stash<'tt>,
-
-    should_free_empty_descs: bool,
-    state: Result<IterState>,
-}
-
-impl<'tt> Iterator for TraverseIterator<'tt> {
-    type Item = Result<TraverseYield<'tt>>;
+    /// Same as `destroy`, but the mapped memory is also returned to `desc_alloc`, once no
+    /// other address space is sharing it (see `unmap_and_free`).
+    pub fn destroy_and_free<DescAlloc: PhysicalPageAllocator>(self, desc_alloc: &DescAlloc) {
+        self.destroy_impl(desc_alloc, true)
+    }
 
-    fn next(&mut self) -> Option<Self::Item> {
-        if let Some(empty_desc) = self.empty_descs.pop() {
-            return Some(Ok(TraverseYield::UnusedMemory(empty_desc)));
+    /// Merge runs of mappings within `vaddr_rng` into larger blocks.
+    /// A level 3 table of 512 pages (or a level 2 table of 512 2MiB blocks), mapping physically
+    /// contiguous and suitably aligned memory with identical attributes, is replaced by a
+    /// single 2MiB (or 1GiB) block descriptor. Replaced tables are returned to `desc_alloc`,
+    /// once no walk could be in them (see `reclaim_tables`).
+    ///
+    /// `map` does this around every new mapping. Other updates leave runs behind, which
+    /// are picked up by calling this periodically from a background scanner.
+    /// Returns the number of tables replaced.
+    pub fn promote_mappings<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+    ) -> usize {
+        if vaddr_rng.start >= vaddr_rng.end {
+            return 0;
         }
 
-        match self.fetch_block() {
-            FetchBlockResult::Block(pbo_info) => Some(Ok(TraverseYield::PhysicalBlock(pbo_info))),
-            FetchBlockResult::Err(e) => Some(Err(e)),
-            FetchBlockResult::None => None,
-        }
-    }
-}
+        let root_span = 1 << VIRTUAL_ADDRESS_NBITS;
+        let root_vaddr = VirtualAddress::new(vaddr_rng.start.align_down(root_span))
+            .unwrap_or_else(|_| bug!("VA space of root table must be a valid address"));
 
-enum FetchBlockResult<'tt> {
-    Block(PhysicalBlockOverlapInfo<'tt>),
-    Err(Error),
-    None,
-}
+        let num_freed = self.promote_table(
+            &self.root,
+            &ROOT_TRANSLATION_LEVEL,
+            root_vaddr,
+            &vaddr_rng,
+            desc_alloc,
+        );
 
-impl<'tt> TraverseIterator<'tt> {
-    fn new(
-        root: &'tt DescriptorTable,
-        mut va_rng: Range<VirtualAddress>,
-        should_free_empty_descs: bool,
-    ) -> Self {
-        // Align start and end to page boundary.
-        va_rng.start.align_down(FOUR_KIB);
-        va_rng.end.align_up(FOUR_KIB);
+        self.reclaim_tables(desc_alloc);
+        num_freed
+    }
 
-        let mut iter = TraverseIterator {
-            root,
-            va_rng: va_rng.clone(),
-            should_free_empty_descs,
-            va_space_explored: VirtualAddress::new(0).unwrap(),
-            empty_descs: Vec::default(),
-            stash: Vec::default(),
-            state: Ok(IterState::Halt),
+    /// Replace each level 3 table within `vaddr_rng`, which maps private pages with identical
+    /// attributes in all of its slots, with a level 2 block. Memory of the pages is copied
+    /// into a newly allocated block and returned to `desc_alloc`, along with the table.
+    /// Must be used only for ranges backed by pages allocated from `desc_alloc`.
+    ///
+    /// Unlike `promote_mappings`, pages need not be contiguous in PA. This is meant to be
+    /// called periodically from a background scanner, for regions populated page by page.
+    /// Returns the no. of blocks installed. Stops at the first block which can't be allocated.
+    pub fn collapse_pages<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+    ) -> usize {
+        let mut num_collapsed = 0;
+        let mut vaddr = match VirtualAddress::new(vaddr_rng.start.align_up(L2_BLOCK_SIZE)) {
+            Ok(vaddr) => vaddr,
+            Err(_) => return 0,
         };
 
-        iter.begin();
-        iter
+        let epoch = self.epoch.pin();
+        while vaddr < vaddr_rng.end && (vaddr_rng.end - vaddr) as usize >= L2_BLOCK_SIZE {
+            // Level 2 table is skipped, if it was replaced by a block meanwhile.
+            if let Some((descs, idx, _guard)) = self
+                .find_desc(vaddr, &AddressTranslationLevel::Two)
+                .and_then(|(descs, idx)| Some((descs, idx, descs.lock_live()?)))
+            {
+                match self.collapse_table(descs, idx, vaddr, desc_alloc) {
+                    Ok(true) => num_collapsed += 1,
+                    Ok(false) => {}
+                    Err(_) => break,
+                }
+            }
+            vaddr += L2_BLOCK_SIZE;
+        }
+
+        drop(epoch);
+        self.reclaim_tables(desc_alloc);
+        num_collapsed
     }
 
-    fn begin(&mut self) {
-        if self.va_rng.start >= self.va_rng.end {
-            return;
+    /// Free the tables retired by earlier updates, which no walk could be in anymore.
+    /// Updates unlinking tables do this themselves, but tables walked meanwhile are left
+    /// retired. So, this is also meant to be called periodically (ex: from a background
+    /// scanner).
+    /// Returns the no. of tables still retired.
+    pub fn reclaim_tables<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        desc_alloc: &DescAlloc,
+    ) -> usize {
+        let mut table = self.retired.swap(core::ptr::null_mut(), Ordering::Acquire);
+        if table.is_null() {
+            return 0;
         }
 
-        self.state = (|| -> Result<IterState> {
-            let mut descs = self.root;
-            let vaddr = self.va_rng.start;
-
-            for level in TRANSLATION_LEVELS.iter() {
-                let idx = vaddr.get_idx_for_level(level);
-                let desc = load_desc(descs, idx);
+        // Tables retired in the current epoch need it to advance twice.
+        self.epoch.try_advance();
+        let epoch = self.epoch.try_advance();
+        let mut num_retired = 0;
 
-                self.va_space_explored.set_idx_for_level(level, idx);
-                self.stash
-                    .push(descs)
-                    .unwrap_or_else(|_| bug!("stash size exceeded"));
+        while let Some(descs) = unsafe { table.as_ref() } {
+            table = descs.next_retired.load(Ordering::Relaxed);
 
-                match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
-                    Descriptor::Table(child_descs) => {
-                        descs = TraverseIterator::descend(&child_descs, level, vaddr).0;
-                    }
-                    _ => break,
+            match Epoch::is_reclaimable(descs.retired_epoch.load(Ordering::Relaxed), epoch) {
+                true => self.tables.free(desc_alloc, descs),
+                false => {
+                    self.push_retired(descs);
+                    num_retired += 1;
                 }
             }
-            Ok(IterState::Load)
-        })();
+        }
 
-        assert!(self.va_space_explored < self.va_rng.end);
+        num_retired
     }
 
-    fn fetch_block(&mut self) -> FetchBlockResult<'tt> {
-        while !self.stash.is_empty() {
-            match self.state {
-                Ok(state) => match state {
-                    IterState::Load => {
-                        if let Some(pbo_info) = self.load_block() {
-                            self.state = Ok(IterState::MoveRight);
-                            return FetchBlockResult::Block(pbo_info);
-                        } else {
-                            self.state = Ok(IterState::Step);
-                        }
-                    }
-                    IterState::MoveRight => self.state = Ok(self.move_right()),
-                    IterState::Step => self.state = self.step(),
-                    IterState::Halt => break,
-                },
-                Err(e) => return FetchBlockResult::Err(e),
+    /// Top up the table pool with the tables missing on the walk for `vaddr` through `levels`
+    /// (ex: up to level 2 for installing pages), so that the walk can install them without
+    /// going to `desc_alloc` (see `TablePool`). Must be called with the epoch pinned.
+    fn reserve_tables<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr: VirtualAddress,
+        levels: &[AddressTranslationLevel],
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        let mut descs = &self.root;
+
+        for (i, level) in levels.iter().enumerate() {
+            match parse_desc(load_desc(descs, vaddr.get_idx_for_level(level)), level) {
+                Ok(Descriptor::Table(tbl_desc)) => descend_tbl_desc(tbl_desc, &mut descs),
+                Ok(Descriptor::Invalid) => {
+                    return self.tables.reserve(desc_alloc, levels.len() - i)
+                }
+                // Walk fails anyway.
+                _ => return Ok(()),
             }
         }
 
-        FetchBlockResult::None
+        Ok(())
     }
 
-    fn step(&mut self) -> Result<IterState> {
-        assert!(!self.stash.is_empty());
-
-        let descs = *self
-            .stash
-            .last()
-            .unwrap_or_else(|| bug!("bug on load_block"));
-        let level = AddressTranslationLevel::from(self.stash.len() - 1);
-        let idx = self.va_space_explored.get_idx_for_level(&level);
-
-        assert!(idx < NUM_TABLE_DESC_ENTRIES);
-        assert!(self.va_space_explored < self.va_rng.end);
+    /// Install an empty table at the invalid descriptor at `idx` of `descs`, a table of `level`
+    /// (see `install_new_tbl_desc`). Level 1 tables are locked for it, as their descriptors
+    /// are left invalid during the break-before-make of `promote_entry`. Level 2 tables must
+    /// be locked by the caller.
+    fn install_tbl_desc<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        descs: &DescriptorTable,
+        idx: usize,
+        level: &AddressTranslationLevel,
+        desc_alloc: &DescAlloc,
+    ) -> Result<Option<Stage1TableDescriptor>> {
+        let _guard = (*level == AddressTranslationLevel::One).then(|| descs.lock());
+        install_new_tbl_desc(&self.tables, desc_alloc, descs, idx)
+    }
 
-        let desc = load_desc(descs, idx as usize);
-        match parse_desc(desc, &level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
-            Descriptor::Table(child_descs) => {
-                let child =
-                    TraverseIterator::descend(&child_descs, &level, self.va_space_explored).0;
-                self.stash
-                    .push(child)
-                    .unwrap_or_else(|_| bug!("stash size exceeded"));
-                return Ok(IterState::Load);
-            }
-            _ => return Ok(self.move_right()),
-        }
+    /// Return the free tables held for recycling (see `TablePool`) to `desc_alloc`, ex: when
+    /// running low on memory. Returns the no. of tables freed.
+    pub fn trim_tables<DescAlloc: PhysicalPageAllocator>(&self, desc_alloc: &DescAlloc) -> usize {
+        self.tables.drain(desc_alloc)
     }
 
-    fn move_right(&mut self) -> IterState {
-        assert!(!self.stash.is_empty());
+    /// Memory taken by the descriptor tables of this translation table.
+    /// Tables unlinked by `traverse` are handed over to the caller (see
+    /// `TraverseYield::UnusedMemory`), but stay counted.
+    pub fn table_usage(&self) -> TableUsage {
+        self.tables.usage()
+    }
 
-        let descs = *self
-            .stash
-            .last()
-            .unwrap_or_else(|| bug!("bug on load_block"));
-        let level = AddressTranslationLevel::from(self.stash.len() - 1);
-        let idx = self.va_space_explored.get_idx_for_level(&level);
+    /// Hand `descs`, which was just unlinked, over for freeing once no walk could be in it.
+    /// Tables installed below it must have been unlinked (or retired) too.
+    fn retire_table(&self, descs: &DescriptorTable) {
+        descs
+            .retired_epoch
+            .store(self.epoch.current(), Ordering::Release);
+        self.push_retired(descs);
+    }
 
-        assert!(idx < NUM_TABLE_DESC_ENTRIES);
-        assert!(self.va_space_explored < self.va_rng.end);
+    fn push_retired(&self, descs: &DescriptorTable) {
+        let descs_ptr = descs as *const DescriptorTable as *mut DescriptorTable;
+        let mut head = self.retired.load(Ordering::Relaxed);
 
-        if self.find_next_valid_entry(descs, &level, idx + 1) {
-            return IterState::Load;
-        } else {
-            return self.move_up(descs, level);
+        loop {
+            descs.next_retired.store(head, Ordering::Relaxed);
+            match self.retired.compare_exchange_weak(
+                head,
+                descs_ptr,
+                Ordering::Release,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => return,
+                Err(new_head) => head = new_head,
+            }
         }
     }
 
-    fn move_up(&mut self, descs: &DescriptorTable, level: AddressTranslationLevel) -> IterState {
-        assert!(!self.stash.is_empty());
+    /// Free all the retired tables. There can be no walks, as the table is owned.
+    fn free_retired_tables<DescAlloc: PhysicalPageAllocator>(&mut self, desc_alloc: &DescAlloc) {
+        let mut table = *self.retired.get_mut();
 
-        if self.va_space_explored >= self.va_rng.end {
-            while self.ascend() {
-                // Allow Empty descriptors to be visited and free'd
-            }
-            return IterState::Halt;
+        while let Some(descs) = unsafe { table.as_ref() } {
+            table = descs.next_retired.load(Ordering::Relaxed);
+            free_desc_table(desc_alloc, descs);
         }
+        *self.retired.get_mut() = core::ptr::null_mut();
+    }
 
-        // Move up until, a valid entry can be found.
-        while self.ascend() {
-            let parent = *self
-                .stash
-                .last()
-                .unwrap_or_else(|| bug!("bug on load_block"));
-            let parent_level = AddressTranslationLevel::from(self.stash.len() - 1);
-            let parent_idx = self.va_space_explored.get_idx_for_level(&parent_level);
+    /// Descriptor Table used at `level` for walking `vaddr`, along with the index of `vaddr`.
+    /// Returns None, if the walk ends before `level`.
+    fn find_desc(
+        &self,
+        vaddr: VirtualAddress,
+        level: &AddressTranslationLevel,
+    ) -> Option<(&DescriptorTable, usize)> {
+        let mut descs = &self.root;
 
-            if self.find_next_valid_entry(parent, &parent_level, parent_idx + 1) {
-                return IterState::Load;
+        for walk_level in TRANSLATION_LEVELS.iter() {
+            let idx = vaddr.get_idx_for_level(walk_level);
+
+            if walk_level == level {
+                return Some((descs, idx));
+            }
+            match parse_desc(load_desc(descs, idx), walk_level).ok()? {
+                Descriptor::Table(tbl_desc) => descend_tbl_desc(tbl_desc, &mut descs),
+                _ => return None,
             }
         }
-        IterState::Halt
-    }
-
-    fn ascend(&mut self) -> bool {
-        let level = AddressTranslationLevel::from(self.stash.len() - 1);
-        let descs = self.stash.pop().unwrap_or_else(|| bug!("bug in ascend"));
 
-        self.free_descs_if_empty(descs, &level);
-        self.va_space_explored.clear_idx_for_level(&level);
-        !self.stash.is_empty()
+        None
     }
 
-    fn descend(
-        descs: &Stage1TableDescriptor,
-        level: &AddressTranslationLevel,
+    /// Collapse the level 3 table pointed by the level 2 descriptor at `idx` (mapping `vaddr`)
+    /// into a block (see `collapse_pages`). Returns false, if the table can't be collapsed.
+    fn collapse_table<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        descs: &DescriptorTable,
+        idx: usize,
         vaddr: VirtualAddress,
-    ) -> (&'tt DescriptorTable, usize) {
-        let child = get_next_level_desc(descs);
-        let child_level = level.next();
-        let child_idx = vaddr.get_idx_for_level(&child_level);
+        desc_alloc: &DescAlloc,
+    ) -> Result<bool> {
+        let page_descs = match parse_desc(load_desc(descs, idx), &AddressTranslationLevel::Two) {
+            Ok(Descriptor::Table(tbl_desc)) => get_next_level_desc(&tbl_desc),
+            _ => return Ok(false),
+        };
+        let attributes = match find_collapsible_attributes(page_descs) {
+            Some(attributes) => attributes,
+            None => return Ok(false),
+        };
+        let layout = Layout::from_size_align(L2_BLOCK_SIZE, L2_BLOCK_SIZE)
+            .unwrap_or_else(|_| bug!("Block Layout Mismatch"));
+        let block = desc_alloc
+            .allocate(layout)
+            .map_err(|_| Error::PhysicalOOM)?
+            .as_non_null_ptr();
 
-        (child, child_idx)
-    }
+        // Break-before-make. The pages are copied only after they are unmapped, so that no
+        // write to them gets lost. Accesses meanwhile fault, and are retried.
+        store_desc(descs, idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(vaddr..vaddr + L2_BLOCK_SIZE, self.tlb_scope());
 
-    fn load_block(&self) -> Option<PhysicalBlockOverlapInfo<'tt>> {
-        let descs = *self
-            .stash
-            .last()
-            .unwrap_or_else(|| bug!("bug on load_block"));
-        let level = AddressTranslationLevel::from(self.stash.len() - 1);
-        let idx = self.va_space_explored.get_idx_for_level(&level);
+        let page_layout = Layout::from_size_align(PAGE_SIZE, PAGE_SIZE)
+            .unwrap_or_else(|_| bug!("Page Layout Mismatch"));
+        for page_idx in 0..NUM_TABLE_DESC_ENTRIES {
+            let paddr = parse_output_address(
+                &Stage1LastLevelDescriptor::new(load_desc(page_descs, page_idx)),
+                &AddressTranslationLevel::Three,
+            );
 
-        let desc = load_desc(descs, idx as usize);
-        match parse_desc(desc, &level)
-            .map_err(|_| Error::CorruptedTranslationTable(desc))
-            .unwrap_or_else(|_| bug!("parsing verified descriptor failed"))
-        {
-            Descriptor::Block(_) | Descriptor::Page(_) => {
-                Some(self.create_phy_block_info(descs, &level, idx))
+            unsafe {
+                core::ptr::copy_nonoverlapping(
+                    phy2virt(paddr).as_ptr::<u8>(),
+                    block.as_ptr().add(page_idx * PAGE_SIZE),
+                    PAGE_SIZE,
+                );
+                desc_alloc.deallocate(
+                    NonNull::new(paddr.as_raw_ptr() as *mut u8)
+                        .unwrap_or_else(|| bug!("null page")),
+                    page_layout,
+                );
             }
-            _ => None,
         }
-    }
 
-    fn find_next_valid_entry(
-        &mut self,
-        descs: &DescriptorTable,
-        level: &AddressTranslationLevel,
-        mut idx: usize,
-    ) -> bool {
-        loop {
-            if idx < NUM_TABLE_DESC_ENTRIES {
-                self.va_space_explored.set_idx_for_level(&level, idx);
+        store_desc(
+            descs,
+            idx,
+            new_stage1_block_desc(
+                BlockDescLevel::Two,
+                block.addr().get() as u64,
+                with_block_tag(attributes),
+            ),
+        );
+        self.walk_cache.invalidate();
+        self.retire_table(page_descs);
 
-                if self.va_space_explored < self.va_rng.end {
-                    let desc = load_desc(descs, idx as usize);
+        Ok(true)
+    }
 
-                    if matches!(to_raw_desc(desc), RawDescriptor::Invalid) {
-                        idx += 1;
-                    } else {
-                        return true;
+    /// Unmap `vaddr_rng`, freeing the tables of `min_freed_level` (or below) left empty.
+    fn unmap_impl<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+        free_memory: bool,
+        min_freed_level: AddressTranslationLevel,
+    ) -> Result<()> {
+        let mut gather = UnmapGather::new(self, desc_alloc);
+        let blocks = TraverseIterator::new(
+            &self.root,
+            &self.walk_cache,
+            vaddr_rng,
+            Some(min_freed_level),
+        );
+
+        for res in blocks {
+            match res? {
+                TraverseYield::PhysicalBlock(mut pbo_info) => {
+                    let ref_block = pbo_info.ref_block();
+                    let free_block = free_memory
+                        && pbo_info.overlaps_whole_block()
+                        && !desc_alloc.is_shared(ref_block.start);
+
+                    pbo_info.unmap_overlapping_range(self, desc_alloc)?;
+                    gather.add_range(pbo_info.overlapping_vaddr_range());
+                    if free_block {
+                        gather.add_block(ref_block);
                     }
-                } else {
-                    break;
                 }
-            } else {
-                break;
+                TraverseYield::UnusedMemory(table) => gather.add_table(table),
             }
         }
 
-        false
+        Ok(())
     }
 
-    fn free_descs_if_empty(&mut self, descs: &DescriptorTable, level: &AddressTranslationLevel) {
-        if !self.should_free_empty_descs || level == &AddressTranslationLevel::Zero {
-            return;
+    fn destroy_impl<DescAlloc: PhysicalPageAllocator>(
+        self,
+        desc_alloc: &DescAlloc,
+        free_memory: bool,
+    ) {
+        for subtree in self.into_subtrees(desc_alloc, free_memory) {
+            subtree.destroy(desc_alloc);
         }
+    }
 
-        for idx in 0..NUM_TABLE_DESC_ENTRIES {
-            let desc = load_desc(descs, idx);
-            let desc = Stage1LastLevelDescriptor::new(desc);
-
-            if desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::VALID) {
-                return;
-            }
+    /// Tear down this table as in `destroy` (or `destroy_and_free`, if `free_memory`), but
+    /// leave the subtrees below the entries of the level below the root (ex: 1GiB of VA each,
+    /// with 4KiB granule) to the caller. The subtrees share no tables, so they can be torn
+    /// down on different cores to speed up destroying very large address spaces.
+    /// Tables above the subtrees (and the memory mapped by them) are freed by the iterator, as
+    /// it's driven. Dropping it early destroys the rest of the table, subtrees included.
+    pub fn into_subtrees<DescAlloc: PhysicalPageAllocator>(
+        mut self,
+        desc_alloc: &DescAlloc,
+        free_memory: bool,
+    ) -> IntoSubtrees<'_, DescAlloc> {
+        // Tables (and memory) can be freed only once no TLB could be holding a walk through
+        // them (or a translation to it).
+        let asid = self.asid.load();
+        let asid_used = ASID_ALLOCATOR.lock().free(asid);
+        if self.has_global.load(Ordering::Relaxed) {
+            tlb::invalidate_all();
+        } else if asid_used {
+            tlb::invalidate_asid(asid.get());
+        }
+        self.free_retired_tables(desc_alloc);
+        self.tables.drain(desc_alloc);
+
+        IntoSubtrees {
+            tt: self,
+            desc_alloc,
+            free_memory,
+            root_idx: 0,
+            upper: None,
         }
-
-        let parent_level = level.prev();
-        let parent = self.stash[parent_level as usize];
-        let parent_idx = self.va_space_explored.get_idx_for_level(&parent_level);
-
-        *load_desc_mut(parent, parent_idx) = INVALID_DESCRIPTOR;
-        self.empty_descs
-            .push(NonNull::from(unsafe { &*(descs.0.get() as *const u8) }))
-            .unwrap_or_else(|_| bug!("empty_descs size exceeded"));
     }
 
-    fn create_phy_block_info(
-        &self,
-        descs: &'tt DescriptorTable,
-        level: &AddressTranslationLevel,
-        idx: usize,
-    ) -> PhysicalBlockOverlapInfo<'tt> {
-        assert!(self.va_space_explored < self.va_rng.end);
-
-        let desc = load_desc_mut(descs, idx as usize);
-        let ll_desc = Stage1LastLevelDescriptor::new(*desc);
-
-        let paddr = match level {
-            AddressTranslationLevel::Zero => bug!("invalid level to fetch output address"),
-            AddressTranslationLevel::One => {
-                ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_1GiB) as usize * ONE_GIB
-            }
-            AddressTranslationLevel::Two => {
-                ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_2MiB) as usize * TWO_MIB
-            }
-            AddressTranslationLevel::Three => {
-                ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_4KiB) as usize * FOUR_KIB
-            }
-        };
+    /// Install this table in TTBR0 for running user space.
+    /// Non-global (user) mappings are tagged with this table's ASID, so TLB entries of the
+    /// previously active table need not be flushed.
+    pub fn activate(&self) {
+        let mut asid_allocator = ASID_ALLOCATOR.lock();
+        let (asid, flush_tlb) =
+            asid_allocator.get_or_allocate(self.asid.load(), asid::current_cpu());
+
+        self.asid.store(asid);
+        drop(asid_allocator);
+        if flush_tlb {
+            tlb::invalidate_all();
+        }
+        asid::set_ttbr0(self.get_base_address(), asid);
+    }
 
-        PhysicalBlockOverlapInfo::new(
-            self,
-            PhysicalAddress::new(paddr),
-            self.va_space_explored,
-            get_vaddr_spacing_per_entry(level) as u32,
-            desc,
-        )
+    /// Translate `vaddr` to the PhysicalAddress it is backed by.
+    /// If this table is the one installed in TTBR0/TTBR1, the MMU does the walk (see `at`),
+    /// otherwise the table is walked in software.
+    ///
+    /// Addresses in the TTBR0 half are translated only if they are readable from EL0, so that
+    /// a user supplied address can be validated and translated in one step.
+    pub fn translate(&self, vaddr: VirtualAddress) -> Option<PhysicalAddress> {
+        if at::is_installed(self.get_base_address(), vaddr) {
+            at::translate(vaddr)
+        } else {
+            self.translate_sw(vaddr)
+        }
     }
-}
 
-fn get_next_level_desc<'tt>(tbl_desc: &Stage1TableDescriptor) -> &'tt DescriptorTable {
-    let next_lvl_desc = read_next_level_desc(&tbl_desc);
-    assert_ne!(next_lvl_desc, 0);
-    unsafe { &*(next_lvl_desc as *mut DescriptorTable) }
-}
+    /// Translate the buffer spanning `vaddr_rng`, one page at a time.
+    /// PhysicalAddress corresponding to the first byte of the buffer within the i'th page
+    /// is stored at `phy_pages[i]`.
+    ///
+    /// Stops at the first page that cannot be translated or once `phy_pages` is full.
+    /// Returns the number of pages translated.
+    pub fn translate_buffer(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        phy_pages: &mut [PhysicalAddress],
+    ) -> usize {
+        let use_mmu = at::is_installed(self.get_base_address(), vaddr_rng.start);
+        let mut vaddr = vaddr_rng.start;
+        let mut num_pages = 0;
+
+        while vaddr < vaddr_rng.end && num_pages < phy_pages.len() {
+            let paddr = match use_mmu {
+                true => at::translate(vaddr),
+                false => self.translate_sw(vaddr),
+            };
 
-fn read_next_level_desc(tbl_desc: &Stage1TableDescriptor) -> u64 {
-    tbl_desc.read(STAGE1_TABLE_DESCRIPTOR::NEXT_LEVEL_TABLE_ADDR) << NEXT_LEVEL_TABLE_ADDR_SHIFT
-}
+            match paddr {
+                Some(paddr) => phy_pages[num_pages] = paddr,
+                None => break,
+            }
 
-fn descend_tbl_desc(tbl_desc: Stage1TableDescriptor, descs: &mut &DescriptorTable) {
-    *descs = get_next_level_desc(&tbl_desc);
-}
+            num_pages += 1;
+            vaddr = vaddr + (GRANULE_SIZE - vaddr.get_page_offset());
+        }
 
-fn install_new_tbl_desc<DescAlloc: PhysicalPageAllocator>(
-    desc_alloc: &DescAlloc,
-    new_desc: &mut u64,
-) -> Result<Stage1TableDescriptor> {
-    let alloc_desc_table = || -> Result<u64> {
-        let layout =
-            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
-                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
-        let ptr = desc_alloc
-            .allocate_zeroed(layout)
-            .map_err(|_| Error::PhysicalOOM)?
-            .as_non_null_ptr()
-            .addr()
-            .get();
-        Ok(ptr as u64)
-    };
-    let next_level_table = alloc_desc_table()?;
-    let tbl_desc = Stage1TableDescriptor::new(new_stage1_table_desc(next_level_table));
-    *new_desc = tbl_desc.get();
-    Ok(tbl_desc)
-}
+        num_pages
+    }
 
-fn install_contigious_mappings<F: Fn(u64, u64) -> u64>(
-    map: &mut ParsedMemoryMap,
-    idx: usize,
-    descs: &DescriptorTable,
-    page_size: usize,
-    new_stage1_descriptor: &F,
-) {
-    let mut paddr = map.phy_addr.as_raw_ptr() as u64;
-    let num_mapped_pages = core::cmp::min(map.num_pages, NUM_TABLE_DESC_ENTRIES - idx);
-    for i in 0..num_mapped_pages {
-        assert_eq!(load_desc(descs, idx + i), INVALID_DESCRIPTOR);
-        let desc = new_stage1_descriptor(paddr, map.attributes);
-        *load_desc_mut(descs, idx + i) = desc;
-        paddr += page_size as u64;
+    /// Build the Scatter-Gather list of the buffer spanning `vaddr_rng` into `segments`, in
+    /// a single walk: physically contiguous runs of the buffer are merged into a segment, upto
+    /// `constraints.max_segment_size`. Runs beyond `constraints.dma_limit` are bounced using
+    /// buffers allocated from `dma_alloc`, which must return memory reachable by the engine.
+    ///
+    /// Stops once `segments` is full, so that a large buffer can be transferred in batches,
+    /// resuming right after the last segment. Returns the number of segments filled.
+    /// Fails, if the buffer isn't entirely mapped (memory mapped lazily must be faulted in
+    /// beforehand). Bounce buffers allocated for the segments must be freed using
+    /// `release_sg_list`, once the transfer is complete.
+    pub fn build_sg_list<DmaAlloc: Allocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        constraints: &DmaConstraints,
+        segments: &mut [DmaSegment],
+        dma_alloc: &DmaAlloc,
+    ) -> Result<usize> {
+        let mut num_segments = 0;
+        let res = self.fill_sg_list(
+            vaddr_rng,
+            constraints,
+            segments,
+            &mut num_segments,
+            dma_alloc,
+        );
+
+        match res {
+            Ok(_) => Ok(num_segments),
+            Err(e) => {
+                dma::release_sg_list(&segments[..num_segments], dma_alloc);
+                Err(e)
+            }
+        }
     }
-    map.phy_addr += num_mapped_pages * page_size;
-    map.virt_addr += num_mapped_pages * page_size;
-    map.num_pages -= num_mapped_pages;
-}
 
-#[derive(Debug, Clone, Copy)]
-enum ContiguousSpan {
-    /// Number of Pages in 4KiB boundary
-    FourKiB(usize),
-    /// Number of Pages in 2MiB boundary
-    TwoMiB(usize),
-    /// Number of Pages in 1GiB boundary
-    OneGiB(usize),
-}
+    fn fill_sg_list<DmaAlloc: Allocator>(
+        &self,
+        vaddr_rng: Range<VirtualAddress>,
+        constraints: &DmaConstraints,
+        segments: &mut [DmaSegment],
+        num_segments: &mut usize,
+        dma_alloc: &DmaAlloc,
+    ) -> Result<()> {
+        let mut mapped_end = vaddr_rng.start;
 
-const ALIGNMENTS: [usize; 3] = [ONE_GIB, TWO_MIB, FOUR_KIB];
-const MAX_MAPPING_SPANS: usize = max_mapping_spans(ALIGNMENTS.len());
+        for extent in self.extents(vaddr_rng.clone()) {
+            let extent = extent?;
+            if extent.virtual_address() != mapped_end {
+                return Err(Error::InvalidVirtualAddress(mapped_end.as_raw_ptr()));
+            }
+            mapped_end = mapped_end + extent.len();
+
+            let mut vaddr = extent.virtual_address();
+            let mut paddr = extent.physical_address();
+            while vaddr < mapped_end {
+                let reachable = paddr < constraints.dma_limit;
+                // A run straddling the limit is split at it, so that a segment is either
+                // reachable or bounced as a whole.
+                let mut len = (mapped_end - vaddr) as usize;
+                if reachable {
+                    len = min(len, (constraints.dma_limit - paddr) as usize);
+                }
 
-#[derive(Default)]
-struct MappingScheme {
-    spans: Vec<ContiguousSpan, MAX_MAPPING_SPANS>,
-}
+                let last = num_segments.checked_sub(1).map(|last| &mut segments[last]);
+                match last {
+                    Some(last)
+                        if reachable
+                            && !last.is_bounced()
+                            && last.physical_address() + last.len() == paddr
+                            && last.len() < constraints.max_segment_size =>
+                    {
+                        len = min(len, constraints.max_segment_size - last.len());
+                        *last = DmaSegment::new(
+                            last.virtual_address(),
+                            last.physical_address(),
+                            last.len() + len,
+                            None,
+                            constraints,
+                        );
+                    }
+                    _ => {
+                        if *num_segments == segments.len() {
+                            return Ok(());
+                        }
 
-fn find_best_mapping_scheme_impl(
-    scheme: &mut MappingScheme,
-    vaddr: VirtualAddress,
-    paddr: PhysicalAddress,
-    size: usize,
-    level: usize,
-) {
-    if size == 0 {
-        return;
-    }
+                        len = min(len, constraints.max_segment_size);
+                        let bounce = match reachable {
+                            true => None,
+                            false => Some(
+                                dma_alloc
+                                    .allocate(dma::bounce_layout(len))
+                                    .map_err(|_| Error::PhysicalOOM)?
+                                    .as_non_null_ptr(),
+                            ),
+                        };
+                        segments[*num_segments] = DmaSegment::new(
+                            vaddr,
+                            paddr,
+                            len,
+                            bounce.map(|ptr| PhysicalAddress::new(ptr.addr().get())),
+                            constraints,
+                        );
+                        *num_segments += 1;
+                    }
+                }
 
-    fn align_offset<A: Address>(a: A, align: usize) -> usize {
-        let offset = a.align_offset(align);
-        if offset != 0 {
-            align - offset
-        } else {
-            0
+                vaddr = vaddr + len;
+                paddr = paddr + len;
+            }
         }
-    }
-
-    let align = ALIGNMENTS[level];
-    let va_offset = align_offset(vaddr, align);
-    let pa_offset = align_offset(paddr, align);
 
-    if va_offset == pa_offset && size > pa_offset && size - pa_offset >= align {
-        let current_span_paddr = PhysicalAddress::new(paddr.align_up(align));
-        let current_span_size = {
-            let span_end = current_span_paddr + size - pa_offset;
-            span_end.align_down(align);
-            (span_end - current_span_paddr) as usize
-        };
-        assert_ne!(current_span_size, 0);
+        match mapped_end < vaddr_rng.end {
+            true => Err(Error::InvalidVirtualAddress(mapped_end.as_raw_ptr())),
+            false => Ok(()),
+        }
+    }
 
-        find_best_mapping_scheme_impl(scheme, vaddr, paddr, pa_offset, level + 1);
+    /// Descriptor Table holding the block/page descriptor mapping `vaddr`, along with its
+    /// index and level.
+    fn find_leaf_desc(
+        &self,
+        vaddr: VirtualAddress,
+    ) -> Option<(&DescriptorTable, usize, AddressTranslationLevel)> {
+        let (mut descs, start_level) = self
+            .walk_cache
+            .lookup(vaddr)
+            .unwrap_or((&self.root, ROOT_TRANSLATION_LEVEL));
+
+        for level in
+            TRANSLATION_LEVELS[start_level as usize - ROOT_TRANSLATION_LEVEL as usize..].iter()
+        {
+            let idx = vaddr.get_idx_for_level(level);
 
-        let page_count = current_span_size / align;
-        if page_count != 0 {
-            scheme
-                .spans
-                .push(match align {
-                    ONE_GIB => ContiguousSpan::OneGiB(page_count),
-                    TWO_MIB => ContiguousSpan::TwoMiB(page_count),
-                    FOUR_KIB => ContiguousSpan::FourKiB(page_count),
-                    _ => bug!("Cannot reach here"),
-                })
-                .unwrap_or_else(|_| bug!("spans limit reached"));
+            match parse_desc(load_desc(descs, idx), level).ok()? {
+                Descriptor::Table(tbl_desc) => descend_tbl_desc(tbl_desc, &mut descs),
+                Descriptor::Block(_) | Descriptor::Page(_) => return Some((descs, idx, *level)),
+                Descriptor::Invalid => return None,
+            }
         }
 
-        find_best_mapping_scheme_impl(
-            scheme,
-            VirtualAddress::new(vaddr.align_up(align))
-                .unwrap_or_else(|_| bug!("bug in constructing aligned virtual address"))
-                + current_span_size,
-            current_span_paddr + current_span_size,
-            size - current_span_size - pa_offset,
-            level + 1,
-        );
-    } else {
-        find_best_mapping_scheme_impl(scheme, vaddr, paddr, size, level + 1);
+        None
     }
-}
 
-fn find_best_mapping_scheme(
-    vaddr: VirtualAddress,
-    paddr: PhysicalAddress,
-    size: usize,
-) -> MappingScheme {
-    assert!(vaddr.is_aligned(GRANULE_SIZE));
-    assert!(paddr.is_aligned(GRANULE_SIZE));
+    /// Same as `find_leaf_desc`, but the lock guarding updates of the descriptor is held (see
+    /// `DescriptorTable::lock`).
+    fn lock_leaf_desc(
+        &self,
+        vaddr: VirtualAddress,
+    ) -> Option<(
+        MutexGuard<'_, ()>,
+        &DescriptorTable,
+        usize,
+        AddressTranslationLevel,
+    )> {
+        let (mut descs, start_level) = self
+            .walk_cache
+            .lookup_upto(vaddr, &AddressTranslationLevel::Two)
+            .unwrap_or((&self.root, ROOT_TRANSLATION_LEVEL));
+        let mut guard = None;
+
+        for level in
+            TRANSLATION_LEVELS[start_level as usize - ROOT_TRANSLATION_LEVEL as usize..].iter()
+        {
+            let idx = vaddr.get_idx_for_level(level);
+            if *level == AddressTranslationLevel::Two {
+                match descs.lock_live() {
+                    Some(live) => guard = Some(live),
+                    None => return self.lock_leaf_desc(vaddr),
+                }
+            }
 
-    let mut scheme = MappingScheme::default();
+            match parse_desc(load_desc(descs, idx), level).ok()? {
+                Descriptor::Table(tbl_desc) => descend_tbl_desc(tbl_desc, &mut descs),
+                Descriptor::Block(_) | Descriptor::Page(_) => {
+                    // Level 1 blocks are guarded by the table holding them.
+                    let guard = guard.unwrap_or_else(|| descs.lock());
+                    return Some((guard, descs, idx, *level));
+                }
+                Descriptor::Invalid => return None,
+            }
+        }
 
-    find_best_mapping_scheme_impl(&mut scheme, vaddr, paddr, size, 0);
-    scheme
-}
+        None
+    }
 
-pub struct TranslationDesc {
-    virt_addr: VirtualAddress,
-    phy_addr: PhysicalAddress,
-    access_perms: AccessPermissions,
-    memory_kind: MemoryKind,
-}
+    /// Replace the shared block/page descriptor at `idx` (mapping `vaddr` at `level`) with
+    /// one private to this address space. Memory still shared with others is copied, or just
+    /// replaced with zeroed memory, if `zeroed` (ex: the zero page is never taken over).
+    fn make_leaf_private<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        descs: &DescriptorTable,
+        idx: usize,
+        level: &AddressTranslationLevel,
+        vaddr: VirtualAddress,
+        zeroed: bool,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        let size = get_vaddr_spacing_per_entry(level);
+        let desc = load_desc(descs, idx);
+        let paddr = parse_output_address(&Stage1LastLevelDescriptor::new(desc), level);
+        let ref_paddr = parse_ref_block(desc, level).start;
+        let mut attributes = without_sharing(parse_attributes(desc, paddr));
+
+        let output_address = if zeroed || desc_alloc.is_shared(ref_paddr) {
+            let layout = Layout::from_size_align(size, size)
+                .unwrap_or_else(|_| bug!("Block Layout Mismatch"));
+            let copy = match zeroed {
+                true => desc_alloc.allocate_zeroed(layout),
+                false => desc_alloc.allocate(layout),
+            }
+            .map_err(|_| Error::PhysicalOOM)?
+            .as_non_null_ptr();
+
+            if !zeroed {
+                unsafe {
+                    core::ptr::copy_nonoverlapping(
+                        phy2virt(paddr).as_ptr::<u8>(),
+                        copy.as_ptr(),
+                        size,
+                    )
+                };
+            }
+            desc_alloc.unshare(ref_paddr);
+            // Copy of a page of a block is a page of its own.
+            if is_block_piece(desc, level) {
+                attributes = without_block_tag(attributes);
+            }
+            copy.addr().get() as u64
+        } else {
+            paddr.as_raw_ptr() as u64
+        };
+        let new_desc = match level {
+            AddressTranslationLevel::Three => new_stage1_page_desc(output_address, attributes),
+            _ => new_stage1_block_desc(BlockDescLevel::from(level), output_address, attributes),
+        };
 
-struct ParsedMemoryMap {
-    /// Page Aligned
-    phy_addr: PhysicalAddress,
-    /// Page Aligned
-    virt_addr: VirtualAddress,
-    num_pages: usize,
-    attributes: u64,
-}
+        // Rest of the contiguous run stays shared, so cannot be hinted as contiguous anymore.
+        break_contiguous_run(descs, idx, level, vaddr, self.tlb_scope());
 
-fn parse_memory_map(map: &MemoryMap) -> ParsedMemoryMap {
-    match map {
-        MemoryMap::Normal(desc) => ParsedMemoryMap {
-            phy_addr: desc.physical_address(),
-            virt_addr: desc.virtual_address(),
-            num_pages: desc.num_pages(),
-            attributes: parse_map_attrs(&desc.access_permissions(), MemoryKind::Normal),
-        },
-        MemoryMap::Device(desc) => ParsedMemoryMap {
-            phy_addr: desc.physical_address(),
-            virt_addr: desc.virtual_address(),
-            num_pages: desc.num_pages(),
-            attributes: parse_map_attrs(&desc.access_permissions(), MemoryKind::Device),
-        },
+        // Break-before-make, as the output address could be changing.
+        store_desc(descs, idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(vaddr..vaddr + size, self.tlb_scope());
+        store_desc(descs, idx, new_desc);
+
+        Ok(())
     }
-}
 
-fn parse_map_attrs(ap: &AccessPermissions, device: MemoryKind) -> u64 {
-    let page_desc = Stage1PageDescriptor::new(0);
-    let el1_rw = ap.contains(AccessPermissions::EL1_READ | AccessPermissions::EL1_WRITE);
-    let el0_rw = ap.contains(AccessPermissions::EL0_READ | AccessPermissions::EL0_WRITE);
-    let el1_ro = ap.contains(AccessPermissions::EL1_READ);
-    let el0_ro = ap.contains(AccessPermissions::EL0_READ);
+    /// Software equivalent of `at::translate`.
+    fn translate_sw(&self, vaddr: VirtualAddress) -> Option<PhysicalAddress> {
+        let desc = self.virt2phy(vaddr)?;
 
-    if el1_rw {
-        if el0_rw {
-            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RW_EL1_EL0)
-        } else {
-            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RW_EL1)
+        match vaddr.get_ttbr_select() {
+            TTBR::Zero if !desc.access_perms.contains(AccessPermissions::EL0_READ) => None,
+            _ => Some(desc.phy_addr),
         }
-    } else if el1_ro {
-        if el0_ro {
-            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RO_EL1_EL0)
+    }
+
+    /// TLB entries holding this table's mappings (and walks): the ones tagged with its ASID,
+    /// unless it has global mappings.
+    fn tlb_scope(&self) -> tlb::Scope {
+        if self.has_global.load(Ordering::Relaxed) {
+            tlb::Scope::All
         } else {
-            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RO_EL1)
+            tlb::Scope::Asid(self.asid.load().get())
         }
     }
 
-    if ap.contains(AccessPermissions::EL1_WRITE) || !ap.contains(AccessPermissions::EL1_EXECUTE) {
-        page_desc.modify(STAGE1_PAGE_DESCRIPTOR::PXN::SET);
-    }
-    if ap.contains(AccessPermissions::EL0_WRITE) || !ap.contains(AccessPermissions::EL0_EXECUTE) {
-        page_desc.modify(STAGE1_PAGE_DESCRIPTOR::UXN::SET);
+    /// Keep track of global mappings being added with `attributes` (see `has_global`).
+    fn note_attributes(&self, attributes: u64) {
+        if !Stage1LastLevelDescriptor::new(attributes).is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::NG) {
+            self.has_global.store(true, Ordering::Relaxed);
+        }
     }
 
-    match device {
-        MemoryKind::Normal => page_desc.modify(STAGE1_PAGE_DESCRIPTOR::SH::InnerShareable),
-        MemoryKind::Device => page_desc.modify(STAGE1_PAGE_DESCRIPTOR::SH::OuterShareable),
-    }
+    fn map_impl<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &ParsedMemoryMap,
+        desc_alloc: &DescAlloc,
+        mmap: &MemoryMap,
+    ) -> Result<()> {
+        let epoch = self.epoch.pin();
+        self.walk_cache.invalidate();
+        self.note_attributes(map.attributes);
 
-    page_desc.get()
-}
+        let map_scheme =
+            find_best_mapping_scheme(map.virt_addr, map.phy_addr, map.num_pages * GRANULE_SIZE);
+        let mut map = ParsedMemoryMap {
+            phy_addr: map.phy_addr,
+            virt_addr: map.virt_addr,
+            attributes: map.attributes,
+            num_pages: 0,
+        };
 
-enum Descriptor {
-    Table(Stage1TableDescriptor),
-    Block(Stage1BlockDescriptor),
-    Page(Stage1PageDescriptor),
-    Invalid,
-}
+        let map_start = map.virt_addr;
+        let attributes = map.attributes;
 
-enum RawDescriptor {
-    TableOrPage(u64),
-    Block(Stage1BlockDescriptor),
+        for scheme in map_scheme.spans {
+            match scheme {
+                ContiguousSpan::Pages(num_pages) => {
+                    map.num_pages = num_pages;
+                    while map.num_pages > 0 {
+                        self.install_page_descs(&mut map, desc_alloc, mmap)
+                            .map_err(|e| e)?;
+                    }
+                }
+                ContiguousSpan::PageRuns(num_runs) => {
+                    map.num_pages =
+                        num_runs * get_contiguous_run_len(&AddressTranslationLevel::Three);
+                    map.attributes = with_contiguous_hint(attributes);
+                    while map.num_pages > 0 {
+                        self.install_page_descs(&mut map, desc_alloc, mmap)
+                            .map_err(|e| e)?;
+                    }
+                    map.attributes = attributes;
+                }
+                ContiguousSpan::L2Blocks(num_pages) => {
+                    map.num_pages = num_pages;
+                    while map.num_pages > 0 {
+                        self.install_l2_block_desc(&mut map, desc_alloc, mmap)
+                            .map_err(|e| e)?;
+                    }
+                }
+                ContiguousSpan::L2BlockRuns(num_runs) => {
+                    map.num_pages =
+                        num_runs * get_contiguous_run_len(&AddressTranslationLevel::Two);
+                    map.attributes = with_contiguous_hint(attributes);
+                    while map.num_pages > 0 {
+                        self.install_l2_block_desc(&mut map, desc_alloc, mmap)
+                            .map_err(|e| e)?;
+                    }
+                    map.attributes = attributes;
+                }
+                ContiguousSpan::L1Blocks(num_pages) => {
+                    map.num_pages = num_pages;
+                    while map.num_pages > 0 {
+                        self.install_l1_block_desc(&mut map, desc_alloc, mmap)
+                            .map_err(|e| e)?;
+                    }
+                }
+            }
+        }
+
+        // Tables replaced by blocks can be freed right away, unless other threads are walking.
+        drop(epoch);
+
+        // Only the tables at either end of the new mapping could have been completed
+        // together with the existing neighbours. Tables in between are either already
+        // mapped with blocks, or cannot be promoted due to misaligned PA.
+        let map_end = map.virt_addr - GRANULE_SIZE;
+        self.promote_mappings(map_start..map_start + 1usize, desc_alloc);
+        self.promote_mappings(map_end..map_end + 1usize, desc_alloc);
+
+        Ok(())
+    }
+
+    /// Promote all the mappings of `level + 1` in the table pointed by the descriptor at `idx`,
+    /// with a single block descriptor at `level`. `vaddr` is the start of VA range covered.
+    /// Returns true, if the table was replaced and freed.
+    /// `descs` must be locked (see `DescriptorTable::lock`).
+    fn promote_entry<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        descs: &DescriptorTable,
+        idx: usize,
+        level: &AddressTranslationLevel,
+        vaddr: VirtualAddress,
+        desc_alloc: &DescAlloc,
+    ) -> bool {
+        if !supports_block_desc(level) {
+            return false;
+        }
+
+        let next_level_descs = match parse_desc(load_desc(descs, idx), level) {
+            Ok(Descriptor::Table(tbl_desc)) => get_next_level_desc(&tbl_desc),
+            _ => return false,
+        };
+        // Threads waiting to update a level 2 table, must find it retired.
+        let _guard = next_level_descs.lock();
+        let block_desc = match find_promoted_block_desc(next_level_descs, level) {
+            Some(block_desc) => block_desc,
+            None => return false,
+        };
+
+        // Break-before-make: TLBs must never hold both the pages and the block for a VA.
+        store_desc(descs, idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(
+            vaddr..vaddr + get_vaddr_spacing_per_entry(level),
+            self.tlb_scope(),
+        );
+        store_desc(descs, idx, block_desc);
+        self.walk_cache.invalidate();
+
+        self.retire_table(next_level_descs);
+        true
+    }
+
+    fn promote_table<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        descs: &DescriptorTable,
+        level: &AddressTranslationLevel,
+        table_vaddr: VirtualAddress,
+        vaddr_rng: &Range<VirtualAddress>,
+        desc_alloc: &DescAlloc,
+    ) -> usize {
+        let entry_size = get_vaddr_spacing_per_entry(level);
+        let num_entries = get_num_entries(level);
+        let table_last = table_vaddr + (entry_size * num_entries - 1);
+        let range_last = vaddr_rng.end - 1usize;
+        let first_idx = match vaddr_rng.start > table_vaddr {
+            true => vaddr_rng.start.get_idx_for_level(level),
+            false => 0,
+        };
+        let last_idx = match range_last < table_last {
+            true => range_last.get_idx_for_level(level),
+            false => num_entries - 1,
+        };
+        let mut num_freed = 0;
+        // Tables below can be replaced by blocks, only with this table locked. Locks are taken
+        // top-down, so level 1 tables are locked before the level 2 tables below them.
+        let _guard = supports_block_desc(level).then(|| descs.lock());
+
+        for idx in first_idx..=last_idx {
+            let vaddr = table_vaddr + idx * entry_size;
+
+            if let Ok(Descriptor::Table(tbl_desc)) = parse_desc(load_desc(descs, idx), level) {
+                // Promote bottom-up, so that a fresh level 2 block can complete a level 1 run.
+                num_freed += self.promote_table(
+                    get_next_level_desc(&tbl_desc),
+                    &level.next(),
+                    vaddr,
+                    vaddr_rng,
+                    desc_alloc,
+                );
+                if self.promote_entry(descs, idx, level, vaddr, desc_alloc) {
+                    num_freed += 1;
+                }
+            }
+        }
+
+        num_freed
+    }
+
+    fn install_page_descs<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &mut ParsedMemoryMap,
+        desc_alloc: &DescAlloc,
+        mmap: &MemoryMap,
+    ) -> Result<()> {
+        self.reserve_tables(
+            map.virt_addr,
+            &TRANSLATION_LEVELS[..TRANSLATION_LEVELS.len() - 1],
+            desc_alloc,
+        )?;
+        let mut descs = &self.root;
+        let mut _guard = None;
+
+        for level in TRANSLATION_LEVELS {
+            let idx = map.virt_addr.get_idx_for_level(level);
+            if *level == AddressTranslationLevel::Two {
+                match descs.lock_live() {
+                    Some(live) => _guard = Some(live),
+                    None => return self.install_page_descs(map, desc_alloc, mmap),
+                }
+            }
+            let desc = load_desc(descs, idx);
+
+            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+                Descriptor::Table(tbl_desc) => {
+                    assert_ne!(level, &AddressTranslationLevel::Three);
+                    descend_tbl_desc(tbl_desc, &mut descs);
+                }
+                Descriptor::Block(_) | Descriptor::Page(_) => {
+                    return Err(Error::VMMapExists(*mmap))
+                }
+
+                Descriptor::Invalid => {
+                    match level {
+                        // We need to insert only Page Descriptor.
+                        // Until we reach level 3, insert Table Descriptors.
+                        AddressTranslationLevel::Zero
+                        | AddressTranslationLevel::One
+                        | AddressTranslationLevel::Two => {
+                            let tbl_desc = self
+                                .install_tbl_desc(descs, idx, level, desc_alloc)?
+                                .ok_or(Error::VMMapExists(*mmap))?;
+                            descend_tbl_desc(tbl_desc, &mut descs);
+                        }
+                        AddressTranslationLevel::Three => {
+                            install_contigious_mappings(
+                                map,
+                                idx,
+                                descs,
+                                PAGE_SIZE,
+                                &|output_address, attributes| {
+                                    new_stage1_page_desc(output_address, attributes)
+                                },
+                            );
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    fn install_l2_block_desc<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &mut ParsedMemoryMap,
+        desc_alloc: &DescAlloc,
+        mmap: &MemoryMap,
+    ) -> Result<()> {
+        self.reserve_tables(
+            map.virt_addr,
+            &TRANSLATION_LEVELS[..TRANSLATION_LEVELS.len() - 2],
+            desc_alloc,
+        )?;
+        let mut descs = &self.root;
+        let mut _guard = None;
+
+        for level in TRANSLATION_LEVELS {
+            let idx = map.virt_addr.get_idx_for_level(level);
+            if *level == AddressTranslationLevel::Two {
+                match descs.lock_live() {
+                    Some(live) => _guard = Some(live),
+                    None => return self.install_l2_block_desc(map, desc_alloc, mmap),
+                }
+            }
+            let desc = load_desc(descs, idx);
+
+            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+                Descriptor::Table(tbl_desc) => {
+                    assert_ne!(level, &AddressTranslationLevel::Three);
+                    descend_tbl_desc(tbl_desc, &mut descs);
+                }
+                Descriptor::Block(_) => return Err(Error::VMMapExists(*mmap)),
+                Descriptor::Page(_) => return Err(Error::CorruptedTranslationTable(desc)),
+
+                Descriptor::Invalid => {
+                    // We need to insert only Level 2 Block Descriptor.
+                    // Until we reach level 2, insert Table Descriptors.
+                    match level {
+                        AddressTranslationLevel::Zero | AddressTranslationLevel::One => {
+                            let tbl_desc = self
+                                .install_tbl_desc(descs, idx, level, desc_alloc)?
+                                .ok_or(Error::VMMapExists(*mmap))?;
+                            descend_tbl_desc(tbl_desc, &mut descs);
+                        }
+                        AddressTranslationLevel::Two => {
+                            install_contigious_mappings(
+                                map,
+                                idx,
+                                descs,
+                                L2_BLOCK_SIZE,
+                                &|output_address, attributes| {
+                                    new_stage1_block_desc(
+                                        BlockDescLevel::Two,
+                                        output_address,
+                                        attributes,
+                                    )
+                                },
+                            );
+                            break;
+                        }
+                        AddressTranslationLevel::Three => {
+                            return Err(Error::CorruptedTranslationTable(desc))
+                        }
+                    }
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    fn install_l1_block_desc<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        map: &mut ParsedMemoryMap,
+        desc_alloc: &DescAlloc,
+        mmap: &MemoryMap,
+    ) -> Result<()> {
+        self.reserve_tables(
+            map.virt_addr,
+            &TRANSLATION_LEVELS[..TRANSLATION_LEVELS.len().saturating_sub(3)],
+            desc_alloc,
+        )?;
+        let mut descs = &self.root;
+        let mut _guard = None;
+
+        for level in TRANSLATION_LEVELS {
+            let idx = map.virt_addr.get_idx_for_level(level);
+            if *level == AddressTranslationLevel::One {
+                _guard = Some(descs.lock());
+            }
+            let desc = load_desc(descs, idx);
+
+            match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+                Descriptor::Table(tbl_desc) => {
+                    assert_ne!(level, &AddressTranslationLevel::Three);
+                    descend_tbl_desc(tbl_desc, &mut descs);
+                }
+                Descriptor::Block(_) => {
+                    if *level == AddressTranslationLevel::One {
+                        return Err(Error::VMMapExists(*mmap));
+                    } else {
+                        return Err(Error::CorruptedTranslationTable(desc));
+                    }
+                }
+                Descriptor::Page(_) => return Err(Error::CorruptedTranslationTable(desc)),
+                Descriptor::Invalid => {
+                    // We need to insert only Level 1 Block Descriptor.
+                    // Until we reach level 1, insert Table Descriptors.
+                    match level {
+                        AddressTranslationLevel::Zero => {
+                            let tbl_desc =
+                                install_new_tbl_desc(&self.tables, desc_alloc, descs, idx)?
+                                    .ok_or(Error::VMMapExists(*mmap))?;
+                            descend_tbl_desc(tbl_desc, &mut descs);
+                        }
+                        AddressTranslationLevel::One => {
+                            install_contigious_mappings(
+                                map,
+                                idx,
+                                descs,
+                                L1_BLOCK_SIZE,
+                                &|output_address, attributes| {
+                                    new_stage1_block_desc(
+                                        BlockDescLevel::One,
+                                        output_address,
+                                        attributes,
+                                    )
+                                },
+                            );
+                            break;
+                        }
+                        AddressTranslationLevel::Two | AddressTranslationLevel::Three => {
+                            return Err(Error::CorruptedTranslationTable(desc))
+                        }
+                    }
+                }
+            }
+        }
+
+        Ok(())
+    }
+}
+
+pub enum TraverseYield<'tt> {
+    PhysicalBlock(PhysicalBlockOverlapInfo<'tt>),
+    /// Table left empty and unlinked by the traversal. Lookups by other threads could still
+    /// be walking it, so `unmap` retires it instead of freeing it right away.
+    UnusedMemory(NonNull<u8>),
+}
+
+/// Information about a physical block.
+pub struct PhysicalBlockOverlapInfo<'tt> {
+    /// Range of physical block, that contains the overlap.
+    phy_block: PhysicalAddress,
+    vaddr: VirtualAddress,
+    size: u32,
+
+    /// Offest within the above `phy_block`, which ovelaps the provided VA space.
+    overlap: Range<u32>,
+    level: AddressTranslationLevel,
+
+    /// Table holding the descriptor of this block at `idx`.
+    descs: &'tt DescriptorTable,
+    idx: usize,
+    /// Whether the contiguous run (if any) this block is part of, lies entirely in the
+    /// provided VA space.
+    run_overlapped: bool,
+}
+
+impl<'tt> PhysicalBlockOverlapInfo<'tt> {
+    fn new(
+        iter: &TraverseIterator<'tt>,
+        paddr: PhysicalAddress,
+        vaddr: VirtualAddress,
+        level: &AddressTranslationLevel,
+        descs: &'tt DescriptorTable,
+        idx: usize,
+    ) -> Self {
+        let block_size = get_vaddr_spacing_per_entry(level);
+        let run_size = block_size * get_contiguous_run_len(level);
+        let run_start = vaddr - vaddr.align_offset(run_size);
+        let run_end = run_start + run_size;
+        let phy_start = paddr;
+        let vaddr_start = vaddr;
+        let vaddr_end = vaddr_start + block_size;
+        let va_space_overlap_start = max(vaddr_start, iter.va_rng.start);
+        let va_space_overlap_end = min(vaddr_end, iter.va_rng.end);
+
+        Self {
+            phy_block: phy_start,
+            vaddr: vaddr_start,
+            size: block_size as u32,
+            overlap: (va_space_overlap_start - vaddr_start) as u32
+                ..(va_space_overlap_end - vaddr_start) as u32,
+            level: *level,
+            descs,
+            idx,
+            run_overlapped: iter.va_rng.start <= run_start && run_end <= iter.va_rng.end,
+        }
+    }
+
+    pub fn phy_block(&self) -> Range<PhysicalAddress> {
+        self.phy_block..self.phy_block + self.size as usize
+    }
+
+    pub fn vaddr(&self) -> VirtualAddress {
+        self.vaddr
+    }
+
+    /// Memory the references to the mapped memory are counted for (see `parse_ref_block`).
+    fn ref_block(&self) -> Range<PhysicalAddress> {
+        parse_ref_block(load_desc(self.descs, self.idx), &self.level)
+    }
+
+    pub fn size(&self) -> usize {
+        self.size as usize
+    }
+
+    pub fn overlapping_range(&self) -> &Range<u32> {
+        &self.overlap
+    }
+
+    pub fn non_overlapping_range(&self) -> (Range<u32>, Range<u32>) {
+        (0..self.overlap.start, self.overlap.end..self.size)
+    }
+
+    pub fn remove_overlapping_range<DescAlloc: PhysicalPageAllocator>(
+        &mut self,
+        tt: &TranslationTable,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        self.unmap_overlapping_range(tt, desc_alloc)?;
+        tlb::invalidate_range(self.overlapping_vaddr_range(), tt.tlb_scope());
+        Ok(())
+    }
+
+    fn overlaps_whole_block(&self) -> bool {
+        self.overlap == (0..self.size)
+    }
+
+    fn overlapping_vaddr_range(&self) -> Range<VirtualAddress> {
+        self.vaddr + self.overlap.start as usize..self.vaddr + self.overlap.end as usize
+    }
+
+    /// Overlapping part of the block, as an extent of its own.
+    fn extent(&self) -> Extent {
+        let desc = load_desc(self.descs, self.idx);
+        // Blocks and pages differ only in the descriptor type.
+        let attributes = Stage1LastLevelDescriptor::new(parse_attributes(desc, self.phy_block));
+        attributes.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE::CLEAR);
+
+        Extent {
+            virt_addr: self.vaddr + self.overlap.start as usize,
+            phy_addr: self.phy_block + self.overlap.start as usize,
+            len: (self.overlap.end - self.overlap.start) as usize,
+            access_perms: parse_mapped_access_perms(desc),
+            memory_kind: parse_memory_kind(&Stage1LastLevelDescriptor::new(desc)),
+            attributes: attributes.get(),
+        }
+    }
+
+    /// Same as `remove_overlapping_range`, but TLB maintenance for the overlapping range
+    /// is left to the caller.
+    fn unmap_overlapping_range<DescAlloc: PhysicalPageAllocator>(
+        &mut self,
+        tt: &TranslationTable,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        // Physical Block:
+        // [..........MMMM...........]
+        // [A         B  C          D]
+        // first_range = [A, B)
+        // overlapping_range = [B, C)
+        // last_range = [C, D)
+        let (first_rng, last_rng) = self.non_overlapping_range();
+
+        // Rest of the contiguous run stays mapped, but cannot be hinted as contiguous anymore.
+        if !self.run_overlapped {
+            break_contiguous_run(
+                self.descs,
+                self.idx,
+                &self.level,
+                self.vaddr,
+                tt.tlb_scope(),
+            );
+        }
+
+        let whole_block = first_rng.is_empty() && last_rng.is_empty();
+        let desc = load_desc(self.descs, self.idx);
+        if whole_block {
+            // Drop the reference held by this address space (or page of a block), unless it's
+            // the last one.
+            let ref_paddr = self.ref_block().start;
+            if (read_swuse(desc) & SWUSE_SHARED != 0 || is_block_piece(desc, &self.level))
+                && desc_alloc.is_shared(ref_paddr)
+            {
+                desc_alloc.unshare(ref_paddr);
+            }
+        } else if read_swuse(desc) & SWUSE_SHARED != 0 {
+            // Pieces of a split block cannot be reference counted on their own.
+            tt.make_leaf_private(
+                self.descs,
+                self.idx,
+                &self.level,
+                self.vaddr,
+                false,
+                desc_alloc,
+            )?;
+        }
+
+        if whole_block {
+            store_desc(self.descs, self.idx, INVALID_DESCRIPTOR);
+            tt.walk_cache.invalidate();
+            return Ok(());
+        }
+
+        // Otherwise, the block is split in place into a table of the next level, which maps
+        // [A, B) and [C, D) with identical attributes and leaves [B, C) unmapped.
+        let tbl_desc = split_block_desc(
+            load_desc(self.descs, self.idx),
+            &self.level,
+            self.vaddr,
+            &self.overlapping_vaddr_range(),
+            &|_| INVALID_DESCRIPTOR,
+            &tt.tables,
+            desc_alloc,
+        )?;
+
+        // Break-before-make: The table is fully built by now, so the block stays unmapped
+        // only for the duration of TLB maintenance.
+        store_desc(self.descs, self.idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(self.vaddr..self.vaddr + self.size(), tt.tlb_scope());
+        store_desc(self.descs, self.idx, tbl_desc);
+        tt.walk_cache.invalidate();
+
+        Ok(())
+    }
+
+    /// Change the access permissions of the overlapping range to `access_perms`, in place.
+    /// Block partially overlapping the range is split, into a table mapping the rest of it as
+    /// is. TLB maintenance for the overlapping range is left to the caller.
+    fn protect_overlapping_range<DescAlloc: PhysicalPageAllocator>(
+        &self,
+        tt: &TranslationTable,
+        access_perms: &AccessPermissions,
+        desc_alloc: &DescAlloc,
+    ) -> Result<()> {
+        let desc = load_desc(self.descs, self.idx);
+        let new_desc = with_access_perms(desc, access_perms);
+        if new_desc == desc {
+            return Ok(());
+        }
+
+        // Rest of the run keeps its permissions, so cannot be hinted as contiguous anymore.
+        if !self.run_overlapped {
+            break_contiguous_run(
+                self.descs,
+                self.idx,
+                &self.level,
+                self.vaddr,
+                tt.tlb_scope(),
+            );
+        }
+
+        // Only the permissions change, so no break-before-make is needed.
+        if self.overlaps_whole_block() {
+            store_desc(
+                self.descs,
+                self.idx,
+                with_access_perms(load_desc(self.descs, self.idx), access_perms),
+            );
+            return Ok(());
+        }
+
+        // Pieces of a split block cannot be reference counted on their own.
+        if read_swuse(desc) & SWUSE_SHARED != 0 {
+            tt.make_leaf_private(
+                self.descs,
+                self.idx,
+                &self.level,
+                self.vaddr,
+                false,
+                desc_alloc,
+            )?;
+        }
+
+        let tbl_desc = split_block_desc(
+            load_desc(self.descs, self.idx),
+            &self.level,
+            self.vaddr,
+            &self.overlapping_vaddr_range(),
+            &|desc| with_access_perms(desc, access_perms),
+            &tt.tables,
+            desc_alloc,
+        )?;
+
+        // Break-before-make, as a block is replaced with a table.
+        store_desc(self.descs, self.idx, INVALID_DESCRIPTOR);
+        tlb::invalidate_range(self.vaddr..self.vaddr + self.size(), tt.tlb_scope());
+        store_desc(self.descs, self.idx, tbl_desc);
+        tt.walk_cache.invalidate();
+
+        Ok(())
+    }
+}
+
+/// Max. no of freed tables (and pages/blocks) held by `UnmapGather`, before it is flushed.
+const UNMAP_GATHER_MAX_TABLES: usize = 32;
+
+/// Batches the TLB maintenance and freeing of translation tables during an unmap.
+/// Tables (and unmapped memory) cannot be freed, until no TLB could be holding a walk
+/// through them (or a translation to it). Tables are then retired, as walks by other
+/// threads could still be in them (see `TranslationTable::retire_table`).
+struct UnmapGather<'a, DescAlloc: PhysicalPageAllocator> {
+    tt: &'a TranslationTable,
+    desc_alloc: &'a DescAlloc,
+    vaddr_rng: Option<Range<VirtualAddress>>,
+    tables: Vec<NonNull<u8>, UNMAP_GATHER_MAX_TABLES>,
+    blocks: Vec<Range<PhysicalAddress>, UNMAP_GATHER_MAX_TABLES>,
+}
+
+impl<'a, DescAlloc: PhysicalPageAllocator> UnmapGather<'a, DescAlloc> {
+    fn new(tt: &'a TranslationTable, desc_alloc: &'a DescAlloc) -> Self {
+        Self {
+            tt,
+            desc_alloc,
+            vaddr_rng: None,
+            tables: Vec::new(),
+            blocks: Vec::new(),
+        }
+    }
+
+    fn add_range(&mut self, vaddr_rng: Range<VirtualAddress>) {
+        self.vaddr_rng = Some(match self.vaddr_rng.take() {
+            Some(rng) => min(rng.start, vaddr_rng.start)..max(rng.end, vaddr_rng.end),
+            None => vaddr_rng,
+        });
+    }
+
+    fn add_table(&mut self, table: NonNull<u8>) {
+        if self.tables.is_full() {
+            self.flush();
+        }
+        self.tables
+            .push(table)
+            .unwrap_or_else(|_| bug!("UnmapGather tables size exceeded"));
+    }
+
+    fn add_block(&mut self, block: Range<PhysicalAddress>) {
+        if self.blocks.is_full() {
+            self.flush();
+        }
+        self.blocks
+            .push(block)
+            .unwrap_or_else(|_| bug!("UnmapGather blocks size exceeded"));
+    }
+
+    fn flush(&mut self) {
+        // Walks through a freed table may be cached for any VA it spans, not just for the
+        // ones that were unmapped. So, freeing tables needs all the entries of this address
+        // space to be invalidated.
+        match self.vaddr_rng.take() {
+            _ if !self.tables.is_empty() => tlb::invalidate(self.tt.tlb_scope()),
+            Some(vaddr_rng) => tlb::invalidate_range(vaddr_rng, self.tt.tlb_scope()),
+            None => {}
+        }
+
+        for table in self.tables.iter() {
+            self.tt.retire_table(unsafe { table.cast().as_ref() });
+        }
+        if !self.tables.is_empty() {
+            self.tt.reclaim_tables(self.desc_alloc);
+        }
+        self.tables.clear();
+
+        for block in self.blocks.iter() {
+            let size = (block.end - block.start) as usize;
+            let layout = Layout::from_size_align(size, size)
+                .unwrap_or_else(|_| bug!("Block Layout Mismatch"));
+            let ptr = NonNull::new(block.start.as_raw_ptr() as *mut u8)
+                .unwrap_or_else(|| bug!("null block"));
+
+            unsafe { self.desc_alloc.deallocate(ptr, layout) };
+        }
+        self.blocks.clear();
+    }
+}
+
+impl<'a, DescAlloc: PhysicalPageAllocator> Drop for UnmapGather<'a, DescAlloc> {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+type Stash<'tt> = Vec<&'tt DescriptorTable, MAX_TRANSLATION_LEVELS>;
+
+#[derive(Clone, Copy)]
+enum IterState {
+    Load,
+    Step,
+    MoveRight,
+    Halt,
+}
+
+pub struct TraverseIterator<'tt> {
+    root: &'tt DescriptorTable,
+    walk_cache: &'tt WalkCache,
+    va_rng: Range<VirtualAddress>,
+    va_space_explored: VirtualAddress,
+
+    empty_descs: Vec<NonNull<u8>, MAX_TRANSLATION_LEVELS>,
+    stash: Stash<'tt>,
+
+    /// Tables of this level (or below) left empty are unlinked and handed out, if any.
+    free_empty_descs: Option<AddressTranslationLevel>,
+    state: Result<IterState>,
+}
+
+impl<'tt> Iterator for TraverseIterator<'tt> {
+    type Item = Result<TraverseYield<'tt>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if let Some(empty_desc) = self.empty_descs.pop() {
+            return Some(Ok(TraverseYield::UnusedMemory(empty_desc)));
+        }
+
+        match self.fetch_block() {
+            FetchBlockResult::Block(pbo_info) => Some(Ok(TraverseYield::PhysicalBlock(pbo_info))),
+            FetchBlockResult::Err(e) => Some(Err(e)),
+            // Tables freed while ascending out of the last block, must still be handed out.
+            FetchBlockResult::None => self
+                .empty_descs
+                .pop()
+                .map(|empty_desc| Ok(TraverseYield::UnusedMemory(empty_desc))),
+        }
+    }
+}
+
+enum FetchBlockResult<'tt> {
+    Block(PhysicalBlockOverlapInfo<'tt>),
+    Err(Error),
+    None,
+}
+
+impl<'tt> TraverseIterator<'tt> {
+    fn new(
+        root: &'tt DescriptorTable,
+        walk_cache: &'tt WalkCache,
+        mut va_rng: Range<VirtualAddress>,
+        free_empty_descs: Option<AddressTranslationLevel>,
+    ) -> Self {
+        // Align start and end to page boundary.
+        va_rng.start.align_down(PAGE_SIZE);
+        va_rng.end.align_up(PAGE_SIZE);
+
+        let mut iter = TraverseIterator {
+            root,
+            walk_cache,
+            va_rng: va_rng.clone(),
+            free_empty_descs,
+            va_space_explored: VirtualAddress::new(0).unwrap(),
+            empty_descs: Vec::default(),
+            stash: Vec::default(),
+            state: Ok(IterState::Halt),
+        };
+
+        iter.begin();
+        iter
+    }
+
+    fn begin(&mut self) {
+        if self.va_rng.start >= self.va_rng.end {
+            return;
+        }
+
+        self.state = (|| -> Result<IterState> {
+            let mut descs = self.root;
+            let vaddr = self.va_rng.start;
+
+            for level in TRANSLATION_LEVELS.iter() {
+                let idx = vaddr.get_idx_for_level(level);
+                let desc = load_desc(descs, idx);
+
+                self.va_space_explored.set_idx_for_level(level, idx);
+                self.stash
+                    .push(descs)
+                    .unwrap_or_else(|_| bug!("stash size exceeded"));
+
+                match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+                    Descriptor::Table(child_descs) => {
+                        descs = TraverseIterator::descend(&child_descs, level, vaddr).0;
+                    }
+                    _ => break,
+                }
+            }
+            Ok(IterState::Load)
+        })();
+
+        assert!(self.va_space_explored < self.va_rng.end);
+    }
+
+    fn fetch_block(&mut self) -> FetchBlockResult<'tt> {
+        while !self.stash.is_empty() {
+            match self.state {
+                Ok(state) => match state {
+                    IterState::Load => {
+                        if let Some(pbo_info) = self.load_block() {
+                            self.state = Ok(IterState::MoveRight);
+                            return FetchBlockResult::Block(pbo_info);
+                        } else {
+                            self.state = Ok(IterState::Step);
+                        }
+                    }
+                    IterState::MoveRight => self.state = Ok(self.move_right()),
+                    IterState::Step => self.state = self.step(),
+                    IterState::Halt => break,
+                },
+                Err(e) => return FetchBlockResult::Err(e),
+            }
+        }
+
+        FetchBlockResult::None
+    }
+
+    fn step(&mut self) -> Result<IterState> {
+        assert!(!self.stash.is_empty());
+
+        let descs = *self
+            .stash
+            .last()
+            .unwrap_or_else(|| bug!("bug on load_block"));
+        let level = self.stash_level();
+        let idx = self.va_space_explored.get_idx_for_level(&level);
+
+        assert!(idx < NUM_TABLE_DESC_ENTRIES);
+        assert!(self.va_space_explored < self.va_rng.end);
+
+        let desc = load_desc(descs, idx as usize);
+        match parse_desc(desc, &level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+            Descriptor::Table(child_descs) => {
+                let child =
+                    TraverseIterator::descend(&child_descs, &level, self.va_space_explored).0;
+                self.stash
+                    .push(child)
+                    .unwrap_or_else(|_| bug!("stash size exceeded"));
+                return Ok(IterState::Load);
+            }
+            _ => return Ok(self.move_right()),
+        }
+    }
+
+    fn move_right(&mut self) -> IterState {
+        assert!(!self.stash.is_empty());
+
+        let descs = *self
+            .stash
+            .last()
+            .unwrap_or_else(|| bug!("bug on load_block"));
+        let level = self.stash_level();
+        let idx = self.va_space_explored.get_idx_for_level(&level);
+
+        assert!(idx < NUM_TABLE_DESC_ENTRIES);
+        assert!(self.va_space_explored < self.va_rng.end);
+
+        if self.find_next_valid_entry(descs, &level, idx + 1) {
+            return IterState::Load;
+        } else {
+            return self.move_up(descs, level);
+        }
+    }
+
+    fn move_up(&mut self, descs: &DescriptorTable, level: AddressTranslationLevel) -> IterState {
+        assert!(!self.stash.is_empty());
+
+        if self.va_space_explored >= self.va_rng.end {
+            while self.ascend() {
+                // Allow Empty descriptors to be visited and free'd
+            }
+            return IterState::Halt;
+        }
+
+        // Move up until, a valid entry can be found.
+        while self.ascend() {
+            let parent = *self
+                .stash
+                .last()
+                .unwrap_or_else(|| bug!("bug on load_block"));
+            let parent_level = self.stash_level();
+            let parent_idx = self.va_space_explored.get_idx_for_level(&parent_level);
+
+            if self.find_next_valid_entry(parent, &parent_level, parent_idx + 1) {
+                return IterState::Load;
+            }
+        }
+        IterState::Halt
+    }
+
+    fn ascend(&mut self) -> bool {
+        let level = self.stash_level();
+        let descs = self.stash.pop().unwrap_or_else(|| bug!("bug in ascend"));
+
+        self.free_descs_if_empty(descs, &level);
+        self.va_space_explored.clear_idx_for_level(&level);
+        !self.stash.is_empty()
+    }
+
+    /// Level of the table at the top of the stash.
+    fn stash_level(&self) -> AddressTranslationLevel {
+        AddressTranslationLevel::from(ROOT_TRANSLATION_LEVEL as usize + self.stash.len() - 1)
+    }
+
+    fn descend(
+        descs: &Stage1TableDescriptor,
+        level: &AddressTranslationLevel,
+        vaddr: VirtualAddress,
+    ) -> (&'tt DescriptorTable, usize) {
+        let child = get_next_level_desc(descs);
+        let child_level = level.next();
+        let child_idx = vaddr.get_idx_for_level(&child_level);
+
+        (child, child_idx)
+    }
+
+    fn load_block(&self) -> Option<PhysicalBlockOverlapInfo<'tt>> {
+        let descs = *self
+            .stash
+            .last()
+            .unwrap_or_else(|| bug!("bug on load_block"));
+        let level = self.stash_level();
+        let idx = self.va_space_explored.get_idx_for_level(&level);
+
+        let desc = load_desc(descs, idx as usize);
+        match parse_desc(desc, &level)
+            .map_err(|_| Error::CorruptedTranslationTable(desc))
+            .unwrap_or_else(|_| bug!("parsing verified descriptor failed"))
+        {
+            Descriptor::Block(_) | Descriptor::Page(_) => {
+                Some(self.create_phy_block_info(descs, &level, idx))
+            }
+            _ => None,
+        }
+    }
+
+    fn find_next_valid_entry(
+        &mut self,
+        descs: &DescriptorTable,
+        level: &AddressTranslationLevel,
+        idx: usize,
+    ) -> bool {
+        let num_entries = get_num_entries(level);
+        if idx >= num_entries {
+            return false;
+        }
+
+        // Runs of invalid entries are jumped over, instead of being scanned.
+        let (idx, found) = match descs.next_valid_idx(idx) {
+            Some(valid_idx) if valid_idx < num_entries => (valid_idx, true),
+            _ => (num_entries - 1, false),
+        };
+        self.va_space_explored.set_idx_for_level(level, idx);
+
+        found && self.va_space_explored < self.va_rng.end
+    }
+
+    fn free_descs_if_empty(&mut self, descs: &DescriptorTable, level: &AddressTranslationLevel) {
+        match self.free_empty_descs {
+            Some(min_level) if *level >= min_level && level != &ROOT_TRANSLATION_LEVEL => {}
+            _ => return,
+        }
+        if !descs.is_empty() {
+            return;
+        }
+
+        let parent_level = level.prev();
+        let parent = self.stash[parent_level as usize - ROOT_TRANSLATION_LEVEL as usize];
+        let parent_idx = self.va_space_explored.get_idx_for_level(&parent_level);
+
+        store_desc(parent, parent_idx, INVALID_DESCRIPTOR);
+        self.walk_cache.invalidate();
+        self.empty_descs
+            .push(NonNull::from(descs).cast())
+            .unwrap_or_else(|_| bug!("empty_descs size exceeded"));
+    }
+
+    fn create_phy_block_info(
+        &self,
+        descs: &'tt DescriptorTable,
+        level: &AddressTranslationLevel,
+        idx: usize,
+    ) -> PhysicalBlockOverlapInfo<'tt> {
+        assert!(self.va_space_explored < self.va_rng.end);
+
+        let ll_desc = Stage1LastLevelDescriptor::new(load_desc(descs, idx));
+        let paddr = parse_output_address(&ll_desc, level);
+
+        PhysicalBlockOverlapInfo::new(self, paddr, self.va_space_explored, level, descs, idx)
+    }
+}
+
+fn get_next_level_desc<'tt>(tbl_desc: &Stage1TableDescriptor) -> &'tt DescriptorTable {
+    let next_lvl_desc = read_next_level_desc(&tbl_desc);
+    assert_ne!(next_lvl_desc, 0);
+    unsafe { &*(next_lvl_desc as *mut DescriptorTable) }
+}
+
+fn read_next_level_desc(tbl_desc: &Stage1TableDescriptor) -> u64 {
+    tbl_desc.read(STAGE1_TABLE_DESCRIPTOR::NEXT_LEVEL_TABLE_ADDR) << NEXT_LEVEL_TABLE_ADDR_SHIFT
+}
+
+fn descend_tbl_desc(tbl_desc: Stage1TableDescriptor, descs: &mut &DescriptorTable) {
+    *descs = get_next_level_desc(&tbl_desc);
+}
+
+/// Install an empty table from `tables` at the invalid descriptor at `idx` of `descs`.
+///
+/// Tables are installed without locking: if another thread installs a descriptor first, the
+/// new table is recycled and the table installed by it is returned instead. Returns None, if
+/// it installed a block. Tables which blocks are installed in must be locked though (see
+/// `TranslationTable::install_tbl_desc`).
+fn install_new_tbl_desc<DescAlloc: PhysicalPageAllocator>(
+    tables: &TablePool,
+    desc_alloc: &DescAlloc,
+    descs: &DescriptorTable,
+    idx: usize,
+) -> Result<Option<Stage1TableDescriptor>> {
+    let tbl_desc = new_tbl_desc(tables, desc_alloc)?;
+
+    match cas_desc(descs, idx, INVALID_DESCRIPTOR, tbl_desc.get()) {
+        Ok(()) => Ok(Some(tbl_desc)),
+        Err(desc) => {
+            tables.free(desc_alloc, get_next_level_desc(&tbl_desc));
+
+            match to_raw_desc(desc) {
+                RawDescriptor::TableOrPage(desc) => Ok(Some(Stage1TableDescriptor::new(desc))),
+                _ => Ok(None),
+            }
+        }
+    }
+}
+
+/// Table descriptor pointing to an empty table from `tables`. The table is not installed.
+fn new_tbl_desc<DescAlloc: PhysicalPageAllocator>(
+    tables: &TablePool,
+    desc_alloc: &DescAlloc,
+) -> Result<Stage1TableDescriptor> {
+    let next_level_table = tables.alloc(desc_alloc)?.addr().get() as u64;
+    Ok(Stage1TableDescriptor::new(new_stage1_table_desc(
+        next_level_table,
+    )))
+}
+
+fn desc_table_layout() -> Layout {
+    Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
+        .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"))
+}
+
+/// Return `descs` to `desc_alloc`, bypassing the `TablePool`. Used only for tearing down
+/// a translation table, whose pool goes away with it.
+fn free_desc_table<DescAlloc: PhysicalPageAllocator>(
+    desc_alloc: &DescAlloc,
+    descs: &DescriptorTable,
+) {
+    unsafe { desc_alloc.deallocate(NonNull::from(descs).cast(), desc_table_layout()) };
+}
+
+/// Frees `descs` (a table of `level`) which was never installed, along with its child tables.
+fn free_unpublished_desc_table<DescAlloc: PhysicalPageAllocator>(
+    tables: &TablePool,
+    desc_alloc: &DescAlloc,
+    descs: &DescriptorTable,
+    level: &AddressTranslationLevel,
+) {
+    for idx in descs.valid_indices() {
+        if let Ok(Descriptor::Table(tbl_desc)) = parse_desc(load_desc(descs, idx), level) {
+            free_unpublished_desc_table(
+                tables,
+                desc_alloc,
+                get_next_level_desc(&tbl_desc),
+                &level.next(),
+            );
+        }
+    }
+    tables.free(desc_alloc, descs);
+}
+
+/// Free the tables below `descs` (a table of `level`) and the memory mapped by them (if
+/// `free_memory`), as described in `TranslationTable::destroy`. `descs` itself is left as is.
+fn destroy_table<DescAlloc: PhysicalPageAllocator>(
+    descs: &DescriptorTable,
+    level: &AddressTranslationLevel,
+    desc_alloc: &DescAlloc,
+    free_memory: bool,
+) {
+    for idx in descs.valid_indices() {
+        let desc = load_desc(descs, idx);
+
+        match parse_desc(desc, level) {
+            Ok(Descriptor::Table(tbl_desc)) => {
+                let next_level_descs = get_next_level_desc(&tbl_desc);
+                destroy_table(next_level_descs, &level.next(), desc_alloc, free_memory);
+                free_desc_table(desc_alloc, next_level_descs);
+            }
+            Ok(Descriptor::Block(_) | Descriptor::Page(_)) => {
+                release_leaf_desc(desc, level, desc_alloc, free_memory)
+            }
+            _ => {}
+        }
+    }
+}
+
+/// Drop the reference to the memory mapped by the block/page descriptor `desc` (at `level`)
+/// of a table being destroyed, freeing the memory if `free_memory` and it's the last one.
+fn release_leaf_desc<DescAlloc: PhysicalPageAllocator>(
+    desc: u64,
+    level: &AddressTranslationLevel,
+    desc_alloc: &DescAlloc,
+    free_memory: bool,
+) {
+    let block = parse_ref_block(desc, level);
+    let paddr = block.start;
+
+    if desc_alloc.is_shared(paddr) {
+        // Drop the reference held by this address space (or page of a block), unless it's
+        // the last one.
+        if read_swuse(desc) & SWUSE_SHARED != 0 || is_block_piece(desc, level) {
+            desc_alloc.unshare(paddr);
+        }
+    } else if free_memory {
+        let size = (block.end - block.start) as usize;
+        let layout =
+            Layout::from_size_align(size, size).unwrap_or_else(|_| bug!("Block Layout Mismatch"));
+        let ptr = NonNull::new(paddr.as_raw_ptr() as *mut u8).unwrap_or_else(|| bug!("null block"));
+
+        unsafe { desc_alloc.deallocate(ptr, layout) };
+    }
+}
+
+/// Copy the mappings in `src` (a table of `level`) into `dst`, sharing the mapped memory
+/// as described in `TranslationTable::fork`. Tables below `src` are copied too.
+fn fork_table<DescAlloc: PhysicalPageAllocator>(
+    src: &DescriptorTable,
+    dst: &DescriptorTable,
+    level: &AddressTranslationLevel,
+    tables: &TablePool,
+    desc_alloc: &DescAlloc,
+) -> Result<()> {
+    for idx in src.valid_indices() {
+        let desc = load_desc(src, idx);
+
+        match parse_desc(desc, level).map_err(|_| Error::CorruptedTranslationTable(desc))? {
+            Descriptor::Table(tbl_desc) => {
+                let dst_tbl_desc = install_new_tbl_desc(tables, desc_alloc, dst, idx)?
+                    .unwrap_or_else(|| bug!("Forked table is updated concurrently"));
+                fork_table(
+                    get_next_level_desc(&tbl_desc),
+                    get_next_level_desc(&dst_tbl_desc),
+                    &level.next(),
+                    tables,
+                    desc_alloc,
+                )?;
+            }
+            Descriptor::Block(_) | Descriptor::Page(_) => {
+                // Only permissions are reduced, so no break-before-make is needed.
+                let desc = share_leaf_desc(desc, level, desc_alloc);
+                store_desc(src, idx, desc);
+                store_desc(dst, idx, desc);
+            }
+            Descriptor::Invalid => {}
+        }
+    }
+
+    Ok(())
+}
+
+/// Undo a partial `fork_table` into `descs` (a table of `level`): references to the shared
+/// memory are dropped and the tables below `descs` are freed.
+fn release_forked_table<DescAlloc: PhysicalPageAllocator>(
+    descs: &DescriptorTable,
+    level: &AddressTranslationLevel,
+    desc_alloc: &DescAlloc,
+) {
+    for idx in descs.valid_indices() {
+        let desc = load_desc(descs, idx);
+
+        match parse_desc(desc, level) {
+            Ok(Descriptor::Table(tbl_desc)) => {
+                let next_level_descs = get_next_level_desc(&tbl_desc);
+                release_forked_table(next_level_descs, &level.next(), desc_alloc);
+                free_desc_table(desc_alloc, next_level_descs);
+            }
+            Ok(Descriptor::Block(_) | Descriptor::Page(_))
+                if read_swuse(desc) & SWUSE_SHARED != 0 =>
+            {
+                let paddr = parse_ref_block(desc, level).start;
+                if desc_alloc.is_shared(paddr) {
+                    desc_alloc.unshare(paddr);
+                }
+            }
+            _ => {}
+        }
+    }
+}
+
+/// Block/page descriptor `desc` (at `level`), as it's mapped by both the address spaces
+/// sharing it after a fork.
+/// User mappings of normal memory get another reference and the writable ones are write
+/// protected. Kernel and device mappings aren't reference counted, so are left as is.
+fn share_leaf_desc<DescAlloc: PhysicalPageAllocator>(
+    desc: u64,
+    level: &AddressTranslationLevel,
+    desc_alloc: &DescAlloc,
+) -> u64 {
+    if !is_user_memory_desc(desc) {
+        return desc;
+    }
+
+    desc_alloc.share(parse_ref_block(desc, level).start);
+    with_sharing(desc)
+}
+
+/// Build a table of `level + 1` equivalent to the block descriptor `block_desc` at `level`
+/// (mapping `block_vaddr`), with the descriptors of the mappings within `split_rng` replaced
+/// by `in_range` (ex: left out for an unmap). Entries partially overlapping `split_rng` are
+/// split further. Returns the table descriptor pointing to the new table.
+/// The table is not installed.
+fn split_block_desc<DescAlloc, InRange>(
+    block_desc: u64,
+    level: &AddressTranslationLevel,
+    block_vaddr: VirtualAddress,
+    split_rng: &Range<VirtualAddress>,
+    in_range: &InRange,
+    tables: &TablePool,
+    desc_alloc: &DescAlloc,
+) -> Result<u64>
+where
+    DescAlloc: PhysicalPageAllocator,
+    InRange: Fn(u64) -> u64,
+{
+    let next_level = level.next();
+    let entry_size = get_vaddr_spacing_per_entry(&next_level);
+    let paddr = parse_output_address(&Stage1LastLevelDescriptor::new(block_desc), level);
+    let attributes = parse_attributes(block_desc, paddr);
+
+    let tbl_desc = new_tbl_desc(tables, desc_alloc)?;
+    let descs = get_next_level_desc(&tbl_desc);
+    let mut num_mapped = 0;
+
+    for idx in 0..NUM_TABLE_DESC_ENTRIES {
+        let vaddr = block_vaddr + idx * entry_size;
+        let output_address = (paddr + idx * entry_size).as_raw_ptr() as u64;
+        let desc = match next_level {
+            AddressTranslationLevel::Three => new_stage1_page_desc(output_address, attributes),
+            _ => new_stage1_block_desc(
+                BlockDescLevel::from(&next_level),
+                output_address,
+                attributes,
+            ),
+        };
+
+        let new_desc = if split_rng.end <= vaddr || vaddr + entry_size <= split_rng.start {
+            desc
+        } else if split_rng.start <= vaddr && vaddr + entry_size <= split_rng.end {
+            in_range(desc)
+        } else {
+            let res = split_block_desc(
+                desc,
+                &next_level,
+                vaddr,
+                split_rng,
+                in_range,
+                tables,
+                desc_alloc,
+            );
+            match res {
+                Ok(tbl_desc) => tbl_desc,
+                Err(e) => {
+                    free_unpublished_desc_table(tables, desc_alloc, descs, &next_level);
+                    return Err(e);
+                }
+            }
+        };
+        if new_desc != INVALID_DESCRIPTOR {
+            num_mapped += 1;
+        }
+        store_desc(descs, idx, new_desc);
+    }
+
+    // Pages of an allocated block hold a reference each to it, the block's own included.
+    if is_block_piece(block_desc, &next_level) {
+        for _ in 1..num_mapped {
+            desc_alloc.share(paddr);
+        }
+    }
+
+    Ok(tbl_desc.get())
+}
+
+/// Block descriptor at `level`, equivalent to all the mappings in `descs` (of `level + 1`).
+/// Returns None, if the mappings aren't contiguous in PA, aligned to the block size and
+/// identical in attributes.
+fn find_promoted_block_desc(
+    descs: &DescriptorTable,
+    level: &AddressTranslationLevel,
+) -> Option<u64> {
+    let next_level = level.next();
+    let entry_size = get_vaddr_spacing_per_entry(&next_level);
+    let mut block = None;
+
+    if !descs.is_full() {
+        return None;
+    }
+
+    for idx in 0..NUM_TABLE_DESC_ENTRIES {
+        let desc = load_desc(descs, idx);
+
+        match parse_desc(desc, &next_level) {
+            Ok(Descriptor::Page(_) | Descriptor::Block(_)) => {}
+            _ => return None,
+        }
+
+        // Shared memory is reference counted per page (or block), so must stay as is. So do
+        // allocated blocks (and their pages), so that they're freed as allocated.
+        if read_swuse(desc) & (SWUSE_SHARED | SWUSE_BLOCK) != 0 {
+            return None;
+        }
+
+        let paddr = parse_output_address(&Stage1LastLevelDescriptor::new(desc), &next_level);
+        let attributes = parse_attributes(desc, paddr);
+
+        match block {
+            None if paddr.align_offset(get_vaddr_spacing_per_entry(level)) == 0 => {
+                block = Some((paddr, attributes))
+            }
+            Some((block_paddr, block_attributes))
+                if paddr == block_paddr + idx * entry_size && attributes == block_attributes => {}
+            _ => return None,
+        }
+    }
+
+    let (paddr, attributes) = block?;
+    Some(new_stage1_block_desc(
+        BlockDescLevel::from(level),
+        paddr.as_raw_ptr() as u64,
+        attributes,
+    ))
+}
+
+/// Whether `pages` (slots of a level 3 table, along with their PA) fill an entire contiguous
+/// run, with PA contiguous and aligned to the run size.
+fn is_contiguous_page_run(pages: &[(usize, PhysicalAddress)]) -> bool {
+    let (first_idx, first_paddr) = match pages.first() {
+        Some(page) => *page,
+        None => return false,
+    };
+
+    pages.len() == PAGE_RUN_LEN
+        && first_idx % PAGE_RUN_LEN == 0
+        && first_paddr.is_aligned(PAGE_RUN_LEN * PAGE_SIZE)
+        && pages
+            .iter()
+            .enumerate()
+            .all(|(i, (_, paddr))| *paddr == first_paddr + i * PAGE_SIZE)
+}
+
+/// Attributes shared by the pages mapped in all the slots of `descs` (a level 3 table).
+/// Returns None, if any of the slots is unmapped, shared, part of a block (see `SWUSE_BLOCK`)
+/// or differs in attributes.
+/// Clean and dirty pages (see `TranslationTable::clear_dirty`) differ in attributes too.
+fn find_collapsible_attributes(descs: &DescriptorTable) -> Option<u64> {
+    let mut attributes = None;
+
+    if !descs.is_full() {
+        return None;
+    }
+
+    for idx in 0..NUM_TABLE_DESC_ENTRIES {
+        let desc = load_desc(descs, idx);
+
+        match parse_desc(desc, &AddressTranslationLevel::Three) {
+            Ok(Descriptor::Page(_)) if read_swuse(desc) & !SWUSE_WRITABLE == 0 => {}
+            _ => return None,
+        }
+
+        let paddr = parse_output_address(
+            &Stage1LastLevelDescriptor::new(desc),
+            &AddressTranslationLevel::Three,
+        );
+        let page_attributes = parse_attributes(desc, paddr);
+
+        match attributes {
+            None => attributes = Some(page_attributes),
+            Some(attributes) if attributes == page_attributes => {}
+            _ => return None,
+        }
+    }
+
+    attributes
+}
+
+/// `descs` must be locked (a level 3 table, by locking the level 2 table above it), so that
+/// no table gets installed in the descriptors meanwhile.
+fn install_contigious_mappings<F: Fn(u64, u64) -> u64>(
+    map: &mut ParsedMemoryMap,
+    idx: usize,
+    descs: &DescriptorTable,
+    page_size: usize,
+    new_stage1_descriptor: &F,
+) {
+    let mut paddr = map.phy_addr.as_raw_ptr() as u64;
+    let num_mapped_pages = core::cmp::min(map.num_pages, NUM_TABLE_DESC_ENTRIES - idx);
+    for i in 0..num_mapped_pages {
+        assert_eq!(load_desc(descs, idx + i), INVALID_DESCRIPTOR);
+        let desc = new_stage1_descriptor(paddr, map.attributes);
+        store_desc(descs, idx + i, desc);
+        paddr += page_size as u64;
+    }
+    map.phy_addr += num_mapped_pages * page_size;
+    map.virt_addr += num_mapped_pages * page_size;
+    map.num_pages -= num_mapped_pages;
+}
+
+#[derive(Debug, Clone, Copy)]
+enum ContiguousSpan {
+    /// Number of Pages (4KiB with 4KiB granule)
+    Pages(usize),
+    /// Number of contiguous runs of Pages (64KiB with 4KiB granule)
+    PageRuns(usize),
+    /// Number of Level 2 Blocks (2MiB with 4KiB granule)
+    L2Blocks(usize),
+    /// Number of contiguous runs of Level 2 Blocks (32MiB with 4KiB granule)
+    L2BlockRuns(usize),
+    /// Number of Level 1 Blocks (1GiB with 4KiB granule)
+    L1Blocks(usize),
+}
+
+impl ContiguousSpan {
+    /// Size of each of the units counted by the span. Also its alignment.
+    const fn unit_size(&self) -> usize {
+        match self {
+            ContiguousSpan::Pages(_) => PAGE_SIZE,
+            ContiguousSpan::PageRuns(_) => {
+                PAGE_SIZE * get_contiguous_run_len(&AddressTranslationLevel::Three)
+            }
+            ContiguousSpan::L2Blocks(_) => L2_BLOCK_SIZE,
+            ContiguousSpan::L2BlockRuns(_) => {
+                L2_BLOCK_SIZE * get_contiguous_run_len(&AddressTranslationLevel::Two)
+            }
+            ContiguousSpan::L1Blocks(_) => L1_BLOCK_SIZE,
+        }
+    }
+
+    fn with_count(&self, count: usize) -> Self {
+        match self {
+            ContiguousSpan::Pages(_) => ContiguousSpan::Pages(count),
+            ContiguousSpan::PageRuns(_) => ContiguousSpan::PageRuns(count),
+            ContiguousSpan::L2Blocks(_) => ContiguousSpan::L2Blocks(count),
+            ContiguousSpan::L2BlockRuns(_) => ContiguousSpan::L2BlockRuns(count),
+            ContiguousSpan::L1Blocks(_) => ContiguousSpan::L1Blocks(count),
+        }
+    }
+}
+
+/// Kinds of spans usable with the granule, largest first.
+const SPAN_KINDS: &[ContiguousSpan] = match supports_block_desc(&AddressTranslationLevel::One) {
+    true => &[
+        ContiguousSpan::L1Blocks(0),
+        ContiguousSpan::L2BlockRuns(0),
+        ContiguousSpan::L2Blocks(0),
+        ContiguousSpan::PageRuns(0),
+        ContiguousSpan::Pages(0),
+    ],
+    false => &[
+        ContiguousSpan::L2BlockRuns(0),
+        ContiguousSpan::L2Blocks(0),
+        ContiguousSpan::PageRuns(0),
+        ContiguousSpan::Pages(0),
+    ],
+};
+const MAX_MAPPING_SPANS: usize = max_mapping_spans(SPAN_KINDS.len());
+
+#[derive(Default)]
+struct MappingScheme {
+    spans: Vec<ContiguousSpan, MAX_MAPPING_SPANS>,
+}
+
+fn find_best_mapping_scheme_impl(
+    scheme: &mut MappingScheme,
+    vaddr: VirtualAddress,
+    paddr: PhysicalAddress,
+    size: usize,
+    level: usize,
+) {
+    if size == 0 {
+        return;
+    }
+
+    fn align_offset<A: Address>(a: A, align: usize) -> usize {
+        let offset = a.align_offset(align);
+        if offset != 0 {
+            align - offset
+        } else {
+            0
+        }
+    }
+
+    let span_kind = SPAN_KINDS[level];
+    let align = span_kind.unit_size();
+    let va_offset = align_offset(vaddr, align);
+    let pa_offset = align_offset(paddr, align);
+
+    if va_offset == pa_offset && size > pa_offset && size - pa_offset >= align {
+        let current_span_paddr = PhysicalAddress::new(paddr.align_up(align));
+        let current_span_size = {
+            let span_end =
+                PhysicalAddress::new((current_span_paddr + size - pa_offset).align_down(align));
+            (span_end - current_span_paddr) as usize
+        };
+        assert_ne!(current_span_size, 0);
+
+        find_best_mapping_scheme_impl(scheme, vaddr, paddr, pa_offset, level + 1);
+
+        let page_count = current_span_size / align;
+        if page_count != 0 {
+            scheme
+                .spans
+                .push(span_kind.with_count(page_count))
+                .unwrap_or_else(|_| bug!("spans limit reached"));
+        }
+
+        find_best_mapping_scheme_impl(
+            scheme,
+            VirtualAddress::new(vaddr.align_up(align))
+                .unwrap_or_else(|_| bug!("bug in constructing aligned virtual address"))
+                + current_span_size,
+            current_span_paddr + current_span_size,
+            size - current_span_size - pa_offset,
+            level + 1,
+        );
+    } else {
+        find_best_mapping_scheme_impl(scheme, vaddr, paddr, size, level + 1);
+    }
+}
+
+fn find_best_mapping_scheme(
+    vaddr: VirtualAddress,
+    paddr: PhysicalAddress,
+    size: usize,
+) -> MappingScheme {
+    assert!(vaddr.is_aligned(GRANULE_SIZE));
+    assert!(paddr.is_aligned(GRANULE_SIZE));
+
+    let mut scheme = MappingScheme::default();
+
+    find_best_mapping_scheme_impl(&mut scheme, vaddr, paddr, size, 0);
+    scheme
+}
+
+pub struct TranslationDesc {
+    virt_addr: VirtualAddress,
+    phy_addr: PhysicalAddress,
+    access_perms: AccessPermissions,
+    memory_kind: MemoryKind,
+}
+
+impl TranslationDesc {
+    pub fn virtual_address(&self) -> VirtualAddress {
+        self.virt_addr
+    }
+
+    pub fn physical_address(&self) -> PhysicalAddress {
+        self.phy_addr
+    }
+
+    pub fn access_permissions(&self) -> AccessPermissions {
+        self.access_perms
+    }
+
+    pub fn memory_kind(&self) -> &MemoryKind {
+        &self.memory_kind
+    }
+}
+
+/// Run of mappings contiguous in both VA and PA, with identical attributes.
+/// See `TranslationTable::extents`.
+#[derive(Debug, Clone)]
+pub struct Extent {
+    virt_addr: VirtualAddress,
+    phy_addr: PhysicalAddress,
+    len: usize,
+    access_perms: AccessPermissions,
+    memory_kind: MemoryKind,
+    /// Everything other than the output address, in the descriptors of the mappings.
+    attributes: u64,
+}
+
+impl Extent {
+    pub fn virtual_address(&self) -> VirtualAddress {
+        self.virt_addr
+    }
+
+    pub fn physical_address(&self) -> PhysicalAddress {
+        self.phy_addr
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn access_permissions(&self) -> AccessPermissions {
+        self.access_perms
+    }
+
+    pub fn memory_kind(&self) -> &MemoryKind {
+        &self.memory_kind
+    }
+
+    /// Whether `next` continues this extent.
+    fn is_followed_by(&self, next: &Extent) -> bool {
+        self.virt_addr + self.len == next.virt_addr
+            && self.phy_addr + self.len == next.phy_addr
+            && self.attributes == next.attributes
+    }
+}
+
+/// Tables below an entry of the level below the root, handed out by
+/// `TranslationTable::into_subtrees`.
+pub struct Subtree {
+    descs: NonNull<DescriptorTable>,
+    level: AddressTranslationLevel,
+    free_memory: bool,
+}
+
+// Tables of a subtree aren't reachable from anywhere else, once it's handed out.
+unsafe impl Send for Subtree {}
+
+/// Iterator over the subtrees of a table being torn down (see
+/// `TranslationTable::into_subtrees`). Subtrees not taken yet are destroyed on drop, along
+/// with the rest of the table.
+pub struct IntoSubtrees<'a, DescAlloc: PhysicalPageAllocator> {
+    tt: TranslationTable,
+    desc_alloc: &'a DescAlloc,
+    free_memory: bool,
+    /// Next index in the root table.
+    root_idx: usize,
+    /// Table of the level below the root, whose subtrees are being handed out and the next
+    /// index in it.
+    upper: Option<(&'a DescriptorTable, usize)>,
+}
+
+impl<DescAlloc: PhysicalPageAllocator> Iterator for IntoSubtrees<'_, DescAlloc> {
+    type Item = Subtree;
+
+    fn next(&mut self) -> Option<Subtree> {
+        let upper_level = ROOT_TRANSLATION_LEVEL.next();
+
+        loop {
+            if let Some((descs, idx)) = self.upper {
+                match descs.next_valid_idx(idx) {
+                    Some(idx) => {
+                        self.upper = Some((descs, idx + 1));
+                        let desc = load_desc(descs, idx);
+
+                        match parse_desc(desc, &upper_level) {
+                            Ok(Descriptor::Table(tbl_desc)) => {
+                                return Some(Subtree {
+                                    descs: NonNull::from(get_next_level_desc(&tbl_desc)),
+                                    level: upper_level.next(),
+                                    free_memory: self.free_memory,
+                                });
+                            }
+                            Ok(Descriptor::Block(_) | Descriptor::Page(_)) => release_leaf_desc(
+                                desc,
+                                &upper_level,
+                                self.desc_alloc,
+                                self.free_memory,
+                            ),
+                            _ => {}
+                        }
+                    }
+                    None => {
+                        free_desc_table(self.desc_alloc, descs);
+                        self.upper = None;
+                    }
+                }
+                continue;
+            }
+
+            let idx = self.tt.root.next_valid_idx(self.root_idx)?;
+            self.root_idx = idx + 1;
+            let desc = load_desc(&self.tt.root, idx);
+
+            match parse_desc(desc, &ROOT_TRANSLATION_LEVEL) {
+                Ok(Descriptor::Table(tbl_desc)) => {
+                    self.upper = Some((get_next_level_desc(&tbl_desc), 0))
+                }
+                Ok(Descriptor::Block(_) | Descriptor::Page(_)) => release_leaf_desc(
+                    desc,
+                    &ROOT_TRANSLATION_LEVEL,
+                    self.desc_alloc,
+                    self.free_memory,
+                ),
+                _ => {}
+            }
+        }
+    }
+}
+
+impl<DescAlloc: PhysicalPageAllocator> Drop for IntoSubtrees<'_, DescAlloc> {
+    fn drop(&mut self) {
+        while let Some(subtree) = self.next() {
+            subtree.destroy(self.desc_alloc);
+        }
+    }
+}
+
+impl Subtree {
+    /// Free the tables of the subtree and the memory mapped by them (see
+    /// `TranslationTable::into_subtrees`).
+    pub fn destroy<DescAlloc: PhysicalPageAllocator>(self, desc_alloc: &DescAlloc) {
+        let descs = unsafe { self.descs.as_ref() };
+
+        destroy_table(descs, &self.level, desc_alloc, self.free_memory);
+        free_desc_table(desc_alloc, descs);
+    }
+}
+
+struct ParsedMemoryMap {
+    /// Page Aligned
+    phy_addr: PhysicalAddress,
+    /// Page Aligned
+    virt_addr: VirtualAddress,
+    num_pages: usize,
+    attributes: u64,
+}
+
+fn parse_memory_map(map: &MemoryMap) -> ParsedMemoryMap {
+    match map {
+        MemoryMap::Normal(desc) => ParsedMemoryMap {
+            phy_addr: desc.physical_address(),
+            virt_addr: desc.virtual_address(),
+            num_pages: desc.num_pages(),
+            attributes: parse_map_attrs(
+                &desc.access_permissions(),
+                MemoryKind::Normal,
+                desc.virtual_address(),
+            ),
+        },
+        MemoryMap::Device(desc) => ParsedMemoryMap {
+            phy_addr: desc.physical_address(),
+            virt_addr: desc.virtual_address(),
+            num_pages: desc.num_pages(),
+            attributes: parse_map_attrs(
+                &desc.access_permissions(),
+                MemoryKind::Device,
+                desc.virtual_address(),
+            ),
+        },
+    }
+}
+
+/// Attributes of a block/page descriptor mapping `vaddr` (and the rest of the mapping).
+fn parse_map_attrs(ap: &AccessPermissions, device: MemoryKind, vaddr: VirtualAddress) -> u64 {
+    let page_desc = Stage1PageDescriptor::new(0);
+    let el1_rw = ap.contains(AccessPermissions::EL1_READ | AccessPermissions::EL1_WRITE);
+    let el0_rw = ap.contains(AccessPermissions::EL0_READ | AccessPermissions::EL0_WRITE);
+    let el1_ro = ap.contains(AccessPermissions::EL1_READ);
+    let el0_ro = ap.contains(AccessPermissions::EL0_READ);
+
+    if el1_rw {
+        if el0_rw {
+            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RW_EL1_EL0)
+        } else {
+            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RW_EL1)
+        }
+    } else if el1_ro {
+        if el0_ro {
+            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RO_EL1_EL0)
+        } else {
+            page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AP::RO_EL1)
+        }
+    }
+
+    if ap.contains(AccessPermissions::EL1_WRITE) || !ap.contains(AccessPermissions::EL1_EXECUTE) {
+        page_desc.modify(STAGE1_PAGE_DESCRIPTOR::PXN::SET);
+    }
+    if ap.contains(AccessPermissions::EL0_WRITE) || !ap.contains(AccessPermissions::EL0_EXECUTE) {
+        page_desc.modify(STAGE1_PAGE_DESCRIPTOR::UXN::SET);
+    }
+
+    // Mappings in the lower VA range (TTBR0) are private to an address space, so tag them with
+    // its ASID. Even the ones accessible only from EL1: otherwise, their TLB entries would
+    // survive switching to another address space, mapping the same VA elsewhere.
+    if matches!(vaddr.get_ttbr_select(), TTBR::Zero) {
+        page_desc.modify(STAGE1_PAGE_DESCRIPTOR::NG::True);
+    }
+
+    match device {
+        MemoryKind::Normal => page_desc.modify(STAGE1_PAGE_DESCRIPTOR::SH::InnerShareable),
+        MemoryKind::Device => page_desc.modify(STAGE1_PAGE_DESCRIPTOR::SH::OuterShareable),
+    }
+
+    // New mappings start out accessed. Otherwise, the first access to each of them would
+    // take an Access Flag fault, unless the MMU manages the flag.
+    page_desc.modify(STAGE1_PAGE_DESCRIPTOR::AF::True);
+
+    page_desc.get()
+}
+
+enum Descriptor {
+    Table(Stage1TableDescriptor),
+    Block(Stage1BlockDescriptor),
+    Page(Stage1PageDescriptor),
+    Invalid,
+}
+
+enum RawDescriptor {
+    TableOrPage(u64),
+    Block(Stage1BlockDescriptor),
     Invalid,
 }
 
-fn parse_desc(
-    desc_val: u64,
-    level: &AddressTranslationLevel,
-) -> core::result::Result<Descriptor, Descriptor> {
-    match to_raw_desc(desc_val) {
-        RawDescriptor::TableOrPage(desc_val) => {
-            if level == &AddressTranslationLevel::Three {
-                // PageDescriptors can be present only in last level (3).
-                Ok(Descriptor::Page(Stage1PageDescriptor::new(desc_val)))
-            } else {
-                // TableDescriptors can appear at any level other than last level (3).
-                Ok(Descriptor::Table(Stage1TableDescriptor::new(desc_val)))
+fn parse_desc(
+    desc_val: u64,
+    level: &AddressTranslationLevel,
+) -> core::result::Result<Descriptor, Descriptor> {
+    match to_raw_desc(desc_val) {
+        RawDescriptor::TableOrPage(desc_val) => {
+            if level == &AddressTranslationLevel::Three {
+                // PageDescriptors can be present only in last level (3).
+                Ok(Descriptor::Page(Stage1PageDescriptor::new(desc_val)))
+            } else {
+                // TableDescriptors can appear at any level other than last level (3).
+                Ok(Descriptor::Table(Stage1TableDescriptor::new(desc_val)))
+            }
+        }
+        RawDescriptor::Block(block_desc) => {
+            // Block Descriptors can be present only in levels 1 (4KiB granule) and 2.
+            if supports_block_desc(level) {
+                Ok(Descriptor::Block(block_desc))
+            } else {
+                Err(Descriptor::Block(block_desc))
+            }
+        }
+        // Invalid Descriptors can appear anywhere.
+        RawDescriptor::Invalid => Ok(Descriptor::Invalid),
+    }
+}
+
+fn to_raw_desc(value: u64) -> RawDescriptor {
+    // Table and Page descriptors both have bits [0:1] set to 0b11.
+    // Only way they can be distinguished is at which level they appear.
+    // So, treat them as same.
+    let tbl_desc = Stage1TableDescriptor::new(value);
+    if tbl_desc
+        .matches_all(STAGE1_TABLE_DESCRIPTOR::VALID::SET + STAGE1_TABLE_DESCRIPTOR::TYPE::Table)
+    {
+        return RawDescriptor::TableOrPage(value);
+    }
+
+    let block_desc = Stage1BlockDescriptor::new(value);
+    if block_desc
+        .matches_all(STAGE1_BLOCK_DESCRIPTOR::VALID::SET + STAGE1_BLOCK_DESCRIPTOR::TYPE::Block)
+    {
+        return RawDescriptor::Block(block_desc);
+    }
+
+    RawDescriptor::Invalid
+}
+
+fn parse_output_address(
+    ll_desc: &Stage1LastLevelDescriptor,
+    level: &AddressTranslationLevel,
+) -> PhysicalAddress {
+    match level {
+        AddressTranslationLevel::Zero => bug!("unexpected level for parse_output_address"),
+        AddressTranslationLevel::One | AddressTranslationLevel::Two => {
+            assert!(!ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE));
+        }
+        AddressTranslationLevel::Three => {
+            assert!(ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE));
+        }
+    }
+
+    PhysicalAddress::new(
+        (ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR) << DESC_OUTPUT_ADDR_SHIFT)
+            as usize,
+    )
+}
+
+/// Offset of `vaddr` within the block (or page) mapped at `level`.
+fn get_block_offset(vaddr: VirtualAddress, level: &AddressTranslationLevel) -> usize {
+    match level {
+        AddressTranslationLevel::Zero => bug!("unexpected level for get_block_offset"),
+        _ => vaddr.align_offset(get_vaddr_spacing_per_entry(level)),
+    }
+}
+
+/// Everything other than the output address `paddr` in a block/page descriptor.
+/// Contiguous hint is dropped, as it's a property of the run the descriptor is part of.
+/// Access flag is set, so that descriptors differing only in their age have the same
+/// attributes, and the ones rebuilt from them start out accessed.
+fn parse_attributes(desc: u64, paddr: PhysicalAddress) -> u64 {
+    // Output address bits hold exactly `paddr`.
+    let attributes = Stage1LastLevelDescriptor::new(without_contiguous_hint(
+        desc & !(paddr.as_raw_ptr() as u64),
+    ));
+    attributes.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::AF::True);
+    attributes.get()
+}
+
+fn read_swuse(desc: u64) -> u64 {
+    Stage1LastLevelDescriptor::new(desc).read(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE)
+}
+
+/// Block/page descriptor (or attributes) `desc`, tagged as mapping (a page of) a block
+/// allocated as a whole (see `SWUSE_BLOCK`).
+fn with_block_tag(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(read_swuse(desc) | SWUSE_BLOCK));
+    ll_desc.get()
+}
+
+fn without_block_tag(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(read_swuse(desc) & !SWUSE_BLOCK));
+    ll_desc.get()
+}
+
+/// Whether block/page descriptor `desc` (at `level`) maps a page of a level 2 block allocated
+/// as a whole (see `SWUSE_BLOCK`).
+fn is_block_piece(desc: u64, level: &AddressTranslationLevel) -> bool {
+    *level == AddressTranslationLevel::Three && read_swuse(desc) & SWUSE_BLOCK != 0
+}
+
+/// Memory the references to the memory mapped by block/page descriptor `desc` (at `level`)
+/// are counted for (see `PhysicalPageAllocator::share`), and freed as: the block a page was
+/// split from, or the mapped memory itself.
+fn parse_ref_block(desc: u64, level: &AddressTranslationLevel) -> Range<PhysicalAddress> {
+    let paddr = parse_output_address(&Stage1LastLevelDescriptor::new(desc), level);
+
+    match is_block_piece(desc, level) {
+        true => {
+            let block = PhysicalAddress::new(paddr.align_down(L2_BLOCK_SIZE));
+            block..block + L2_BLOCK_SIZE
+        }
+        false => paddr..paddr + get_vaddr_spacing_per_entry(level),
+    }
+}
+
+/// Block/page descriptor `desc`, as it's mapped when it's private to an address space.
+/// Write access to a copy-on-write mapping is restored.
+fn without_sharing(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    let swuse = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE);
+
+    if swuse & SWUSE_COW != 0 {
+        let ap = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
+        ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::AP.val(ap & !AP_READ_ONLY));
+    }
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(swuse & !(SWUSE_SHARED | SWUSE_COW)));
+
+    ll_desc.get()
+}
+
+/// Block/page descriptor (or attributes) `desc`, as it's mapped when it's shared with other
+/// address spaces. Writable mappings are write protected, until made private (copy-on-write).
+/// Copy made on a write is dirty, so clean mappings just become copy-on-write.
+fn with_sharing(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    let ap = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
+    let mut swuse = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE) | SWUSE_SHARED;
+
+    if ap & AP_READ_ONLY == 0 || swuse & SWUSE_WRITABLE != 0 {
+        swuse = (swuse | SWUSE_COW) & !SWUSE_WRITABLE;
+        ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::AP.val(ap | AP_READ_ONLY));
+    }
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(swuse));
+
+    ll_desc.get()
+}
+
+/// Block/page descriptor `desc`, as it's mapped once written. Write access to a clean
+/// mapping (see `TranslationTable::clear_dirty`) is restored.
+fn without_write_tracking(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    let swuse = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE);
+
+    if swuse & SWUSE_WRITABLE != 0 {
+        let ap = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
+        ll_desc.modify(
+            STAGE1_LAST_LEVEL_DESCRIPTOR::AP.val(ap & !AP_READ_ONLY)
+                + STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(swuse & !SWUSE_WRITABLE),
+        );
+    }
+
+    ll_desc.get()
+}
+
+/// Block/page descriptor `desc`, with its access permissions changed to `access_perms`.
+/// The mapping stays global (or not) as it was mapped. Shared mappings made writable become
+/// copy-on-write and clean ones stay write protected, until written.
+fn with_access_perms(desc: u64, access_perms: &AccessPermissions) -> u64 {
+    // Only permissions are taken from these, so the VA (deciding nG) doesn't matter.
+    let perms = Stage1LastLevelDescriptor::new(parse_map_attrs(
+        access_perms,
+        MemoryKind::Normal,
+        VirtualAddress::new(0).unwrap_or_else(|_| bug!("Invalid VA")),
+    ));
+    let swuse = read_swuse(desc);
+    let mut ap = perms.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
+    let mut new_swuse = swuse & !(SWUSE_COW | SWUSE_WRITABLE);
+
+    if swuse & SWUSE_WRITABLE != 0 && ap & AP_READ_ONLY == 0 {
+        ap |= AP_READ_ONLY;
+        new_swuse |= SWUSE_WRITABLE;
+    }
+
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    ll_desc.modify(
+        STAGE1_LAST_LEVEL_DESCRIPTOR::AP.val(ap)
+            + STAGE1_LAST_LEVEL_DESCRIPTOR::UXN.val(perms.read(STAGE1_LAST_LEVEL_DESCRIPTOR::UXN))
+            + STAGE1_LAST_LEVEL_DESCRIPTOR::PXN.val(perms.read(STAGE1_LAST_LEVEL_DESCRIPTOR::PXN))
+            + STAGE1_LAST_LEVEL_DESCRIPTOR::SWUSE.val(new_swuse),
+    );
+
+    match swuse & SWUSE_SHARED != 0 {
+        true => with_sharing(ll_desc.get()),
+        false => ll_desc.get(),
+    }
+}
+
+/// Whether block/page descriptor `desc` maps normal memory private to an address space (i.e
+/// mapped in the lower VA range, see `parse_map_attrs`).
+/// Kernel (TTBR1) and device mappings aren't reference counted or tracked.
+fn is_user_memory_desc(desc: u64) -> bool {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+
+    ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::NG)
+        && !ll_desc.matches_all(STAGE1_LAST_LEVEL_DESCRIPTOR::SH::OuterShareable)
+}
+
+fn with_contiguous_hint(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::Contiguous::True);
+    ll_desc.get()
+}
+
+fn without_contiguous_hint(desc: u64) -> u64 {
+    let ll_desc = Stage1LastLevelDescriptor::new(desc);
+    ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::Contiguous::False);
+    ll_desc.get()
+}
+
+/// Clear the contiguous hint from the run the descriptor at `idx` (mapping `vaddr` at `level`)
+/// is part of, in the TLB entries of `scope`. Must be done before any descriptor in the run is
+/// changed.
+fn break_contiguous_run(
+    descs: &DescriptorTable,
+    idx: usize,
+    level: &AddressTranslationLevel,
+    vaddr: VirtualAddress,
+    scope: tlb::Scope,
+) {
+    let ll_desc = Stage1LastLevelDescriptor::new(load_desc(descs, idx));
+    if !ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::Contiguous) {
+        return;
+    }
+
+    let entry_size = get_vaddr_spacing_per_entry(level);
+    let run_len = get_contiguous_run_len(level);
+    let run_idx = idx - idx % run_len;
+    let run_vaddr = vaddr - (idx - run_idx) * entry_size;
+
+    // Break-before-make: TLBs could be holding a single entry for the whole run.
+    // Entries are invalidated by clearing just the VALID bit, so that they can be restored.
+    for idx in run_idx..run_idx + run_len {
+        let ll_desc = Stage1LastLevelDescriptor::new(load_desc(descs, idx));
+        ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::VALID::False);
+        store_desc(descs, idx, ll_desc.get());
+    }
+    tlb::invalidate_range(run_vaddr..run_vaddr + run_len * entry_size, scope);
+    for idx in run_idx..run_idx + run_len {
+        let ll_desc =
+            Stage1LastLevelDescriptor::new(without_contiguous_hint(load_desc(descs, idx)));
+        ll_desc.modify(STAGE1_LAST_LEVEL_DESCRIPTOR::VALID::True);
+        store_desc(descs, idx, ll_desc.get());
+    }
+}
+
+/// Access permissions of the mapping described by block/page descriptor `desc`.
+/// Copy-on-write and clean mappings are reported as writable.
+fn parse_mapped_access_perms(desc: u64) -> AccessPermissions {
+    parse_access_perms(&Stage1LastLevelDescriptor::new(without_write_tracking(
+        without_sharing(desc),
+    )))
+}
+
+fn parse_memory_kind(ll_desc: &Stage1LastLevelDescriptor) -> MemoryKind {
+    if ll_desc.matches_all(STAGE1_LAST_LEVEL_DESCRIPTOR::SH::OuterShareable) {
+        MemoryKind::Device
+    } else {
+        MemoryKind::Normal
+    }
+}
+
+fn parse_access_perms(ll_desc: &Stage1LastLevelDescriptor) -> AccessPermissions {
+    use STAGE1_LAST_LEVEL_DESCRIPTOR::AP::Value as AP;
+
+    let mut access_perms = match ll_desc.read_as_enum(STAGE1_LAST_LEVEL_DESCRIPTOR::AP) {
+        Some(AP::RW_EL1_EL0) => {
+            AccessPermissions::EL1_READ
+                | AccessPermissions::EL1_WRITE
+                | AccessPermissions::EL0_READ
+                | AccessPermissions::EL0_WRITE
+        }
+        Some(AP::RW_EL1) => AccessPermissions::EL1_READ | AccessPermissions::EL1_WRITE,
+        Some(AP::RO_EL1_EL0) => AccessPermissions::EL1_READ | AccessPermissions::EL0_READ,
+        Some(AP::RO_EL1) => AccessPermissions::EL1_READ,
+        None => bug!("Invalid Access Permissions on page"),
+    };
+
+    if !ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::PXN)
+        && !access_perms.contains(AccessPermissions::EL1_WRITE)
+    {
+        access_perms |= AccessPermissions::EL1_EXECUTE;
+    }
+    if !ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::UXN)
+        && !access_perms.contains(AccessPermissions::EL0_WRITE)
+    {
+        access_perms |= AccessPermissions::EL0_EXECUTE;
+    }
+
+    access_perms
+}
+
+fn new_stage1_table_desc(next_level_addr: u64) -> u64 {
+    let table_desc = Stage1TableDescriptor::new(0);
+
+    assert_ne!(next_level_addr, 0);
+    assert_eq!(
+        next_level_addr & ((1 << NEXT_LEVEL_TABLE_ADDR_SHIFT) - 1),
+        0
+    );
+
+    table_desc.modify(STAGE1_TABLE_DESCRIPTOR::VALID::True + STAGE1_TABLE_DESCRIPTOR::TYPE::Table);
+    table_desc.modify(
+        STAGE1_TABLE_DESCRIPTOR::NEXT_LEVEL_TABLE_ADDR
+            .val(next_level_addr >> NEXT_LEVEL_TABLE_ADDR_SHIFT),
+    );
+
+    table_desc.get()
+}
+
+fn new_stage1_page_desc(output_address: u64, attributes: u64) -> u64 {
+    let page_desc = Stage1PageDescriptor::new(attributes);
+
+    assert_eq!(output_address & (PAGE_SIZE as u64 - 1), 0);
+
+    page_desc.modify(STAGE1_PAGE_DESCRIPTOR::VALID::True + STAGE1_PAGE_DESCRIPTOR::TYPE::Page);
+    page_desc
+        .modify(STAGE1_PAGE_DESCRIPTOR::OUTPUT_ADDR.val(output_address >> DESC_OUTPUT_ADDR_SHIFT));
+
+    page_desc.get()
+}
+
+enum BlockDescLevel {
+    One,
+    Two,
+}
+
+impl BlockDescLevel {
+    fn from(level: &AddressTranslationLevel) -> Self {
+        match level {
+            AddressTranslationLevel::One if supports_block_desc(level) => Self::One,
+            AddressTranslationLevel::Two => Self::Two,
+            _ => bug!("Wrong Level used for constructing a Block Descriptor"),
+        }
+    }
+}
+
+fn new_stage1_block_desc(level: BlockDescLevel, output_address: u64, attributes: u64) -> u64 {
+    let block_desc = Stage1BlockDescriptor::new(attributes);
+
+    block_desc.modify(STAGE1_BLOCK_DESCRIPTOR::VALID::True + STAGE1_BLOCK_DESCRIPTOR::TYPE::Block);
+
+    let block_size = match level {
+        BlockDescLevel::One => L1_BLOCK_SIZE,
+        BlockDescLevel::Two => L2_BLOCK_SIZE,
+    };
+    assert_eq!(output_address & (block_size as u64 - 1), 0);
+    block_desc
+        .modify(STAGE1_BLOCK_DESCRIPTOR::OUTPUT_ADDR.val(output_address >> DESC_OUTPUT_ADDR_SHIFT));
+
+    block_desc.get()
+}
+
+const fn max_mapping_spans(num_aligns: usize) -> usize {
+    if num_aligns == 0 {
+        0
+    } else {
+        1 + 2 * max_mapping_spans(num_aligns - 1)
+    }
+}
+
+fn load_desc(descs: &DescriptorTable, idx: usize) -> u64 {
+    descs.descs[idx].load(Ordering::Acquire)
+}
+
+/// Update the descriptor at `idx`, along with the record of valid descriptors of `descs`.
+fn store_desc(descs: &DescriptorTable, idx: usize, desc: u64) {
+    let old_desc = descs.descs[idx].swap(desc, Ordering::AcqRel);
+    update_occupancy(descs, idx, old_desc, desc);
+}
+
+/// Update the descriptor at `idx` to `desc`, only if it's still `current`.
+/// Returns the descriptor found instead, otherwise.
+fn cas_desc(
+    descs: &DescriptorTable,
+    idx: usize,
+    current: u64,
+    desc: u64,
+) -> core::result::Result<(), u64> {
+    descs.descs[idx].compare_exchange(current, desc, Ordering::AcqRel, Ordering::Acquire)?;
+    update_occupancy(descs, idx, current, desc);
+    Ok(())
+}
+
+fn update_occupancy(descs: &DescriptorTable, idx: usize, old_desc: u64, desc: u64) {
+    let is_valid =
+        |desc| Stage1LastLevelDescriptor::new(desc).is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::VALID);
+    let occupancy = &descs.occupancy;
+    let word = &occupancy.bitmap[idx / u64::BITS as usize];
+    let bit = 1 << (idx % u64::BITS as usize);
+
+    match (is_valid(old_desc), is_valid(desc)) {
+        (false, true) => {
+            word.fetch_or(bit, Ordering::Relaxed);
+            occupancy.num_valid.fetch_add(1, Ordering::Relaxed);
+        }
+        (true, false) => {
+            word.fetch_and(!bit, Ordering::Relaxed);
+            occupancy.num_valid.fetch_sub(1, Ordering::Relaxed);
+        }
+        _ => {}
+    }
+}
+
+#[cfg(test)]
+pub(super) mod tests {
+    extern crate std;
+
+    use core::{
+        alloc::{AllocError, Allocator, Layout},
+        cell::{Cell, RefCell},
+        cmp::min,
+        mem::size_of,
+        ops::Range,
+        ptr::NonNull,
+        sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+    };
+    use rand::{
+        distributions::{Distribution, Uniform},
+        seq::SliceRandom,
+        thread_rng, Rng,
+    };
+    use rayon::prelude::*;
+    use std::{collections::HashMap, vec, vec::Vec};
+    use tock_registers::interfaces::Readable;
+
+    use crate::{
+        address::{
+            Address, AddressTranslationLevel, PhysicalAddress, VirtualAddress,
+            ROOT_TRANSLATION_LEVEL,
+        },
+        bug,
+        error::Error,
+        mmu::{
+            dma::{release_sg_list, DmaConstraints, DmaSegment},
+            translation_table::{
+                ContiguousSpan, DescriptorTable, TableUsage, TranslationTable, TraverseYield,
+                NUM_TABLE_DESC_ENTRIES, TRANSLATION_LEVELS,
+            },
+            utils::{get_contiguous_run_len, get_vaddr_spacing_per_entry, supports_block_desc},
+            GRANULE_SIZE, OUTPUT_ADDR_BITS, TRANSLATION_TABLE_DESC_ALIGN,
+        },
+        vm::{AccessPermissions, MapDesc, MemoryKind, MemoryMap, PhysicalPageAllocator},
+    };
+
+    use super::{
+        find_best_mapping_scheme, get_next_level_desc, load_desc, new_stage1_page_desc, parse_desc,
+        parse_memory_map, read_swuse, store_desc, Descriptor, Stage1LastLevelDescriptor,
+        AP_READ_ONLY, INVALID_DESCRIPTOR, L1_BLOCK_SIZE, L2_BLOCK_SIZE, PAGE_SIZE,
+        STAGE1_LAST_LEVEL_DESCRIPTOR, SUBTREE_LEVEL, SWUSE_COW,
+    };
+
+    const PAGE_RUN_LEN: usize = get_contiguous_run_len(&AddressTranslationLevel::Three);
+    const L2_BLOCK_RUN_LEN: usize = get_contiguous_run_len(&AddressTranslationLevel::Two);
+    const PAGE_RUN_SIZE: usize = PAGE_RUN_LEN * PAGE_SIZE;
+    const L2_BLOCK_RUN_SIZE: usize = L2_BLOCK_RUN_LEN * L2_BLOCK_SIZE;
+
+    /// No. of pages and level 2 blocks mapped by the generated memory maps (per parent region).
+    const TEST_ENTRIES: usize = match NUM_TABLE_DESC_ENTRIES < 512 {
+        true => NUM_TABLE_DESC_ENTRIES,
+        false => 512,
+    };
+    /// No. of level 1 block sized regions mapped by the generated memory maps.
+    /// Tests map these regions with pages too, so with larger granules (where the level 1
+    /// regions are huge), the count is capped to keep the level 3 tables within 1GiB.
+    const TEST_L1_ENTRIES: usize = {
+        const MAX_L3_TABLES_SIZE: usize = 1024 * 1024 * 1024;
+        const L3_TABLES_SIZE_PER_L1: usize = L1_BLOCK_SIZE / L2_BLOCK_SIZE * GRANULE_SIZE;
+
+        match MAX_L3_TABLES_SIZE / L3_TABLES_SIZE_PER_L1 < 512 {
+            true => MAX_L3_TABLES_SIZE / L3_TABLES_SIZE_PER_L1,
+            false => 512,
+        }
+    };
+
+    /// Level upto which a fully mapped table gets promoted.
+    const PROMOTED_LEVEL: AddressTranslationLevel =
+        match supports_block_desc(&AddressTranslationLevel::One) {
+            true => AddressTranslationLevel::One,
+            false => AddressTranslationLevel::Two,
+        };
+
+    #[derive(Default)]
+    pub(in crate::mmu) struct TestAllocator {
+        pub(in crate::mmu) mem: RefCell<HashMap<*mut u8, Layout>>,
+        /// No. of references added by `share`, for each shared page.
+        pub(in crate::mmu) refs: RefCell<HashMap<usize, usize>>,
+        /// Age of each page, that went unaccessed for at least one aging scan.
+        pub(in crate::mmu) ages: RefCell<HashMap<usize, u8>>,
+    }
+
+    unsafe impl Allocator for TestAllocator {
+        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+            let ptr = unsafe { std::alloc::alloc(layout) };
+            self.mem.borrow_mut().insert(ptr, layout);
+            unsafe {
+                Ok(NonNull::slice_from_raw_parts(
+                    NonNull::new_unchecked(ptr),
+                    layout.size(),
+                ))
+            }
+        }
+
+        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+            let ptr = ptr.addr().get() as *mut u8;
+            self.mem.borrow_mut().remove(&ptr);
+            self.ages.borrow_mut().remove(&(ptr as usize));
+            unsafe { std::alloc::dealloc(ptr, layout) };
+        }
+    }
+
+    impl Drop for TestAllocator {
+        fn drop(&mut self) {
+            for (ptr, layout) in self.mem.borrow().iter() {
+                unsafe { std::alloc::dealloc(*ptr, *layout) };
+            }
+        }
+    }
+
+    impl PhysicalPageAllocator for TestAllocator {
+        fn share(&self, paddr: PhysicalAddress) {
+            *self
+                .refs
+                .borrow_mut()
+                .entry(paddr.as_raw_ptr())
+                .or_default() += 1;
+        }
+
+        fn unshare(&self, paddr: PhysicalAddress) {
+            let mut refs = self.refs.borrow_mut();
+            let count = refs
+                .get_mut(&paddr.as_raw_ptr())
+                .unwrap_or_else(|| bug!("{paddr} is not shared"));
+
+            *count -= 1;
+            if *count == 0 {
+                refs.remove(&paddr.as_raw_ptr());
+            }
+        }
+
+        fn is_shared(&self, paddr: PhysicalAddress) -> bool {
+            self.refs.borrow().contains_key(&paddr.as_raw_ptr())
+        }
+
+        fn page_age(&self, paddr: PhysicalAddress) -> u8 {
+            self.ages
+                .borrow()
+                .get(&paddr.as_raw_ptr())
+                .copied()
+                .unwrap_or_default()
+        }
+
+        fn set_page_age(&self, paddr: PhysicalAddress, age: u8) {
+            let mut ages = self.ages.borrow_mut();
+            if age == 0 {
+                ages.remove(&paddr.as_raw_ptr());
+            } else {
+                ages.insert(paddr.as_raw_ptr(), age);
+            }
+        }
+    }
+
+    #[warn(non_snake_case)]
+    fn get_a_random_512GiB_range() -> u32 {
+        thread_rng().gen_range(0..TEST_L1_ENTRIES) as u32
+    }
+
+    fn get_random_range(start: u32, end: u32) -> Vec<u32> {
+        let mut vec: Vec<u32> = (start..end).collect();
+        vec.shuffle(&mut thread_rng());
+        vec
+    }
+
+    fn get_random_virt_addr() -> VirtualAddress {
+        const TOTAL_VIRTUAL_ADDRESS_SPACE: usize = 1usize << OUTPUT_ADDR_BITS;
+        const NUM_L1_REGIONS: usize = TOTAL_VIRTUAL_ADDRESS_SPACE / L1_BLOCK_SIZE;
+        VirtualAddress::new(
+            rand::thread_rng().gen_range(0..NUM_L1_REGIONS - (2 * TEST_L1_ENTRIES + 1))
+                * L1_BLOCK_SIZE,
+        )
+        .unwrap()
+    }
+
+    fn generate_memory_maps(mut virt_addr: VirtualAddress) -> Vec<MemoryMap> {
+        let rand_1GiB_ranges = get_random_range(0, TEST_L1_ENTRIES as u32);
+        let rand_2MiB_ranges = get_random_range(0, TEST_ENTRIES as u32);
+        let rand_4KiB_ranges = get_random_range(0, TEST_ENTRIES as u32);
+        let access_perms = AccessPermissions::normal_memory_default();
+        let mut memory_maps = Vec::new();
+        let form_phy_addr = |OneGiB: u32, TwoMiB: u32, FourKiB| {
+            PhysicalAddress::new(
+                OneGiB as usize * L1_BLOCK_SIZE
+                    + TwoMiB as usize * L2_BLOCK_SIZE
+                    + FourKiB as usize * PAGE_SIZE,
+            )
+        };
+
+        for (i, one_gib_ind) in rand_1GiB_ranges.iter().enumerate() {
+            if i == TEST_L1_ENTRIES - 1 {
+                for (i, two_mib_ind) in rand_2MiB_ranges.iter().enumerate() {
+                    if i == TEST_ENTRIES - 1 {
+                        for four_kib_ind in &rand_4KiB_ranges {
+                            memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                                form_phy_addr(*one_gib_ind, *two_mib_ind, *four_kib_ind),
+                                virt_addr,
+                                PAGE_SIZE / GRANULE_SIZE,
+                                access_perms,
+                            )));
+
+                            virt_addr += PAGE_SIZE;
+                        }
+                    } else {
+                        memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                            form_phy_addr(*one_gib_ind, *two_mib_ind, 0),
+                            virt_addr,
+                            L2_BLOCK_SIZE / GRANULE_SIZE,
+                            access_perms,
+                        )));
+
+                        virt_addr += L2_BLOCK_SIZE;
+                    }
+                }
+            } else {
+                memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                    form_phy_addr(*one_gib_ind, 0, 0),
+                    virt_addr,
+                    L1_BLOCK_SIZE / GRANULE_SIZE,
+                    access_perms,
+                )));
+            }
+
+            virt_addr += L1_BLOCK_SIZE;
+        }
+
+        memory_maps.shuffle(&mut thread_rng());
+        memory_maps
+    }
+
+    fn insert_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let memory_maps = generate_memory_maps(vaddr);
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
+
+        assert!(translation_table.is_ok());
+
+        let translation_table = translation_table.unwrap();
+
+        for map in &memory_maps {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let vaddr = desc.virtual_address();
+                    let translation = translation_table.virt2phy(vaddr);
+
+                    assert!(translation.is_some());
+                    let translation = translation.unwrap();
+
+                    assert_eq!(translation.phy_addr, desc.physical_address());
+                    assert_eq!(translation.access_perms, desc.access_permissions());
+                    assert_eq!(translation.memory_kind, MemoryKind::Normal);
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
             }
         }
-        RawDescriptor::Block(block_desc) => {
-            // Block Descriptors can be present only in levels 1 and 2.
-            if level == &AddressTranslationLevel::One || level == &AddressTranslationLevel::Two {
-                Ok(Descriptor::Block(block_desc))
-            } else {
-                Err(Descriptor::Block(block_desc))
+    }
+
+    fn traverse_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let memory_maps = generate_memory_maps(vaddr);
+        let layout =
+            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
+                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
+
+        assert!(translation_table.is_ok());
+
+        let translation_table = translation_table.unwrap();
+
+        for map in &memory_maps {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let vaddr = desc.virtual_address();
+                    let paddr = desc.physical_address();
+                    let map_size = desc.num_pages() * PAGE_SIZE;
+                    let mut size = 0;
+
+                    for res in translation_table.traverse(vaddr..vaddr + map_size, true) {
+                        assert!(res.is_ok());
+
+                        match res.unwrap() {
+                            TraverseYield::PhysicalBlock(mut pbo_info) => {
+                                assert_eq!(pbo_info.phy_block().start, paddr + size);
+                                assert_eq!(pbo_info.vaddr(), vaddr + size);
+                                let overlap = pbo_info.phy_block();
+                                size += (overlap.end - overlap.start) as usize;
+
+                                let remove = pbo_info
+                                    .remove_overlapping_range(&translation_table, &page_alloc);
+                                assert!(remove.is_ok());
+                            }
+                            TraverseYield::UnusedMemory(mem) => unsafe {
+                                page_alloc.deallocate(mem, layout)
+                            },
+                        }
+                    }
+
+                    assert_eq!(size, map_size);
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
             }
         }
-        // Invalid Descriptors can appear anywhere.
-        RawDescriptor::Invalid => Ok(Descriptor::Invalid),
     }
-}
 
-fn to_raw_desc(value: u64) -> RawDescriptor {
-    // Table and Page descriptors both have bits [0:1] set to 0b11.
-    // Only way they can be distinguished is at which level they appear.
-    // So, treat them as same.
-    let tbl_desc = Stage1TableDescriptor::new(value);
-    if tbl_desc
-        .matches_all(STAGE1_TABLE_DESCRIPTOR::VALID::SET + STAGE1_TABLE_DESCRIPTOR::TYPE::Table)
-    {
-        return RawDescriptor::TableOrPage(value);
+    fn lookup_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let memory_maps = generate_memory_maps(vaddr);
+        let layout =
+            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
+                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
+
+        assert!(translation_table.is_ok());
+
+        let translation_table = translation_table.unwrap();
+        let mut rng = thread_rng();
+
+        for map in &memory_maps {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let vaddr = desc.virtual_address();
+                    let paddr = desc.physical_address();
+                    let map_size = desc.num_pages() * PAGE_SIZE;
+                    let mut traversed_size = 0;
+                    let unmap_start = Uniform::from(0..desc.num_pages()).sample(&mut rng);
+                    let unmap_end =
+                        Uniform::from(unmap_start + 1..=desc.num_pages()).sample(&mut rng);
+                    let unmap_rng =
+                        vaddr + unmap_start * GRANULE_SIZE..vaddr + unmap_end * GRANULE_SIZE;
+
+                    for res in translation_table.traverse(unmap_rng.clone(), true) {
+                        assert!(res.is_ok());
+
+                        match res.unwrap() {
+                            TraverseYield::PhysicalBlock(pbo_info) => {
+                                let pblock = pbo_info.phy_block();
+                                let overlap = pbo_info.overlapping_range();
+                                assert_eq!(
+                                    pblock.start + overlap.start as usize,
+                                    paddr + unmap_start * GRANULE_SIZE + traversed_size
+                                );
+                                assert_eq!(
+                                    pbo_info.vaddr() + overlap.start as usize,
+                                    vaddr + unmap_start * GRANULE_SIZE + traversed_size
+                                );
+                                traversed_size += (overlap.end - overlap.start) as usize;
+                            }
+                            TraverseYield::UnusedMemory(mem) => unsafe {
+                                page_alloc.deallocate(mem, layout)
+                            },
+                        }
+                    }
+
+                    assert_eq!(traversed_size, (unmap_rng.end - unmap_rng.start) as usize);
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
+            }
+        }
     }
 
-    let block_desc = Stage1BlockDescriptor::new(value);
-    if block_desc
-        .matches_all(STAGE1_BLOCK_DESCRIPTOR::VALID::SET + STAGE1_BLOCK_DESCRIPTOR::TYPE::Block)
-    {
-        return RawDescriptor::Block(block_desc);
+    fn translate_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_PAGES: usize = 8;
+        let page_alloc = TestAllocator::default();
+        let user_perms = AccessPermissions::user_memory_default();
+        let kernel_perms = AccessPermissions::normal_memory_default();
+        let paddr = PhysicalAddress::new(3 * L1_BLOCK_SIZE);
+        let pages_vaddr = vaddr + L1_BLOCK_SIZE + L2_BLOCK_SIZE;
+        let kernel_vaddr = vaddr + L1_BLOCK_SIZE + 4 * L2_BLOCK_SIZE;
+        let memory_maps = [
+            MemoryMap::Normal(MapDesc::new(
+                paddr,
+                vaddr,
+                L1_BLOCK_SIZE / GRANULE_SIZE,
+                user_perms,
+            )),
+            MemoryMap::Normal(MapDesc::new(
+                paddr + L1_BLOCK_SIZE,
+                vaddr + L1_BLOCK_SIZE,
+                L2_BLOCK_SIZE / GRANULE_SIZE,
+                user_perms,
+            )),
+            MemoryMap::Normal(MapDesc::new(
+                paddr + L1_BLOCK_SIZE + L2_BLOCK_SIZE + PAGE_SIZE,
+                pages_vaddr,
+                NUM_PAGES,
+                user_perms,
+            )),
+            MemoryMap::Normal(MapDesc::new(
+                paddr + 2 * L1_BLOCK_SIZE,
+                kernel_vaddr,
+                1,
+                kernel_perms,
+            )),
+        ];
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
+
+        assert!(translation_table.is_ok());
+
+        let translation_table = translation_table.unwrap();
+        let mut rng = thread_rng();
+
+        for map in &memory_maps[..3] {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let offset = Uniform::from(0..desc.num_pages() * GRANULE_SIZE).sample(&mut rng);
+                    assert_eq!(
+                        translation_table.translate(desc.virtual_address() + offset),
+                        Some(desc.physical_address() + offset)
+                    );
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
+            }
+        }
+
+        // Kernel only mappings in TTBR0 half must not be translated for users.
+        assert!(translation_table.virt2phy(kernel_vaddr).is_some());
+        assert_eq!(translation_table.translate(kernel_vaddr), None);
+
+        // Buffer runs past the mapped pages, so translation must stop at the hole.
+        let offset = Uniform::from(0..GRANULE_SIZE).sample(&mut rng);
+        let buf_rng = pages_vaddr + offset..pages_vaddr + (NUM_PAGES + 1) * GRANULE_SIZE;
+        let mut phy_pages = [PhysicalAddress::new(0); NUM_PAGES + 1];
+
+        assert_eq!(
+            translation_table.translate_buffer(buf_rng.clone(), &mut phy_pages),
+            NUM_PAGES
+        );
+        assert_eq!(
+            phy_pages[0],
+            paddr + L1_BLOCK_SIZE + L2_BLOCK_SIZE + PAGE_SIZE + offset
+        );
+        for i in 1..NUM_PAGES {
+            assert_eq!(
+                phy_pages[i],
+                paddr + L1_BLOCK_SIZE + L2_BLOCK_SIZE + (i + 1) * PAGE_SIZE
+            );
+        }
+
+        // Translation stops once the output is full.
+        assert_eq!(
+            translation_table.translate_buffer(buf_rng, &mut phy_pages[..2]),
+            2
+        );
     }
 
-    RawDescriptor::Invalid
-}
+    /// Block of `PROMOTED_LEVEL` (1GiB with 4KiB granule) at `vaddr`, mapped with maps of the
+    /// next level (2MiB) except for one region, which is mapped one page at a time.
+    /// All of it is contiguous in PA and aligned to 1GiB.
+    fn generate_promotable_memory_maps(vaddr: VirtualAddress) -> (PhysicalAddress, Vec<MemoryMap>) {
+        let paddr = PhysicalAddress::new(get_a_random_512GiB_range() as usize * L1_BLOCK_SIZE);
+        let region_size = get_vaddr_spacing_per_entry(&(PROMOTED_LEVEL as usize + 1).into());
+        let paged_region = thread_rng().gen_range(0..NUM_TABLE_DESC_ENTRIES);
+        let access_perms = AccessPermissions::normal_memory_default();
+        let mut memory_maps = Vec::new();
 
-fn parse_output_address(
-    ll_desc: &Stage1LastLevelDescriptor,
-    level: &AddressTranslationLevel,
-) -> PhysicalAddress {
-    match level {
-        AddressTranslationLevel::Zero => bug!("unexpected level for parse_output_address"),
-        AddressTranslationLevel::One => {
-            assert!(!ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE));
-            PhysicalAddress::new(
-                (ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_1GiB)
-                    << LEVEL_1_OUTPUT_ADDR_SHIFT) as usize,
-            )
+        for i in 0..NUM_TABLE_DESC_ENTRIES {
+            if i == paged_region || region_size == PAGE_SIZE {
+                for j in 0..region_size / PAGE_SIZE {
+                    let offset = i * region_size + j * PAGE_SIZE;
+                    memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                        paddr + offset,
+                        vaddr + offset,
+                        PAGE_SIZE / GRANULE_SIZE,
+                        access_perms,
+                    )));
+                }
+            } else {
+                memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                    paddr + i * region_size,
+                    vaddr + i * region_size,
+                    region_size / GRANULE_SIZE,
+                    access_perms,
+                )));
+            }
         }
-        AddressTranslationLevel::Two => {
-            assert!(!ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE));
-            PhysicalAddress::new(
-                (ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_2MiB)
-                    << LEVEL_2_OUTPUT_ADDR_SHIFT) as usize,
-            )
+
+        memory_maps.shuffle(&mut thread_rng());
+        (paddr, memory_maps)
+    }
+
+    fn assert_promoted_to_block(
+        translation_table: &TranslationTable,
+        page_alloc: &TestAllocator,
+        vaddr: VirtualAddress,
+        paddr: PhysicalAddress,
+    ) {
+        let block_size = get_vaddr_spacing_per_entry(&PROMOTED_LEVEL);
+
+        // Only the tables upto `PROMOTED_LEVEL` must remain, besides the recycled ones.
+        translation_table.trim_tables(page_alloc);
+        assert_eq!(
+            page_alloc.mem.borrow().len(),
+            PROMOTED_LEVEL as usize - ROOT_TRANSLATION_LEVEL as usize
+        );
+
+        let blocks: Vec<_> = translation_table
+            .traverse(vaddr..vaddr + block_size, false)
+            .map(|res| match res {
+                Ok(TraverseYield::PhysicalBlock(pbo_info)) => pbo_info.phy_block(),
+                _ => bug!("unexpected traversal result"),
+            })
+            .collect();
+        assert_eq!(blocks, vec![paddr..paddr + block_size]);
+
+        let offset = thread_rng().gen_range(0..block_size);
+        let translation = translation_table.virt2phy(vaddr + offset);
+        assert!(translation.is_some());
+        assert_eq!(translation.unwrap().phy_addr, paddr + offset);
+    }
+
+    fn promote_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let (paddr, memory_maps) = generate_promotable_memory_maps(vaddr);
+        let (last_map, memory_maps) = memory_maps.split_last().unwrap();
+        let translation_table = TranslationTable::default();
+
+        for map in memory_maps {
+            assert!(translation_table.map(map, &page_alloc).is_ok());
         }
-        AddressTranslationLevel::Three => {
-            assert!(ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::TYPE));
-            PhysicalAddress::new(
-                (ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::OUTPUT_ADDR_4KiB)
-                    << LEVEL_3_OUTPUT_ADDR_SHIFT) as usize,
-            )
+
+        // Cannot promote, until the run is complete.
+        assert!(page_alloc.mem.borrow().len() > 1);
+
+        assert!(translation_table.map(last_map, &page_alloc).is_ok());
+        assert_promoted_to_block(&translation_table, &page_alloc, vaddr, paddr);
+    }
+
+    fn promote_scanner_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let (paddr, memory_maps) = generate_promotable_memory_maps(vaddr);
+        let translation_table = TranslationTable::default();
+
+        // Install the mappings directly, bypassing the promotion done by `map`.
+        for map in &memory_maps {
+            let mut parsed_map = parse_memory_map(map);
+            let res = match parsed_map.num_pages {
+                1 => translation_table.install_page_descs(&mut parsed_map, &page_alloc, map),
+                _ => {
+                    // Block installers count pages of the block size.
+                    parsed_map.num_pages = 1;
+                    translation_table.install_l2_block_desc(&mut parsed_map, &page_alloc, map)
+                }
+            };
+            assert!(res.is_ok());
         }
+
+        let block_size = get_vaddr_spacing_per_entry(&PROMOTED_LEVEL);
+        let num_freed = AddressTranslationLevel::Three as usize - PROMOTED_LEVEL as usize;
+
+        assert_eq!(
+            page_alloc.mem.borrow().len(),
+            AddressTranslationLevel::Three as usize - ROOT_TRANSLATION_LEVEL as usize
+        );
+        assert_eq!(
+            translation_table.promote_mappings(vaddr..vaddr + block_size, &page_alloc),
+            num_freed
+        );
+        assert_promoted_to_block(&translation_table, &page_alloc, vaddr, paddr);
+        assert_eq!(
+            translation_table.promote_mappings(vaddr..vaddr + block_size, &page_alloc),
+            0
+        );
     }
-}
 
-fn parse_access_perms(ll_desc: &Stage1LastLevelDescriptor) -> AccessPermissions {
-    let ap = ll_desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP);
+    fn remove_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let memory_maps = generate_memory_maps(vaddr);
+        let layout =
+            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
+                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
+
+        assert!(translation_table.is_ok());
+
+        let translation_table = translation_table.unwrap();
+        let mut rng = thread_rng();
+
+        for map in &memory_maps {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let vaddr = desc.virtual_address();
+                    let unmap_start = Uniform::from(0..desc.num_pages()).sample(&mut rng);
+                    let unmap_end =
+                        Uniform::from(unmap_start + 1..=desc.num_pages()).sample(&mut rng);
+                    let unmap_rng =
+                        vaddr + unmap_start * GRANULE_SIZE..vaddr + unmap_end * GRANULE_SIZE;
+                    let mut traversed_size = 0;
+
+                    // Warm up the walk cache, so that stale tables would be visible after removal.
+                    assert!(translation_table.virt2phy(unmap_rng.start).is_some());
+
+                    for res in translation_table.traverse(unmap_rng.clone(), true) {
+                        assert!(res.is_ok());
+
+                        match res.unwrap() {
+                            TraverseYield::PhysicalBlock(mut pbo_info) => {
+                                let overlap = pbo_info.overlapping_range();
+                                traversed_size += (overlap.end - overlap.start) as usize;
 
-    let mut access_perms = if ap == STAGE1_LAST_LEVEL_DESCRIPTOR::AP::RW_EL1_EL0.value {
-        AccessPermissions::EL1_READ
-            | AccessPermissions::EL1_WRITE
-            | AccessPermissions::EL0_READ
-            | AccessPermissions::EL0_WRITE
-    } else if ap == STAGE1_LAST_LEVEL_DESCRIPTOR::AP::RW_EL1.value {
-        AccessPermissions::EL1_READ | AccessPermissions::EL1_WRITE
-    } else if ap == STAGE1_LAST_LEVEL_DESCRIPTOR::AP::RO_EL1_EL0.value {
-        AccessPermissions::EL1_READ | AccessPermissions::EL0_READ
-    } else if ap == STAGE1_LAST_LEVEL_DESCRIPTOR::AP::RO_EL1.value {
-        AccessPermissions::EL1_READ
-    } else {
-        bug!("Invalid Access Permissions on page");
-    };
+                                let remove = pbo_info
+                                    .remove_overlapping_range(&translation_table, &page_alloc);
+                                assert!(remove.is_ok());
+                            }
+                            TraverseYield::UnusedMemory(mem) => unsafe {
+                                page_alloc.deallocate(mem, layout)
+                            },
+                        }
+                    }
 
-    if !ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::PXN)
-        && !access_perms.contains(AccessPermissions::EL1_WRITE)
-    {
-        access_perms |= AccessPermissions::EL1_EXECUTE;
-    }
-    if !ll_desc.is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::UXN)
-        && !access_perms.contains(AccessPermissions::EL0_WRITE)
-    {
-        access_perms |= AccessPermissions::EL0_EXECUTE;
+                    assert_eq!(traversed_size, (unmap_rng.end - unmap_rng.start) as usize);
+
+                    let count_after_removal =
+                        translation_table.traverse(unmap_rng.clone(), true).count();
+                    assert_eq!(count_after_removal, 0);
+                    assert!(translation_table.virt2phy(unmap_rng.start).is_none());
+
+                    // Rest of the mapping must be left intact.
+                    for page in [0, unmap_end] {
+                        if page == unmap_start || page == desc.num_pages() {
+                            continue;
+                        }
+
+                        let translation = translation_table.virt2phy(vaddr + page * GRANULE_SIZE);
+                        assert!(translation.is_some());
+                        assert_eq!(
+                            translation.unwrap().phy_addr,
+                            desc.physical_address() + page * GRANULE_SIZE
+                        );
+                    }
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
+            }
+        }
     }
 
-    access_perms
-}
+    fn unmap_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let memory_maps = generate_memory_maps(vaddr);
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
 
-fn new_stage1_table_desc(next_level_addr: u64) -> u64 {
-    let table_desc = Stage1TableDescriptor::new(0);
+        assert!(translation_table.is_ok());
 
-    assert_ne!(next_level_addr, 0);
-    assert_eq!(
-        next_level_addr & ((1 << NEXT_LEVEL_TABLE_ADDR_SHIFT) - 1),
-        0
-    );
+        let translation_table = translation_table.unwrap();
+        let mut rng = thread_rng();
 
-    table_desc.modify(STAGE1_TABLE_DESCRIPTOR::VALID::True + STAGE1_TABLE_DESCRIPTOR::TYPE::Table);
-    table_desc.modify(
-        STAGE1_TABLE_DESCRIPTOR::NEXT_LEVEL_TABLE_ADDR
-            .val(next_level_addr >> NEXT_LEVEL_TABLE_ADDR_SHIFT),
-    );
+        for map in &memory_maps {
+            match map {
+                MemoryMap::Normal(desc) => {
+                    let vaddr = desc.virtual_address();
+                    let unmap_start = Uniform::from(0..desc.num_pages()).sample(&mut rng);
+                    let unmap_end =
+                        Uniform::from(unmap_start + 1..=desc.num_pages()).sample(&mut rng);
+                    let unmap_rng =
+                        vaddr + unmap_start * GRANULE_SIZE..vaddr + unmap_end * GRANULE_SIZE;
 
-    table_desc.get()
-}
+                    assert!(translation_table
+                        .unmap(unmap_rng.clone(), &page_alloc)
+                        .is_ok());
+                    assert_eq!(
+                        translation_table.traverse(unmap_rng.clone(), false).count(),
+                        0
+                    );
+
+                    if unmap_start != 0 {
+                        let translation = translation_table.virt2phy(vaddr);
+                        assert!(translation.is_some());
+                        assert_eq!(translation.unwrap().phy_addr, desc.physical_address());
+                    }
+                }
+                MemoryMap::Device(_) => assert!(false, "Failure"),
+            }
+        }
 
-fn new_stage1_page_desc(output_address: u64, attributes: u64) -> u64 {
-    let page_desc = Stage1PageDescriptor::new(attributes);
+        assert_occupancy(&translation_table.root, &ROOT_TRANSLATION_LEVEL);
 
-    assert_eq!(output_address & ((1 << LEVEL_3_OUTPUT_ADDR_SHIFT) - 1), 0);
+        // Unmapping everything must return all the tables (to the pool, if not freed).
+        let vaddr_end = vaddr + TEST_L1_ENTRIES * L1_BLOCK_SIZE;
+        assert!(translation_table
+            .unmap(vaddr..vaddr_end, &page_alloc)
+            .is_ok());
+        assert_eq!(
+            translation_table.traverse(vaddr..vaddr_end, false).count(),
+            0
+        );
+        translation_table.trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
 
-    page_desc.modify(STAGE1_PAGE_DESCRIPTOR::VALID::True + STAGE1_PAGE_DESCRIPTOR::TYPE::Page);
-    page_desc.modify(
-        STAGE1_PAGE_DESCRIPTOR::OUTPUT_ADDR_4KiB.val(output_address >> LEVEL_3_OUTPUT_ADDR_SHIFT),
-    );
+    /// Check that the record of valid descriptors of `descs` (a table of `level`) and the
+    /// tables below it, matches the descriptors.
+    fn assert_occupancy(descs: &DescriptorTable, level: &AddressTranslationLevel) {
+        let mut num_valid = 0;
 
-    page_desc.get()
-}
+        for idx in 0..NUM_TABLE_DESC_ENTRIES {
+            let desc = load_desc(descs, idx);
+            let is_valid =
+                Stage1LastLevelDescriptor::new(desc).is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::VALID);
 
-enum BlockDescLevel {
-    One,
-    Two,
-}
+            assert_eq!(descs.next_valid_idx(idx) == Some(idx), is_valid);
+            num_valid += is_valid as usize;
 
-impl BlockDescLevel {
-    fn from(level: &AddressTranslationLevel) -> Self {
-        match level {
-            AddressTranslationLevel::One => Self::One,
-            AddressTranslationLevel::Two => Self::Two,
-            _ => bug!("Wrong Level used for constructing a Block Descriptor"),
+            if let Ok(Descriptor::Table(tbl_desc)) = parse_desc(desc, level) {
+                assert_occupancy(get_next_level_desc(&tbl_desc), &level.next());
+            }
         }
-    }
-}
-
-fn new_stage1_block_desc(level: BlockDescLevel, output_address: u64, attributes: u64) -> u64 {
-    let block_desc = Stage1BlockDescriptor::new(attributes);
 
-    block_desc.modify(STAGE1_BLOCK_DESCRIPTOR::VALID::True + STAGE1_BLOCK_DESCRIPTOR::TYPE::Block);
+        assert_eq!(descs.num_valid(), num_valid);
+        assert_eq!(descs.valid_indices().count(), num_valid);
+    }
 
-    match level {
-        BlockDescLevel::One => {
-            assert_eq!(output_address & ((1 << LEVEL_1_OUTPUT_ADDR_SHIFT) - 1), 0);
-            block_desc.modify(
-                STAGE1_BLOCK_DESCRIPTOR::OUTPUT_ADDR_1GiB
-                    .val(output_address >> LEVEL_1_OUTPUT_ADDR_SHIFT),
-            )
+    fn is_contiguous_hinted(translation_table: &TranslationTable, vaddr: VirtualAddress) -> bool {
+        match translation_table
+            .traverse(vaddr..vaddr + 1usize, false)
+            .next()
+        {
+            Some(Ok(TraverseYield::PhysicalBlock(pbo_info))) => {
+                Stage1LastLevelDescriptor::new(load_desc(pbo_info.descs, pbo_info.idx))
+                    .is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::Contiguous)
+            }
+            _ => bug!("{vaddr:?} is not mapped"),
         }
-        BlockDescLevel::Two => {
-            assert_eq!(output_address & ((1 << LEVEL_2_OUTPUT_ADDR_SHIFT) - 1), 0);
-            block_desc.modify(
-                STAGE1_BLOCK_DESCRIPTOR::OUTPUT_ADDR_2MiB
-                    .val(output_address >> LEVEL_2_OUTPUT_ADDR_SHIFT),
-            )
+    }
+
+    /// Whether the mapping of `vaddr` is tagged with the ASID of the translation table.
+    fn is_non_global(translation_table: &TranslationTable, vaddr: VirtualAddress) -> bool {
+        match translation_table
+            .traverse(vaddr..vaddr + 1usize, false)
+            .next()
+        {
+            Some(Ok(TraverseYield::PhysicalBlock(pbo_info))) => {
+                Stage1LastLevelDescriptor::new(load_desc(pbo_info.descs, pbo_info.idx))
+                    .is_set(STAGE1_LAST_LEVEL_DESCRIPTOR::NG)
+            }
+            _ => bug!("{vaddr:?} is not mapped"),
         }
     }
 
-    block_desc.get()
-}
+    fn non_global_test_using_vaddr(vaddr: VirtualAddress) {
+        const TTBR1_VA_BASE: usize = 0xFFFF_0000_0000_0000;
+        let page_alloc = TestAllocator::default();
+        let translation_table = TranslationTable::default();
+        // Only the level indices of a VA select its descriptor, so keep clear of the other ones.
+        let kernel_vaddr =
+            VirtualAddress::new(TTBR1_VA_BASE + (vaddr + 2 * L2_BLOCK_SIZE).as_raw_ptr()).unwrap();
+
+        // Mappings in the lower VA range are non-global, even if accessible only from EL1.
+        for (vaddr, access_perms, non_global) in [
+            (vaddr, AccessPermissions::normal_memory_default(), true),
+            (
+                vaddr + L2_BLOCK_SIZE,
+                AccessPermissions::user_memory_default(),
+                true,
+            ),
+            (
+                kernel_vaddr,
+                AccessPermissions::normal_memory_default(),
+                false,
+            ),
+        ] {
+            let map = MemoryMap::Normal(MapDesc::new(
+                PhysicalAddress::new(PAGE_SIZE),
+                vaddr,
+                1,
+                access_perms,
+            ));
+
+            translation_table.map(&map, &page_alloc).unwrap();
+            assert_eq!(is_non_global(&translation_table, vaddr), non_global);
+            // Global mappings can't be invalidated by ASID, when tearing down the table.
+            assert_eq!(
+                translation_table.has_global.load(Ordering::Relaxed),
+                !non_global
+            );
+        }
 
-const fn max_mapping_spans(num_aligns: usize) -> usize {
-    if num_aligns == 0 {
-        0
-    } else {
-        1 + 2 * max_mapping_spans(num_aligns - 1)
+        translation_table.destroy(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
     }
-}
 
-fn load_desc(descs: &DescriptorTable, idx: usize) -> u64 {
-    unsafe { (*descs.0.get())[idx] }
-}
+    fn contiguous_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_PAGES: usize = 2 * PAGE_RUN_SIZE / GRANULE_SIZE + 3;
+        let page_alloc = TestAllocator::default();
+        let perms = AccessPermissions::normal_memory_default();
+        let paddr = PhysicalAddress::new(3 * L1_BLOCK_SIZE);
+        let blocks_vaddr = vaddr;
+        let pages_vaddr = vaddr + L1_BLOCK_SIZE;
+        let memory_maps = [
+            MemoryMap::Normal(MapDesc::new(
+                paddr,
+                blocks_vaddr,
+                (L2_BLOCK_RUN_SIZE + L2_BLOCK_SIZE) / GRANULE_SIZE,
+                perms,
+            )),
+            MemoryMap::Normal(MapDesc::new(
+                paddr + L1_BLOCK_SIZE,
+                pages_vaddr,
+                NUM_PAGES,
+                perms,
+            )),
+        ];
+        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
 
-#[allow(clippy::mut_from_ref)]
-fn load_desc_mut(descs: &DescriptorTable, idx: usize) -> &mut u64 {
-    unsafe { &mut (*descs.0.get())[idx] }
-}
+        assert!(translation_table.is_ok());
 
-#[cfg(test)]
-mod tests {
-    extern crate std;
+        let translation_table = translation_table.unwrap();
 
-    use core::{
-        alloc::{AllocError, Allocator, Layout},
-        cell::RefCell,
-        mem::size_of,
-        ptr::NonNull,
-    };
-    use rand::{
-        distributions::{Distribution, Uniform},
-        seq::SliceRandom,
-        thread_rng, Rng,
-    };
-    use rayon::prelude::*;
-    use std::{collections::HashMap, vec, vec::Vec};
+        // Only whole runs of blocks/pages are hinted.
+        for i in 0..=L2_BLOCK_RUN_LEN {
+            let vaddr = blocks_vaddr + i * L2_BLOCK_SIZE;
+            assert_eq!(
+                is_contiguous_hinted(&translation_table, vaddr),
+                i < L2_BLOCK_RUN_LEN
+            );
+            assert_eq!(
+                translation_table.virt2phy(vaddr).unwrap().phy_addr,
+                paddr + i * L2_BLOCK_SIZE
+            );
+        }
+        for i in 0..NUM_PAGES {
+            let vaddr = pages_vaddr + i * GRANULE_SIZE;
+            assert_eq!(
+                is_contiguous_hinted(&translation_table, vaddr),
+                i < 2 * PAGE_RUN_LEN
+            );
+            assert_eq!(
+                translation_table.virt2phy(vaddr).unwrap().phy_addr,
+                paddr + L1_BLOCK_SIZE + i * GRANULE_SIZE
+            );
+        }
 
-    use crate::{
-        address::{PhysicalAddress, VirtualAddress},
-        bug,
-        mmu::{
-            translation_table::{
-                ContiguousSpan, DescriptorTable, TranslationTable, TraverseYield,
-                NUM_TABLE_DESC_ENTRIES,
-            },
-            GRANULE_SIZE, OUTPUT_ADDR_BITS, TRANSLATION_TABLE_DESC_ALIGN,
-        },
-        vm::{AccessPermissions, MapDesc, MemoryKind, MemoryMap, PhysicalPageAllocator},
-    };
+        // Unmapping part of a run must un-hint the rest of the run, but leave it mapped.
+        let hole = pages_vaddr + PAGE_RUN_SIZE + 5 * GRANULE_SIZE;
+        assert!(translation_table
+            .unmap(hole..hole + GRANULE_SIZE, &page_alloc)
+            .is_ok());
+        let hole = blocks_vaddr + 3 * L2_BLOCK_SIZE + PAGE_SIZE;
+        assert!(translation_table
+            .unmap(hole..hole + GRANULE_SIZE, &page_alloc)
+            .is_ok());
+
+        for i in 0..NUM_PAGES {
+            let vaddr = pages_vaddr + i * GRANULE_SIZE;
+            if i == PAGE_RUN_LEN + 5 {
+                assert!(translation_table.virt2phy(vaddr).is_none());
+                continue;
+            }
+            assert_eq!(
+                is_contiguous_hinted(&translation_table, vaddr),
+                i < PAGE_RUN_LEN
+            );
+            assert_eq!(
+                translation_table.virt2phy(vaddr).unwrap().phy_addr,
+                paddr + L1_BLOCK_SIZE + i * GRANULE_SIZE
+            );
+        }
+        for i in 0..L2_BLOCK_RUN_SIZE / GRANULE_SIZE {
+            let vaddr = blocks_vaddr + i * GRANULE_SIZE;
+            if vaddr == hole {
+                assert!(translation_table.virt2phy(vaddr).is_none());
+                continue;
+            }
+            assert!(!is_contiguous_hinted(&translation_table, vaddr));
+            assert_eq!(
+                translation_table.virt2phy(vaddr).unwrap().phy_addr,
+                paddr + i * GRANULE_SIZE
+            );
+        }
+    }
+
+    fn extents_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let rw = AccessPermissions::normal_memory_default();
+        let ro = AccessPermissions::EL1_READ;
+        let block_paddr = PhysicalAddress::new(3 * L1_BLOCK_SIZE);
+        let pages_paddr = PhysicalAddress::new(5 * L1_BLOCK_SIZE);
+        let pages_vaddr = vaddr + L2_BLOCK_SIZE + 3 * PAGE_SIZE;
+        let ro_vaddr = pages_vaddr + 2 * PAGE_SIZE;
+        let end = ro_vaddr + 2 * PAGE_SIZE;
+        let maps = [
+            // A block followed by pages, contiguous in PA.
+            MapDesc::new(block_paddr, vaddr, L2_BLOCK_SIZE / GRANULE_SIZE + 3, rw),
+            // Pages not contiguous in PA with the above.
+            MapDesc::new(pages_paddr, pages_vaddr, 2, rw),
+            // Pages contiguous in PA with the above, but differing in permissions.
+            MapDesc::new(pages_paddr + 2 * PAGE_SIZE, ro_vaddr, 2, ro),
+        ]
+        .map(MemoryMap::Normal);
+        let translation_table = TranslationTable::new(&maps, &page_alloc).unwrap();
+        let extents = |vaddr_rng: Range<VirtualAddress>| {
+            translation_table
+                .extents(vaddr_rng)
+                .map(|extent| {
+                    let extent = extent.unwrap();
+                    assert_eq!(extent.memory_kind(), &MemoryKind::Normal);
+                    (
+                        extent.virtual_address(),
+                        extent.physical_address(),
+                        extent.len(),
+                        extent.access_permissions(),
+                    )
+                })
+                .collect::<Vec<_>>()
+        };
 
-    use super::{find_best_mapping_scheme, FOUR_KIB, ONE_GIB, TWO_MIB};
+        assert_eq!(
+            extents(vaddr..end),
+            [
+                (vaddr, block_paddr, L2_BLOCK_SIZE + 3 * PAGE_SIZE, rw),
+                (pages_vaddr, pages_paddr, 2 * PAGE_SIZE, rw),
+                (ro_vaddr, pages_paddr + 2 * PAGE_SIZE, 2 * PAGE_SIZE, ro),
+            ]
+        );
 
-    #[derive(Default)]
-    struct TestAllocator {
-        mem: RefCell<HashMap<*mut u8, Layout>>,
+        // Extents are clipped to the range.
+        assert_eq!(
+            extents(vaddr + PAGE_SIZE..pages_vaddr + PAGE_SIZE),
+            [
+                (
+                    vaddr + PAGE_SIZE,
+                    block_paddr + PAGE_SIZE,
+                    L2_BLOCK_SIZE + 2 * PAGE_SIZE,
+                    rw
+                ),
+                (pages_vaddr, pages_paddr, PAGE_SIZE, rw),
+            ]
+        );
+        assert!(extents(end..end + PAGE_SIZE).is_empty());
     }
 
-    unsafe impl Allocator for TestAllocator {
-        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
-            let ptr = unsafe { std::alloc::alloc(layout) };
-            self.mem.borrow_mut().insert(ptr, layout);
-            unsafe {
-                Ok(NonNull::slice_from_raw_parts(
-                    NonNull::new_unchecked(ptr),
-                    layout.size(),
-                ))
-            }
+    fn protect_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let rw = AccessPermissions::user_memory_default();
+        let ro = AccessPermissions::EL1_READ | AccessPermissions::EL0_READ;
+        let pages_vaddr = vaddr + L2_BLOCK_SIZE;
+        let end = pages_vaddr + PAGE_RUN_SIZE;
+        let l1_vaddr = vaddr + L1_BLOCK_SIZE;
+        let mut maps = vec![MemoryMap::Normal(MapDesc::new(
+            PhysicalAddress::new(3 * L1_BLOCK_SIZE),
+            vaddr,
+            (L2_BLOCK_SIZE + PAGE_RUN_SIZE) / GRANULE_SIZE,
+            rw,
+        ))];
+        if supports_block_desc(&AddressTranslationLevel::One) {
+            maps.push(MemoryMap::Normal(MapDesc::new(
+                PhysicalAddress::new(5 * L1_BLOCK_SIZE),
+                l1_vaddr,
+                L1_BLOCK_SIZE / GRANULE_SIZE,
+                rw,
+            )));
         }
+        let translation_table = TranslationTable::new(&maps, &page_alloc).unwrap();
+        let perms = |translation_table: &TranslationTable, vaddr_rng: Range<VirtualAddress>| {
+            translation_table
+                .extents(vaddr_rng)
+                .map(|extent| {
+                    let extent = extent.unwrap();
+                    (
+                        extent.virtual_address(),
+                        extent.len(),
+                        extent.access_permissions(),
+                    )
+                })
+                .collect::<Vec<_>>()
+        };
+        let leaf_level = |vaddr| translation_table.find_leaf_desc(vaddr).unwrap().2;
+
+        // Protecting from the middle of the block into the run of pages splits the block and
+        // breaks the run.
+        let ro_rng = vaddr + L2_BLOCK_SIZE / 2..pages_vaddr + PAGE_SIZE;
+        assert!(translation_table
+            .protect(ro_rng.clone(), &ro, &page_alloc)
+            .is_ok());
+        assert_eq!(
+            perms(&translation_table, vaddr..end),
+            [
+                (vaddr, L2_BLOCK_SIZE / 2, rw),
+                (ro_rng.start, L2_BLOCK_SIZE / 2 + PAGE_SIZE, ro),
+                (ro_rng.end, PAGE_RUN_SIZE - PAGE_SIZE, rw),
+            ]
+        );
+        assert!(!is_contiguous_hinted(&translation_table, ro_rng.end));
+
+        // Restoring the permissions merges the mappings back into one extent.
+        assert!(translation_table
+            .protect(vaddr..end, &rw, &page_alloc)
+            .is_ok());
+        assert_eq!(
+            perms(&translation_table, vaddr..end),
+            [(vaddr, L2_BLOCK_SIZE + PAGE_RUN_SIZE, rw)]
+        );
 
-        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
-            let ptr = ptr.addr().get() as *mut u8;
-            self.mem.borrow_mut().remove(&ptr);
-            unsafe { std::alloc::dealloc(ptr, layout) };
+        // Blocks are split only at the edges of the range.
+        if supports_block_desc(&AddressTranslationLevel::One) {
+            let ro_rng = l1_vaddr + PAGE_SIZE..l1_vaddr + L1_BLOCK_SIZE - PAGE_SIZE;
+            assert!(translation_table
+                .protect(ro_rng.clone(), &ro, &page_alloc)
+                .is_ok());
+            assert_eq!(
+                perms(&translation_table, l1_vaddr..l1_vaddr + L1_BLOCK_SIZE),
+                [
+                    (l1_vaddr, PAGE_SIZE, rw),
+                    (ro_rng.start, L1_BLOCK_SIZE - 2 * PAGE_SIZE, ro),
+                    (ro_rng.end, PAGE_SIZE, rw),
+                ]
+            );
+            assert_eq!(leaf_level(l1_vaddr), AddressTranslationLevel::Three);
+            assert_eq!(
+                leaf_level(l1_vaddr + L1_BLOCK_SIZE / 2),
+                AddressTranslationLevel::Two
+            );
         }
-    }
 
-    impl Drop for TestAllocator {
-        fn drop(&mut self) {
-            for (ptr, layout) in self.mem.borrow().iter() {
-                unsafe { std::alloc::dealloc(*ptr, *layout) };
-            }
+        // Shared mappings made writable stay copy-on-write.
+        let child = translation_table.fork(&page_alloc).unwrap();
+        for perms in [ro, rw] {
+            assert!(child.protect(pages_vaddr..end, &perms, &page_alloc).is_ok());
         }
+        let (descs, idx, _) = child.find_leaf_desc(pages_vaddr).unwrap();
+        let desc = Stage1LastLevelDescriptor::new(load_desc(descs, idx));
+        assert_ne!(
+            desc.read(STAGE1_LAST_LEVEL_DESCRIPTOR::AP) & AP_READ_ONLY,
+            0
+        );
+        assert_ne!(read_swuse(desc.get()) & SWUSE_COW, 0);
+        assert_eq!(
+            perms(&child, pages_vaddr..end),
+            [(pages_vaddr, PAGE_RUN_SIZE, rw)]
+        );
     }
 
-    impl PhysicalPageAllocator for TestAllocator {}
+    fn sg_list_test_using_vaddr(vaddr: VirtualAddress) {
+        let page_alloc = TestAllocator::default();
+        let mem_alloc = TestAllocator::default();
+        let dma_alloc = TestAllocator::default();
+        let perms = AccessPermissions::normal_memory_default();
+        let pages = alloc_backing_memory(&mem_alloc, 4 * PAGE_SIZE, PAGE_SIZE);
+        let other_page = alloc_backing_memory(&mem_alloc, PAGE_SIZE, PAGE_SIZE);
+        let other_vaddr = vaddr + 4 * PAGE_SIZE;
+        let end = other_vaddr + PAGE_SIZE;
+        let maps = [
+            // Pages contiguous in PA, but differing in permissions.
+            MapDesc::new(pages, vaddr, 2, perms),
+            MapDesc::new(
+                pages + 2 * PAGE_SIZE,
+                vaddr + 2 * PAGE_SIZE,
+                2,
+                AccessPermissions::EL1_READ,
+            ),
+            MapDesc::new(other_page, other_vaddr, 1, perms),
+        ]
+        .map(MemoryMap::Normal);
+        let translation_table = TranslationTable::new(&maps, &page_alloc).unwrap();
+        let no_limit = DmaConstraints {
+            max_segment_size: usize::MAX,
+            dma_limit: PhysicalAddress::new(usize::MAX),
+            bus_offset: 0xC000_0000,
+        };
+        let mut segments = [DmaSegment::default(); 8];
+        let mut sg_list = |vaddr_rng: Range<VirtualAddress>, constraints: &DmaConstraints| {
+            let num_segments = translation_table
+                .build_sg_list(vaddr_rng, constraints, &mut segments, &dma_alloc)
+                .unwrap();
+            segments[..num_segments]
+                .iter()
+                .map(|segment| {
+                    assert_eq!(
+                        segment.dma_address(),
+                        segment.physical_address().as_raw_ptr() + constraints.bus_offset
+                    );
+                    (
+                        segment.virtual_address(),
+                        segment.physical_address(),
+                        segment.len(),
+                    )
+                })
+                .collect::<Vec<_>>()
+        };
 
-    #[warn(non_snake_case)]
-    fn get_a_random_512GiB_range() -> u32 {
-        thread_rng().gen_range(0..NUM_TABLE_DESC_ENTRIES) as u32
-    }
+        // Runs contiguous in PA are merged.
+        let mut expected = vec![(vaddr, pages, 4 * PAGE_SIZE)];
+        match other_page == pages + 4 * PAGE_SIZE {
+            true => expected[0].2 += PAGE_SIZE,
+            false => expected.push((other_vaddr, other_page, PAGE_SIZE)),
+        }
+        assert_eq!(sg_list(vaddr..end, &no_limit), expected);
 
-    fn get_random_range(start: u32, end: u32) -> Vec<u32> {
-        let mut vec: Vec<u32> = (start..end).collect();
-        vec.shuffle(&mut thread_rng());
-        vec
-    }
+        // ... upto the max. segment size.
+        let capped = DmaConstraints {
+            max_segment_size: 3 * PAGE_SIZE,
+            ..no_limit
+        };
+        assert_eq!(
+            sg_list(vaddr + 1usize..vaddr + 4 * PAGE_SIZE, &capped),
+            [
+                (vaddr + 1usize, pages + 1usize, 3 * PAGE_SIZE),
+                (
+                    vaddr + 3 * PAGE_SIZE + 1usize,
+                    pages + 3 * PAGE_SIZE + 1usize,
+                    PAGE_SIZE - 1
+                ),
+            ]
+        );
 
-    fn get_random_virt_addr() -> VirtualAddress {
-        const TOTAL_VIRTUAL_ADDRESS_SPACE: usize = 1usize << OUTPUT_ADDR_BITS;
-        VirtualAddress::new(
-            rand::thread_rng().gen_range(0..(TOTAL_VIRTUAL_ADDRESS_SPACE / ONE_GIB) - 1) * ONE_GIB,
-        )
-        .unwrap()
-    }
+        // Holes in the buffer.
+        assert!(matches!(
+            translation_table.build_sg_list(vaddr..end + PAGE_SIZE, &no_limit, &mut segments, &dma_alloc),
+            Err(Error::InvalidVirtualAddress(addr)) if addr == end.as_raw_ptr()
+        ));
+
+        // Stops once the segments are full.
+        assert_eq!(
+            translation_table
+                .build_sg_list(vaddr..end, &capped, &mut segments[..1], &dma_alloc)
+                .unwrap(),
+            1
+        );
 
-    fn generate_memory_maps(mut virt_addr: VirtualAddress) -> Vec<MemoryMap> {
-        let rand_1GiB_ranges = get_random_range(0, NUM_TABLE_DESC_ENTRIES as u32);
-        let rand_2MiB_ranges = get_random_range(0, NUM_TABLE_DESC_ENTRIES as u32);
-        let rand_4KiB_ranges = get_random_range(0, NUM_TABLE_DESC_ENTRIES as u32);
-        let access_perms = AccessPermissions::normal_memory_default();
-        let mut memory_maps = Vec::new();
-        let form_phy_addr = |OneGiB: u32, TwoMiB: u32, FourKiB| {
-            PhysicalAddress::new(
-                OneGiB as usize * ONE_GIB + TwoMiB as usize * TWO_MIB + FourKiB as usize * FOUR_KIB,
+        // The pages beyond the DMA limit are bounced.
+        let limited = DmaConstraints {
+            dma_limit: pages + PAGE_SIZE,
+            ..no_limit
+        };
+        let num_segments = translation_table
+            .build_sg_list(
+                vaddr..vaddr + 2 * PAGE_SIZE,
+                &limited,
+                &mut segments,
+                &dma_alloc,
+            )
+            .unwrap();
+        assert_eq!(num_segments, 2);
+        assert!(!segments[0].is_bounced());
+        assert_eq!(segments[0].dma_address(), pages.as_raw_ptr() + 0xC000_0000);
+        assert!(segments[1].is_bounced());
+        assert_eq!(segments[1].physical_address(), pages + PAGE_SIZE);
+        assert_eq!(segments[1].len(), PAGE_SIZE);
+        assert_eq!(dma_alloc.mem.borrow().len(), 1);
+
+        let page = unsafe {
+            core::slice::from_raw_parts_mut((pages + PAGE_SIZE).as_raw_ptr() as *mut u8, PAGE_SIZE)
+        };
+        let bounce = unsafe {
+            core::slice::from_raw_parts_mut(
+                (segments[1].dma_address() - 0xC000_0000) as *mut u8,
+                PAGE_SIZE,
             )
         };
+        page.fill(0xAB);
+        unsafe { segments[1].sync_for_device() };
+        assert!(bounce.iter().all(|byte| *byte == 0xAB));
+        bounce.fill(0xCD);
+        unsafe { segments[1].sync_for_cpu() };
+        assert!(page.iter().all(|byte| *byte == 0xCD));
+
+        release_sg_list(&segments[..num_segments], &dma_alloc);
+        assert!(dma_alloc.mem.borrow().is_empty());
+
+        // Bounce buffers are released on failure.
+        assert!(translation_table
+            .build_sg_list(vaddr..end + PAGE_SIZE, &limited, &mut segments, &dma_alloc)
+            .is_err());
+        assert!(dma_alloc.mem.borrow().is_empty());
+    }
 
-        for (i, one_gib_ind) in rand_1GiB_ranges.iter().enumerate() {
-            if i == NUM_TABLE_DESC_ENTRIES - 1 {
-                for (i, two_mib_ind) in rand_2MiB_ranges.iter().enumerate() {
-                    if i == NUM_TABLE_DESC_ENTRIES - 1 {
-                        for four_kib_ind in &rand_4KiB_ranges {
-                            memory_maps.push(MemoryMap::Normal(MapDesc::new(
-                                form_phy_addr(*one_gib_ind, *two_mib_ind, *four_kib_ind),
-                                virt_addr,
-                                FOUR_KIB / GRANULE_SIZE,
-                                access_perms,
-                            )));
+    fn map_pages_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_PAGES: usize = 2 * PAGE_RUN_LEN + 1;
+        let page_alloc = TestAllocator::default();
+        let perms = AccessPermissions::user_memory_default();
+        let paddr = PhysicalAddress::new(3 * L1_BLOCK_SIZE);
+        let premapped = PAGE_RUN_LEN + 3;
+        let premapped_paddr = PhysicalAddress::new(5 * L1_BLOCK_SIZE);
+        let pages_rng = vaddr..vaddr + NUM_PAGES * GRANULE_SIZE;
+        let contiguous_page =
+            |vaddr_page: VirtualAddress| Ok(paddr + (vaddr_page - vaddr) as usize);
+        let translation_table = TranslationTable::default();
+
+        assert!(translation_table
+            .map(
+                &MemoryMap::Normal(MapDesc::new(
+                    premapped_paddr,
+                    vaddr + premapped * GRANULE_SIZE,
+                    1,
+                    perms
+                )),
+                &page_alloc
+            )
+            .is_ok());
+
+        // Only the unmapped slots are filled. Only the whole runs are hinted.
+        assert_eq!(
+            translation_table
+                .map_pages(pages_rng.clone(), &perms, &page_alloc, contiguous_page)
+                .unwrap(),
+            NUM_PAGES - 1
+        );
+        for page in 0..NUM_PAGES {
+            let vaddr = vaddr + page * GRANULE_SIZE;
+            let translation = translation_table.virt2phy(vaddr).unwrap();
+
+            assert_eq!(
+                is_contiguous_hinted(&translation_table, vaddr),
+                page < PAGE_RUN_LEN
+            );
+            assert_eq!(translation.access_perms, perms);
+            assert_eq!(
+                translation.phy_addr,
+                match page == premapped {
+                    true => premapped_paddr,
+                    false => paddr + page * GRANULE_SIZE,
+                }
+            );
+        }
 
-                            virt_addr += FOUR_KIB;
-                        }
-                    } else {
-                        memory_maps.push(MemoryMap::Normal(MapDesc::new(
-                            form_phy_addr(*one_gib_ind, *two_mib_ind, 0),
-                            virt_addr,
-                            TWO_MIB / GRANULE_SIZE,
-                            access_perms,
-                        )));
+        // Mapping the same pages again is a no-op.
+        assert_eq!(
+            translation_table
+                .map_pages(pages_rng.clone(), &perms, &page_alloc, contiguous_page)
+                .unwrap(),
+            0
+        );
 
-                        virt_addr += TWO_MIB;
+        // Pages must be within a single level 3 table.
+        let table_end = vaddr + L2_BLOCK_SIZE;
+        assert!(translation_table
+            .map_pages(
+                table_end - GRANULE_SIZE..table_end + GRANULE_SIZE,
+                &perms,
+                &page_alloc,
+                contiguous_page
+            )
+            .is_err());
+
+        // Pages allocated before a failure stay mapped, but unhinted.
+        let run_vaddr = vaddr + 4 * PAGE_RUN_SIZE;
+        let mut num_allocated = 0;
+        assert!(translation_table
+            .map_pages(
+                run_vaddr..run_vaddr + PAGE_RUN_SIZE,
+                &perms,
+                &page_alloc,
+                |vaddr_page| match num_allocated < PAGE_RUN_LEN - 1 {
+                    true => {
+                        num_allocated += 1;
+                        contiguous_page(vaddr_page)
                     }
-                }
-            } else {
-                memory_maps.push(MemoryMap::Normal(MapDesc::new(
-                    form_phy_addr(*one_gib_ind, 0, 0),
-                    virt_addr,
-                    ONE_GIB / GRANULE_SIZE,
-                    access_perms,
-                )));
-            }
+                    false => Err(Error::PhysicalOOM),
+                }
+            )
+            .is_err());
+        for page in 0..PAGE_RUN_LEN {
+            let vaddr = run_vaddr + page * GRANULE_SIZE;
 
-            virt_addr += ONE_GIB;
+            match page < PAGE_RUN_LEN - 1 {
+                true => assert!(!is_contiguous_hinted(&translation_table, vaddr)),
+                false => assert!(translation_table.virt2phy(vaddr).is_none()),
+            }
         }
 
-        memory_maps.shuffle(&mut thread_rng());
-        memory_maps
+        assert!(translation_table
+            .unmap(vaddr..vaddr + L2_BLOCK_SIZE, &page_alloc)
+            .is_ok());
+        translation_table.trim_tables(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
     }
 
-    fn insert_test_using_vaddr(vaddr: VirtualAddress) {
-        let page_alloc = TestAllocator::default();
-        let memory_maps = generate_memory_maps(vaddr);
-        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
-
-        assert!(translation_table.is_ok());
-
-        let translation_table = translation_table.unwrap();
-
-        for map in &memory_maps {
-            match map {
-                MemoryMap::Normal(desc) => {
-                    let vaddr = desc.virtual_address();
-                    let translation = translation_table.virt2phy(vaddr);
+    fn concurrent_map_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_THREADS: usize = 4;
+        const NUM_TABLES: usize = 4;
+        let desc_alloc = SyncAllocator::default();
+        let perms = AccessPermissions::user_memory_default();
+        let next_paddr = AtomicUsize::new(L1_BLOCK_SIZE);
+        let num_allocated = AtomicUsize::new(0);
+        let num_mapped = AtomicUsize::new(0);
+        let translation_table = TranslationTable::default();
+        let map_vaddr = |thread: usize| vaddr + (NUM_TABLES + thread) * L2_BLOCK_SIZE;
+        let map_paddr = |thread: usize| PhysicalAddress::new((thread + 1) * L2_BLOCK_SIZE);
+
+        std::thread::scope(|scope| {
+            for thread in 0..NUM_THREADS {
+                let (translation_table, desc_alloc) = (&translation_table, &desc_alloc);
+                let (next_paddr, num_allocated, num_mapped) =
+                    (&next_paddr, &num_allocated, &num_mapped);
+
+                scope.spawn(move || {
+                    // All threads fault on the same pages: each page is mapped exactly once.
+                    for table in 0..NUM_TABLES {
+                        let table_vaddr = vaddr + table * L2_BLOCK_SIZE;
+                        let mapped = translation_table
+                            .map_pages(
+                                table_vaddr..table_vaddr + TEST_ENTRIES * PAGE_SIZE,
+                                &perms,
+                                desc_alloc,
+                                |_| {
+                                    num_allocated.fetch_add(1, Ordering::Relaxed);
+                                    Ok(PhysicalAddress::new(
+                                        next_paddr.fetch_add(PAGE_SIZE, Ordering::Relaxed),
+                                    ))
+                                },
+                            )
+                            .unwrap();
+                        num_mapped.fetch_add(mapped, Ordering::Relaxed);
+                    }
 
-                    assert!(translation.is_some());
-                    let translation = translation.unwrap();
+                    // Each thread maps its own region.
+                    let map = MemoryMap::Normal(MapDesc::new(
+                        map_paddr(thread),
+                        map_vaddr(thread),
+                        TEST_ENTRIES,
+                        perms,
+                    ));
+                    assert!(translation_table.map(&map, desc_alloc).is_ok());
+                    assert!(translation_table.mark_accessed(map_vaddr(thread)));
+                });
+            }
+        });
 
-                    assert_eq!(translation.phy_addr, desc.physical_address());
-                    assert_eq!(translation.access_perms, desc.access_permissions());
-                    assert_eq!(translation.memory_kind, MemoryKind::Normal);
-                }
-                MemoryMap::Device(_) => assert!(false, "Failure"),
+        assert_eq!(
+            num_mapped.load(Ordering::Relaxed),
+            NUM_TABLES * TEST_ENTRIES
+        );
+        assert_eq!(
+            num_allocated.load(Ordering::Relaxed),
+            NUM_TABLES * TEST_ENTRIES
+        );
+        for table in 0..NUM_TABLES {
+            for page in 0..TEST_ENTRIES {
+                let vaddr = vaddr + table * L2_BLOCK_SIZE + page * PAGE_SIZE;
+                assert!(translation_table.virt2phy(vaddr).is_some());
+            }
+        }
+        for thread in 0..NUM_THREADS {
+            for page in 0..TEST_ENTRIES {
+                let translation = translation_table
+                    .virt2phy(map_vaddr(thread) + page * PAGE_SIZE)
+                    .unwrap();
+                assert_eq!(translation.phy_addr, map_paddr(thread) + page * PAGE_SIZE);
             }
         }
-    }
-
-    fn traverse_test_using_vaddr(vaddr: VirtualAddress) {
-        let page_alloc = TestAllocator::default();
-        let memory_maps = generate_memory_maps(vaddr);
-        let layout =
-            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
-                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
-        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
 
-        assert!(translation_table.is_ok());
+        // Tables of the threads losing the race to install a table were recycled, so are
+        // freed along with the pool.
+        translation_table.destroy(&desc_alloc);
+        assert_eq!(desc_alloc.0.load(Ordering::Relaxed), 0);
+    }
 
-        let translation_table = translation_table.unwrap();
+    fn split_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_SUBTREES: usize = 4;
+        let subtree_span = get_vaddr_spacing_per_entry(&SUBTREE_LEVEL.prev());
+        let vaddr = VirtualAddress::new(vaddr.align_down(subtree_span)).unwrap();
+        let desc_alloc = SyncAllocator::default();
+        let ro_perms = AccessPermissions::EL1_READ;
+        let vaddr_rng = vaddr + PAGE_SIZE..vaddr + (NUM_SUBTREES * subtree_span - PAGE_SIZE);
+        // Pages at both the ends of each subtree.
+        let maps = (0..NUM_SUBTREES)
+            .flat_map(|i| {
+                [
+                    vaddr + i * subtree_span,
+                    vaddr + ((i + 1) * subtree_span - TEST_ENTRIES * PAGE_SIZE),
+                ]
+            })
+            .map(|vaddr| {
+                MemoryMap::Normal(MapDesc::new(
+                    PhysicalAddress::new(PAGE_SIZE),
+                    vaddr,
+                    TEST_ENTRIES,
+                    AccessPermissions::normal_memory_default(),
+                ))
+            })
+            .collect::<Vec<_>>();
+        let translation_table = TranslationTable::new(&maps, &desc_alloc).unwrap();
+
+        // Pieces are the parts of the range within each subtree.
+        let pieces = TranslationTable::split_at_subtrees(vaddr_rng.clone()).collect::<Vec<_>>();
+        assert_eq!(pieces.len(), NUM_SUBTREES);
+        assert_eq!(pieces[0].start, vaddr_rng.start);
+        assert_eq!(pieces[NUM_SUBTREES - 1].end, vaddr_rng.end);
+        for (i, piece) in pieces.iter().enumerate().skip(1) {
+            assert_eq!(piece.start, pieces[i - 1].end);
+            assert_eq!(piece.start, vaddr + i * subtree_span);
+        }
 
-        for map in &memory_maps {
-            match map {
-                MemoryMap::Normal(desc) => {
-                    let vaddr = desc.virtual_address();
-                    let paddr = desc.physical_address();
-                    let map_size = desc.num_pages() * FOUR_KIB;
-                    let mut size = 0;
+        // Unmapping a range spanning subtrees must go through `unmap`.
+        assert!(translation_table
+            .unmap_subtree(
+                vaddr..vaddr + (subtree_span + PAGE_SIZE),
+                &desc_alloc,
+                false
+            )
+            .is_err());
+
+        std::thread::scope(|scope| {
+            for piece in pieces.iter() {
+                let (translation_table, desc_alloc) = (&translation_table, &desc_alloc);
+                scope.spawn(move || {
+                    assert!(translation_table
+                        .protect(piece.clone(), &ro_perms, desc_alloc)
+                        .is_ok());
+                    let translation = translation_table.virt2phy(piece.end - PAGE_SIZE).unwrap();
+                    assert_eq!(translation.access_perms, ro_perms);
+                    assert!(translation_table
+                        .unmap_subtree(piece.clone(), desc_alloc, false)
+                        .is_ok());
+                });
+            }
+        });
 
-                    for res in translation_table.traverse(vaddr..vaddr + map_size, true) {
-                        assert!(res.is_ok());
+        assert!(translation_table
+            .traverse(vaddr_rng.clone(), false)
+            .next()
+            .is_none());
+        for vaddr in [vaddr, vaddr_rng.end] {
+            let translation = translation_table.virt2phy(vaddr).unwrap();
+            assert_eq!(
+                translation.access_perms,
+                AccessPermissions::normal_memory_default()
+            );
+        }
 
-                        match res.unwrap() {
-                            TraverseYield::PhysicalBlock(mut pbo_info) => {
-                                assert_eq!(pbo_info.phy_block().start, paddr + size);
-                                assert_eq!(pbo_info.vaddr(), vaddr + size);
-                                let overlap = pbo_info.phy_block();
-                                size += (overlap.end - overlap.start) as usize;
+        // Subtrees not taken are destroyed along with the iterator.
+        let mut subtrees = translation_table.into_subtrees(&desc_alloc, false);
+        subtrees.next().unwrap().destroy(&desc_alloc);
+        drop(subtrees);
+        assert_eq!(desc_alloc.0.load(Ordering::Relaxed), 0);
+    }
 
-                                let remove = pbo_info
-                                    .remove_overlapping_range(&translation_table, &page_alloc);
-                                assert!(remove.is_ok());
+    fn reclaim_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_READERS: usize = 3;
+        const NUM_ROUNDS: usize = 64;
+        let page_alloc = TestAllocator::default();
+        let translation_table = TranslationTable::default();
+        let paddr = PhysicalAddress::new(PAGE_SIZE);
+        let pages = MemoryMap::Normal(MapDesc::new(
+            paddr,
+            vaddr,
+            PAGE_RUN_LEN + 1,
+            AccessPermissions::normal_memory_default(),
+        ));
+
+        assert!(translation_table.map(&pages, &page_alloc).is_ok());
+        let num_tables = page_alloc.mem.borrow().len();
+
+        // Tables unlinked during a walk, stay until the walk is done.
+        let walk = translation_table.epoch.pin();
+        assert!(translation_table
+            .unmap(vaddr..vaddr + L2_BLOCK_SIZE, &page_alloc)
+            .is_ok());
+        assert!(translation_table.virt2phy(vaddr).is_none());
+        assert_eq!(page_alloc.mem.borrow().len(), num_tables);
+        assert_eq!(translation_table.reclaim_tables(&page_alloc), num_tables);
+        drop(walk);
+        assert_eq!(translation_table.reclaim_tables(&page_alloc), 0);
+        // Reclaimed tables are recycled.
+        assert_eq!(translation_table.table_usage().pooled, num_tables);
+        assert_eq!(translation_table.trim_tables(&page_alloc), num_tables);
+        assert!(page_alloc.mem.borrow().is_empty());
+
+        // Lookups run concurrently with maps and unmaps.
+        let desc_alloc = SyncAllocator::default();
+        let done = AtomicBool::new(false);
+
+        std::thread::scope(|scope| {
+            for _ in 0..NUM_READERS {
+                scope.spawn(|| {
+                    while !done.load(Ordering::Relaxed) {
+                        for page in 0..PAGE_RUN_LEN + 1 {
+                            if let Some(translation) =
+                                translation_table.virt2phy(vaddr + page * PAGE_SIZE)
+                            {
+                                assert_eq!(translation.phy_addr, paddr + page * PAGE_SIZE);
                             }
-                            TraverseYield::UnusedMemory(mem) => unsafe {
-                                page_alloc.deallocate(mem, layout)
-                            },
                         }
                     }
+                });
+            }
 
-                    assert_eq!(size, map_size);
-                }
-                MemoryMap::Device(_) => assert!(false, "Failure"),
+            for _ in 0..NUM_ROUNDS {
+                assert!(translation_table.map(&pages, &desc_alloc).is_ok());
+                assert!(translation_table
+                    .unmap(vaddr..vaddr + L2_BLOCK_SIZE, &desc_alloc)
+                    .is_ok());
             }
-        }
+            done.store(true, Ordering::Relaxed);
+        });
+
+        assert_eq!(translation_table.reclaim_tables(&desc_alloc), 0);
+        translation_table.trim_tables(&desc_alloc);
+        assert_eq!(desc_alloc.0.load(Ordering::Relaxed), 0);
     }
 
-    fn lookup_test_using_vaddr(vaddr: VirtualAddress) {
+    fn table_pool_test_using_vaddr(vaddr: VirtualAddress) {
         let page_alloc = TestAllocator::default();
-        let memory_maps = generate_memory_maps(vaddr);
-        let layout =
-            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
-                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
-        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
-
-        assert!(translation_table.is_ok());
-
-        let translation_table = translation_table.unwrap();
-        let mut rng = thread_rng();
+        let translation_table = TranslationTable::default();
+        let pages = MemoryMap::Normal(MapDesc::new(
+            PhysicalAddress::new(PAGE_SIZE),
+            vaddr,
+            PAGE_RUN_LEN + 1,
+            AccessPermissions::normal_memory_default(),
+        ));
+        let num_tables = TRANSLATION_LEVELS.len() - 1;
+
+        assert!(translation_table.map(&pages, &page_alloc).is_ok());
+        assert_eq!(
+            translation_table.table_usage(),
+            TableUsage {
+                tables: num_tables,
+                pooled: 0,
+                bytes: num_tables * size_of::<DescriptorTable>(),
+            }
+        );
 
-        for map in &memory_maps {
-            match map {
-                MemoryMap::Normal(desc) => {
-                    let vaddr = desc.virtual_address();
-                    let paddr = desc.physical_address();
-                    let map_size = desc.num_pages() * FOUR_KIB;
-                    let mut traversed_size = 0;
-                    let unmap_start = Uniform::from(0..desc.num_pages()).sample(&mut rng);
-                    let unmap_end =
-                        Uniform::from(unmap_start + 1..=desc.num_pages()).sample(&mut rng);
-                    let unmap_rng =
-                        vaddr + unmap_start * GRANULE_SIZE..vaddr + unmap_end * GRANULE_SIZE;
+        // Unmapped tables are recycled for the tables installed next.
+        assert!(translation_table
+            .unmap(vaddr..vaddr + L2_BLOCK_SIZE, &page_alloc)
+            .is_ok());
+        assert_eq!(translation_table.table_usage().pooled, num_tables);
+        assert!(translation_table.map(&pages, &page_alloc).is_ok());
+        assert_eq!(translation_table.table_usage().pooled, 0);
+        assert_eq!(page_alloc.mem.borrow().len(), num_tables);
+
+        // Walk fails before installing any table, if not all the tables missing on it could
+        // be allocated.
+        let pages = MemoryMap::Normal(MapDesc::new(
+            PhysicalAddress::new(PAGE_SIZE),
+            vaddr + L1_BLOCK_SIZE,
+            1,
+            AccessPermissions::normal_memory_default(),
+        ));
+        let limited_alloc = LimitedAllocator(&page_alloc, Cell::new(1));
+
+        assert!(matches!(
+            translation_table.map(&pages, &limited_alloc),
+            Err(Error::PhysicalOOM)
+        ));
+        assert!(translation_table
+            .find_desc(vaddr + L1_BLOCK_SIZE, &AddressTranslationLevel::Two)
+            .is_none());
+        assert_eq!(translation_table.table_usage().pooled, 1);
+        assert!(translation_table.map(&pages, &page_alloc).is_ok());
+        assert_eq!(translation_table.table_usage().pooled, 0);
+
+        translation_table.destroy(&page_alloc);
+        assert!(page_alloc.mem.borrow().is_empty());
+    }
 
-                    for res in translation_table.traverse(unmap_rng.clone(), true) {
-                        assert!(res.is_ok());
+    /// Allocate zeroed memory of `size` aligned to `align` from `mem_alloc`, to back a mapping.
+    fn alloc_backing_memory(
+        mem_alloc: &TestAllocator,
+        size: usize,
+        align: usize,
+    ) -> PhysicalAddress {
+        let layout = Layout::from_size_align(size, align).unwrap();
+        let ptr = mem_alloc.allocate_zeroed(layout).unwrap().as_non_null_ptr();
+        PhysicalAddress::new(ptr.addr().get())
+    }
 
-                        match res.unwrap() {
-                            TraverseYield::PhysicalBlock(pbo_info) => {
-                                let pblock = pbo_info.phy_block();
-                                let overlap = pbo_info.overlapping_range();
-                                assert_eq!(
-                                    pblock.start + overlap.start as usize,
-                                    paddr + unmap_start * GRANULE_SIZE + traversed_size
-                                );
-                                assert_eq!(
-                                    pbo_info.vaddr() + overlap.start as usize,
-                                    vaddr + unmap_start * GRANULE_SIZE + traversed_size
-                                );
-                                traversed_size += (overlap.end - overlap.start) as usize;
-                            }
-                            TraverseYield::UnusedMemory(mem) => unsafe {
-                                page_alloc.deallocate(mem, layout)
-                            },
-                        }
-                    }
+    fn read_word(paddr: PhysicalAddress) -> usize {
+        unsafe { *(paddr.as_raw_ptr() as *const usize) }
+    }
 
-                    assert_eq!(traversed_size, (unmap_rng.end - unmap_rng.start) as usize);
-                }
-                MemoryMap::Device(_) => assert!(false, "Failure"),
-            }
-        }
+    fn write_word(paddr: PhysicalAddress, val: usize) {
+        unsafe { *(paddr.as_raw_ptr() as *mut usize) = val }
     }
 
-    fn remove_test_using_vaddr(vaddr: VirtualAddress) {
+    fn fork_test_using_vaddr(vaddr: VirtualAddress) {
+        const NUM_PAGES: usize = 2 * PAGE_RUN_LEN + 3;
+        // Copying blocks of larger granules takes too long.
+        const FORK_BLOCKS: bool = L2_BLOCK_SIZE <= 32 * 1024 * 1024;
         let page_alloc = TestAllocator::default();
-        let memory_maps = generate_memory_maps(vaddr);
-        let layout =
-            Layout::from_size_align(size_of::<DescriptorTable>(), TRANSLATION_TABLE_DESC_ALIGN)
-                .unwrap_or_else(|_| bug!("Descriptor Layout Mismatch"));
-        let translation_table = TranslationTable::new(&memory_maps, &page_alloc);
-
-        assert!(translation_table.is_ok());
+        let mem_alloc = TestAllocator::default();
+        let user_perms = AccessPermissions::user_memory_default();
+        let ro_perms = AccessPermissions::EL1_READ | AccessPermissions::EL0_READ;
+        let pages_paddr = alloc_backing_memory(&mem_alloc, NUM_PAGES * PAGE_SIZE, PAGE_RUN_SIZE);
+        let ro_paddr = alloc_backing_memory(&mem_alloc, PAGE_SIZE, PAGE_SIZE);
+        let ro_vaddr = vaddr + L2_BLOCK_SIZE;
+        let block_vaddr = vaddr + 2 * L2_BLOCK_SIZE;
+        let mut memory_maps = vec![
+            MemoryMap::Normal(MapDesc::new(pages_paddr, vaddr, NUM_PAGES, user_perms)),
+            MemoryMap::Normal(MapDesc::new(ro_paddr, ro_vaddr, 1, ro_perms)),
+        ];
+
+        for i in 0..NUM_PAGES {
+            write_word(pages_paddr + i * PAGE_SIZE, i);
+        }
+        if FORK_BLOCKS {
+            let block_paddr = alloc_backing_memory(&mem_alloc, L2_BLOCK_SIZE, L2_BLOCK_SIZE);
+
+            write_word(block_paddr + PAGE_SIZE, NUM_PAGES);
+            memory_maps.push(MemoryMap::Normal(MapDesc::new(
+                block_paddr,
+                block_vaddr,
+                L2_BLOCK_SIZE / GRANULE_SIZE,
+                user_perms,
+            )));
+        }
 
-        let translation_table = translation_table.unwrap();
-        let mut rng = thread_rng();
+        let parent = TranslationTable::new(&memory_maps, &page_alloc).unwrap();
+        let num_tables = page_alloc.mem.borrow().len();
+        let child = parent.fork(&page_alloc).unwrap();
 
+        // Only the tables are copied and all of the memory is shared.
+        assert_eq!(page_alloc.mem.borrow().len(), 2 * num_tables);
         for map in &memory_maps {
             match map {
                 MemoryMap::Normal(desc) => {
-                    let vaddr = desc.virtual_address();
-                    let unmap_start = Uniform::from(0..desc.num_pages()).sample(&mut rng);
-                    let unmap_end =
-                        Uniform::from(unmap_start + 1..=desc.num_pages()).sample(&mut rng);
-                    let unmap_rng =
-                        vaddr + unmap_start * GRANULE_SIZE..vaddr + unmap_end * GRANULE_SIZE;
-                    let mut traversed_size = 0;
-
-                    for res in translation_table.traverse(unmap_rng.clone(), true) {
-                        assert!(res.is_ok());
-
-                        match res.unwrap() {
-                            TraverseYield::PhysicalBlock(mut pbo_info) => {
-                                let overlap = pbo_info.overlapping_range();
-                                traversed_size += (overlap.end - overlap.start) as usize;
-
-                                let remove = pbo_info
-                                    .remove_overlapping_range(&translation_table, &page_alloc);
-                                assert!(remove.is_ok());
-                            }
-                            TraverseYield::UnusedMemory(mem) => unsafe {
-                                page_alloc.deallocate(mem, layout)
-                            },
-                        }
+                    for page in 0..desc.num_pages() {
+                        let vaddr = desc.virtual_address() + page * GRANULE_SIZE;
+                        let translation = child.virt2phy(vaddr).unwrap();
+
+                        assert_eq!(
+                            translation.phy_addr,
+                            parent.virt2phy(vaddr).unwrap().phy_addr
+                        );
+                        assert_eq!(translation.access_perms, desc.access_permissions());
                     }
-
-                    assert_eq!(traversed_size, (unmap_rng.end - unmap_rng.start) as usize);
-
-                    let count_after_removal =
-                        translation_table.traverse(unmap_rng.clone(), true).count();
-                    assert_eq!(count_after_removal, 0);
+                    assert!(page_alloc.is_shared(desc.physical_address()));
                 }
                 MemoryMap::Device(_) => assert!(false, "Failure"),
             }
         }
+
+        // Write fault in the child makes a private copy. Parent still maps the original.
+        let page = PAGE_RUN_LEN + 1;
+        let fault_vaddr = vaddr + page * PAGE_SIZE + 8usize;
+        let page_paddr = pages_paddr + page * PAGE_SIZE;
+
+        assert!(child.resolve_cow_fault(fault_vaddr, &page_alloc).unwrap());
+        let copy = child.virt2phy(fault_vaddr).unwrap().phy_addr - 8usize;
+        assert_ne!(copy, page_paddr);
+        assert_eq!(read_word(copy), page);
+        assert_eq!(
+            parent.virt2phy(fault_vaddr).unwrap().phy_addr,
+            page_paddr + 8usize
+        );
+        assert!(!page_alloc.is_shared(page_paddr));
+        assert!(!is_contiguous_hinted(&child, fault_vaddr));
+        assert!(is_contiguous_hinted(&parent, fault_vaddr));
+        assert!(!child.resolve_cow_fault(fault_vaddr, &page_alloc).unwrap());
+
+        // Parent is the only one left using the page, so it's just made writable again.
+        assert!(parent.resolve_cow_fault(fault_vaddr, &page_alloc).unwrap());
+        assert_eq!(
+            parent.virt2phy(fault_vaddr).unwrap().phy_addr,
+            page_paddr + 8usize
+        );
+        assert!(!parent.resolve_cow_fault(fault_vaddr, &page_alloc).unwrap());
+
+        // Faults on read only (or unmapped) memory are genuine.
+        assert!(!child.resolve_cow_fault(ro_vaddr, &page_alloc).unwrap());
+        assert!(!child
+            .resolve_cow_fault(ro_vaddr + PAGE_SIZE, &page_alloc)
+            .unwrap());
+
+        if FORK_BLOCKS {
+            let block_paddr = child.virt2phy(block_vaddr).unwrap().phy_addr;
+            let hole = block_vaddr + 2 * PAGE_SIZE;
+
+            // Splitting a shared block in the parent needs a private copy of the block.
+            assert!(parent.unmap(hole..hole + PAGE_SIZE, &page_alloc).is_ok());
+            let copy = parent.virt2phy(block_vaddr).unwrap().phy_addr;
+            assert_ne!(copy, block_paddr);
+            assert_eq!(read_word(copy + PAGE_SIZE), NUM_PAGES);
+            assert!(parent.virt2phy(hole).is_none());
+            assert!(!page_alloc.is_shared(block_paddr));
+
+            assert!(child.resolve_cow_fault(block_vaddr, &page_alloc).unwrap());
+            assert_eq!(child.virt2phy(block_vaddr).unwrap().phy_addr, block_paddr);
+        }
+
+        // Child going away drops its references, leaving the parent intact.
+        assert!(child
+            .unmap(vaddr..vaddr + L1_BLOCK_SIZE, &page_alloc)
+            .is_ok());
+        assert!(page_alloc.refs.borrow().is_empty());
+        for page in 0..NUM_PAGES {
+            let vaddr = vaddr + page * PAGE_SIZE;
+            assert_eq!(
+                parent.virt2phy(vaddr).unwrap().phy_addr,
+                pages_paddr + page * PAGE_SIZE
+            );
+        }
     }
 
     fn mapping_scheme_test_using_vaddr(vaddr: VirtualAddress) {
@@ -1589,9 +5949,11 @@ mod tests {
 
                     for scheme in scheme.spans {
                         mapped_size += match scheme {
-                            ContiguousSpan::FourKiB(num_pages) => num_pages * FOUR_KIB,
-                            ContiguousSpan::TwoMiB(num_pages) => num_pages * TWO_MIB,
-                            ContiguousSpan::OneGiB(num_pages) => num_pages * ONE_GIB,
+                            ContiguousSpan::Pages(num_pages) => num_pages * PAGE_SIZE,
+                            ContiguousSpan::PageRuns(num_runs) => num_runs * PAGE_RUN_SIZE,
+                            ContiguousSpan::L2Blocks(num_pages) => num_pages * L2_BLOCK_SIZE,
+                            ContiguousSpan::L2BlockRuns(num_runs) => num_runs * L2_BLOCK_RUN_SIZE,
+                            ContiguousSpan::L1Blocks(num_pages) => num_pages * L1_BLOCK_SIZE,
                         }
                     }
 
@@ -1606,16 +5968,16 @@ mod tests {
     fn mapping_scheme_test() {
         let vaddr = get_random_virt_addr();
 
-        for i in (0..NUM_TABLE_DESC_ENTRIES) {
-            mapping_scheme_test_using_vaddr(vaddr + i * ONE_GIB);
+        for i in (0..TEST_L1_ENTRIES) {
+            mapping_scheme_test_using_vaddr(vaddr + i * L1_BLOCK_SIZE);
         }
 
-        for i in (0..NUM_TABLE_DESC_ENTRIES) {
-            mapping_scheme_test_using_vaddr(vaddr + i * TWO_MIB);
+        for i in (0..TEST_ENTRIES) {
+            mapping_scheme_test_using_vaddr(vaddr + i * L2_BLOCK_SIZE);
         }
 
-        for i in (0..NUM_TABLE_DESC_ENTRIES) {
-            mapping_scheme_test_using_vaddr(vaddr + i * FOUR_KIB);
+        for i in (0..TEST_ENTRIES) {
+            mapping_scheme_test_using_vaddr(vaddr + i * PAGE_SIZE);
         }
     }
 
@@ -1623,36 +5985,140 @@ mod tests {
     fn insert_sanity_test() {
         let vaddr = get_random_virt_addr();
 
-        insert_test_using_vaddr(vaddr + 1 * ONE_GIB);
-        insert_test_using_vaddr(vaddr + 2 * TWO_MIB);
-        insert_test_using_vaddr(vaddr + 3 * FOUR_KIB);
+        insert_test_using_vaddr(vaddr + 1 * L1_BLOCK_SIZE);
+        insert_test_using_vaddr(vaddr + 2 * L2_BLOCK_SIZE);
+        insert_test_using_vaddr(vaddr + 3 * PAGE_SIZE);
     }
 
     #[test]
     fn traverse_sanity_test() {
         let vaddr = get_random_virt_addr();
 
-        traverse_test_using_vaddr(vaddr + 1 * ONE_GIB);
-        traverse_test_using_vaddr(vaddr + 2 * TWO_MIB);
-        traverse_test_using_vaddr(vaddr + 3 * FOUR_KIB);
+        traverse_test_using_vaddr(vaddr + 1 * L1_BLOCK_SIZE);
+        traverse_test_using_vaddr(vaddr + 2 * L2_BLOCK_SIZE);
+        traverse_test_using_vaddr(vaddr + 3 * PAGE_SIZE);
     }
 
     #[test]
     fn lookup_sanity_test() {
         let vaddr = get_random_virt_addr();
 
-        lookup_test_using_vaddr(vaddr + 1 * ONE_GIB);
-        lookup_test_using_vaddr(vaddr + 2 * TWO_MIB);
-        lookup_test_using_vaddr(vaddr + 3 * FOUR_KIB);
+        lookup_test_using_vaddr(vaddr + 1 * L1_BLOCK_SIZE);
+        lookup_test_using_vaddr(vaddr + 2 * L2_BLOCK_SIZE);
+        lookup_test_using_vaddr(vaddr + 3 * PAGE_SIZE);
+    }
+
+    #[test]
+    fn translate_sanity_test() {
+        translate_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn unmap_sanity_test() {
+        let vaddr = get_random_virt_addr();
+
+        unmap_test_using_vaddr(vaddr + 1 * L1_BLOCK_SIZE);
+        unmap_test_using_vaddr(vaddr + 2 * L2_BLOCK_SIZE);
+        unmap_test_using_vaddr(vaddr + 3 * PAGE_SIZE);
+    }
+
+    #[test]
+    fn contiguous_sanity_test() {
+        contiguous_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn occupancy_sanity_test() {
+        let descs = DescriptorTable::default();
+        let last_idx = NUM_TABLE_DESC_ENTRIES - 1;
+        let page_desc = new_stage1_page_desc(0, 0);
+
+        assert!(descs.is_empty());
+        assert_eq!(descs.next_valid_idx(0), None);
+
+        for idx in [3, 64, last_idx] {
+            store_desc(&descs, idx, page_desc);
+        }
+        // Overwriting a valid descriptor doesn't change the occupancy.
+        store_desc(&descs, 64, page_desc);
+        assert_eq!(descs.num_valid(), 3);
+        assert_eq!(descs.next_valid_idx(0), Some(3));
+        assert_eq!(descs.next_valid_idx(4), Some(64));
+        assert_eq!(descs.next_valid_idx(65), Some(last_idx));
+        assert_eq!(descs.next_valid_idx(NUM_TABLE_DESC_ENTRIES), None);
+
+        for idx in [3, 64, last_idx] {
+            store_desc(&descs, idx, INVALID_DESCRIPTOR);
+        }
+        assert!(descs.is_empty());
+        assert_eq!(descs.valid_indices().count(), 0);
+    }
+
+    #[test]
+    fn extents_sanity_test() {
+        extents_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn protect_sanity_test() {
+        protect_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn sg_list_sanity_test() {
+        sg_list_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn map_pages_sanity_test() {
+        map_pages_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn concurrent_map_sanity_test() {
+        concurrent_map_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn non_global_sanity_test() {
+        non_global_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn split_sanity_test() {
+        split_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn reclaim_sanity_test() {
+        reclaim_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn table_pool_sanity_test() {
+        table_pool_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn fork_sanity_test() {
+        fork_test_using_vaddr(get_random_virt_addr());
+    }
+
+    #[test]
+    fn promote_sanity_test() {
+        let vaddr = get_random_virt_addr();
+
+        promote_test_using_vaddr(vaddr);
+        promote_scanner_test_using_vaddr(vaddr);
     }
 
     #[test]
     fn remove_sanity_test() {
         let vaddr = get_random_virt_addr();
 
-        remove_test_using_vaddr(vaddr + 1 * ONE_GIB);
-        remove_test_using_vaddr(vaddr + 2 * TWO_MIB);
-        remove_test_using_vaddr(vaddr + 3 * FOUR_KIB);
+        remove_test_using_vaddr(vaddr + 1 * L1_BLOCK_SIZE);
+        remove_test_using_vaddr(vaddr + 2 * L2_BLOCK_SIZE);
+        remove_test_using_vaddr(vaddr + 3 * PAGE_SIZE);
     }
 
     #[test]
@@ -1660,16 +6126,16 @@ mod tests {
     fn insert_long_test() {
         let vaddr = get_random_virt_addr();
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            insert_test_using_vaddr(vaddr + i * ONE_GIB);
+        (0..TEST_L1_ENTRIES).into_par_iter().for_each(|i| {
+            insert_test_using_vaddr(vaddr + i * L1_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            insert_test_using_vaddr(vaddr + i * TWO_MIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            insert_test_using_vaddr(vaddr + i * L2_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            insert_test_using_vaddr(vaddr + i * FOUR_KIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            insert_test_using_vaddr(vaddr + i * PAGE_SIZE);
         });
     }
 
@@ -1678,16 +6144,16 @@ mod tests {
     fn traverse_long_test() {
         let vaddr = get_random_virt_addr();
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            traverse_test_using_vaddr(vaddr + i * ONE_GIB);
+        (0..TEST_L1_ENTRIES).into_par_iter().for_each(|i| {
+            traverse_test_using_vaddr(vaddr + i * L1_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            traverse_test_using_vaddr(vaddr + i * TWO_MIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            traverse_test_using_vaddr(vaddr + i * L2_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            traverse_test_using_vaddr(vaddr + i * FOUR_KIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            traverse_test_using_vaddr(vaddr + i * PAGE_SIZE);
         });
     }
 
@@ -1696,34 +6162,73 @@ mod tests {
     fn lookup_long_test() {
         let vaddr = get_random_virt_addr();
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            lookup_test_using_vaddr(vaddr + i * ONE_GIB);
+        (0..TEST_L1_ENTRIES).into_par_iter().for_each(|i| {
+            lookup_test_using_vaddr(vaddr + i * L1_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            lookup_test_using_vaddr(vaddr + i * TWO_MIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            lookup_test_using_vaddr(vaddr + i * L2_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            lookup_test_using_vaddr(vaddr + i * FOUR_KIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            lookup_test_using_vaddr(vaddr + i * PAGE_SIZE);
         });
     }
 
+    /// Allocator shareable across threads, which only keeps count of the live allocations.
+    #[derive(Default)]
+    struct SyncAllocator(AtomicUsize);
+
+    unsafe impl Allocator for SyncAllocator {
+        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+            self.0.fetch_add(1, Ordering::Relaxed);
+            std::alloc::Global.allocate(layout)
+        }
+
+        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+            self.0.fetch_sub(1, Ordering::Relaxed);
+            unsafe { std::alloc::Global.deallocate(ptr, layout) };
+        }
+    }
+
+    impl PhysicalPageAllocator for SyncAllocator {}
+
+    /// Allocator, which runs out of memory after the given no. of allocations.
+    struct LimitedAllocator<'a>(&'a TestAllocator, Cell<usize>);
+
+    unsafe impl Allocator for LimitedAllocator<'_> {
+        fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+            match self.1.get() {
+                0 => Err(AllocError),
+                remaining => {
+                    self.1.set(remaining - 1);
+                    self.0.allocate(layout)
+                }
+            }
+        }
+
+        unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+            self.0.deallocate(ptr, layout)
+        }
+    }
+
+    impl PhysicalPageAllocator for LimitedAllocator<'_> {}
+
     #[test]
     #[ignore]
     fn remove_long_test() {
         let vaddr = get_random_virt_addr();
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            remove_test_using_vaddr(vaddr + i * ONE_GIB);
+        (0..TEST_L1_ENTRIES).into_par_iter().for_each(|i| {
+            remove_test_using_vaddr(vaddr + i * L1_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            remove_test_using_vaddr(vaddr + i * TWO_MIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            remove_test_using_vaddr(vaddr + i * L2_BLOCK_SIZE);
         });
 
-        (0..NUM_TABLE_DESC_ENTRIES).into_par_iter().for_each(|i| {
-            remove_test_using_vaddr(vaddr + i * FOUR_KIB);
+        (0..TEST_ENTRIES).into_par_iter().for_each(|i| {
+            remove_test_using_vaddr(vaddr + i * PAGE_SIZE);
         });
     }
 }
@@ -13,18 +13,40 @@ pub mod consts {
     pub const VIRTUAL_ADDRESS_IGNORE_MSB: u32 = address::VIRTUAL_ADDRESS_IGNORE_MSB;
     pub const VIRTUAL_ADDRESS_LEVEL_IDX_BITS: u32 = address::VIRTUAL_ADDRESS_LEVEL_IDX_BITS;
 
-    pub const VIRTUAL_ADDRESS_NBITS: u32 = u64::BITS - VIRTUAL_ADDRESS_IGNORE_MSB;
-    pub const VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS: u32 = FOUR_KIB.ilog2();
-    pub const MAX_TRANSLATION_LEVELS: usize = ((VIRTUAL_ADDRESS_NBITS
-        - VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS)
-        / VIRTUAL_ADDRESS_LEVEL_IDX_BITS) as usize;
+    pub const VIRTUAL_ADDRESS_NBITS: u32 = address::VIRTUAL_ADDRESS_NBITS;
+    pub const VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS: u32 = super::super::GRANULE_SIZE_BITS;
+    pub const MAX_TRANSLATION_LEVELS: usize =
+        (VIRTUAL_ADDRESS_NBITS - VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS)
+            .div_ceil(VIRTUAL_ADDRESS_LEVEL_IDX_BITS) as usize;
 }
 
 pub const fn get_vaddr_spacing_per_entry(level: &AddressTranslationLevel) -> usize {
+    1 << level.va_shift()
+}
+
+/// No. of entries in a table at `level`. Root table could be smaller than a granule.
+pub const fn get_num_entries(level: &AddressTranslationLevel) -> usize {
+    1 << level.idx_bits()
+}
+
+/// Whether block descriptors can be used at `level`.
+/// Level 1 blocks are available only with 4KiB granule.
+pub const fn supports_block_desc(level: &AddressTranslationLevel) -> bool {
     match level {
-        AddressTranslationLevel::Zero => 512 * consts::ONE_GIB,
-        AddressTranslationLevel::One => consts::ONE_GIB,
-        AddressTranslationLevel::Two => consts::TWO_MIB,
-        AddressTranslationLevel::Three => consts::FOUR_KIB,
+        AddressTranslationLevel::One => {
+            consts::VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS == consts::FOUR_KIB.ilog2()
+        }
+        AddressTranslationLevel::Two => true,
+        AddressTranslationLevel::Zero | AddressTranslationLevel::Three => false,
+    }
+}
+
+/// No. of adjacent entries at `level`, that make up a run for the contiguous hint.
+pub const fn get_contiguous_run_len(level: &AddressTranslationLevel) -> usize {
+    match (consts::VIRTUAL_ADDRESS_PAGE_OFFSET_NBITS, level) {
+        (14, AddressTranslationLevel::Three) => 128,
+        (14, _) => 32,
+        (16, _) => 32,
+        _ => 16,
     }
 }
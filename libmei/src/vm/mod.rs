@@ -36,9 +36,35 @@ pub fn phy2virt(paddr: PhysicalAddress) -> VirtualAddress {
     *EL0_VIRT_ADDRESS_BASE + paddr.as_raw_ptr()
 }
 
-pub trait PhysicalPageAllocator: core::alloc::Allocator {}
+/// Allocator of physical pages, which also keeps count of the address spaces sharing a page.
+/// A page starts with a single (untracked) reference held by whoever allocated it.
+///
+/// Page metadata (references and ages) is needed only for memory mapped into address spaces.
+/// The defaults suit allocators of memory, which is never shared nor aged (ex: descriptor
+/// tables only): no page is ever shared, and no page ever ages.
+pub trait PhysicalPageAllocator: core::alloc::Allocator {
+    /// Add a reference to the page (or block) at `paddr`.
+    fn share(&self, _paddr: PhysicalAddress) {}
+
+    /// Drop a reference added by `share`.
+    fn unshare(&self, _paddr: PhysicalAddress) {}
+
+    /// Whether more than one reference to the page (or block) at `paddr` is held.
+    fn is_shared(&self, _paddr: PhysicalAddress) -> bool {
+        false
+    }
+
+    /// No. of aging scans the page (or block) at `paddr` went without being accessed.
+    /// Must be 0 for a freshly allocated page.
+    fn page_age(&self, _paddr: PhysicalAddress) -> u8 {
+        0
+    }
+
+    /// Record the age of the page (or block) at `paddr`, as of the latest aging scan.
+    fn set_page_age(&self, _paddr: PhysicalAddress, _age: u8) {}
+}
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum MemoryKind {
     /// DRAM memory: always cache-able.
     Normal,